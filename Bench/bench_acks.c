@@ -0,0 +1,185 @@
+/**
+ * @file bench_acks.c
+ * Bus load and interrupt cost of the deferred, merged ACK's on a 4-node bus.
+ *
+ * Every node sends bursts of ACK'd messages to every other node. ACK's are
+ * merged when several wait for the same poll, so the run is repeated at
+ * several poll intervals. It measures the ACK frames actually sent, and for comparison works out what
+ * the old scheme would have put on the bus: one ACK per message, sent from
+ * the RX interrupt, echoing the whole message. The old scheme's ISR time
+ * can't be measured in this tree, so it is compared by interrupt count
+ * (each echo ACK was one more frame to send and to receive); the deferred
+ * scheme's ISR time on this host is recorded as it is.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "can_id.h"
+#include "host_bench.h"
+#include <stdio.h>
+
+#define NODE_COUNT 4
+#define BURST 2 // messages from each node to each other node, every 20ms.
+
+static VirtualBus s_bus;
+
+static struct
+{
+	uint32_t messages;
+	uint32_t acks;
+	uint64_t message_bits;
+	uint64_t ack_bits;
+	uint64_t echo_bits; // of the ACK's the old scheme would have sent.
+} s_counts;
+
+static uint32_t s_rng = 1;
+
+static uint32_t next_random(void)
+{
+	s_rng ^= s_rng << 13;
+	s_rng ^= s_rng >> 17;
+	s_rng ^= s_rng << 5;
+	return s_rng;
+}
+
+static void on_message(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	(void)msg;
+	(void)info;
+	(void)ctx;
+}
+
+static void on_frame(const VirtualBusFrameInfo *info, void *ctx)
+{
+	(void)ctx;
+
+	if (!info->ok)
+		return;
+
+	CANIdFields fields;
+	CANId_Unpack(info->frame.id, info->frame.extended, &fields);
+
+	if (fields.is_ack)
+	{
+		s_counts.acks++;
+		s_counts.ack_bits += info->bits;
+		return;
+	}
+
+	s_counts.messages++;
+	s_counts.message_bits += info->bits;
+
+	// the old ACK: the same frame back, with the ACK bit set.
+	CANIdFields echo_fields = fields;
+	echo_fields.is_ack = true;
+	echo_fields.sender = fields.recipient;
+	echo_fields.recipient = fields.sender;
+
+	FakeCANFrame echo = info->frame;
+	echo.id = CANId_Pack(&echo_fields, info->frame.extended);
+	s_counts.echo_bits += VirtualBus_Frame_Bits(&echo);
+}
+
+static CANMessage random_message(void)
+{
+	static const CmdID cmds[] = {
+		CMD_COMMON_RESET, CMD_PWR_SET_LINE_POWER, CMD_CDH_SET_RTC, CMD_CDH_PROCESS_ERROR,
+	};
+
+	CANMessage msg = {0};
+	msg.cmd = cmds[next_random() % (sizeof(cmds)/sizeof(cmds[0]))];
+	for (uint8_t i = 0; i < CAN_MAX_BODY_SIZE; i++)
+	{
+		msg.body[i] = (uint8_t)next_random();
+	}
+
+	return msg;
+}
+
+static void run(uint32_t rounds, uint32_t poll_interval_us)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){ .poll_interval_us = poll_interval_us }, false);
+	s_bus.on_frame = &on_frame;
+	memset(&s_counts, 0, sizeof(s_counts));
+
+	for (int i = 0; i < NODE_COUNT; i++)
+	{
+		VirtualNode *node = VirtualBus_Add_Node(&s_bus);
+		VirtualBus_Init_Node(&s_bus, node, (CANWrapper_InitTypeDef){ .node_id = (NodeID)i });
+		CANWrapperEx_Register_Handler_Range(&node->hcw, 0, CMD_ID_COUNT - 1, &on_message, NULL);
+	}
+
+	// a burst to every other node, every 20ms.
+	for (uint32_t round = 0; round < rounds; round++)
+	{
+		for (int n = 0; n < NODE_COUNT; n++)
+		{
+			for (int to = 0; to < NODE_COUNT; to++)
+			{
+				for (uint32_t k = 0; k < BURST && to != n; k++)
+				{
+					CANMessage msg = random_message();
+					CANWrapperEx_Transmit(&s_bus.nodes[n].hcw, (NodeID)to, &msg);
+				}
+			}
+		}
+
+		VirtualBus_Run(&s_bus, 20000);
+	}
+}
+
+static void record(const char *name, uint32_t poll_interval_us, double value, const char *unit)
+{
+	char full_name[96];
+	snprintf(full_name, sizeof(full_name), "%s/poll=%uus", name, (unsigned)poll_interval_us);
+	Bench_Record(full_name, value, unit);
+}
+
+int main(int argc, char **argv)
+{
+	Bench_Init("acks", argc, argv);
+
+	const uint32_t rounds = Bench_Quick() ? 20 : 1000;
+	const uint32_t poll_intervals[] = { 100, 1000, 5000 };
+
+	for (size_t p = 0; p < sizeof(poll_intervals)/sizeof(poll_intervals[0]); p++)
+	{
+		const uint32_t poll = poll_intervals[p];
+		run(rounds, poll);
+
+		uint64_t isr_time = 0;
+		uint32_t interrupts = 0;
+		uint32_t rx_frames = 0;
+		for (int n = 0; n < NODE_COUNT; n++)
+		{
+			const FakeCAN_Counters *counters = &s_bus.nodes[n].can.counters;
+			isr_time += counters->isr_time;
+			interrupts += counters->tx_interrupts + counters->rx_interrupts;
+			rx_frames += counters->frames_received;
+		}
+
+		const double messages = s_counts.messages;
+		const double bit_ns = 1e9 / VIRTUAL_BUS_DEFAULT_BITRATE;
+		const double elapsed_ns = VirtualBus_Now(&s_bus) * 1000.0;
+		const double busy_ns = (double)s_bus.stats.busy_time;
+		const double echo_busy_ns = busy_ns + ((double)s_counts.echo_bits - (double)s_counts.ack_bits)*bit_ns;
+
+		record("merged/ack_frames_per_message", poll, s_counts.acks / messages, "frames");
+		record("merged/ack_bits_per_message", poll, s_counts.ack_bits / messages, "bits");
+		record("echo_model/ack_bits_per_message", poll, s_counts.echo_bits / messages, "bits");
+
+		record("merged/bus_load", poll, 100.0 * busy_ns / elapsed_ns, "%");
+		record("echo_model/bus_load", poll, 100.0 * echo_busy_ns / elapsed_ns, "%");
+
+		// a message and its echo ACK each took a TX and an RX interrupt.
+		record("merged/can_interrupts_per_message", poll, interrupts / messages, "interrupts");
+		record("echo_model/can_interrupts_per_message", poll, 4.0, "interrupts");
+
+		record("merged/isr_time_per_rx_frame", poll, (double)isr_time / rx_frames, "ns");
+	}
+
+	return Bench_Finish();
+}
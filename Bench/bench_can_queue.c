@@ -0,0 +1,230 @@
+/**
+ * @file bench_can_queue.c
+ * Throughput of the SPSC ring against the modulo queue it replaced.
+ *
+ * Both are timed in one thread, filling a burst the way the RX interrupt
+ * does and draining it the way CANWrapper_Poll_Messages does: the old queue
+ * one item at a time, the ring one item at a time and with DequeueBatch.
+ * The ring is also timed across two threads, which the old queue could not
+ * do safely, so it has no counterpart there.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "can_queue.h"
+#include "host_bench.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+
+// --- the queue from before the ring ---
+//
+// A copy of the old can_queue.c: 100 slots, one of them always empty, a
+// modulo on each index update and the item passed by value.
+
+#define MODULO_QUEUE_SIZE 100
+
+typedef struct
+{
+	uint32_t head;
+	uint32_t tail;
+	CANQueueItem items[MODULO_QUEUE_SIZE];
+} ModuloQueue;
+
+static bool modulo_is_full(const ModuloQueue *queue)
+{
+	return (queue->tail + 1) % MODULO_QUEUE_SIZE == queue->head;
+}
+
+static bool modulo_is_empty(const ModuloQueue *queue)
+{
+	return queue->head == queue->tail;
+}
+
+static bool modulo_enqueue(ModuloQueue *queue, CANQueueItem item)
+{
+	if (modulo_is_full(queue))
+		return false;
+
+	queue->items[queue->tail] = item;
+	queue->tail = (queue->tail + 1) % MODULO_QUEUE_SIZE;
+
+	return true;
+}
+
+static bool modulo_dequeue(ModuloQueue *queue, CANQueueItem *out)
+{
+	if (modulo_is_empty(queue))
+		return false;
+
+	*out = queue->items[queue->head];
+	queue->head = (queue->head + 1) % MODULO_QUEUE_SIZE;
+
+	return true;
+}
+
+// --- workload ---
+
+#define BATCH_SIZE 8 // as CANWrapper_Poll_Messages drains.
+
+static CANQueueItem make_item(uint32_t i)
+{
+	CANQueueItem item = {0};
+	item.msg.msg.cmd = (uint8_t)i;
+	item.msg.msg.body[0] = (uint8_t)(i >> 8);
+	item.msg.dlc = 8;
+
+	return item;
+}
+
+static double bench_modulo(uint32_t burst, uint32_t items)
+{
+	static ModuloQueue queue;
+	queue = (ModuloQueue){0};
+
+	CANQueueItem out;
+	uint64_t sum = 0;
+	uint64_t start = Bench_Time();
+
+	for (uint32_t i = 0; i < items; i += burst)
+	{
+		for (uint32_t j = 0; j < burst; j++)
+		{
+			modulo_enqueue(&queue, make_item(i + j));
+		}
+
+		while (modulo_dequeue(&queue, &out))
+		{
+			sum += out.msg.msg.cmd;
+		}
+	}
+
+	uint64_t elapsed = Bench_Time() - start;
+	Bench_Keep(sum);
+
+	return (double)elapsed / items;
+}
+
+static double bench_ring(uint32_t burst, uint32_t items, size_t batch_size)
+{
+	static CANQueue queue;
+	queue = CANQueue_Create();
+
+	CANQueueItem out[BATCH_SIZE];
+	uint64_t sum = 0;
+	uint64_t start = Bench_Time();
+
+	for (uint32_t i = 0; i < items; i += burst)
+	{
+		for (uint32_t j = 0; j < burst; j++)
+		{
+			// as the RX interrupt does, straight into the slot.
+			CANQueueItem *slot = CANQueue_Reserve(&queue);
+			*slot = make_item(i + j);
+			CANQueue_Commit(&queue);
+		}
+
+		size_t count;
+		while ((count = CANQueue_DequeueBatch(&queue, out, batch_size)) > 0)
+		{
+			for (size_t k = 0; k < count; k++)
+			{
+				sum += out[k].msg.msg.cmd;
+			}
+		}
+	}
+
+	uint64_t elapsed = Bench_Time() - start;
+	Bench_Keep(sum);
+
+	return (double)elapsed / items;
+}
+
+static CANQueue s_shared;
+static uint32_t s_shared_items;
+
+static void *producer(void *arg)
+{
+	(void)arg;
+
+	for (uint32_t i = 0; i < s_shared_items; )
+	{
+		CANQueueItem *slot = CANQueue_Reserve(&s_shared);
+		if (slot == NULL)
+		{
+			sched_yield();
+			continue;
+		}
+
+		*slot = make_item(i++);
+		CANQueue_Commit(&s_shared);
+	}
+
+	return NULL;
+}
+
+static double bench_ring_threads(uint32_t items)
+{
+	s_shared = CANQueue_Create();
+	s_shared_items = items;
+
+	CANQueueItem out[BATCH_SIZE];
+	uint64_t sum = 0;
+	uint32_t received = 0;
+
+	uint64_t start = Bench_Time();
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, producer, NULL);
+
+	while (received < items)
+	{
+		size_t count = CANQueue_DequeueBatch(&s_shared, out, BATCH_SIZE);
+		if (count == 0)
+			sched_yield();
+
+		for (size_t k = 0; k < count; k++)
+		{
+			sum += out[k].msg.msg.cmd;
+		}
+
+		received += count;
+	}
+
+	pthread_join(thread, NULL);
+
+	uint64_t elapsed = Bench_Time() - start;
+	Bench_Keep(sum);
+
+	return (double)elapsed / items;
+}
+
+int main(int argc, char **argv)
+{
+	Bench_Init("can_queue", argc, argv);
+
+	const uint32_t items = Bench_Quick() ? 100000 : 20000000;
+
+	// 3 is a full bxCAN FIFO, 24 a poll interval's worth on a busy bus.
+	const uint32_t bursts[] = { 1, 3, 24 };
+
+	for (size_t i = 0; i < sizeof(bursts)/sizeof(bursts[0]); i++)
+	{
+		char name[64];
+
+		snprintf(name, sizeof(name), "modulo/dequeue/burst=%u", (unsigned)bursts[i]);
+		Bench_Record(name, bench_modulo(bursts[i], items), "ns/item");
+
+		snprintf(name, sizeof(name), "ring/dequeue/burst=%u", (unsigned)bursts[i]);
+		Bench_Record(name, bench_ring(bursts[i], items, 1), "ns/item");
+
+		snprintf(name, sizeof(name), "ring/dequeue_batch/burst=%u", (unsigned)bursts[i]);
+		Bench_Record(name, bench_ring(bursts[i], items, BATCH_SIZE), "ns/item");
+	}
+
+	Bench_Record("ring/two_threads", bench_ring_threads(items / 5), "ns/item");
+
+	return Bench_Finish();
+}
@@ -0,0 +1,388 @@
+/**
+ * @file bench_core.c
+ * ns per operation of the wrapper's data structures and encode/decode paths,
+ * to compare releases of the module before flashing them:
+ *  - CANQueue enqueue, dequeue and batch dequeue.
+ *  - TxCache push, find and erase with 10, 50 and 100 messages cached.
+ *  - CANMessage_Equals and CANMessage_Hash.
+ *  - identifier packing and unpacking, standard and extended.
+ *  - received frames taken from the RX FIFO by the interrupt, then handled
+ *    and ACK'd by one poll, N at a time.
+ *
+ * The numbers are for the host, not the MCU. Compare them between builds on
+ * the same machine.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "can_id.h"
+#include "host_bench.h"
+#include <stdio.h>
+
+#define OP_BATCH 8 // operations timed together, so the clock costs less than they do.
+
+static uint32_t s_rng = 1;
+
+static uint32_t next_random(void)
+{
+	s_rng ^= s_rng << 13;
+	s_rng ^= s_rng >> 17;
+	s_rng ^= s_rng << 5;
+	return s_rng;
+}
+
+static CANMessage random_message(void)
+{
+	CANMessage msg = {0};
+	msg.cmd = (uint8_t)(next_random() % CMD_ID_COUNT);
+	for (uint8_t i = 0; i < CAN_MAX_BODY_SIZE; i++)
+	{
+		msg.body[i] = (uint8_t)next_random();
+	}
+
+	return msg;
+}
+
+// --- CANQueue ---
+
+static CANQueue s_queue;
+
+static void bench_queue(uint32_t rounds)
+{
+	CANQueueItem item = {0};
+	CANQueueItem out[OP_BATCH];
+	uint64_t enqueue = 0, dequeue = 0, dequeue_batch = 0;
+
+	s_queue = CANQueue_Create();
+
+	for (uint32_t r = 0; r < rounds; r++)
+	{
+		item.msg.msg.cmd = (uint8_t)r;
+
+		uint64_t start = Bench_Time();
+		for (int i = 0; i < OP_BATCH; i++)
+		{
+			CANQueue_Enqueue(&s_queue, &item);
+		}
+		uint64_t mid = Bench_Time();
+		for (int i = 0; i < OP_BATCH; i++)
+		{
+			CANQueue_Dequeue(&s_queue, &out[i]);
+		}
+		uint64_t end = Bench_Time();
+
+		enqueue += mid - start;
+		dequeue += end - mid;
+
+		for (int i = 0; i < OP_BATCH; i++)
+		{
+			CANQueue_Enqueue(&s_queue, &item);
+		}
+		start = Bench_Time();
+		CANQueue_DequeueBatch(&s_queue, out, OP_BATCH);
+		dequeue_batch += Bench_Time() - start;
+
+		Bench_Keep(out[OP_BATCH - 1].msg.msg.cmd);
+	}
+
+	const double ops = (double)rounds * OP_BATCH;
+	Bench_Record("can_queue/enqueue", enqueue / ops, "ns/op");
+	Bench_Record("can_queue/dequeue", dequeue / ops, "ns/op");
+	Bench_Record("can_queue/dequeue_batch_8", dequeue_batch / ops, "ns/item");
+}
+
+// --- TxCache ---
+
+static TxCache s_tx_cache;
+
+static TxCacheItem cache_item(bool numbered, uint32_t seq)
+{
+	TxCacheItem item = {0};
+	item.msg.msg = random_message();
+	item.msg.recipient = (uint8_t)(next_random() % 4);
+	item.numbered = numbered;
+	item.seq = seq;
+
+	return item;
+}
+
+/**
+ * @brief Keeps occupancy - OP_BATCH to occupancy messages cached, and times
+ *        pushing OP_BATCH more, finding them as their ACK's would, and
+ *        erasing them.
+ */
+static void bench_tx_cache(uint32_t occupancy, bool numbered, uint32_t rounds)
+{
+	static TxCacheItem items[OP_BATCH];
+	int slots[OP_BATCH];
+	uint32_t seq = 0;
+	uint64_t push = 0, find = 0, erase = 0;
+
+	s_tx_cache = TxCache_Create();
+
+	for (uint32_t i = 0; i + OP_BATCH < occupancy; i++)
+	{
+		TxCacheItem item = cache_item(numbered, seq++);
+		TxCache_Push_Back(&s_tx_cache, &item);
+	}
+
+	for (uint32_t r = 0; r < rounds; r++)
+	{
+		uint8_t keys[OP_BATCH];
+		for (int i = 0; i < OP_BATCH; i++)
+		{
+			items[i] = cache_item(numbered, seq++);
+			keys[i] = numbered ? (uint8_t)items[i].seq : (uint8_t)CANMessage_Hash(&items[i].msg.msg);
+		}
+
+		uint64_t start = Bench_Time();
+		for (int i = 0; i < OP_BATCH; i++)
+		{
+			slots[i] = TxCache_Push_Back(&s_tx_cache, &items[i]);
+		}
+		uint64_t mid = Bench_Time();
+
+		int found = 0;
+		for (int i = 0; i < OP_BATCH; i++)
+		{
+			const CachedCANMessage *msg = &items[i].msg;
+			found += numbered
+					? TxCache_Find_Seq(&s_tx_cache, msg->recipient, msg->msg.cmd, keys[i], 0xFF)
+					: TxCache_Find(&s_tx_cache, msg->recipient, msg->msg.cmd, keys[i]);
+		}
+		uint64_t end = Bench_Time();
+
+		push += mid - start;
+		find += end - mid;
+		Bench_Keep(found);
+
+		start = Bench_Time();
+		for (int i = 0; i < OP_BATCH; i++)
+		{
+			TxCache_Erase(&s_tx_cache, slots[i]);
+		}
+		erase += Bench_Time() - start;
+	}
+
+	const double ops = (double)rounds * OP_BATCH;
+	const char *kind = numbered ? "numbered" : "hashed";
+	char name[64];
+
+	snprintf(name, sizeof(name), "tx_cache/%s/push/occupancy=%u", kind, (unsigned)occupancy);
+	Bench_Record(name, push / ops, "ns/op");
+	snprintf(name, sizeof(name), "tx_cache/%s/find/occupancy=%u", kind, (unsigned)occupancy);
+	Bench_Record(name, find / ops, "ns/op");
+	snprintf(name, sizeof(name), "tx_cache/%s/erase/occupancy=%u", kind, (unsigned)occupancy);
+	Bench_Record(name, erase / ops, "ns/op");
+}
+
+// --- messages and identifiers ---
+
+#define MESSAGE_COUNT 256
+
+static CANMessage s_messages[MESSAGE_COUNT];
+static CANMessage s_copies[MESSAGE_COUNT];
+static CANIdFields s_fields[MESSAGE_COUNT];
+static uint32_t s_ids[MESSAGE_COUNT];
+
+static void bench_messages(uint32_t rounds)
+{
+	for (int i = 0; i < MESSAGE_COUNT; i++)
+	{
+		s_messages[i] = random_message();
+		s_copies[i] = s_messages[i];
+
+		// every other copy differs in its last byte, which is compared last.
+		if (i % 2)
+			s_copies[i].body[CAN_MAX_BODY_SIZE - 1] ^= 1;
+	}
+
+	uint64_t equals = 0, hash = 0;
+	for (uint32_t r = 0; r < rounds; r++)
+	{
+		uint32_t result = 0;
+
+		uint64_t start = Bench_Time();
+		for (int i = 0; i < MESSAGE_COUNT; i++)
+		{
+			result += CANMessage_Equals(&s_messages[i], &s_copies[i]);
+		}
+		uint64_t mid = Bench_Time();
+		for (int i = 0; i < MESSAGE_COUNT; i++)
+		{
+			result += CANMessage_Hash(&s_messages[i]);
+		}
+		uint64_t end = Bench_Time();
+
+		equals += mid - start;
+		hash += end - mid;
+		Bench_Keep(result);
+	}
+
+	const double ops = (double)rounds * MESSAGE_COUNT;
+	Bench_Record("message/equals", equals / ops, "ns/op");
+	Bench_Record("message/hash", hash / ops, "ns/op");
+}
+
+static void bench_ids(bool extended, uint32_t rounds)
+{
+	const uint8_t max_node = extended ? CAN_WRAPPER_EXT_BROADCAST_ID : 3;
+
+	for (int i = 0; i < MESSAGE_COUNT; i++)
+	{
+		s_fields[i] = (CANIdFields){
+			.priority = (uint8_t)(next_random() % 64),
+			.cmd = extended ? (uint8_t)(next_random() % CMD_ID_COUNT) : 0,
+			.sender = (NodeID)(next_random() % (max_node + 1)),
+			.recipient = (NodeID)(next_random() % (max_node + 1)),
+			.seq = extended ? (uint8_t)(next_random() & 0x1F) : 0,
+			.is_ack = next_random() & 1,
+		};
+	}
+
+	uint64_t pack = 0, unpack = 0;
+	for (uint32_t r = 0; r < rounds; r++)
+	{
+		uint64_t start = Bench_Time();
+		for (int i = 0; i < MESSAGE_COUNT; i++)
+		{
+			s_ids[i] = CANId_Pack(&s_fields[i], extended);
+		}
+		uint64_t mid = Bench_Time();
+		for (int i = 0; i < MESSAGE_COUNT; i++)
+		{
+			CANId_Unpack(s_ids[i], extended, &s_fields[i]);
+		}
+		uint64_t end = Bench_Time();
+
+		pack += mid - start;
+		unpack += end - mid;
+		Bench_Keep(s_fields[MESSAGE_COUNT - 1].sender);
+	}
+
+	const double ops = (double)rounds * MESSAGE_COUNT;
+	Bench_Record(extended ? "id/extended/pack" : "id/standard/pack", pack / ops, "ns/op");
+	Bench_Record(extended ? "id/extended/unpack" : "id/standard/unpack", unpack / ops, "ns/op");
+}
+
+// --- end to end ---
+
+static VirtualBus s_bus;
+static VirtualNode *s_node;
+static uint32_t s_handled;
+
+static void on_message(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	(void)msg;
+	(void)info;
+	(void)ctx;
+
+	s_handled++;
+}
+
+/**
+ * @brief Returns what POWER puts on the bus to send CDH the message.
+ */
+static FakeCANFrame frame_from_power(const CANMessage *msg)
+{
+	CANIdFields fields = {
+		.priority = cmd_configs[msg->cmd].priority,
+		.sender = NODE_POWER,
+		.recipient = NODE_CDH,
+	};
+
+	FakeCANFrame frame = {0};
+	frame.id = CANId_Pack(&fields, false);
+	frame.dlc = 1 + cmd_configs[msg->cmd].body_size;
+	memcpy(frame.data, msg->data, frame.dlc);
+
+	return frame;
+}
+
+/**
+ * @brief Sends whatever the wrapper put in the TX mailboxes.
+ */
+static void drain_mailboxes(void)
+{
+	int mailbox;
+	while ((mailbox = FakeCAN_Next_Mailbox(&s_node->can)) >= 0)
+	{
+		FakeCAN_Transmitted(&s_node->can, mailbox, FAKE_CAN_LEC_NONE);
+		FakeCAN_Service(&s_node->hcan);
+	}
+}
+
+/**
+ * @brief Receives n frames, each taken by the RX interrupt, then polls once.
+ */
+static void bench_end_to_end(CmdID cmd, uint32_t n, uint32_t rounds)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){0}, false);
+	s_node = VirtualBus_Add_Node(&s_bus);
+	VirtualBus_Init_Node(&s_bus, s_node, (CANWrapper_InitTypeDef){ .node_id = NODE_CDH });
+	CANWrapperEx_Register_Handler_Range(&s_node->hcw, 0, CMD_ID_COUNT - 1, &on_message, NULL);
+
+	static FakeCANFrame frames[CAN_QUEUE_SIZE];
+	for (uint32_t i = 0; i < n; i++)
+	{
+		CANMessage msg = random_message();
+		msg.cmd = cmd;
+		frames[i] = frame_from_power(&msg);
+	}
+
+	uint64_t elapsed = 0;
+	for (uint32_t r = 0; r < rounds; r++)
+	{
+		uint64_t start = Bench_Time();
+
+		for (uint32_t i = 0; i < n; i++)
+		{
+			FakeCAN_Receive(&s_node->can, &frames[i]);
+			FakeCAN_Service(&s_node->hcan);
+		}
+
+		CANWrapperEx_Poll_Messages(&s_node->hcw);
+		drain_mailboxes();
+
+		elapsed += Bench_Time() - start;
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "end_to_end/%s/messages=%u",
+			cmd_configs[cmd].policy == DELIVERY_ACKED ? "acked" : "fire_and_forget", (unsigned)n);
+	Bench_Record(name, (double)elapsed / rounds / n, "ns/msg");
+}
+
+int main(int argc, char **argv)
+{
+	Bench_Init("core", argc, argv);
+
+	const uint32_t rounds = Bench_Quick() ? 200 : 200000;
+
+	bench_queue(rounds);
+
+	const uint32_t occupancies[] = { 10, 50, 100 };
+	for (size_t i = 0; i < sizeof(occupancies)/sizeof(occupancies[0]); i++)
+	{
+		bench_tx_cache(occupancies[i], false, rounds);
+		bench_tx_cache(occupancies[i], true, rounds);
+	}
+
+	bench_messages(rounds / 8);
+	bench_ids(false, rounds / 8);
+	bench_ids(true, rounds / 8);
+
+	const uint32_t counts[] = { 1, 8, ACK_LIST_SIZE };
+	for (size_t i = 0; i < sizeof(counts)/sizeof(counts[0]); i++)
+	{
+		bench_end_to_end(CMD_CDH_PROCESS_HEARTBEAT, counts[i], rounds / counts[i] + 1);
+		bench_end_to_end(CMD_CDH_SET_RTC, counts[i], rounds / counts[i] + 1);
+	}
+
+	Bench_Keep(s_handled);
+
+	return Bench_Finish();
+}
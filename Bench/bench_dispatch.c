@@ -0,0 +1,130 @@
+/**
+ * @file bench_dispatch.c
+ * Cost of dispatching received messages, across the whole command space.
+ *
+ * CAN_QUEUE_SIZE messages, with command ID's spread over all CMD_ID_COUNT,
+ * are put straight into the receive queue and handled by one poll. This is
+ * timed with a handler registered for every command, with no handlers and a
+ * message_callback that switches on the command (as before the table), and
+ * with nothing to handle them. An empty poll is timed on its own for
+ * comparison.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "host_bench.h"
+#include <stdio.h>
+
+static VirtualBus s_bus;
+static VirtualNode *s_node;
+
+static uint32_t s_hits[CMD_ID_COUNT];
+static CANQueueItem s_items[CAN_QUEUE_SIZE];
+
+static void on_message(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	(void)msg;
+	(void)info;
+
+	(*(uint32_t *)ctx)++;
+}
+
+// the kind of message_callback every subsystem used to write.
+static void on_message_switch(CANMessage msg, NodeID sender, bool is_ack)
+{
+	(void)sender;
+
+	if (is_ack)
+		return;
+
+	switch (msg.cmd)
+	{
+#define CMD(name, id, ...) case CMD_##name: s_hits[id]++; break;
+#include "can_command_schema.h"
+#undef CMD
+	default:
+		break;
+	}
+}
+
+static void setup(bool handlers, CANMessageCallback message_callback)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){0}, false);
+	s_node = VirtualBus_Add_Node(&s_bus);
+	VirtualBus_Init_Node(&s_bus, s_node, (CANWrapper_InitTypeDef){
+		.node_id = NODE_CDH,
+		.message_callback = message_callback,
+	});
+
+	for (uint8_t cmd = 0; handlers && cmd < CMD_ID_COUNT; cmd++)
+	{
+		CANWrapperEx_Register_Handler(&s_node->hcw, cmd, &on_message, &s_hits[cmd]);
+	}
+}
+
+/**
+ * @retval ns per message, including its share of the poll.
+ */
+static double bench_poll(uint32_t polls, bool fill)
+{
+	uint64_t elapsed = 0;
+
+	for (uint32_t i = 0; i < polls; i++)
+	{
+		for (uint32_t j = 0; fill && j < CAN_QUEUE_SIZE; j++)
+		{
+			CANQueue_Enqueue(&s_node->hcw.msg_queue, &s_items[j]);
+		}
+
+		uint64_t start = Bench_Time();
+		CANWrapperEx_Poll_Messages(&s_node->hcw);
+		elapsed += Bench_Time() - start;
+	}
+
+	return (double)elapsed / polls / (fill ? CAN_QUEUE_SIZE : 1);
+}
+
+int main(int argc, char **argv)
+{
+	Bench_Init("dispatch", argc, argv);
+
+	const uint32_t polls = Bench_Quick() ? 200 : 100000;
+
+	// every command ID in turn, in a shuffled order, from POWER.
+	uint32_t rng = 1;
+	for (uint32_t i = 0; i < CAN_QUEUE_SIZE; i++)
+	{
+		rng = rng * 1103515245u + 12345u;
+
+		CANQueueItem *item = &s_items[i];
+		memset(item, 0, sizeof(*item));
+		item->msg.msg.cmd = (uint8_t)((i * 37 + (rng >> 16)) % CMD_ID_COUNT);
+		item->msg.sender = NODE_POWER;
+		item->msg.recipient = NODE_CDH;
+		item->msg.dlc = 8;
+	}
+
+	setup(false, NULL);
+	Bench_Record("poll/empty", bench_poll(polls, false), "ns/poll");
+
+	setup(true, NULL);
+	Bench_Record("handler_table/per_message", bench_poll(polls, true), "ns/msg");
+
+	setup(false, &on_message_switch);
+	Bench_Record("message_callback_switch/per_message", bench_poll(polls, true), "ns/msg");
+
+	setup(false, NULL);
+	Bench_Record("unhandled/per_message", bench_poll(polls, true), "ns/msg");
+
+	uint64_t hits = 0;
+	for (uint8_t cmd = 0; cmd < CMD_ID_COUNT; cmd++)
+	{
+		hits += s_hits[cmd];
+	}
+	Bench_Keep(hits);
+
+	return Bench_Finish();
+}
@@ -0,0 +1,129 @@
+/**
+ * @file bench_recovery.c
+ * Time to recover from injected faults on a 500 kbit/s virtual bus, and the
+ * error interrupts a burst of error frames costs.
+ *
+ * CDH's transmissions are corrupted until it goes bus-off, one to four times
+ * in a row, and the time from its last error frame to the first frame it
+ * gets through is measured. Then bursts of error frames of several lengths
+ * are injected, and the error interrupts taken by a receiving node counted.
+ * Without the masking of the last error code interrupt, that node took one
+ * per error frame. Times are bus time, so the results don't depend on the
+ * host.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "host_bench.h"
+#include <stdio.h>
+
+static VirtualBus s_bus;
+
+static uint64_t s_last_error_frame_end; // ns. of CDH's frames.
+static uint64_t s_first_ok_frame_start; // ns. of CDH's frames, after an error frame.
+
+static void on_frame(const VirtualBusFrameInfo *info, void *ctx)
+{
+	(void)ctx;
+
+	if (info->node != 0)
+		return;
+
+	if (!info->ok)
+	{
+		s_last_error_frame_end = info->end;
+		s_first_ok_frame_start = 0;
+	}
+	else if (s_first_ok_frame_start == 0)
+	{
+		s_first_ok_frame_start = info->start;
+	}
+}
+
+static void setup(void)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){0}, false);
+	s_bus.on_frame = &on_frame;
+
+	s_last_error_frame_end = 0;
+	s_first_ok_frame_start = 0;
+
+	VirtualBus_Init_Node(&s_bus, VirtualBus_Add_Node(&s_bus), (CANWrapper_InitTypeDef){ .node_id = NODE_CDH });
+	VirtualBus_Init_Node(&s_bus, VirtualBus_Add_Node(&s_bus), (CANWrapper_InitTypeDef){ .node_id = NODE_POWER });
+}
+
+/**
+ * @retval us from CDH's last error frame to its next frame, or 0 if it
+ *         didn't get one through.
+ */
+static double bench_bus_offs(uint32_t bus_offs)
+{
+	setup();
+
+	// 32 error frames in a row put the transmit error count past 255.
+	VirtualBus_Inject_Errors(&s_bus.nodes[0], 32 * bus_offs);
+
+	CANMessage msg = { .cmd = CMD_COMMON_RESET };
+	CANWrapperEx_Transmit(&s_bus.nodes[0].hcw, NODE_POWER, &msg);
+	VirtualBus_Run(&s_bus, 1000000);
+
+	if (s_first_ok_frame_start <= s_last_error_frame_end)
+		return 0;
+
+	return (s_first_ok_frame_start - s_last_error_frame_end) / 1000.0;
+}
+
+static bool recovered(void *ctx)
+{
+	(void)ctx;
+	return s_bus.nodes[0].tx_errors == 0 && s_first_ok_frame_start != 0;
+}
+
+/**
+ * @retval Error interrupts per error frame taken by the receiving node.
+ */
+static double bench_error_burst(uint32_t error_frames)
+{
+	setup();
+
+	// one frame, corrupted error_frames times in a row. past 31, CDH goes
+	// bus-off and rejoins along the way, and POWER sees every error frame.
+	VirtualBus_Inject_Errors(&s_bus.nodes[0], error_frames);
+
+	CANMessage msg = { .cmd = CMD_COMMON_RESET };
+	CANWrapperEx_Transmit(&s_bus.nodes[0].hcw, NODE_POWER, &msg);
+	if (!VirtualBus_Run_Until(&s_bus, &recovered, NULL, 60000000))
+		return 0;
+
+	// let the interrupts for the last frames run.
+	VirtualBus_Run(&s_bus, 1000);
+
+	return (double)s_bus.nodes[1].can.counters.error_interrupts / s_bus.stats.error_frames;
+}
+
+int main(int argc, char **argv)
+{
+	Bench_Init("recovery", argc, argv);
+
+	for (uint32_t bus_offs = 1; bus_offs <= 4; bus_offs++)
+	{
+		char name[64];
+		snprintf(name, sizeof(name), "bus_off/recovery_time/in_a_row=%u", (unsigned)bus_offs);
+		Bench_Record(name, bench_bus_offs(bus_offs), "us");
+	}
+
+	const uint32_t bursts[] = { 1, 8, 31, 320 };
+	const size_t burst_count = Bench_Quick() ? 3 : sizeof(bursts)/sizeof(bursts[0]);
+
+	for (size_t i = 0; i < burst_count; i++)
+	{
+		char name[64];
+		snprintf(name, sizeof(name), "error_burst/interrupts_per_error_frame/frames=%u", (unsigned)bursts[i]);
+		Bench_Record(name, bench_error_burst(bursts[i]), "interrupts");
+	}
+
+	return Bench_Finish();
+}
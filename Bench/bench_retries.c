@@ -0,0 +1,124 @@
+/**
+ * @file bench_retries.c
+ * Delivery latency and bus load under the retry policy, on a 500 kbit/s
+ * virtual bus that loses frames.
+ *
+ * CDH sends POWER a numbered, ACK'd message every 10ms. Both nodes lose the
+ * frames they receive at the same rate, so messages and ACK's are lost alike.
+ * Latency is from the call to CANWrapperEx_Transmit to the first time POWER
+ * handles the message, and is bus time, so the results don't depend on the
+ * host.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "host_bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_MESSAGES 2000
+#define SEND_INTERVAL_US 10000
+
+static VirtualBus s_bus;
+
+static uint64_t s_sent_at[MAX_MESSAGES];    // us.
+static uint64_t s_latencies[MAX_MESSAGES];  // us. of the messages delivered.
+static bool s_delivered[MAX_MESSAGES];
+static uint32_t s_delivered_count;
+
+static void on_message(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	(void)info;
+	(void)ctx;
+
+	uint16_t index = msg->body[0] | (uint16_t)msg->body[1] << 8;
+	if (index >= MAX_MESSAGES || s_delivered[index])
+		return;
+
+	s_delivered[index] = true;
+	s_latencies[s_delivered_count++] = VirtualBus_Now(&s_bus) - s_sent_at[index];
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void run(uint32_t messages, uint16_t drop_permille)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){ .seed = 5 }, false);
+
+	memset(s_delivered, 0, sizeof(s_delivered));
+	s_delivered_count = 0;
+
+	VirtualNode *cdh = VirtualBus_Add_Node(&s_bus);
+	VirtualNode *power = VirtualBus_Add_Node(&s_bus);
+	VirtualBus_Init_Node(&s_bus, cdh, (CANWrapper_InitTypeDef){ .node_id = NODE_CDH, .sequence_numbers = true });
+	VirtualBus_Init_Node(&s_bus, power, (CANWrapper_InitTypeDef){ .node_id = NODE_POWER, .sequence_numbers = true });
+	CANWrapperEx_Register_Handler_Range(&power->hcw, 0, CMD_ID_COUNT - 1, &on_message, NULL);
+
+	cdh->drop_permille = drop_permille;
+	power->drop_permille = drop_permille;
+
+	for (uint16_t i = 0; i < messages; i++)
+	{
+		// 3 retries, 10ms backoff and 10ms jitter. short enough to be numbered.
+		CANMessage msg = { .cmd = CMD_CDH_SET_RTC };
+		msg.body[0] = (uint8_t)i;
+		msg.body[1] = (uint8_t)(i >> 8);
+
+		s_sent_at[i] = VirtualBus_Now(&s_bus);
+		CANWrapperEx_Transmit(&cdh->hcw, NODE_POWER, &msg);
+		VirtualBus_Run(&s_bus, SEND_INTERVAL_US);
+	}
+
+	// until the last message is ACK'd or given up on.
+	VirtualBus_Run(&s_bus, 1000000);
+}
+
+static void record(const char *name, uint16_t drop_permille, double value, const char *unit)
+{
+	char full_name[96];
+	snprintf(full_name, sizeof(full_name), "%s/loss=%u_permille", name, (unsigned)drop_permille);
+	Bench_Record(full_name, value, unit);
+}
+
+int main(int argc, char **argv)
+{
+	Bench_Init("retries", argc, argv);
+
+	const uint32_t messages = Bench_Quick() ? 100 : MAX_MESSAGES;
+	const uint16_t drops[] = { 0, 10, 50, 100, 200 };
+
+	for (size_t d = 0; d < sizeof(drops)/sizeof(drops[0]); d++)
+	{
+		const uint16_t drop = drops[d];
+		run(messages, drop);
+
+		CANWrapper_Stats stats;
+		CANWrapperEx_Get_Stats(&s_bus.nodes[0].hcw, &stats);
+
+		qsort(s_latencies, s_delivered_count, sizeof(s_latencies[0]), &compare_u64);
+
+		const uint32_t n = s_delivered_count;
+		const double elapsed_ns = VirtualBus_Now(&s_bus) * 1000.0;
+
+		record("delivered", drop, 100.0 * n / messages, "%");
+		record("given_up", drop, stats.nodes[NODE_POWER].tx_failures, "messages");
+		record("retries_per_message", drop, (double)stats.nodes[NODE_POWER].tx_retries / messages, "frames");
+
+		record("latency/p50", drop, n != 0 ? (double)s_latencies[n / 2] : 0, "us");
+		record("latency/p99", drop, n != 0 ? (double)s_latencies[(n * 99) / 100] : 0, "us");
+		record("latency/max", drop, n != 0 ? (double)s_latencies[n - 1] : 0, "us");
+
+		record("bus_load", drop, 100.0 * s_bus.stats.busy_time / elapsed_ns, "%");
+		record("bus_bits_per_delivered_message", drop, n != 0 ? (double)s_bus.stats.bits / n : 0, "bits");
+	}
+
+	return Bench_Finish();
+}
@@ -0,0 +1,205 @@
+/**
+ * @file bench_telemetry.c
+ * Bus utilisation of periodic telemetry from POWER, ADCS and PAYLOAD to CDH,
+ * booted together, on a 500 kbit/s virtual bus:
+ *  - unscheduled: each node sends every message whose period divides the
+ *    time since boot, as timers started at boot would.
+ *  - scheduled: each node sends the same messages through a CANTelemetry.
+ *
+ * The average load is the same either way. What the scheduler changes is the
+ * peak over short windows, and the frames waiting for the bus at once.
+ * Times are bus time, so the results don't depend on the host.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "can_telemetry.h"
+#include "host_bench.h"
+#include <stdio.h>
+
+#define SENDERS 3
+#define PRODUCERS_PER_SENDER 4
+#define STEP_US 1000
+#define MAX_STEPS 5000
+
+static VirtualBus s_bus;
+static CANTelemetry s_telemetry[SENDERS];
+
+static const NodeID s_senders[SENDERS] = { NODE_POWER, NODE_ADCS, NODE_PAYLOAD };
+static const CmdID s_interval_cmds[SENDERS] = { CMD_PWR_SET_TELEMETRY_INTERVAL, CMD_ADCS_SET_TELEMETRY_INTERVAL, CMD_PLD_SET_TELEMETRY_INTERVAL };
+
+static const struct
+{
+	CmdID cmd;
+	uint16_t interval_ms;
+} s_producers[SENDERS][PRODUCERS_PER_SENDER] = {
+	{ { CMD_CDH_PROCESS_BATTERY_VOLTAGE, 50 }, { CMD_CDH_PROCESS_CONVERTER_STATUS, 100 },
+	  { CMD_CDH_PROCESS_PCB_TEMP, 500 },       { CMD_CDH_PROCESS_MCU_TEMP, 1000 } },
+	{ { CMD_CDH_PROCESS_MAGNETIC_FIELD, 20 },  { CMD_CDH_PROCESS_ANGULAR_VELOCITY, 20 },
+	  { CMD_CDH_PROCESS_PCB_TEMP, 500 },       { CMD_CDH_PROCESS_MCU_TEMP, 1000 } },
+	{ { CMD_CDH_PROCESS_WELL_LIGHT, 100 },     { CMD_CDH_PROCESS_WELL_TEMP, 100 },
+	  { CMD_CDH_PROCESS_PCB_TEMP, 500 },       { CMD_CDH_PROCESS_MCU_TEMP, 1000 } },
+};
+
+static uint64_t s_busy[MAX_STEPS]; // ns the bus was busy in each step.
+static uint32_t s_max_backlog;     // most frames queued for the bus at once, over every sender.
+
+static uint32_t backlog(void)
+{
+	uint32_t frames = 0;
+	for (uint8_t i = 0; i < s_bus.node_count; i++)
+	{
+		VirtualNode *node = &s_bus.nodes[i];
+		frames += node->hcw.tx_queue.size + CAN_TX_MAILBOX_COUNT - HAL_CAN_GetTxMailboxesFreeLevel(&node->hcan);
+	}
+
+	return frames;
+}
+
+static void on_frame(const VirtualBusFrameInfo *info, void *ctx)
+{
+	(void)ctx;
+
+	// split the frame over the steps it spans.
+	const uint64_t step_ns = STEP_US * 1000ULL;
+	for (uint64_t t = info->start; t < info->end; )
+	{
+		uint64_t step = t / step_ns;
+		uint64_t step_end = (step + 1) * step_ns;
+		uint64_t until = info->end < step_end ? info->end : step_end;
+
+		if (step < MAX_STEPS)
+			s_busy[step] += until - t;
+
+		t = until;
+	}
+
+	// its mailbox is already free. count it with the frames queued behind it.
+	uint32_t frames = backlog() + 1;
+	if (frames > s_max_backlog)
+		s_max_backlog = frames;
+}
+
+static bool fill(CANMessage *msg, void *ctx)
+{
+	(void)msg;
+	(void)ctx;
+	return true;
+}
+
+static void setup(bool scheduled)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){0}, false);
+	s_bus.on_frame = &on_frame;
+
+	memset(s_busy, 0, sizeof(s_busy));
+	s_max_backlog = 0;
+
+	VirtualBus_Init_Node(&s_bus, VirtualBus_Add_Node(&s_bus), (CANWrapper_InitTypeDef){ .node_id = NODE_CDH });
+
+	for (int i = 0; i < SENDERS; i++)
+	{
+		VirtualNode *node = VirtualBus_Add_Node(&s_bus);
+		VirtualBus_Init_Node(&s_bus, node, (CANWrapper_InitTypeDef){ .node_id = s_senders[i] });
+
+		if (!scheduled)
+			continue;
+
+		CANTelemetry_Init(&s_telemetry[i], &node->hcw, (CANTelemetry_InitTypeDef){ .interval_cmd = s_interval_cmds[i] });
+
+		for (int p = 0; p < PRODUCERS_PER_SENDER; p++)
+		{
+			CANTelemetry_ProducerTypeDef producer = {
+				.cmd = s_producers[i][p].cmd,
+				.recipient = NODE_CDH,
+				.sensor = (uint8_t)p,
+				.well_id = CAN_TELEMETRY_ANY_WELL,
+				.interval_ms = s_producers[i][p].interval_ms,
+				.fill = &fill,
+			};
+			CANTelemetry_Add_Producer(&s_telemetry[i], &producer);
+		}
+	}
+}
+
+/**
+ * @brief Sends what timers started at boot would send at this ms.
+ */
+static void send_unscheduled(uint32_t ms)
+{
+	for (int i = 0; i < SENDERS; i++)
+	{
+		for (int p = 0; p < PRODUCERS_PER_SENDER; p++)
+		{
+			if (ms % s_producers[i][p].interval_ms != 0)
+				continue;
+
+			CANMessage msg = { .cmd = s_producers[i][p].cmd };
+			CANWrapperEx_Transmit(&s_bus.nodes[1 + i].hcw, NODE_CDH, &msg);
+		}
+	}
+}
+
+static void bench(bool scheduled, uint32_t steps)
+{
+	const char *kind = scheduled ? "scheduled" : "unscheduled";
+	char name[64];
+
+	setup(scheduled);
+
+	for (uint32_t step = 0; step < steps; step++)
+	{
+		if (!scheduled)
+			send_unscheduled(step * STEP_US / 1000);
+
+		VirtualBus_Run(&s_bus, STEP_US);
+	}
+
+	const uint64_t step_ns = STEP_US * 1000ULL;
+	const uint32_t windows[] = { 1, 10 }; // steps.
+	uint64_t total = 0;
+
+	for (uint32_t step = 0; step < steps; step++)
+		total += s_busy[step];
+
+	snprintf(name, sizeof(name), "%s/frames", kind);
+	Bench_Record(name, s_bus.stats.frames, "frames");
+	snprintf(name, sizeof(name), "%s/average_load", kind);
+	Bench_Record(name, 100.0 * total / (steps * step_ns), "%");
+
+	for (size_t w = 0; w < sizeof(windows)/sizeof(windows[0]); w++)
+	{
+		uint64_t peak = 0;
+		for (uint32_t first = 0; first + windows[w] <= steps; first++)
+		{
+			uint64_t busy = 0;
+			for (uint32_t step = first; step < first + windows[w]; step++)
+				busy += s_busy[step];
+
+			if (busy > peak)
+				peak = busy;
+		}
+
+		snprintf(name, sizeof(name), "%s/peak_load/window=%ums", kind, (unsigned)(windows[w] * STEP_US / 1000));
+		Bench_Record(name, 100.0 * peak / (windows[w] * step_ns), "%");
+	}
+
+	snprintf(name, sizeof(name), "%s/max_frames_waiting", kind);
+	Bench_Record(name, s_max_backlog, "frames");
+}
+
+int main(int argc, char **argv)
+{
+	Bench_Init("telemetry", argc, argv);
+
+	// whole periods of the slowest producer.
+	const uint32_t steps = Bench_Quick() ? 1000 : MAX_STEPS;
+
+	bench(false, steps);
+	bench(true, steps);
+
+	return Bench_Finish();
+}
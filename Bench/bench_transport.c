@@ -0,0 +1,178 @@
+/**
+ * @file bench_transport.c
+ * Goodput of the segmented transport against sending the payload 7 bytes
+ * at a time as ACK'd messages, waiting for each ACK before the next
+ * (stop-and-wait), on a 500 kbit/s virtual bus with and without lost frames.
+ *
+ * Times are bus time, so the results don't depend on the host.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "can_transport.h"
+#include "host_bench.h"
+#include <stdio.h>
+
+#define MAX_PAYLOAD 4096
+#define TAG 1
+
+static VirtualBus s_bus;
+static VirtualNode *s_sender;
+static VirtualNode *s_receiver;
+
+static CANTransport s_tx_transport;
+static CANTransport s_rx_transport;
+
+static uint8_t s_payload[MAX_PAYLOAD];
+static uint8_t s_buffer[MAX_PAYLOAD];
+static bool s_done;
+static bool s_success;
+
+static uint8_t *on_buffer(NodeID sender, uint8_t tag, uint16_t length, void *ctx)
+{
+	(void)sender;
+	(void)tag;
+	(void)ctx;
+
+	return length <= MAX_PAYLOAD ? s_buffer : NULL;
+}
+
+static void on_receive(NodeID sender, uint8_t tag, uint8_t *buffer, uint16_t length, bool success, void *ctx)
+{
+	(void)sender;
+	(void)tag;
+	(void)buffer;
+	(void)length;
+	(void)success;
+	(void)ctx;
+}
+
+static void on_send(NodeID recipient, uint8_t tag, bool success, void *ctx)
+{
+	(void)recipient;
+	(void)tag;
+	(void)ctx;
+
+	s_done = true;
+	s_success = success;
+}
+
+static void on_message(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	(void)info;
+	(void)ctx;
+
+	// stands in for copying the chunk out.
+	Bench_Keep(msg->body[0]);
+}
+
+static bool done(void *ctx)
+{
+	(void)ctx;
+	return s_done;
+}
+
+static bool acked(void *ctx)
+{
+	(void)ctx;
+	return TxCache_Front(&s_sender->hcw.tx_cache) == TX_CACHE_NONE;
+}
+
+static void setup(uint16_t drop_permille)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){ .seed = 3 }, false);
+
+	s_sender = VirtualBus_Add_Node(&s_bus);
+	s_receiver = VirtualBus_Add_Node(&s_bus);
+	VirtualBus_Init_Node(&s_bus, s_sender, (CANWrapper_InitTypeDef){ .node_id = NODE_CDH });
+	VirtualBus_Init_Node(&s_bus, s_receiver, (CANWrapper_InitTypeDef){ .node_id = NODE_POWER });
+	CANWrapperEx_Register_Handler_Range(&s_receiver->hcw, 0, CMD_ID_COUNT - 1, &on_message, NULL);
+
+	// frames each node receives are lost at this rate, data and ACK's alike.
+	s_sender->drop_permille = drop_permille;
+	s_receiver->drop_permille = drop_permille;
+}
+
+/**
+ * @retval Goodput in bytes/s, or 0 if the transfer failed.
+ */
+static double bench_transport(uint16_t length, uint16_t drop_permille)
+{
+	setup(drop_permille);
+
+	CANTransport_InitTypeDef init = {
+		.buffer_callback = &on_buffer,
+		.receive_callback = &on_receive,
+		.send_callback = &on_send,
+	};
+	CANTransport_Init(&s_tx_transport, &s_sender->hcw, init);
+	CANTransport_Init(&s_rx_transport, &s_receiver->hcw, init);
+
+	s_done = false;
+	s_success = false;
+
+	uint64_t start = VirtualBus_Now(&s_bus);
+	CANTransport_Send(&s_tx_transport, NODE_POWER, TAG, s_payload, length);
+
+	if (!VirtualBus_Run_Until(&s_bus, &done, NULL, 60000000) || !s_success)
+		return 0;
+
+	return length * 1e6 / (double)(VirtualBus_Now(&s_bus) - start);
+}
+
+static double bench_stop_and_wait(uint16_t length, uint16_t drop_permille)
+{
+	setup(drop_permille);
+
+	uint64_t start = VirtualBus_Now(&s_bus);
+
+	// CDH_PROCESS_ERROR carries 7 bytes and is ACK'd.
+	for (uint16_t offset = 0; offset < length; offset += CAN_MAX_BODY_SIZE)
+	{
+		CANMessage msg = { .cmd = CMD_CDH_PROCESS_ERROR };
+		uint16_t chunk = length - offset < CAN_MAX_BODY_SIZE ? length - offset : CAN_MAX_BODY_SIZE;
+		memcpy(msg.body, &s_payload[offset], chunk);
+
+		CANWrapperEx_Transmit(&s_sender->hcw, NODE_POWER, &msg);
+
+		if (!VirtualBus_Run_Until(&s_bus, &acked, NULL, 10000000))
+			return 0;
+	}
+
+	// a message that ran out of retries is gone from the cache too.
+	CANWrapper_Stats stats;
+	CANWrapperEx_Get_Stats(&s_sender->hcw, &stats);
+	if (stats.nodes[NODE_POWER].acks_received < (uint32_t)(length + CAN_MAX_BODY_SIZE - 1) / CAN_MAX_BODY_SIZE)
+		return 0;
+
+	return length * 1e6 / (double)(VirtualBus_Now(&s_bus) - start);
+}
+
+int main(int argc, char **argv)
+{
+	Bench_Init("transport", argc, argv);
+
+	for (uint32_t i = 0; i < MAX_PAYLOAD; i++)
+	{
+		s_payload[i] = (uint8_t)(i * 13);
+	}
+
+	const uint16_t length = Bench_Quick() ? 256 : MAX_PAYLOAD;
+	const uint16_t drops[] = { 0, 10, 50 };
+
+	for (size_t i = 0; i < sizeof(drops)/sizeof(drops[0]); i++)
+	{
+		char name[64];
+
+		snprintf(name, sizeof(name), "stop_and_wait/goodput/loss=%u_permille", (unsigned)drops[i]);
+		Bench_Record(name, bench_stop_and_wait(length, drops[i]), "B/s");
+
+		snprintf(name, sizeof(name), "transport/goodput/loss=%u_permille", (unsigned)drops[i]);
+		Bench_Record(name, bench_transport(length, drops[i]), "B/s");
+	}
+
+	return Bench_Finish();
+}
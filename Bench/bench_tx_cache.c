@@ -0,0 +1,236 @@
+/**
+ * @file bench_tx_cache.c
+ * ACK matching in the hashed TxCache against the linear cache it replaced,
+ * with 10, 50 and 100 messages waiting on an ACK.
+ *
+ * Each ACK cycle finds the message an ACK answers, erases it and caches a
+ * new one, so the occupancy stays the same.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "tx_cache.h"
+#include "host_bench.h"
+#include <stdio.h>
+
+// --- the linear cache from before the hashed table ---
+//
+// A copy of the old tx_cache.c: a circular buffer searched front to back
+// with CANMessage_Equals, and closed up by shifting on erase. Its erase mixed
+// up buffer positions and indices, which is fixed here so that the contents
+// stay right; the cost is the same. One extra slot lets it hold 100.
+
+#define LINEAR_CACHE_SIZE (TX_CACHE_SIZE + 1)
+
+typedef struct
+{
+	size_t size;
+	uint32_t head;
+	uint32_t tail;
+	CachedCANMessage items[LINEAR_CACHE_SIZE];
+} LinearCache;
+
+static bool linear_is_matching_ack(const CachedCANMessage *msg, const CachedCANMessage *ack)
+{
+	return !msg->is_ack
+		&& ack->is_ack
+		&& CANMessage_Equals(&msg->msg, &ack->msg)
+		&& msg->priority == ack->priority
+		&& msg->sender == ack->recipient
+		&& msg->recipient == ack->sender;
+}
+
+static bool linear_push_back(LinearCache *txc, const CachedCANMessage *item)
+{
+	if ((txc->tail + 1) % LINEAR_CACHE_SIZE == txc->head)
+		return false;
+
+	txc->items[txc->tail] = *item;
+	txc->tail = (txc->tail + 1) % LINEAR_CACHE_SIZE;
+	txc->size++;
+
+	return true;
+}
+
+static int linear_find(const LinearCache *txc, const CachedCANMessage *ack)
+{
+	int index = 0;
+	uint32_t i = txc->head;
+	while (i != txc->tail && !linear_is_matching_ack(&txc->items[i], ack))
+	{
+		index++;
+		i = (i + 1) % LINEAR_CACHE_SIZE;
+	}
+
+	return i == txc->tail ? -1 : index;
+}
+
+static void linear_erase(LinearCache *txc, int index)
+{
+	// shift everything after it down by one.
+	uint32_t pos = (txc->head + index) % LINEAR_CACHE_SIZE;
+	uint32_t next = (pos + 1) % LINEAR_CACHE_SIZE;
+	while (next != txc->tail)
+	{
+		txc->items[pos] = txc->items[next];
+		pos = next;
+		next = (next + 1) % LINEAR_CACHE_SIZE;
+	}
+
+	txc->tail = pos;
+	txc->size--;
+}
+
+// --- workload ---
+
+#define SENDER NODE_CDH
+
+static const CmdID s_cmds[] = {
+	CMD_COMMON_GET_PCB_TEMP, CMD_CDH_PROCESS_ERROR, CMD_PWR_SET_LINE_POWER,
+	CMD_CDH_SET_RTC, CMD_PLD_SET_WELL_TEMP, CMD_ADCS_SET_MAGNETORQUER_POWER,
+};
+
+static uint32_t s_rng = 1;
+
+static uint32_t next_random(void)
+{
+	s_rng ^= s_rng << 13;
+	s_rng ^= s_rng >> 17;
+	s_rng ^= s_rng << 5;
+	return s_rng;
+}
+
+static CachedCANMessage random_message(void)
+{
+	CachedCANMessage msg = {0};
+
+	msg.msg.cmd = s_cmds[next_random() % (sizeof(s_cmds)/sizeof(s_cmds[0]))];
+	for (uint8_t i = 0; i < CAN_MAX_BODY_SIZE; i++)
+	{
+		msg.msg.body[i] = (uint8_t)next_random();
+	}
+
+	msg.priority = cmd_configs[msg.msg.cmd].priority;
+	msg.sender = SENDER;
+	msg.recipient = 1 + next_random() % 3;
+
+	return msg;
+}
+
+static double bench_linear(uint32_t occupancy, uint32_t cycles)
+{
+	static LinearCache txc;
+	txc = (LinearCache){0};
+
+	for (uint32_t i = 0; i < occupancy; i++)
+	{
+		CachedCANMessage msg = random_message();
+		linear_push_back(&txc, &msg);
+	}
+
+	uint64_t misses = 0;
+	uint64_t start = Bench_Time();
+
+	for (uint32_t i = 0; i < cycles; i++)
+	{
+		// the ACK of a random outstanding message.
+		CachedCANMessage ack = txc.items[(txc.head + next_random() % txc.size) % LINEAR_CACHE_SIZE];
+		ack.is_ack = true;
+		NodeID recipient = ack.recipient;
+		ack.recipient = ack.sender;
+		ack.sender = recipient;
+
+		int index = linear_find(&txc, &ack);
+		if (index < 0)
+		{
+			misses++;
+			continue;
+		}
+
+		linear_erase(&txc, index);
+
+		CachedCANMessage msg = random_message();
+		linear_push_back(&txc, &msg);
+	}
+
+	uint64_t elapsed = Bench_Time() - start;
+	Bench_Keep(misses);
+
+	return (double)elapsed / cycles;
+}
+
+static double bench_hashed(uint32_t occupancy, uint32_t cycles)
+{
+	static TxCache txc;
+	txc = TxCache_Create();
+
+	int slots[TX_CACHE_SIZE];
+	uint32_t position[TX_CACHE_SIZE]; // of each slot in slots.
+	uint32_t count = 0;
+
+	for (uint32_t i = 0; i < occupancy; i++)
+	{
+		TxCacheItem item = { .msg = random_message() };
+		slots[count] = TxCache_Push_Back(&txc, &item);
+		position[slots[count]] = count;
+		count++;
+	}
+
+	uint64_t misses = 0;
+	uint64_t start = Bench_Time();
+
+	for (uint32_t i = 0; i < cycles; i++)
+	{
+		// an ACK entry carries the command and the low byte of the hash.
+		uint32_t k = next_random() % count;
+		const TxCacheItem *acked = TxCache_At(&txc, slots[k]);
+		uint8_t hash = CANMessage_Hash(&acked->msg.msg) & 0xFF;
+
+		int slot = TxCache_Find(&txc, acked->msg.recipient, acked->msg.msg.cmd, hash);
+		if (slot < 0)
+		{
+			misses++;
+			continue;
+		}
+
+		TxCache_Erase(&txc, slot);
+
+		// keep the list of slots in use for picking ACK's.
+		uint32_t j = position[slot];
+		slots[j] = slots[--count];
+		position[slots[j]] = j;
+
+		TxCacheItem item = { .msg = random_message() };
+		slots[count] = TxCache_Push_Back(&txc, &item);
+		position[slots[count]] = count;
+		count++;
+	}
+
+	uint64_t elapsed = Bench_Time() - start;
+	Bench_Keep(misses);
+
+	return (double)elapsed / cycles;
+}
+
+int main(int argc, char **argv)
+{
+	Bench_Init("tx_cache", argc, argv);
+
+	const uint32_t cycles = Bench_Quick() ? 10000 : 2000000;
+	const uint32_t occupancies[] = { 10, 50, 100 };
+
+	for (size_t i = 0; i < sizeof(occupancies)/sizeof(occupancies[0]); i++)
+	{
+		char name[64];
+
+		snprintf(name, sizeof(name), "linear/ack_cycle/outstanding=%u", (unsigned)occupancies[i]);
+		Bench_Record(name, bench_linear(occupancies[i], cycles), "ns/op");
+
+		snprintf(name, sizeof(name), "hashed/ack_cycle/outstanding=%u", (unsigned)occupancies[i]);
+		Bench_Record(name, bench_hashed(occupancies[i], cycles), "ns/op");
+	}
+
+	return Bench_Finish();
+}
@@ -0,0 +1,210 @@
+/**
+ * @file bench_wait.c
+ * A CAN task that sleeps in CANWrapperEx_Wait_And_Process, against one that
+ * calls CANWrapperEx_Poll_Messages in a loop, on the POSIX port:
+ *  - latency from a frame reaching the receiver's RX FIFO to its handler,
+ *    which includes waking the task.
+ *  - the CPU the task uses while the bus is quiet, and how often it polls.
+ *
+ * The bus runs in its thread by the real time, so the numbers depend on the
+ * host and its load. Compare the two tasks on the same machine.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "host_bench.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define MAX_SAMPLES 2000
+#define SEND_INTERVAL_US 1000
+
+static VirtualBus s_bus;
+static VirtualNode *s_receiver;
+
+static pthread_t s_task;
+static atomic_bool s_stop;
+static bool s_wait; // whether the task waits, or polls in a loop.
+static atomic_uint_fast64_t s_polls;
+
+static uint64_t s_arrivals[MAX_SAMPLES]; // ns. when each frame reached the receiver.
+static atomic_uint s_arrival_count;
+static double s_latencies[MAX_SAMPLES]; // us.
+static atomic_uint s_handled;
+
+static void on_frame(const VirtualBusFrameInfo *info, void *ctx)
+{
+	(void)info;
+	(void)ctx;
+
+	// before the RX interrupt runs, so before the task can be woken.
+	unsigned n = atomic_load(&s_arrival_count);
+	if (n < MAX_SAMPLES)
+	{
+		s_arrivals[n] = FakeHAL_Get_Time();
+		atomic_store(&s_arrival_count, n + 1);
+	}
+}
+
+static void on_heartbeat(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	(void)msg;
+	(void)info;
+	(void)ctx;
+
+	// fire-and-forget frames arrive, and are handled, in the order they were sent.
+	unsigned n = atomic_load(&s_handled);
+	if (n < atomic_load(&s_arrival_count))
+		s_latencies[n] = (FakeHAL_Get_Time() - s_arrivals[n]) / 1000.0;
+
+	atomic_store(&s_handled, n + 1);
+}
+
+static void *task_main(void *arg)
+{
+	(void)arg;
+
+	while (!atomic_load(&s_stop))
+	{
+		if (s_wait)
+			CANWrapperEx_Wait_And_Process(&s_receiver->hcw, CAN_OS_WAIT_FOREVER);
+		else
+			CANWrapperEx_Poll_Messages(&s_receiver->hcw);
+
+		atomic_fetch_add(&s_polls, 1);
+	}
+
+	return NULL;
+}
+
+static void sleep_us(uint64_t us)
+{
+	struct timespec delay = { .tv_sec = us / 1000000, .tv_nsec = (long)(us % 1000000) * 1000 };
+	nanosleep(&delay, NULL);
+}
+
+static uint64_t task_cpu_ns(void)
+{
+	clockid_t clock;
+	struct timespec now;
+
+	pthread_getcpuclockid(s_task, &clock);
+	clock_gettime(clock, &now);
+
+	return (uint64_t)now.tv_sec*1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static void start(bool wait)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){0}, true);
+
+	VirtualNode *sender = VirtualBus_Add_Node(&s_bus);
+	VirtualBus_Init_Node(&s_bus, sender, (CANWrapper_InitTypeDef){ .node_id = NODE_CDH });
+
+	s_receiver = VirtualBus_Add_Node(&s_bus);
+	VirtualBus_Init_Node(&s_bus, s_receiver, (CANWrapper_InitTypeDef){ .node_id = NODE_POWER });
+	CANWrapperEx_Register_Handler(&s_receiver->hcw, CMD_CDH_PROCESS_HEARTBEAT, &on_heartbeat, NULL);
+
+	// only the receiver's frames are timed.
+	s_bus.on_frame = &on_frame;
+
+	atomic_store(&s_arrival_count, 0);
+	atomic_store(&s_handled, 0);
+	atomic_store(&s_polls, 0);
+	atomic_store(&s_stop, false);
+	s_wait = wait;
+
+	VirtualBus_Start_Thread(&s_bus);
+	pthread_create(&s_task, NULL, &task_main, NULL);
+}
+
+static void stop(void)
+{
+	atomic_store(&s_stop, true);
+
+#ifdef CAN_WRAPPER_OS
+	CANOS_Event_Signal(&s_receiver->hcw.work_event);
+#endif
+
+	pthread_join(s_task, NULL);
+	VirtualBus_Stop_Thread(&s_bus);
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static void run(bool wait, uint32_t messages, uint64_t idle_us)
+{
+	const char *kind = wait ? "wait_and_process" : "busy_poll";
+	char name[64];
+
+	start(wait);
+
+	// quiet bus: nothing to do but wait for the next timer period.
+	sleep_us(idle_us / 4);
+	uint64_t cpu_start = task_cpu_ns();
+	uint64_t polls_start = atomic_load(&s_polls);
+	uint64_t wall_start = Bench_Time();
+
+	sleep_us(idle_us);
+
+	double wall_ns = (double)(Bench_Time() - wall_start);
+	double cpu = 100.0 * (task_cpu_ns() - cpu_start) / wall_ns;
+	double polls = (atomic_load(&s_polls) - polls_start) * 1e9 / wall_ns;
+
+	// one heartbeat at a time, so each finds the task idle.
+	CANMessage msg = { .cmd = CMD_CDH_PROCESS_HEARTBEAT };
+	for (uint32_t i = 0; i < messages; i++)
+	{
+		CANWrapperEx_Transmit(&s_bus.nodes[0].hcw, NODE_POWER, &msg);
+		sleep_us(SEND_INTERVAL_US);
+	}
+
+	// let the last one through.
+	sleep_us(10*SEND_INTERVAL_US);
+	stop();
+
+	unsigned count = atomic_load(&s_handled);
+	if (count > messages)
+		count = messages;
+
+	qsort(s_latencies, count, sizeof(s_latencies[0]), &compare_doubles);
+
+	snprintf(name, sizeof(name), "%s/idle_cpu", kind);
+	Bench_Record(name, cpu, "%");
+	snprintf(name, sizeof(name), "%s/idle_polls_per_s", kind);
+	Bench_Record(name, polls, "polls/s");
+	snprintf(name, sizeof(name), "%s/handled", kind);
+	Bench_Record(name, 100.0 * count / messages, "%");
+
+	if (count == 0)
+		return;
+
+	snprintf(name, sizeof(name), "%s/rx_to_handler/p50", kind);
+	Bench_Record(name, s_latencies[count / 2], "us");
+	snprintf(name, sizeof(name), "%s/rx_to_handler/p99", kind);
+	Bench_Record(name, s_latencies[(count * 99) / 100], "us");
+	snprintf(name, sizeof(name), "%s/rx_to_handler/max", kind);
+	Bench_Record(name, s_latencies[count - 1], "us");
+}
+
+int main(int argc, char **argv)
+{
+	Bench_Init("wait", argc, argv);
+
+	const uint32_t messages = Bench_Quick() ? 50 : MAX_SAMPLES;
+	const uint64_t idle_us = Bench_Quick() ? 50000 : 1000000;
+
+	run(true, messages, idle_us);
+	run(false, messages, idle_us);
+
+	return Bench_Finish();
+}
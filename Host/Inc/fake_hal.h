@@ -0,0 +1,426 @@
+/**
+ * @file fake_hal.h
+ * Stand-in for the STM32L4 HAL, for building and testing the wrapper on a host.
+ * Build with -DCAN_WRAPPER_HAL_HEADER='"fake_hal.h"'.
+ *
+ * Models the parts of bxCAN and the basic timers that the wrapper relies on:
+ *  - 3 TX mailboxes, sent lowest identifier first (TXFP = 0).
+ *  - 2 RX FIFOs of 3 frames, without FIFO lock, so a 4th frame overwrites the
+ *    newest one and sets the overrun flag.
+ *  - 28 filter banks in 16 and 32 bit scale, in mask and list mode.
+ *  - The ESR error counters and flags, and bus-off and its recovery.
+ *  - A timer counting at 1MHz from a clock the test controls (see FakeHAL_Set_Time).
+ *
+ * The controller doesn't send anything by itself. A bus (see virtual_bus.h)
+ * takes frames from the mailboxes, hands them to the other controllers and
+ * runs the interrupt handlers with FakeCAN_Service and FakeTIM_Service.
+ *
+ * Interrupts are emulated by a lock: an "ISR" runs with it held, and
+ * __disable_irq takes it, so a thread inside a critical section keeps them
+ * out the way PRIMASK would.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#ifndef CAN_WRAPPER_MODULE_HOST_INC_FAKE_HAL_H_
+#define CAN_WRAPPER_MODULE_HOST_INC_FAKE_HAL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum
+{
+	HAL_OK      = 0x00U,
+	HAL_ERROR   = 0x01U,
+	HAL_BUSY    = 0x02U,
+	HAL_TIMEOUT = 0x03U
+} HAL_StatusTypeDef;
+
+#define ENABLE  1U
+#define DISABLE 0U
+#define SET     1U
+#define RESET   0U
+
+// --- CMSIS ---
+
+/**
+ * @brief Takes the interrupt lock, unless this thread already holds it.
+ */
+void __disable_irq(void);
+
+/**
+ * @brief Returns 1 while this thread holds the interrupt lock.
+ */
+uint32_t __get_PRIMASK(void);
+
+/**
+ * @brief Releases the interrupt lock when given 0 and this thread holds it.
+ */
+void __set_PRIMASK(uint32_t primask);
+
+// --- clock ---
+
+/**
+ * @brief Returns the time in ns since FakeHAL_Reset.
+ */
+uint64_t FakeHAL_Get_Time(void);
+
+/**
+ * @brief Moves the simulated clock forward to time (in ns). Ignored if it is in the past.
+ */
+void FakeHAL_Set_Time(uint64_t time);
+
+/**
+ * @brief Sets the clock back to 0.
+ *
+ * @param real_time: true to follow CLOCK_MONOTONIC from now on, for tests
+ *                   that run the wrapper in threads. false to only move with FakeHAL_Set_Time.
+ */
+void FakeHAL_Reset(bool real_time);
+
+// --- CAN ---
+
+#define CAN_TX_MAILBOX_COUNT 3
+#define CAN_RX_FIFO_COUNT    2
+#define CAN_RX_FIFO_DEPTH    3
+#define CAN_FILTER_BANKS     28
+
+#define CAN_ID_STD     0x00000000U
+#define CAN_ID_EXT     0x00000004U
+
+#define CAN_RTR_DATA   0x00000000U
+#define CAN_RTR_REMOTE 0x00000002U
+
+#define CAN_RX_FIFO0   0x00000000U
+#define CAN_RX_FIFO1   0x00000001U
+
+#define CAN_TX_MAILBOX0 0x00000001U
+#define CAN_TX_MAILBOX1 0x00000002U
+#define CAN_TX_MAILBOX2 0x00000004U
+
+#define CAN_FILTER_FIFO0 0x00000000U
+#define CAN_FILTER_FIFO1 0x00000001U
+
+#define CAN_FILTERMODE_IDMASK 0x00000000U
+#define CAN_FILTERMODE_IDLIST 0x00000001U
+
+#define CAN_FILTERSCALE_16BIT 0x00000000U
+#define CAN_FILTERSCALE_32BIT 0x00000001U
+
+// the IER bits, which is what the real HAL uses for these.
+#define CAN_IT_TX_MAILBOX_EMPTY     0x00000001U
+#define CAN_IT_RX_FIFO0_MSG_PENDING 0x00000002U
+#define CAN_IT_RX_FIFO0_FULL        0x00000004U
+#define CAN_IT_RX_FIFO0_OVERRUN     0x00000008U
+#define CAN_IT_RX_FIFO1_MSG_PENDING 0x00000010U
+#define CAN_IT_RX_FIFO1_FULL        0x00000020U
+#define CAN_IT_RX_FIFO1_OVERRUN     0x00000040U
+#define CAN_IT_ERROR_WARNING        0x00000100U
+#define CAN_IT_ERROR_PASSIVE        0x00000200U
+#define CAN_IT_BUSOFF               0x00000400U
+#define CAN_IT_LAST_ERROR_CODE      0x00000800U
+#define CAN_IT_ERROR                0x00008000U
+
+#define HAL_CAN_ERROR_NONE      0x00000000U
+#define HAL_CAN_ERROR_EWG       0x00000001U
+#define HAL_CAN_ERROR_EPV       0x00000002U
+#define HAL_CAN_ERROR_BOF       0x00000004U
+#define HAL_CAN_ERROR_STF       0x00000008U
+#define HAL_CAN_ERROR_FOR       0x00000010U
+#define HAL_CAN_ERROR_ACK       0x00000020U
+#define HAL_CAN_ERROR_BR        0x00000040U
+#define HAL_CAN_ERROR_BD        0x00000080U
+#define HAL_CAN_ERROR_CRC       0x00000100U
+#define HAL_CAN_ERROR_RX_FOV0   0x00000200U
+#define HAL_CAN_ERROR_RX_FOV1   0x00000400U
+#define HAL_CAN_ERROR_NOT_READY 0x00080000U
+#define HAL_CAN_ERROR_PARAM     0x00200000U
+
+#define CAN_ESR_EWGF     0x00000001U
+#define CAN_ESR_EPVF     0x00000002U
+#define CAN_ESR_BOFF     0x00000004U
+#define CAN_ESR_LEC_Pos  4U
+#define CAN_ESR_LEC_Msk  (0x7U << CAN_ESR_LEC_Pos)
+#define CAN_ESR_TEC_Pos  16U
+#define CAN_ESR_TEC_Msk  (0xFFU << CAN_ESR_TEC_Pos)
+#define CAN_ESR_REC_Pos  24U
+#define CAN_ESR_REC_Msk  (0xFFU << CAN_ESR_REC_Pos)
+
+// last error codes, as bxCAN writes them to ESR.LEC.
+typedef enum
+{
+	FAKE_CAN_LEC_NONE = 0,
+	FAKE_CAN_LEC_STUFF,
+	FAKE_CAN_LEC_FORM,
+	FAKE_CAN_LEC_ACK,
+	FAKE_CAN_LEC_BIT_RECESSIVE,
+	FAKE_CAN_LEC_BIT_DOMINANT,
+	FAKE_CAN_LEC_CRC
+} FakeCAN_LastError;
+
+typedef struct
+{
+	uint32_t id; // 11 or 29 bit identifier.
+	bool extended;
+	bool remote;
+	uint8_t dlc;
+	uint8_t data[8];
+} FakeCANFrame;
+
+typedef struct
+{
+	bool active;
+	bool scale32;
+	bool list_mode;
+	uint8_t fifo;
+	uint32_t fr1;
+	uint32_t fr2;
+} FakeCANFilterBank;
+
+typedef enum
+{
+	FAKE_CAN_RESET = 0,  // not started, or stopped.
+	FAKE_CAN_RUNNING,
+	FAKE_CAN_BUS_OFF     // waiting for 128 times 11 recessive bits.
+} FakeCAN_State;
+
+typedef struct
+{
+	uint32_t tx_interrupts;
+	uint32_t rx_interrupts;
+	uint32_t error_interrupts;
+	uint32_t frames_sent;
+	uint32_t frames_received;  // frames that passed a filter.
+	uint32_t frames_filtered;  // frames that didn't.
+	uint32_t overruns;
+	uint32_t bus_offs;
+	uint64_t isr_time;  // ns of host time spent in HAL_CAN_IRQHandler.
+} FakeCAN_Counters;
+
+/**
+ * @brief The controller. ESR is laid out as on bxCAN. Everything else is the
+ *        state behind the other registers, kept in a form that is easier to test.
+ */
+typedef struct
+{
+	volatile uint32_t ESR;
+
+	FakeCAN_State state;
+	uint32_t ier;  // enabled CAN_IT_* notifications.
+
+	bool mailbox_pending[CAN_TX_MAILBOX_COUNT];
+	FakeCANFrame mailboxes[CAN_TX_MAILBOX_COUNT];
+	uint8_t tx_complete; // bit i: mailbox i was sent and its interrupt hasn't run yet.
+
+	FakeCANFrame fifos[CAN_RX_FIFO_COUNT][CAN_RX_FIFO_DEPTH];
+	uint16_t fifo_filter[CAN_RX_FIFO_COUNT][CAN_RX_FIFO_DEPTH]; // filter match index of each frame.
+	uint8_t fifo_count[CAN_RX_FIFO_COUNT];
+	bool fifo_overrun[CAN_RX_FIFO_COUNT];
+
+	FakeCANFilterBank filters[CAN_FILTER_BANKS];
+
+	uint16_t tec;
+	uint8_t rec;
+	bool error_interrupt;    // ERRI: an enabled error condition is waiting for the ISR.
+	bool recovering;         // bus-off, and restarted, so counting recessive_runs.
+	uint32_t recessive_runs; // sequences of 11 recessive bits seen while recovering.
+
+	FakeCAN_Counters counters;
+} CAN_TypeDef;
+
+typedef struct
+{
+	CAN_TypeDef *Instance;
+	volatile uint32_t ErrorCode;
+} CAN_HandleTypeDef;
+
+typedef struct
+{
+	uint32_t StdId;
+	uint32_t ExtId;
+	uint32_t IDE;
+	uint32_t RTR;
+	uint32_t DLC;
+	uint32_t TransmitGlobalTime;
+} CAN_TxHeaderTypeDef;
+
+typedef struct
+{
+	uint32_t StdId;
+	uint32_t ExtId;
+	uint32_t IDE;
+	uint32_t RTR;
+	uint32_t DLC;
+	uint32_t Timestamp;
+	uint32_t FilterMatchIndex;
+} CAN_RxHeaderTypeDef;
+
+typedef struct
+{
+	uint32_t FilterIdHigh;
+	uint32_t FilterIdLow;
+	uint32_t FilterMaskIdHigh;
+	uint32_t FilterMaskIdLow;
+	uint32_t FilterFIFOAssignment;
+	uint32_t FilterBank;
+	uint32_t FilterMode;
+	uint32_t FilterScale;
+	uint32_t FilterActivation;
+	uint32_t SlaveStartFilterBank;
+} CAN_FilterTypeDef;
+
+HAL_StatusTypeDef HAL_CAN_ConfigFilter(CAN_HandleTypeDef *hcan, const CAN_FilterTypeDef *filter);
+HAL_StatusTypeDef HAL_CAN_Start(CAN_HandleTypeDef *hcan);
+HAL_StatusTypeDef HAL_CAN_Stop(CAN_HandleTypeDef *hcan);
+HAL_StatusTypeDef HAL_CAN_ActivateNotification(CAN_HandleTypeDef *hcan, uint32_t active_its);
+HAL_StatusTypeDef HAL_CAN_DeactivateNotification(CAN_HandleTypeDef *hcan, uint32_t inactive_its);
+uint32_t HAL_CAN_GetTxMailboxesFreeLevel(const CAN_HandleTypeDef *hcan);
+HAL_StatusTypeDef HAL_CAN_AddTxMessage(CAN_HandleTypeDef *hcan, const CAN_TxHeaderTypeDef *header, const uint8_t data[], uint32_t *mailbox);
+HAL_StatusTypeDef HAL_CAN_GetRxMessage(CAN_HandleTypeDef *hcan, uint32_t fifo, CAN_RxHeaderTypeDef *header, uint8_t data[]);
+uint32_t HAL_CAN_GetRxFifoFillLevel(const CAN_HandleTypeDef *hcan, uint32_t fifo);
+uint32_t HAL_CAN_GetError(const CAN_HandleTypeDef *hcan);
+HAL_StatusTypeDef HAL_CAN_ResetError(CAN_HandleTypeDef *hcan);
+
+/**
+ * @brief Runs the CAN interrupt handlers, as HAL_CAN_IRQHandler does for the
+ *        TX, RX0, RX1 and SCE vectors, calling the HAL_CAN_*Callback functions.
+ */
+void HAL_CAN_IRQHandler(CAN_HandleTypeDef *hcan);
+
+void HAL_CAN_TxMailbox0CompleteCallback(CAN_HandleTypeDef *hcan);
+void HAL_CAN_TxMailbox1CompleteCallback(CAN_HandleTypeDef *hcan);
+void HAL_CAN_TxMailbox2CompleteCallback(CAN_HandleTypeDef *hcan);
+void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef *hcan);
+void HAL_CAN_RxFifo1MsgPendingCallback(CAN_HandleTypeDef *hcan);
+void HAL_CAN_ErrorCallback(CAN_HandleTypeDef *hcan);
+
+/**
+ * @brief Resets the controller, as at power-on: no filters, nothing pending, counters at 0.
+ */
+void FakeCAN_Reset(CAN_TypeDef *can);
+
+/**
+ * @brief Returns true if the controller is taking part in bus traffic.
+ */
+bool FakeCAN_Is_On_Bus(const CAN_TypeDef *can);
+
+/**
+ * @brief Returns the mailbox that would win arbitration for this controller, or -1 if none is pending.
+ */
+int FakeCAN_Next_Mailbox(const CAN_TypeDef *can);
+
+/**
+ * @brief Ends the transmission of a mailbox.
+ *
+ * @param lec: FAKE_CAN_LEC_NONE if it was sent. Otherwise the error the
+ *             transmitter saw, and the mailbox is sent again later.
+ */
+void FakeCAN_Transmitted(CAN_TypeDef *can, int mailbox, FakeCAN_LastError lec);
+
+/**
+ * @brief Hands a frame on the bus to the controller, which stores it if a filter accepts it.
+ *
+ * @retval true if it was stored in one of the FIFOs.
+ */
+bool FakeCAN_Receive(CAN_TypeDef *can, const FakeCANFrame *frame);
+
+/**
+ * @brief Records an error the controller saw while receiving.
+ */
+void FakeCAN_Receive_Error(CAN_TypeDef *can, FakeCAN_LastError lec);
+
+/**
+ * @brief Counts sequences of 11 recessive bits towards recovering from bus-off.
+ */
+void FakeCAN_Recessive_Bits(CAN_TypeDef *can, uint32_t runs);
+
+/**
+ * @brief Returns true if an interrupt of the controller is pending and enabled.
+ */
+bool FakeCAN_IRQ_Pending(const CAN_TypeDef *can);
+
+/**
+ * @brief Enters the CAN interrupt, if one is pending, and runs HAL_CAN_IRQHandler.
+ *
+ * @retval true if it ran.
+ */
+bool FakeCAN_Service(CAN_HandleTypeDef *hcan);
+
+// --- TIM ---
+
+#define TIM_FLAG_UPDATE 0x00000001U // SR.UIF
+#define TIM_IT_UPDATE   0x00000001U // DIER.UIE
+
+typedef struct TIM_HandleTypeDef TIM_HandleTypeDef;
+
+typedef struct
+{
+	volatile uint32_t SR;
+	volatile uint32_t DIER;
+	uint32_t ARR;
+
+	bool running;
+	uint64_t start_time;     // ns.
+	uint32_t ns_per_count;   // 1000 at 1MHz.
+	uint64_t updates;        // update events so far.
+	bool irq_held;           // see FakeTIM_Hold_IRQ.
+	uint32_t irq_count;
+
+	// the "vector": what the application calls from TIMx_IRQHandler.
+	void (*irq_handler)(TIM_HandleTypeDef *htim);
+
+	// runs in HAL_TIM_IRQHandler between clearing UIF and the callback,
+	// where a higher priority interrupt could preempt it.
+	void (*preempt)(TIM_HandleTypeDef *htim);
+} TIM_TypeDef;
+
+struct TIM_HandleTypeDef
+{
+	TIM_TypeDef *Instance;
+};
+
+HAL_StatusTypeDef HAL_TIM_Base_Start_IT(TIM_HandleTypeDef *htim);
+
+/**
+ * @brief Clears UIF and calls HAL_TIM_PeriodElapsedCallback, as the real handler does for update events.
+ */
+void HAL_TIM_IRQHandler(TIM_HandleTypeDef *htim);
+
+void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim);
+
+uint32_t FakeTIM_Get_Counter(TIM_HandleTypeDef *htim);
+uint32_t FakeTIM_Get_SR(TIM_HandleTypeDef *htim);
+void FakeTIM_Clear_IT(TIM_HandleTypeDef *htim, uint32_t it);
+
+#define __HAL_TIM_GET_COUNTER(__HANDLE__)       FakeTIM_Get_Counter(__HANDLE__)
+#define __HAL_TIM_GET_AUTORELOAD(__HANDLE__)    ((__HANDLE__)->Instance->ARR)
+#define __HAL_TIM_GET_FLAG(__HANDLE__, __FLAG__) ((FakeTIM_Get_SR(__HANDLE__) & (__FLAG__)) == (__FLAG__))
+#define __HAL_TIM_CLEAR_IT(__HANDLE__, __INTERRUPT__) FakeTIM_Clear_IT(__HANDLE__, __INTERRUPT__)
+
+/**
+ * @brief Resets the timer to a 1MHz counter with the given auto-reload value, stopped.
+ */
+void FakeTIM_Reset(TIM_TypeDef *tim, uint32_t arr);
+
+/**
+ * @brief Returns the time (in ns) of the timer's next update event, or UINT64_MAX if it is stopped.
+ */
+uint64_t FakeTIM_Next_Update(const TIM_TypeDef *tim);
+
+/**
+ * @brief Keeps the update interrupt pending while held, like a higher priority
+ *        interrupt or a long critical section would.
+ */
+void FakeTIM_Hold_IRQ(TIM_HandleTypeDef *htim, bool held);
+
+/**
+ * @brief Enters the timer interrupt, if one is pending, and runs irq_handler.
+ *
+ * @retval true if it ran.
+ */
+bool FakeTIM_Service(TIM_HandleTypeDef *htim);
+
+#endif /* CAN_WRAPPER_MODULE_HOST_INC_FAKE_HAL_H_ */
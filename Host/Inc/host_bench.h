@@ -0,0 +1,54 @@
+/**
+ * @file host_bench.h
+ * Timing and JSON output for the host benchmarks in Bench/.
+ *
+ * Every benchmark takes:
+ *  --quick        a short run, as ctest does to check that it still works.
+ *  --json <file>  write the results there instead of to stdout.
+ *
+ * The output is {"suite": ..., "quick": ..., "results": [{"name": ..., "value": ..., "unit": ...}, ...]}.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#ifndef CAN_WRAPPER_MODULE_HOST_INC_HOST_BENCH_H_
+#define CAN_WRAPPER_MODULE_HOST_INC_HOST_BENCH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief Reads the command line. Call first.
+ */
+void Bench_Init(const char *suite, int argc, char **argv);
+
+bool Bench_Quick(void);
+
+/**
+ * @brief Returns CLOCK_MONOTONIC in ns.
+ */
+uint64_t Bench_Time(void);
+
+/**
+ * @brief Adds a result. name is copied.
+ */
+void Bench_Record(const char *name, double value, const char *unit);
+
+/**
+ * @brief Writes the results.
+ *
+ * @retval The exit code for main.
+ */
+int Bench_Finish(void);
+
+/**
+ * @brief Stops the compiler from optimising away a value a benchmark computes.
+ */
+static inline void Bench_Keep(uint64_t value)
+{
+	__asm__ volatile("" : : "r"(value) : "memory");
+}
+
+#endif /* CAN_WRAPPER_MODULE_HOST_INC_HOST_BENCH_H_ */
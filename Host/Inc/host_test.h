@@ -0,0 +1,43 @@
+/**
+ * @file host_test.h
+ * Checks for the host tests in Tests/. A failed check is printed and the
+ * test carries on, then HOST_TEST_RESULT gives the exit code for ctest.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#ifndef CAN_WRAPPER_MODULE_HOST_INC_HOST_TEST_H_
+#define CAN_WRAPPER_MODULE_HOST_INC_HOST_TEST_H_
+
+#include <stdio.h>
+
+static int host_test_failures;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			host_test_failures++; \
+		} \
+	} while (0)
+
+// for integers. prints both sides when they differ.
+#define CHECK_EQ(actual, expected) \
+	do { \
+		long long actual_ = (long long)(actual); \
+		long long expected_ = (long long)(expected); \
+		if (actual_ != expected_) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s == %s (%lld != %lld)\n", \
+					__FILE__, __LINE__, #actual, #expected, actual_, expected_); \
+			host_test_failures++; \
+		} \
+	} while (0)
+
+#define HOST_TEST_RESULT() \
+	(host_test_failures == 0 ? (printf("all checks passed\n"), 0) : (printf("%d checks failed\n", host_test_failures), 1))
+
+#endif /* CAN_WRAPPER_MODULE_HOST_INC_HOST_TEST_H_ */
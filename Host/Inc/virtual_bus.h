@@ -0,0 +1,176 @@
+/**
+ * @file virtual_bus.h
+ * A simulated CAN bus linking the fake controllers of several wrapper instances.
+ *
+ * Frames go out one at a time, chosen by identifier arbitration among the
+ * controllers' mailboxes, and take as long as their bits (with stuffing) take
+ * at the bus's bitrate. Time is simulated: VirtualBus_Run moves the clock,
+ * delivering frames, timer updates and interrupts in order, and polls every
+ * node on the way. Tests that run the wrapper in threads start a bus thread
+ * instead, which follows the real time.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#ifndef CAN_WRAPPER_MODULE_HOST_INC_VIRTUAL_BUS_H_
+#define CAN_WRAPPER_MODULE_HOST_INC_VIRTUAL_BUS_H_
+
+#include "can_wrapper.h"
+#include <pthread.h>
+
+#define VIRTUAL_BUS_MAX_NODES CAN_WRAPPER_MAX_INSTANCES
+
+#define VIRTUAL_BUS_DEFAULT_BITRATE       500000
+#define VIRTUAL_BUS_DEFAULT_POLL_INTERVAL 100    // us.
+#define VIRTUAL_BUS_TIMER_PERIOD          5000   // us. TIM16's period in the projects.
+
+// the bits after the CRC: delimiter, ACK slot and delimiter, end of frame, intermission.
+#define VIRTUAL_BUS_FRAME_TAIL_BITS 13
+
+// active error flag and error delimiter.
+#define VIRTUAL_BUS_ERROR_FRAME_BITS 14
+
+typedef struct VirtualBus VirtualBus;
+
+typedef struct
+{
+	uint8_t node;        // index of the sender in VirtualBus.nodes.
+	FakeCANFrame frame;
+	uint64_t start;      // ns.
+	uint64_t end;        // ns. includes the intermission.
+	uint32_t bits;
+	bool ok;             // false if it ended in an error frame, and will be sent again.
+} VirtualBusFrameInfo;
+
+typedef void (*VirtualBusFrameHook)(const VirtualBusFrameInfo *info, void *ctx);
+
+typedef struct
+{
+	uint32_t bitrate;          // bit/s. 0 uses VIRTUAL_BUS_DEFAULT_BITRATE.
+	uint32_t poll_interval_us; // how often VirtualBus_Run polls each node. 0 uses VIRTUAL_BUS_DEFAULT_POLL_INTERVAL.
+	uint32_t seed;             // for the receive drops. 0 uses 1.
+} VirtualBus_InitTypeDef;
+
+typedef struct
+{
+	CAN_TypeDef can;
+	CAN_HandleTypeDef hcan;
+	TIM_TypeDef tim;
+	TIM_HandleTypeDef htim;
+
+	CANWrapper_Handle hcw;
+
+	bool polled;          // whether VirtualBus_Run polls this node. set by VirtualBus_Init_Node.
+	uint32_t tx_errors;   // transmissions left to corrupt. see VirtualBus_Inject_Errors.
+	uint16_t drop_permille; // chance of losing a received frame before the filters, per 1000.
+
+	uint32_t frames_dropped;
+} VirtualNode;
+
+typedef struct
+{
+	uint32_t frames;        // sent without error.
+	uint32_t error_frames;
+	uint64_t bits;          // of every frame, including the ones cut by an error.
+	uint64_t busy_time;     // ns.
+} VirtualBusStats;
+
+struct VirtualBus
+{
+	VirtualBus_InitTypeDef init_struct;
+
+	VirtualNode nodes[VIRTUAL_BUS_MAX_NODES];
+	uint8_t node_count;
+
+	bool in_flight;           // a frame is on the bus.
+	VirtualBusFrameInfo current;
+	int current_mailbox;
+	uint64_t idle_since;      // ns. when the bus last went idle.
+	uint64_t next_poll;       // ns.
+
+	VirtualBusStats stats;
+	uint32_t rng_state;
+
+	VirtualBusFrameHook on_frame;
+	void *hook_ctx;
+
+	pthread_t thread;
+	volatile bool thread_running;
+};
+
+/**
+ * @brief Resets the clock to 0 and sets up an empty bus.
+ *
+ * @param real_time: true to run the bus in a thread by the real time (see
+ *                   VirtualBus_Start_Thread). false to move it with VirtualBus_Run.
+ */
+void VirtualBus_Init(VirtualBus *bus, VirtualBus_InitTypeDef init_struct, bool real_time);
+
+/**
+ * @brief Adds a node with a reset CAN controller and a stopped 1MHz timer.
+ *        Use VirtualBus_Init_Node to start a wrapper on it.
+ *
+ * @retval NULL if the bus already has VIRTUAL_BUS_MAX_NODES.
+ */
+VirtualNode *VirtualBus_Add_Node(VirtualBus *bus);
+
+/**
+ * @brief Points init_struct at the node's peripherals and initialises its wrapper.
+ */
+CANWrapper_StatusTypeDef VirtualBus_Init_Node(VirtualBus *bus, VirtualNode *node, CANWrapper_InitTypeDef init_struct);
+
+/**
+ * @brief Runs the bus for us microseconds, polling each node every poll_interval_us.
+ */
+void VirtualBus_Run(VirtualBus *bus, uint64_t us);
+
+/**
+ * @brief Runs the bus until done(ctx) returns true, checking after each step.
+ *
+ * @retval true if done returned true within max_us.
+ */
+bool VirtualBus_Run_Until(VirtualBus *bus, bool (*done)(void *ctx), void *ctx, uint64_t max_us);
+
+/**
+ * @brief Runs the bus for us microseconds without polling any node.
+ */
+void VirtualBus_Advance(VirtualBus *bus, uint64_t us);
+
+/**
+ * @brief Returns the bus time in microseconds.
+ */
+uint64_t VirtualBus_Now(const VirtualBus *bus);
+
+/**
+ * @brief Makes the node's next count transmissions end in a bit error.
+ *        Its TEC goes up by 8 for each, and the other nodes' REC by 1.
+ */
+void VirtualBus_Inject_Errors(VirtualNode *node, uint32_t count);
+
+/**
+ * @brief Starts a thread that moves the bus by the real time. Only for a bus
+ *        initialised with real_time. Nodes are polled by the caller's threads.
+ */
+void VirtualBus_Start_Thread(VirtualBus *bus);
+
+void VirtualBus_Stop_Thread(VirtualBus *bus);
+
+/**
+ * @brief Returns the number of bits the frame takes on the bus, counting stuff
+ *        bits, the CRC and VIRTUAL_BUS_FRAME_TAIL_BITS.
+ */
+uint32_t VirtualBus_Frame_Bits(const FakeCANFrame *frame);
+
+/**
+ * @brief The nodes' timer interrupt, wired as the README shows for TIM1_UP_TIM16_IRQHandler.
+ */
+void VirtualBus_TIM_IRQHandler(TIM_HandleTypeDef *htim);
+
+/**
+ * @brief Returns the index of the node with this wrapper handle, or -1.
+ */
+int VirtualBus_Node_Index(const VirtualBus *bus, const CANWrapper_Handle *hcw);
+
+#endif /* CAN_WRAPPER_MODULE_HOST_INC_VIRTUAL_BUS_H_ */
@@ -0,0 +1,857 @@
+/**
+ * @file fake_hal.c
+ * Stand-in for the STM32L4 HAL's CAN and TIM drivers. See fake_hal.h.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#ifdef CAN_WRAPPER_HAL_HEADER
+
+#include "fake_hal.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+// interrupts leave the ISR stuck after this many entries without going quiet.
+#define MAX_IRQ_ENTRIES 64
+
+static pthread_mutex_t s_irq_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local bool t_irq_disabled;
+
+static _Atomic uint64_t s_time;
+static bool s_real_time;
+static struct timespec s_origin;
+
+/**
+ * @brief Takes the interrupt lock for a HAL function, the way the
+ *        peripheral's registers would be updated atomically.
+ *
+ * @retval true if it was taken here, and must be given back with unlock.
+ */
+static bool lock(void);
+
+static void unlock(bool taken);
+
+static uint64_t monotonic_ns(void);
+
+/**
+ * @brief Sets the ESR flags and counters from tec and rec, and raises the
+ *        error interrupt for flags that have just been set.
+ */
+static void update_esr(CAN_TypeDef *can);
+
+static void set_last_error(CAN_TypeDef *can, FakeCAN_LastError lec);
+
+/**
+ * @brief Returns the filter that accepts the frame, with its match index, or -1.
+ */
+static int match_filter(const CAN_TypeDef *can, const FakeCANFrame *frame, uint16_t *match_index);
+
+/**
+ * @brief Brings the timer's update flag and count up to the current time.
+ */
+static void sync_timer(TIM_TypeDef *tim);
+
+// --- CMSIS ---
+
+void __disable_irq(void)
+{
+	if (!t_irq_disabled)
+	{
+		pthread_mutex_lock(&s_irq_lock);
+		t_irq_disabled = true;
+	}
+}
+
+uint32_t __get_PRIMASK(void)
+{
+	return t_irq_disabled ? 1 : 0;
+}
+
+void __set_PRIMASK(uint32_t primask)
+{
+	if (primask != 0)
+	{
+		__disable_irq();
+	}
+	else if (t_irq_disabled)
+	{
+		t_irq_disabled = false;
+		pthread_mutex_unlock(&s_irq_lock);
+	}
+}
+
+// --- clock ---
+
+uint64_t FakeHAL_Get_Time(void)
+{
+	if (s_real_time)
+		return monotonic_ns();
+
+	return atomic_load(&s_time);
+}
+
+void FakeHAL_Set_Time(uint64_t time)
+{
+	if (time > atomic_load(&s_time))
+		atomic_store(&s_time, time);
+}
+
+void FakeHAL_Reset(bool real_time)
+{
+	clock_gettime(CLOCK_MONOTONIC, &s_origin);
+	atomic_store(&s_time, 0);
+	s_real_time = real_time;
+}
+
+// --- CAN ---
+
+HAL_StatusTypeDef HAL_CAN_ConfigFilter(CAN_HandleTypeDef *hcan, const CAN_FilterTypeDef *filter)
+{
+	if (filter->FilterBank >= CAN_FILTER_BANKS)
+	{
+		hcan->ErrorCode |= HAL_CAN_ERROR_PARAM;
+		return HAL_ERROR;
+	}
+
+	bool taken = lock();
+
+	FakeCANFilterBank *bank = &hcan->Instance->filters[filter->FilterBank];
+	bank->active = filter->FilterActivation == ENABLE;
+	bank->scale32 = filter->FilterScale == CAN_FILTERSCALE_32BIT;
+	bank->list_mode = filter->FilterMode == CAN_FILTERMODE_IDLIST;
+	bank->fifo = filter->FilterFIFOAssignment == CAN_FILTER_FIFO1 ? 1 : 0;
+
+	// the same register layout as HAL_CAN_ConfigFilter writes.
+	if (bank->scale32)
+	{
+		bank->fr1 = (filter->FilterIdHigh & 0xFFFF) << 16 | (filter->FilterIdLow & 0xFFFF);
+		bank->fr2 = (filter->FilterMaskIdHigh & 0xFFFF) << 16 | (filter->FilterMaskIdLow & 0xFFFF);
+	}
+	else
+	{
+		bank->fr1 = (filter->FilterMaskIdLow & 0xFFFF) << 16 | (filter->FilterIdLow & 0xFFFF);
+		bank->fr2 = (filter->FilterMaskIdHigh & 0xFFFF) << 16 | (filter->FilterIdHigh & 0xFFFF);
+	}
+
+	unlock(taken);
+
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_CAN_Start(CAN_HandleTypeDef *hcan)
+{
+	CAN_TypeDef *can = hcan->Instance;
+
+	if (can->state != FAKE_CAN_RESET)
+	{
+		hcan->ErrorCode |= HAL_CAN_ERROR_NOT_READY;
+		return HAL_ERROR;
+	}
+
+	bool taken = lock();
+
+	// leaving initialisation mode is what starts the bus-off recovery.
+	if (can->tec > 255)
+	{
+		can->state = FAKE_CAN_BUS_OFF;
+		can->recovering = true;
+		can->recessive_runs = 0;
+	}
+	else
+	{
+		can->state = FAKE_CAN_RUNNING;
+	}
+
+	unlock(taken);
+
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_CAN_Stop(CAN_HandleTypeDef *hcan)
+{
+	CAN_TypeDef *can = hcan->Instance;
+
+	if (can->state == FAKE_CAN_RESET)
+	{
+		hcan->ErrorCode |= HAL_CAN_ERROR_NOT_READY;
+		return HAL_ERROR;
+	}
+
+	bool taken = lock();
+	can->state = FAKE_CAN_RESET;
+	can->recovering = false;
+	unlock(taken);
+
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_CAN_ActivateNotification(CAN_HandleTypeDef *hcan, uint32_t active_its)
+{
+	bool taken = lock();
+	hcan->Instance->ier |= active_its;
+	unlock(taken);
+
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_CAN_DeactivateNotification(CAN_HandleTypeDef *hcan, uint32_t inactive_its)
+{
+	bool taken = lock();
+	hcan->Instance->ier &= ~inactive_its;
+	unlock(taken);
+
+	return HAL_OK;
+}
+
+uint32_t HAL_CAN_GetTxMailboxesFreeLevel(const CAN_HandleTypeDef *hcan)
+{
+	bool taken = lock();
+
+	uint32_t free_level = 0;
+	for (int i = 0; i < CAN_TX_MAILBOX_COUNT; i++)
+	{
+		if (!hcan->Instance->mailbox_pending[i])
+			free_level++;
+	}
+
+	unlock(taken);
+
+	return free_level;
+}
+
+HAL_StatusTypeDef HAL_CAN_AddTxMessage(CAN_HandleTypeDef *hcan, const CAN_TxHeaderTypeDef *header, const uint8_t data[], uint32_t *mailbox)
+{
+	CAN_TypeDef *can = hcan->Instance;
+
+	if (header->DLC > 8)
+	{
+		hcan->ErrorCode |= HAL_CAN_ERROR_PARAM;
+		return HAL_ERROR;
+	}
+
+	bool taken = lock();
+
+	int free_mailbox = -1;
+	for (int i = 0; i < CAN_TX_MAILBOX_COUNT && free_mailbox < 0; i++)
+	{
+		if (!can->mailbox_pending[i])
+			free_mailbox = i;
+	}
+
+	if (free_mailbox < 0)
+	{
+		unlock(taken);
+		hcan->ErrorCode |= HAL_CAN_ERROR_PARAM;
+		return HAL_ERROR;
+	}
+
+	FakeCANFrame *frame = &can->mailboxes[free_mailbox];
+	memset(frame, 0, sizeof(*frame));
+	frame->extended = header->IDE == CAN_ID_EXT;
+	frame->id = frame->extended ? header->ExtId & 0x1FFFFFFF : header->StdId & 0x7FF;
+	frame->remote = header->RTR == CAN_RTR_REMOTE;
+	frame->dlc = (uint8_t)header->DLC;
+	memcpy(frame->data, data, frame->dlc);
+
+	can->mailbox_pending[free_mailbox] = true;
+	*mailbox = 1U << free_mailbox;
+
+	unlock(taken);
+
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_CAN_GetRxMessage(CAN_HandleTypeDef *hcan, uint32_t fifo, CAN_RxHeaderTypeDef *header, uint8_t data[])
+{
+	CAN_TypeDef *can = hcan->Instance;
+
+	if (fifo >= CAN_RX_FIFO_COUNT)
+	{
+		hcan->ErrorCode |= HAL_CAN_ERROR_PARAM;
+		return HAL_ERROR;
+	}
+
+	bool taken = lock();
+
+	if (can->fifo_count[fifo] == 0)
+	{
+		unlock(taken);
+		hcan->ErrorCode |= HAL_CAN_ERROR_PARAM;
+		return HAL_ERROR;
+	}
+
+	const FakeCANFrame *frame = &can->fifos[fifo][0];
+	header->IDE = frame->extended ? CAN_ID_EXT : CAN_ID_STD;
+	header->StdId = frame->extended ? 0 : frame->id;
+	header->ExtId = frame->extended ? frame->id : 0;
+	header->RTR = frame->remote ? CAN_RTR_REMOTE : CAN_RTR_DATA;
+	header->DLC = frame->dlc;
+	header->Timestamp = 0;
+	header->FilterMatchIndex = can->fifo_filter[fifo][0];
+
+	// the data registers always hold 8 bytes.
+	memcpy(data, frame->data, 8);
+
+	// release the output mailbox.
+	can->fifo_count[fifo]--;
+	memmove(&can->fifos[fifo][0], &can->fifos[fifo][1], can->fifo_count[fifo]*sizeof(FakeCANFrame));
+	memmove(&can->fifo_filter[fifo][0], &can->fifo_filter[fifo][1], can->fifo_count[fifo]*sizeof(uint16_t));
+
+	unlock(taken);
+
+	return HAL_OK;
+}
+
+uint32_t HAL_CAN_GetRxFifoFillLevel(const CAN_HandleTypeDef *hcan, uint32_t fifo)
+{
+	return fifo < CAN_RX_FIFO_COUNT ? hcan->Instance->fifo_count[fifo] : 0;
+}
+
+uint32_t HAL_CAN_GetError(const CAN_HandleTypeDef *hcan)
+{
+	return hcan->ErrorCode;
+}
+
+HAL_StatusTypeDef HAL_CAN_ResetError(CAN_HandleTypeDef *hcan)
+{
+	hcan->ErrorCode = HAL_CAN_ERROR_NONE;
+	return HAL_OK;
+}
+
+void HAL_CAN_IRQHandler(CAN_HandleTypeDef *hcan)
+{
+	CAN_TypeDef *can = hcan->Instance;
+	uint32_t errors = HAL_CAN_ERROR_NONE;
+
+	if (can->ier & CAN_IT_TX_MAILBOX_EMPTY)
+	{
+		for (int i = 0; i < CAN_TX_MAILBOX_COUNT; i++)
+		{
+			if ( !(can->tx_complete & (1U << i)) )
+				continue;
+
+			can->tx_complete &= ~(1U << i);
+			can->counters.tx_interrupts++;
+
+			if (i == 0)
+				HAL_CAN_TxMailbox0CompleteCallback(hcan);
+			else if (i == 1)
+				HAL_CAN_TxMailbox1CompleteCallback(hcan);
+			else
+				HAL_CAN_TxMailbox2CompleteCallback(hcan);
+		}
+	}
+
+	if ((can->ier & CAN_IT_RX_FIFO0_OVERRUN) && can->fifo_overrun[0])
+	{
+		errors |= HAL_CAN_ERROR_RX_FOV0;
+		can->fifo_overrun[0] = false;
+	}
+
+	if ((can->ier & CAN_IT_RX_FIFO0_MSG_PENDING) && can->fifo_count[0] > 0)
+	{
+		can->counters.rx_interrupts++;
+		HAL_CAN_RxFifo0MsgPendingCallback(hcan);
+	}
+
+	if ((can->ier & CAN_IT_RX_FIFO1_OVERRUN) && can->fifo_overrun[1])
+	{
+		errors |= HAL_CAN_ERROR_RX_FOV1;
+		can->fifo_overrun[1] = false;
+	}
+
+	if ((can->ier & CAN_IT_RX_FIFO1_MSG_PENDING) && can->fifo_count[1] > 0)
+	{
+		can->counters.rx_interrupts++;
+		HAL_CAN_RxFifo1MsgPendingCallback(hcan);
+	}
+
+	if ((can->ier & CAN_IT_ERROR) && can->error_interrupt)
+	{
+		uint32_t esr = can->ESR;
+
+		if ((can->ier & CAN_IT_ERROR_WARNING) && (esr & CAN_ESR_EWGF))
+			errors |= HAL_CAN_ERROR_EWG;
+
+		if ((can->ier & CAN_IT_ERROR_PASSIVE) && (esr & CAN_ESR_EPVF))
+			errors |= HAL_CAN_ERROR_EPV;
+
+		if ((can->ier & CAN_IT_BUSOFF) && (esr & CAN_ESR_BOFF))
+			errors |= HAL_CAN_ERROR_BOF;
+
+		if (can->ier & CAN_IT_LAST_ERROR_CODE)
+		{
+			switch ((esr & CAN_ESR_LEC_Msk) >> CAN_ESR_LEC_Pos)
+			{
+			case FAKE_CAN_LEC_STUFF:         errors |= HAL_CAN_ERROR_STF; break;
+			case FAKE_CAN_LEC_FORM:          errors |= HAL_CAN_ERROR_FOR; break;
+			case FAKE_CAN_LEC_ACK:           errors |= HAL_CAN_ERROR_ACK; break;
+			case FAKE_CAN_LEC_BIT_RECESSIVE: errors |= HAL_CAN_ERROR_BR;  break;
+			case FAKE_CAN_LEC_BIT_DOMINANT:  errors |= HAL_CAN_ERROR_BD;  break;
+			case FAKE_CAN_LEC_CRC:           errors |= HAL_CAN_ERROR_CRC; break;
+			default: break;
+			}
+
+			can->ESR &= ~CAN_ESR_LEC_Msk;
+		}
+
+		can->error_interrupt = false;
+	}
+
+	if (errors != HAL_CAN_ERROR_NONE)
+	{
+		can->counters.error_interrupts++;
+		hcan->ErrorCode |= errors;
+		HAL_CAN_ErrorCallback(hcan);
+	}
+}
+
+__attribute__((weak)) void HAL_CAN_TxMailbox0CompleteCallback(CAN_HandleTypeDef *hcan) { (void)hcan; }
+__attribute__((weak)) void HAL_CAN_TxMailbox1CompleteCallback(CAN_HandleTypeDef *hcan) { (void)hcan; }
+__attribute__((weak)) void HAL_CAN_TxMailbox2CompleteCallback(CAN_HandleTypeDef *hcan) { (void)hcan; }
+__attribute__((weak)) void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef *hcan) { (void)hcan; }
+__attribute__((weak)) void HAL_CAN_RxFifo1MsgPendingCallback(CAN_HandleTypeDef *hcan) { (void)hcan; }
+__attribute__((weak)) void HAL_CAN_ErrorCallback(CAN_HandleTypeDef *hcan) { (void)hcan; }
+
+void FakeCAN_Reset(CAN_TypeDef *can)
+{
+	bool taken = lock();
+	memset(can, 0, sizeof(*can));
+	unlock(taken);
+}
+
+bool FakeCAN_Is_On_Bus(const CAN_TypeDef *can)
+{
+	return can->state == FAKE_CAN_RUNNING;
+}
+
+int FakeCAN_Next_Mailbox(const CAN_TypeDef *can)
+{
+	if (!FakeCAN_Is_On_Bus(can))
+		return -1;
+
+	// by identifier, then by mailbox number, as with TXFP = 0.
+	int next = -1;
+	for (int i = 0; i < CAN_TX_MAILBOX_COUNT; i++)
+	{
+		if (!can->mailbox_pending[i])
+			continue;
+
+		if (next < 0 || can->mailboxes[i].id < can->mailboxes[next].id)
+			next = i;
+	}
+
+	return next;
+}
+
+void FakeCAN_Transmitted(CAN_TypeDef *can, int mailbox, FakeCAN_LastError lec)
+{
+	if (lec == FAKE_CAN_LEC_NONE)
+	{
+		can->mailbox_pending[mailbox] = false;
+		can->tx_complete |= 1U << mailbox;
+		can->counters.frames_sent++;
+
+		if (can->tec > 0)
+			can->tec--;
+	}
+	else
+	{
+		// an error passive transmitter that only misses its ACK keeps its count,
+		// so a node alone on the bus stays error passive instead of going bus-off.
+		if ( !(lec == FAKE_CAN_LEC_ACK && can->tec > 127) )
+			can->tec += 8;
+
+		if (can->tec > 255)
+		{
+			can->state = FAKE_CAN_BUS_OFF;
+			can->recovering = false;
+			can->counters.bus_offs++;
+		}
+	}
+
+	set_last_error(can, lec);
+	update_esr(can);
+}
+
+bool FakeCAN_Receive(CAN_TypeDef *can, const FakeCANFrame *frame)
+{
+	if (!FakeCAN_Is_On_Bus(can))
+		return false;
+
+	// the frame was received, and ACK'd, whether or not a filter takes it.
+	if (can->rec > 127)
+		can->rec = 120;
+	else if (can->rec > 0)
+		can->rec--;
+
+	set_last_error(can, FAKE_CAN_LEC_NONE);
+	update_esr(can);
+
+	uint16_t match_index = 0;
+	int bank = match_filter(can, frame, &match_index);
+	if (bank < 0)
+	{
+		can->counters.frames_filtered++;
+		return false;
+	}
+
+	uint8_t fifo = can->filters[bank].fifo;
+
+	// without FIFO lock, the newest frame is overwritten.
+	uint8_t slot = can->fifo_count[fifo];
+	if (slot == CAN_RX_FIFO_DEPTH)
+	{
+		slot--;
+		can->fifo_overrun[fifo] = true;
+		can->counters.overruns++;
+	}
+	else
+	{
+		can->fifo_count[fifo]++;
+	}
+
+	can->fifos[fifo][slot] = *frame;
+	can->fifo_filter[fifo][slot] = match_index;
+	can->counters.frames_received++;
+
+	return true;
+}
+
+void FakeCAN_Receive_Error(CAN_TypeDef *can, FakeCAN_LastError lec)
+{
+	if (!FakeCAN_Is_On_Bus(can))
+		return;
+
+	if (can->rec < 255)
+		can->rec++;
+
+	set_last_error(can, lec);
+	update_esr(can);
+}
+
+void FakeCAN_Recessive_Bits(CAN_TypeDef *can, uint32_t runs)
+{
+	if (can->state != FAKE_CAN_BUS_OFF || !can->recovering)
+		return;
+
+	can->recessive_runs += runs;
+
+	if (can->recessive_runs >= 128)
+	{
+		can->tec = 0;
+		can->rec = 0;
+		can->recovering = false;
+		can->state = FAKE_CAN_RUNNING;
+		update_esr(can);
+	}
+}
+
+bool FakeCAN_IRQ_Pending(const CAN_TypeDef *can)
+{
+	return ((can->ier & CAN_IT_TX_MAILBOX_EMPTY) && can->tx_complete)
+		|| ((can->ier & CAN_IT_RX_FIFO0_MSG_PENDING) && can->fifo_count[0] > 0)
+		|| ((can->ier & CAN_IT_RX_FIFO0_OVERRUN) && can->fifo_overrun[0])
+		|| ((can->ier & CAN_IT_RX_FIFO1_MSG_PENDING) && can->fifo_count[1] > 0)
+		|| ((can->ier & CAN_IT_RX_FIFO1_OVERRUN) && can->fifo_overrun[1])
+		|| ((can->ier & CAN_IT_ERROR) && can->error_interrupt);
+}
+
+bool FakeCAN_Service(CAN_HandleTypeDef *hcan)
+{
+	bool taken = lock();
+	bool ran = false;
+
+	// the interrupt stays asserted until the handler clears its cause.
+	for (int i = 0; i < MAX_IRQ_ENTRIES && FakeCAN_IRQ_Pending(hcan->Instance); i++)
+	{
+		uint64_t start = monotonic_ns();
+		HAL_CAN_IRQHandler(hcan);
+		hcan->Instance->counters.isr_time += monotonic_ns() - start;
+
+		ran = true;
+	}
+
+	unlock(taken);
+
+	return ran;
+}
+
+// --- TIM ---
+
+HAL_StatusTypeDef HAL_TIM_Base_Start_IT(TIM_HandleTypeDef *htim)
+{
+	TIM_TypeDef *tim = htim->Instance;
+
+	if (tim->running)
+		return HAL_ERROR;
+
+	bool taken = lock();
+
+	tim->running = true;
+	tim->start_time = FakeHAL_Get_Time();
+	tim->updates = 0;
+	tim->DIER |= TIM_IT_UPDATE;
+
+	unlock(taken);
+
+	return HAL_OK;
+}
+
+void HAL_TIM_IRQHandler(TIM_HandleTypeDef *htim)
+{
+	TIM_TypeDef *tim = htim->Instance;
+
+	sync_timer(tim);
+
+	if ((tim->SR & TIM_FLAG_UPDATE) && (tim->DIER & TIM_IT_UPDATE))
+	{
+		tim->SR &= ~TIM_FLAG_UPDATE;
+
+		if (tim->preempt != NULL)
+			tim->preempt(htim);
+
+		HAL_TIM_PeriodElapsedCallback(htim);
+	}
+}
+
+__attribute__((weak)) void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim) { (void)htim; }
+
+uint32_t FakeTIM_Get_Counter(TIM_HandleTypeDef *htim)
+{
+	TIM_TypeDef *tim = htim->Instance;
+
+	if (!tim->running)
+		return 0;
+
+	bool taken = lock();
+	sync_timer(tim);
+	uint64_t counts = (FakeHAL_Get_Time() - tim->start_time) / tim->ns_per_count;
+	unlock(taken);
+
+	return (uint32_t)(counts % ((uint64_t)tim->ARR + 1));
+}
+
+uint32_t FakeTIM_Get_SR(TIM_HandleTypeDef *htim)
+{
+	bool taken = lock();
+	sync_timer(htim->Instance);
+	uint32_t sr = htim->Instance->SR;
+	unlock(taken);
+
+	return sr;
+}
+
+void FakeTIM_Clear_IT(TIM_HandleTypeDef *htim, uint32_t it)
+{
+	bool taken = lock();
+	sync_timer(htim->Instance);
+	htim->Instance->SR &= ~it;
+	unlock(taken);
+}
+
+void FakeTIM_Reset(TIM_TypeDef *tim, uint32_t arr)
+{
+	bool taken = lock();
+
+	memset(tim, 0, sizeof(*tim));
+	tim->ARR = arr;
+	tim->ns_per_count = 1000;
+
+	unlock(taken);
+}
+
+uint64_t FakeTIM_Next_Update(const TIM_TypeDef *tim)
+{
+	if (!tim->running)
+		return UINT64_MAX;
+
+	return tim->start_time + (tim->updates + 1)*((uint64_t)tim->ARR + 1)*tim->ns_per_count;
+}
+
+void FakeTIM_Hold_IRQ(TIM_HandleTypeDef *htim, bool held)
+{
+	htim->Instance->irq_held = held;
+}
+
+bool FakeTIM_Service(TIM_HandleTypeDef *htim)
+{
+	TIM_TypeDef *tim = htim->Instance;
+	bool taken = lock();
+
+	sync_timer(tim);
+
+	bool ran = false;
+	if ((tim->SR & TIM_FLAG_UPDATE) && (tim->DIER & TIM_IT_UPDATE) && !tim->irq_held && tim->irq_handler != NULL)
+	{
+		tim->irq_count++;
+		tim->irq_handler(htim);
+		ran = true;
+	}
+
+	unlock(taken);
+
+	return ran;
+}
+
+// --- helpers ---
+
+static bool lock(void)
+{
+	if (t_irq_disabled)
+		return false;
+
+	__disable_irq();
+	return true;
+}
+
+static void unlock(bool taken)
+{
+	if (taken)
+		__set_PRIMASK(0);
+}
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)(now.tv_sec - s_origin.tv_sec)*1000000000ULL + (uint64_t)now.tv_nsec - (uint64_t)s_origin.tv_nsec;
+}
+
+static void update_esr(CAN_TypeDef *can)
+{
+	uint32_t flags = 0;
+
+	if (can->tec >= 96 || can->rec >= 96)
+		flags |= CAN_ESR_EWGF;
+
+	if (can->tec > 127 || can->rec > 127)
+		flags |= CAN_ESR_EPVF;
+
+	if (can->state == FAKE_CAN_BUS_OFF)
+		flags |= CAN_ESR_BOFF;
+
+	uint32_t old_flags = can->ESR & (CAN_ESR_EWGF | CAN_ESR_EPVF | CAN_ESR_BOFF);
+	uint32_t raised = flags & ~old_flags;
+
+	uint32_t tec = can->tec > 255 ? 255 : can->tec;
+	can->ESR = (can->ESR & CAN_ESR_LEC_Msk) | flags | tec << CAN_ESR_TEC_Pos | (uint32_t)can->rec << CAN_ESR_REC_Pos;
+
+	if ( !(can->ier & CAN_IT_ERROR) )
+		return;
+
+	if (((raised & CAN_ESR_EWGF) && (can->ier & CAN_IT_ERROR_WARNING))
+			|| ((raised & CAN_ESR_EPVF) && (can->ier & CAN_IT_ERROR_PASSIVE))
+			|| ((raised & CAN_ESR_BOFF) && (can->ier & CAN_IT_BUSOFF)))
+	{
+		can->error_interrupt = true;
+	}
+}
+
+static void set_last_error(CAN_TypeDef *can, FakeCAN_LastError lec)
+{
+	can->ESR = (can->ESR & ~CAN_ESR_LEC_Msk) | (uint32_t)lec << CAN_ESR_LEC_Pos;
+
+	if (lec != FAKE_CAN_LEC_NONE && (can->ier & CAN_IT_ERROR) && (can->ier & CAN_IT_LAST_ERROR_CODE))
+		can->error_interrupt = true;
+}
+
+static int match_filter(const CAN_TypeDef *can, const FakeCANFrame *frame, uint16_t *match_index)
+{
+	uint32_t remote = frame->remote ? 1 : 0;
+	uint32_t frame32, frame16;
+
+	if (frame->extended)
+	{
+		frame32 = frame->id << 3 | 1U << 2 | remote << 1;
+		frame16 = ((frame->id >> 18) & 0x7FF) << 5 | remote << 4 | 1U << 3 | ((frame->id >> 15) & 0x7);
+	}
+	else
+	{
+		frame32 = frame->id << 21 | remote << 1;
+		frame16 = frame->id << 5 | remote << 4;
+	}
+
+	int best = -1;
+	int best_rank = -1;
+	uint16_t next_index[CAN_RX_FIFO_COUNT] = {0};
+
+	for (int i = 0; i < CAN_FILTER_BANKS; i++)
+	{
+		const FakeCANFilterBank *bank = &can->filters[i];
+
+		// filter numbers count every bank of the FIFO, active or not.
+		uint16_t first_index = next_index[bank->fifo];
+		next_index[bank->fifo] += bank->scale32 ? (bank->list_mode ? 2 : 1) : (bank->list_mode ? 4 : 2);
+
+		if (!bank->active)
+			continue;
+
+		int matched = -1;
+
+		if (bank->scale32 && bank->list_mode)
+		{
+			if (((frame32 ^ bank->fr1) & ~1U) == 0)
+				matched = 0;
+			else if (((frame32 ^ bank->fr2) & ~1U) == 0)
+				matched = 1;
+		}
+		else if (bank->scale32)
+		{
+			if (((frame32 ^ bank->fr1) & bank->fr2 & ~1U) == 0)
+				matched = 0;
+		}
+		else if (bank->list_mode)
+		{
+			const uint16_t ids[4] = { bank->fr1 & 0xFFFF, bank->fr1 >> 16, bank->fr2 & 0xFFFF, bank->fr2 >> 16 };
+			for (int j = 0; j < 4 && matched < 0; j++)
+			{
+				if (frame16 == ids[j])
+					matched = j;
+			}
+		}
+		else
+		{
+			if (((frame16 ^ bank->fr1) & (bank->fr1 >> 16) & 0xFFFF) == 0)
+				matched = 0;
+			else if (((frame16 ^ bank->fr2) & (bank->fr2 >> 16) & 0xFFFF) == 0)
+				matched = 1;
+		}
+
+		if (matched < 0)
+			continue;
+
+		// 32 bit before 16 bit, then list before mask, then the lowest filter number.
+		int rank = (bank->scale32 ? 2 : 0) + (bank->list_mode ? 1 : 0);
+		if (rank > best_rank)
+		{
+			best = i;
+			best_rank = rank;
+			*match_index = first_index + (uint16_t)matched;
+		}
+	}
+
+	return best;
+}
+
+static void sync_timer(TIM_TypeDef *tim)
+{
+	if (!tim->running)
+		return;
+
+	uint64_t counts = (FakeHAL_Get_Time() - tim->start_time) / tim->ns_per_count;
+	uint64_t updates = counts / ((uint64_t)tim->ARR + 1);
+
+	if (updates > tim->updates)
+	{
+		tim->SR |= TIM_FLAG_UPDATE;
+		tim->updates = updates;
+	}
+}
+
+#endif /* CAN_WRAPPER_HAL_HEADER */
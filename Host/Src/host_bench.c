@@ -0,0 +1,108 @@
+/**
+ * @file host_bench.c
+ * Timing and JSON output for the host benchmarks. See host_bench.h.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#ifdef CAN_WRAPPER_HAL_HEADER
+
+#include "host_bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_RESULTS 256
+#define MAX_NAME    96
+
+static struct
+{
+	char name[MAX_NAME];
+	double value;
+	const char *unit;
+} s_results[MAX_RESULTS];
+
+static size_t s_result_count;
+static const char *s_suite;
+static const char *s_json_path;
+static bool s_quick;
+
+void Bench_Init(const char *suite, int argc, char **argv)
+{
+	s_suite = suite;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--quick") == 0)
+		{
+			s_quick = true;
+		}
+		else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+		{
+			s_json_path = argv[++i];
+		}
+		else
+		{
+			fprintf(stderr, "usage: %s [--quick] [--json <file>]\n", argv[0]);
+			exit(2);
+		}
+	}
+}
+
+bool Bench_Quick(void)
+{
+	return s_quick;
+}
+
+uint64_t Bench_Time(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec*1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+void Bench_Record(const char *name, double value, const char *unit)
+{
+	if (s_result_count == MAX_RESULTS)
+		return;
+
+	snprintf(s_results[s_result_count].name, MAX_NAME, "%s", name);
+	s_results[s_result_count].value = value;
+	s_results[s_result_count].unit = unit;
+	s_result_count++;
+}
+
+int Bench_Finish(void)
+{
+	FILE *out = stdout;
+	if (s_json_path != NULL)
+	{
+		out = fopen(s_json_path, "w");
+		if (out == NULL)
+		{
+			perror(s_json_path);
+			return 1;
+		}
+	}
+
+	fprintf(out, "{\n  \"suite\": \"%s\",\n  \"quick\": %s,\n  \"results\": [", s_suite, s_quick ? "true" : "false");
+
+	for (size_t i = 0; i < s_result_count; i++)
+	{
+		fprintf(out, "%s\n    {\"name\": \"%s\", \"value\": %.6g, \"unit\": \"%s\"}",
+				i == 0 ? "" : ",", s_results[i].name, s_results[i].value, s_results[i].unit);
+	}
+
+	fprintf(out, "\n  ]\n}\n");
+
+	if (out != stdout)
+		fclose(out);
+
+	return 0;
+}
+
+#endif /* CAN_WRAPPER_HAL_HEADER */
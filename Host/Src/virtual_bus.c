@@ -0,0 +1,534 @@
+/**
+ * @file virtual_bus.c
+ * A simulated CAN bus linking the fake controllers of several wrapper instances.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#ifdef CAN_WRAPPER_HAL_HEADER
+
+#include "virtual_bus.h"
+#include <string.h>
+#include <time.h>
+
+// how long the bus thread sleeps between steps.
+#define THREAD_STEP_NS 20000
+
+/**
+ * @brief Moves the bus to time target (in ns), handling every frame, timer
+ *        update and interrupt due by then in order.
+ */
+static void step_to(VirtualBus *bus, uint64_t target);
+
+/**
+ * @brief Puts the winner of arbitration on the bus, if any controller has a frame to send.
+ */
+static void start_frame(VirtualBus *bus, uint64_t now);
+
+static void finish_frame(VirtualBus *bus);
+
+/**
+ * @brief Counts the idle time since idle_since towards bus-off recoveries.
+ */
+static void account_idle(VirtualBus *bus, uint64_t now);
+
+/**
+ * @brief Returns when the first recovering controller would rejoin an idle bus, or UINT64_MAX.
+ */
+static uint64_t next_recovery(const VirtualBus *bus);
+
+static void service_interrupts(VirtualBus *bus);
+
+static void poll_nodes(VirtualBus *bus);
+
+/**
+ * @brief Returns the identifier as it is compared bit by bit during arbitration.
+ *        Lower wins. A standard frame beats an extended one with the same base ID.
+ */
+static uint32_t arbitration_key(const FakeCANFrame *frame);
+
+static uint64_t bit_time(const VirtualBus *bus);
+
+static uint32_t next_random(VirtualBus *bus);
+
+static void *thread_main(void *arg);
+
+void VirtualBus_Init(VirtualBus *bus, VirtualBus_InitTypeDef init_struct, bool real_time)
+{
+	if (init_struct.bitrate == 0)
+		init_struct.bitrate = VIRTUAL_BUS_DEFAULT_BITRATE;
+
+	if (init_struct.poll_interval_us == 0)
+		init_struct.poll_interval_us = VIRTUAL_BUS_DEFAULT_POLL_INTERVAL;
+
+	if (init_struct.seed == 0)
+		init_struct.seed = 1;
+
+	FakeHAL_Reset(real_time);
+
+	memset(bus, 0, sizeof(*bus));
+	bus->init_struct = init_struct;
+	bus->rng_state = init_struct.seed;
+	bus->current_mailbox = -1;
+}
+
+VirtualNode *VirtualBus_Add_Node(VirtualBus *bus)
+{
+	if (bus->node_count >= VIRTUAL_BUS_MAX_NODES)
+		return NULL;
+
+	VirtualNode *node = &bus->nodes[bus->node_count++];
+	memset(node, 0, sizeof(*node));
+
+	FakeCAN_Reset(&node->can);
+	node->hcan.Instance = &node->can;
+
+	FakeTIM_Reset(&node->tim, VIRTUAL_BUS_TIMER_PERIOD - 1);
+	node->tim.irq_handler = &VirtualBus_TIM_IRQHandler;
+	node->htim.Instance = &node->tim;
+
+	return node;
+}
+
+CANWrapper_StatusTypeDef VirtualBus_Init_Node(VirtualBus *bus, VirtualNode *node, CANWrapper_InitTypeDef init_struct)
+{
+	(void)bus;
+
+	init_struct.hcan = &node->hcan;
+	init_struct.htim = &node->htim;
+
+	CANWrapper_StatusTypeDef status = CANWrapperEx_Init(&node->hcw, init_struct);
+	node->polled = status == CAN_WRAPPER_HAL_OK;
+
+	return status;
+}
+
+void VirtualBus_Run(VirtualBus *bus, uint64_t us)
+{
+	uint64_t end = FakeHAL_Get_Time() + us*1000;
+
+	while (FakeHAL_Get_Time() < end)
+	{
+		step_to(bus, bus->next_poll < end ? bus->next_poll : end);
+
+		if (FakeHAL_Get_Time() >= bus->next_poll)
+			poll_nodes(bus);
+	}
+}
+
+bool VirtualBus_Run_Until(VirtualBus *bus, bool (*done)(void *ctx), void *ctx, uint64_t max_us)
+{
+	uint64_t end = FakeHAL_Get_Time() + max_us*1000;
+
+	while (!done(ctx))
+	{
+		if (FakeHAL_Get_Time() >= end)
+			return false;
+
+		step_to(bus, bus->next_poll < end ? bus->next_poll : end);
+
+		if (FakeHAL_Get_Time() >= bus->next_poll)
+			poll_nodes(bus);
+	}
+
+	return true;
+}
+
+void VirtualBus_Advance(VirtualBus *bus, uint64_t us)
+{
+	step_to(bus, FakeHAL_Get_Time() + us*1000);
+}
+
+uint64_t VirtualBus_Now(const VirtualBus *bus)
+{
+	(void)bus;
+	return FakeHAL_Get_Time() / 1000;
+}
+
+void VirtualBus_Inject_Errors(VirtualNode *node, uint32_t count)
+{
+	node->tx_errors += count;
+}
+
+void VirtualBus_Start_Thread(VirtualBus *bus)
+{
+	bus->thread_running = true;
+	pthread_create(&bus->thread, NULL, &thread_main, bus);
+}
+
+void VirtualBus_Stop_Thread(VirtualBus *bus)
+{
+	bus->thread_running = false;
+	pthread_join(bus->thread, NULL);
+}
+
+uint32_t VirtualBus_Frame_Bits(const FakeCANFrame *frame)
+{
+	// the stuffed part of the frame: SOF to the end of the CRC.
+	uint8_t bits[128];
+	uint32_t count = 0;
+
+#define PUSH_BITS(value, width) \
+	for (int b_ = (width) - 1; b_ >= 0; b_--) bits[count++] = ((value) >> b_) & 1
+
+	PUSH_BITS(0, 1); // SOF
+
+	if (frame->extended)
+	{
+		PUSH_BITS(frame->id >> 18, 11);
+		PUSH_BITS(1, 1); // SRR
+		PUSH_BITS(1, 1); // IDE
+		PUSH_BITS(frame->id & 0x3FFFF, 18);
+		PUSH_BITS(frame->remote ? 1 : 0, 1);
+		PUSH_BITS(0, 2); // r1, r0
+	}
+	else
+	{
+		PUSH_BITS(frame->id, 11);
+		PUSH_BITS(frame->remote ? 1 : 0, 1);
+		PUSH_BITS(0, 2); // IDE, r0
+	}
+
+	PUSH_BITS(frame->dlc, 4);
+
+	if (!frame->remote)
+	{
+		uint8_t size = frame->dlc > 8 ? 8 : frame->dlc;
+		for (uint8_t i = 0; i < size; i++)
+		{
+			PUSH_BITS(frame->data[i], 8);
+		}
+	}
+
+	uint16_t crc = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		bool crc_next = bits[i] ^ ((crc >> 14) & 1);
+		crc = (crc << 1) & 0x7FFF;
+		if (crc_next)
+			crc ^= 0x4599;
+	}
+
+	PUSH_BITS(crc, 15);
+
+#undef PUSH_BITS
+
+	// a stuff bit follows 5 equal bits, and counts towards the next run.
+	uint32_t stuff_bits = 0;
+	uint8_t run = 1;
+	uint8_t last = bits[0];
+	for (uint32_t i = 1; i < count; i++)
+	{
+		if (bits[i] == last)
+		{
+			run++;
+		}
+		else
+		{
+			last = bits[i];
+			run = 1;
+		}
+
+		if (run == 5)
+		{
+			stuff_bits++;
+			last = !last;
+			run = 1;
+		}
+	}
+
+	return count + stuff_bits + VIRTUAL_BUS_FRAME_TAIL_BITS;
+}
+
+int VirtualBus_Node_Index(const VirtualBus *bus, const CANWrapper_Handle *hcw)
+{
+	for (uint8_t i = 0; i < bus->node_count; i++)
+	{
+		if (&bus->nodes[i].hcw == hcw)
+			return i;
+	}
+
+	return -1;
+}
+
+void VirtualBus_TIM_IRQHandler(TIM_HandleTypeDef *htim)
+{
+	CANWrapper_TIM_IRQHandler(htim);
+	HAL_TIM_IRQHandler(htim);
+}
+
+static void step_to(VirtualBus *bus, uint64_t target)
+{
+	for (;;)
+	{
+		uint64_t now = FakeHAL_Get_Time();
+
+		if (!bus->in_flight)
+			start_frame(bus, now);
+
+		uint64_t next = target;
+
+		if (bus->in_flight && bus->current.end < next)
+			next = bus->current.end;
+
+		for (uint8_t i = 0; i < bus->node_count; i++)
+		{
+			uint64_t update = FakeTIM_Next_Update(&bus->nodes[i].tim);
+			if (update > now && update < next)
+				next = update;
+		}
+
+		if (!bus->in_flight)
+		{
+			uint64_t recovery = next_recovery(bus);
+			if (recovery > now && recovery < next)
+				next = recovery;
+		}
+
+		if (next < now)
+			next = now;
+
+		FakeHAL_Set_Time(next);
+
+		if (!bus->in_flight)
+			account_idle(bus, next);
+
+		if (bus->in_flight && bus->current.end <= next)
+			finish_frame(bus);
+
+		service_interrupts(bus);
+
+		if (next >= target)
+			break;
+	}
+}
+
+static void start_frame(VirtualBus *bus, uint64_t now)
+{
+	account_idle(bus, now);
+
+	int winner = -1;
+	int winner_mailbox = -1;
+	uint32_t winner_key = UINT32_MAX;
+
+	for (uint8_t i = 0; i < bus->node_count; i++)
+	{
+		int mailbox = FakeCAN_Next_Mailbox(&bus->nodes[i].can);
+		if (mailbox < 0)
+			continue;
+
+		uint32_t key = arbitration_key(&bus->nodes[i].can.mailboxes[mailbox]);
+		if (winner < 0 || key < winner_key)
+		{
+			winner = i;
+			winner_mailbox = mailbox;
+			winner_key = key;
+		}
+	}
+
+	if (winner < 0)
+		return;
+
+	VirtualNode *sender = &bus->nodes[winner];
+
+	bus->in_flight = true;
+	bus->current_mailbox = winner_mailbox;
+	bus->current.node = (uint8_t)winner;
+	bus->current.frame = sender->can.mailboxes[winner_mailbox];
+	bus->current.start = now;
+
+	bool acknowledged = false;
+	for (uint8_t i = 0; i < bus->node_count; i++)
+	{
+		if (i != winner && FakeCAN_Is_On_Bus(&bus->nodes[i].can))
+			acknowledged = true;
+	}
+
+	uint32_t bits = VirtualBus_Frame_Bits(&bus->current.frame);
+
+	if (sender->tx_errors > 0)
+	{
+		// say the error is seen half way through, then the error frame and intermission.
+		bus->current.ok = false;
+		bits = bits/2 + VIRTUAL_BUS_ERROR_FRAME_BITS + 3;
+	}
+	else if (!acknowledged)
+	{
+		// up to the ACK slot, then the error frame and intermission.
+		bus->current.ok = false;
+		bits = bits - 11 + VIRTUAL_BUS_ERROR_FRAME_BITS + 3;
+	}
+	else
+	{
+		bus->current.ok = true;
+	}
+
+	bus->current.bits = bits;
+	bus->current.end = now + bits*bit_time(bus);
+}
+
+static void finish_frame(VirtualBus *bus)
+{
+	VirtualBusFrameInfo *info = &bus->current;
+	VirtualNode *sender = &bus->nodes[info->node];
+
+	bus->in_flight = false;
+	bus->idle_since = info->end;
+	bus->stats.bits += info->bits;
+	bus->stats.busy_time += info->end - info->start;
+
+	if (info->ok)
+	{
+		bus->stats.frames++;
+		FakeCAN_Transmitted(&sender->can, bus->current_mailbox, FAKE_CAN_LEC_NONE);
+
+		for (uint8_t i = 0; i < bus->node_count; i++)
+		{
+			VirtualNode *node = &bus->nodes[i];
+			if (i == info->node || !FakeCAN_Is_On_Bus(&node->can))
+				continue;
+
+			if (node->drop_permille > 0 && next_random(bus) % 1000 < node->drop_permille)
+			{
+				node->frames_dropped++;
+				continue;
+			}
+
+			FakeCAN_Receive(&node->can, &info->frame);
+		}
+	}
+	else if (sender->tx_errors > 0)
+	{
+		bus->stats.error_frames++;
+		sender->tx_errors--;
+		FakeCAN_Transmitted(&sender->can, bus->current_mailbox, FAKE_CAN_LEC_BIT_DOMINANT);
+
+		for (uint8_t i = 0; i < bus->node_count; i++)
+		{
+			if (i != info->node)
+				FakeCAN_Receive_Error(&bus->nodes[i].can, FAKE_CAN_LEC_FORM);
+		}
+	}
+	else
+	{
+		bus->stats.error_frames++;
+		FakeCAN_Transmitted(&sender->can, bus->current_mailbox, FAKE_CAN_LEC_ACK);
+	}
+
+	// the end of every frame is 11 recessive bits.
+	for (uint8_t i = 0; i < bus->node_count; i++)
+	{
+		FakeCAN_Recessive_Bits(&bus->nodes[i].can, 1);
+	}
+
+	bus->current_mailbox = -1;
+
+	if (bus->on_frame != NULL)
+		bus->on_frame(info, bus->hook_ctx);
+}
+
+static void account_idle(VirtualBus *bus, uint64_t now)
+{
+	uint64_t run_time = 11*bit_time(bus);
+
+	if (now < bus->idle_since + run_time)
+		return;
+
+	uint64_t runs = (now - bus->idle_since) / run_time;
+	bus->idle_since += runs*run_time;
+
+	for (uint8_t i = 0; i < bus->node_count; i++)
+	{
+		FakeCAN_Recessive_Bits(&bus->nodes[i].can, (uint32_t)(runs > 128 ? 128 : runs));
+	}
+}
+
+static uint64_t next_recovery(const VirtualBus *bus)
+{
+	uint64_t recovery = UINT64_MAX;
+
+	for (uint8_t i = 0; i < bus->node_count; i++)
+	{
+		const CAN_TypeDef *can = &bus->nodes[i].can;
+		if (can->state != FAKE_CAN_BUS_OFF || !can->recovering)
+			continue;
+
+		uint64_t time = bus->idle_since + (128 - can->recessive_runs)*11*bit_time(bus);
+		if (time < recovery)
+			recovery = time;
+	}
+
+	return recovery;
+}
+
+static void service_interrupts(VirtualBus *bus)
+{
+	for (uint8_t i = 0; i < bus->node_count; i++)
+	{
+		FakeTIM_Service(&bus->nodes[i].htim);
+		FakeCAN_Service(&bus->nodes[i].hcan);
+	}
+}
+
+static void poll_nodes(VirtualBus *bus)
+{
+	for (uint8_t i = 0; i < bus->node_count; i++)
+	{
+		if (bus->nodes[i].polled)
+			CANWrapperEx_Poll_Messages(&bus->nodes[i].hcw);
+	}
+
+	// stay on the grid, unless the bus was advanced past it without polling.
+	uint64_t interval = (uint64_t)bus->init_struct.poll_interval_us*1000;
+	bus->next_poll += interval;
+	if (bus->next_poll <= FakeHAL_Get_Time())
+		bus->next_poll = FakeHAL_Get_Time() + interval;
+}
+
+static uint32_t arbitration_key(const FakeCANFrame *frame)
+{
+	if (!frame->extended)
+		return frame->id << 19;
+
+	// the base ID, then SRR and IDE (recessive), then the extension.
+	return (frame->id >> 18) << 19 | 1U << 18 | (frame->id & 0x3FFFF);
+}
+
+static uint64_t bit_time(const VirtualBus *bus)
+{
+	return 1000000000ULL / bus->init_struct.bitrate;
+}
+
+static uint32_t next_random(VirtualBus *bus)
+{
+	// xorshift32.
+	uint32_t x = bus->rng_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	bus->rng_state = x;
+
+	return x;
+}
+
+static void *thread_main(void *arg)
+{
+	VirtualBus *bus = arg;
+
+	while (bus->thread_running)
+	{
+		// the bus is the hardware, so it changes nothing while interrupts are off.
+		__disable_irq();
+		step_to(bus, FakeHAL_Get_Time());
+		__set_PRIMASK(0);
+
+		struct timespec delay = { .tv_sec = 0, .tv_nsec = THREAD_STEP_NS };
+		nanosleep(&delay, NULL);
+	}
+
+	return NULL;
+}
+
+#endif /* CAN_WRAPPER_HAL_HEADER */
@@ -0,0 +1,71 @@
+/**
+ * @file ack_list.h
+ * List ADT of received messages that still need to be ACK'd.
+ *
+ * Filled from the RX interrupts and drained by CANWrapper_Poll_Messages,
+ * which merges the entries for each sender into compact ACK frames.
+ * Not thread-safe. Callers must provide their own locking.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date March 27, 2024
+ */
+
+#ifndef CAN_WRAPPER_MODULE_INC_ACK_LIST_H_
+#define CAN_WRAPPER_MODULE_INC_ACK_LIST_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ACK_LIST_SIZE 32
+
+// a compact ACK frame holds up to this many (cmd, key) entries.
+#define ACK_ENTRIES_PER_FRAME 4
+
+// set in an entry's cmd byte when its key is the message's sequence number
+// rather than the low byte of its hash. command ID's are below 0x80.
+#define ACK_ENTRY_NUMBERED 0x80
+
+typedef struct
+{
+	uint8_t sender;   // node the ACK goes back to.
+	uint8_t cmd;      // command ID of the received message.
+	uint8_t key;      // sequence number of the received message if numbered, else the low byte of its CANMessage_Hash.
+	bool numbered;    // whether the received message carried a sequence number.
+	uint8_t priority; // priority of the received message.
+} PendingAck;
+
+typedef struct
+{
+	size_t size;
+	PendingAck items[ACK_LIST_SIZE];
+} AckList;
+
+/**
+ * @brief               Creates an empty ACK list.
+ */
+AckList AckList_Create();
+
+/**
+ * @brief               Returns true if the given list is full.
+ */
+bool AckList_IsFull(const AckList *list);
+
+/**
+ * @brief               Appends an ACK to the list.
+ *
+ * @return              true on success. false if the list is full.
+ */
+bool AckList_Push(AckList *list, const PendingAck *ack);
+
+/**
+ * @brief               Moves every entry out of the list.
+ *
+ * @param list          The ACK list. Empty afterwards.
+ * @param out_acks      Output location for at least ACK_LIST_SIZE entries.
+ * @return              The number of entries moved.
+ */
+size_t AckList_Take_All(AckList *list, PendingAck *out_acks);
+
+#endif /* CAN_WRAPPER_MODULE_INC_ACK_LIST_H_ */
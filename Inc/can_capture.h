@@ -0,0 +1,127 @@
+/**
+ * @file can_capture.h
+ * Capture of the raw frames a wrapper instance sends and receives.
+ *
+ * Once attached, the wrapper appends every frame it reads out of an RX FIFO
+ * or puts in a TX mailbox to a RAM ring, with the time and direction. The
+ * ring is lock-free, so the interrupt handlers only pay for one reservation
+ * and a copy. CANWrapper_Poll_Messages moves the records into blocks of
+ * CAN_CAPTURE_BLOCK_SIZE and passes full blocks to the application's sink,
+ * which writes them somewhere that outlives a reset (e.g. MRAM) or out of
+ * the board (e.g. a UART).
+ *
+ * A dump is the records back to back, as laid out in CANCaptureRecord.
+ * Tools/can_capture.py decodes one, and Tools/can_replay.c plays one back
+ * through the host build.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 12, 2024
+ */
+
+#ifndef CAN_WRAPPER_MODULE_INC_CAN_CAPTURE_H_
+#define CAN_WRAPPER_MODULE_INC_CAN_CAPTURE_H_
+
+#include "can_wrapper.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CAN_CAPTURE_SIZE       64 // records buffered between polls. must be a power of two.
+#define CAN_CAPTURE_BLOCK_SIZE 16 // records passed to the sink at a time.
+
+_Static_assert((CAN_CAPTURE_SIZE & (CAN_CAPTURE_SIZE - 1)) == 0, "CAN_CAPTURE_SIZE must be a power of two");
+
+#define CAN_CAPTURE_FLAG_TX       0x01 // sent by us. otherwise received.
+#define CAN_CAPTURE_FLAG_EXTENDED 0x02 // 29-bit identifier.
+
+/**
+ * @brief One captured frame. 20 bytes, little-endian, no padding.
+ */
+typedef struct
+{
+	uint32_t tick;    // wrapper tick (us) when the frame was read or submitted. wraps every 71 minutes.
+	uint32_t id;      // 11 or 29-bit identifier.
+	uint8_t dlc;
+	uint8_t flags;    // CAN_CAPTURE_FLAG_*.
+	uint16_t dropped; // records lost just before this one because the ring was full. saturates.
+	uint8_t data[8];  // bytes past the DLC are zero.
+} CANCaptureRecord;
+
+_Static_assert(sizeof(CANCaptureRecord) == 20, "CANCaptureRecord must stay 20 bytes for Tools/can_capture.py");
+
+/**
+ * @brief Called with a block of records. Returns false if the block
+ *        couldn't be written, in which case it is offered again next poll.
+ */
+typedef bool (*CANCaptureSink)(const CANCaptureRecord *records, size_t count, void *ctx);
+
+typedef struct
+{
+	CANCaptureSink sink;        // where blocks of records go.
+	uint32_t flush_interval_ms; // pass on a partial block this long after the last one. 0 waits for a full block.
+	void *ctx;                  // passed to sink.
+} CANCapture_InitTypeDef;
+
+typedef struct
+{
+	_Atomic uint32_t seq; // which pass over the ring the slot is ready for.
+	CANCaptureRecord record;
+} CANCaptureSlot;
+
+typedef struct CANCapture
+{
+	CANCapture_InitTypeDef init_struct;
+	CANWrapper_Handle *hcw;
+
+	_Atomic uint32_t tail;    // next slot to write. claimed by any context.
+	uint32_t head;            // next slot to read. CANWrapper_Poll_Messages only.
+	_Atomic uint32_t dropped; // records lost since the last one written.
+	CANCaptureSlot slots[CAN_CAPTURE_SIZE];
+
+	CANCaptureRecord block[CAN_CAPTURE_BLOCK_SIZE];
+	size_t block_count;
+	uint64_t last_flush;      // tick of the last block passed to the sink.
+} CANCapture;
+
+/**
+ * @brief               Attaches a capture to an initialised wrapper instance.
+ *
+ * @param cap           The capture. Must stay at the same address while attached.
+ * @param hcw           The wrapper instance. See CANWrapper_Get_Default_Handle.
+ * @param init_struct   Configuration for initialisation.
+ */
+CANWrapper_StatusTypeDef CANCapture_Init(CANCapture *cap, CANWrapper_Handle *hcw, CANCapture_InitTypeDef init_struct);
+
+/**
+ * @brief               Appends a frame to the ring. Safe to call from any
+ *                      context, including interrupts that preempt each other.
+ *
+ * Called by the wrapper for every frame sent and received.
+ */
+void CANCapture_Frame(CANCapture *cap, uint32_t id, bool extended, bool transmitted, uint8_t dlc, const uint8_t *data);
+
+/**
+ * @brief               Passes full blocks, and partial blocks older than
+ *                      flush_interval_ms, to the sink.
+ *
+ * Called by CANWrapper_Poll_Messages.
+ */
+void CANCapture_Update(CANCapture *cap);
+
+/**
+ * @brief               Passes everything captured so far to the sink, even
+ *                      if it doesn't fill a block. e.g. before a reset.
+ *
+ * @return              false if the sink refused a block.
+ */
+bool CANCapture_Flush(CANCapture *cap);
+
+/**
+ * @brief               Returns the tick at which a partial block is due to
+ *                      be passed on, or UINT64_MAX if none is.
+ */
+uint64_t CANCapture_Next_Deadline(const CANCapture *cap);
+
+#endif /* CAN_WRAPPER_MODULE_INC_CAN_CAPTURE_H_ */
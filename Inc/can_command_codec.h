@@ -0,0 +1,88 @@
+/**
+ * @file can_command_codec.h
+ * Typed access to command arguments, generated from can_command_schema.h.
+ *
+ * For every command CMD_<NAME> there is:
+ *  - CMD_BODY_SIZE_<NAME>: the size of the message body in bytes.
+ *  - CmdArgs_<NAME>: a packed struct laid out exactly like the message body.
+ *    For NO_ARGS commands it holds one unused byte, since C has no empty
+ *    structs, and the body is still empty.
+ *  - Encode_<NAME>(msg, &args): sets the command ID and writes the body.
+ *  - Decode_<NAME>(msg, &args): reads the body.
+ *
+ * e.g.
+ *   CANMessage msg;
+ *   Encode_PLD_SET_WELL_LED(&msg, &(CmdArgs_PLD_SET_WELL_LED){ .well_id = 2, .power = 100 });
+ *
+ * The body is copied with memcpy, which the compiler turns into plain loads
+ * and stores that are safe at any alignment. Values are copied in the host's
+ * byte order, which is little-endian on Cortex-M4 and x86.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 5, 2024
+ */
+
+#ifndef CAN_WRAPPER_MODULE_INC_CAN_COMMAND_CODEC_H_
+#define CAN_WRAPPER_MODULE_INC_CAN_COMMAND_CODEC_H_
+
+#include "can_command_list.h"
+#include "can_message.h"
+#include <stdint.h>
+#include <string.h>
+
+// body sizes. NO_ARGS adds nothing.
+#define ARG(type, name) + sizeof(type)
+#define ARRAY(type, name, count) + sizeof(type) * (count)
+#define CMD(name, id, priority, timeout, policy, retries, backoff, jitter, ...) \
+	enum { CMD_BODY_SIZE_##name = 0 __VA_ARGS__ }; \
+	_Static_assert(CMD_BODY_SIZE_##name <= CAN_MAX_BODY_SIZE, "CMD_" #name " has more than CAN_MAX_BODY_SIZE bytes of arguments"); \
+	_Static_assert((id) < CMD_ID_COUNT, "CMD_" #name " has an ID outside of cmd_configs"); \
+	_Static_assert((priority) < 64, "CMD_" #name " has a priority wider than 6 bits");
+#include "can_command_schema.h"
+#undef CMD
+#undef ARG
+#undef ARRAY
+
+// argument structs.
+#undef NO_ARGS
+#define NO_ARGS uint8_t unused;
+#define ARG(type, name) type name;
+#define ARRAY(type, name, count) type name[count];
+#define CMD(name, id, priority, timeout, policy, retries, backoff, jitter, ...) \
+	typedef struct __attribute__((packed)) { __VA_ARGS__ } CmdArgs_##name; \
+	_Static_assert(sizeof(CmdArgs_##name) == CMD_BODY_SIZE_##name || CMD_BODY_SIZE_##name == 0, "CmdArgs_" #name " isn't laid out like the body");
+#include "can_command_schema.h"
+#undef CMD
+#undef ARG
+#undef ARRAY
+#undef NO_ARGS
+#define NO_ARGS
+
+// encoders and decoders.
+#define CMD(name, ...) \
+	static inline void Encode_##name(CANMessage *msg, const CmdArgs_##name *args) \
+	{ \
+		msg->cmd = CMD_##name; \
+		memcpy(msg->body, args, CMD_BODY_SIZE_##name); \
+	} \
+	static inline void Decode_##name(const CANMessage *msg, CmdArgs_##name *out_args) \
+	{ \
+		memcpy(out_args, msg->body, CMD_BODY_SIZE_##name); \
+	}
+#include "can_command_schema.h"
+#undef CMD
+
+// duplicate command ID's are duplicate case labels, which don't compile.
+#define CMD(name, id, ...) case id: break;
+static inline void CmdSchema_Check_Unique_IDs(int id)
+{
+	switch (id)
+	{
+#include "can_command_schema.h"
+	default: break;
+	}
+}
+#undef CMD
+
+#endif /* CAN_WRAPPER_MODULE_INC_CAN_COMMAND_CODEC_H_ */
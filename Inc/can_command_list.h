@@ -2,6 +2,8 @@
  * @file can_command_list.h
  * Configurations for all valid command ID's.
  *
+ * Commands are defined in can_command_schema.h. Don't add them here.
+ *
  * @author Logan Furedi <logan.furedi@umsats.ca>
  *
  * @date March 3, 2024
@@ -27,95 +29,34 @@ typedef enum
 	POWER_LINE_ADCS
 } PowerLineID;
 
+#define CMD_ID_COUNT 0x70 // size of the command ID space.
+
+// generated from can_command_schema.h.
 typedef enum
 {
-	////////////////////////////////////////////
-	/// COMMON
-	////////////////////////////////////////////
-	CMD_COMMON_PREPRARE_FOR_SHUTDOWN     = 0x00,
-	CMD_COMMON_RESET,
-	CMD_COMMON_GET_PCB_TEMP,
-	CMD_COMMON_GET_MCU_TEMP,
-
-	////////////////////////////////////////////
-	/// CDH
-	////////////////////////////////////////////
-	// Event Processing.
-	CMD_CDH_PROCESS_HEARTBEAT            = 0x10,
-	CMD_CDH_PROCESS_ERROR,
-	CMD_CDH_PROCESS_READY_FOR_SHUTDOWN,
-	CMD_CDH_PROCESS_STARTUP,
-	CMD_CDH_PROCESS_PCB_TEMP,
-	CMD_CDH_PROCESS_MCU_TEMP,
-	CMD_CDH_PROCESS_CONVERTER_STATUS,
-	CMD_CDH_PROCESS_BATTERY_VOLTAGE,
-	CMD_CDH_PROCESS_MAGNETIC_FIELD,
-	CMD_CDH_PROCESS_ANGULAR_VELOCITY,
-	CMD_CDH_PROCESS_WELL_LIGHT,
-	CMD_CDH_PROCESS_WELL_TEMP,
-	CMD_CDH_PROCESS_LED_TEST,
-
-	// Tests
-	CMD_CDH_TEST_FLASH,
-	CMD_CHD_TEST_MRAM,
-
-	// Antenna
-	CMD_CDH_ENABLE_ANTENNA_DEPLOYMENT,
-	CMD_CDH_DEPLOY_ANTENNA,
-	CMD_CDH_TRANSMIT_UHF_BEACON,
-
-	// RTOS
-	CMD_CDH_GET_NUM_TASKS,
-	CMD_CDH_SCHEDULE_SAMPLE_TASK,
-
-	// CLock
-	CMD_CDH_SET_RTC,
-	CMD_CDH_GET_RTC,
-
-	CMD_CDH_SET_TELEMETRY_INTERVAL,
-
-	////////////////////////////////////////////
-	/// POWER
-	////////////////////////////////////////////
-	CMD_PWR_SET_LINE_POWER               = 0x30,
-	CMD_PWR_SET_BATTERY_HEATER,
-	CMD_PWR_GET_CONVERTER_STATUS,
-	CMD_PWR_SET_TELEMETRY_INTERVAL,
-
-	////////////////////////////////////////////
-	/// ADCS
-	////////////////////////////////////////////
-	CMD_ADCS_GET_MAGNETIC_FIELD          = 0x40,
-	CMD_ADCS_GET_ANGULAR_VELOCITY,
-	CMD_ADCS_SET_TELEMETRY_INTERVAL,
-
-	////////////////////////////////////////////
-	/// PAYLOAD
-	////////////////////////////////////////////
-	CMD_PLD_SET_WELL_LED                 = 0x50,
-	CMD_PLD_SET_WELL_HEATER,
-	CMD_PLD_SET_WELL_TEMP,
-	CMD_PLD_GET_WELL_TEMP,
-	CMD_PLD_GET_WELL_LIGHT,
-	CMD_PLD_SET_TELEMETRY_INTERVAL,
-	CMD_PLD_TEST_LEDS,
-
-	////////////////////////////////////////////
-	/// GROUND STATION
-	////////////////////////////////////////////
-	CMD_GND_VERIFY_FLASH_TEST             = 0x60,
-	CMD_GND_VERIFY_MRAM_TEST,
-	CMD_GDN_VERIFY_CDH_NUM_TASKS,
-	CMD_GND_VERIFY_SAMPLE_TASK,
-	CMD_GND_VERIFY_RTC
+#define CMD(name, id, ...) CMD_##name = id,
+#include "can_command_schema.h"
+#undef CMD
 } CmdID;
 
+typedef enum
+{
+	DELIVERY_ACKED = 0,       // cached until ACK'd. times out if no ACK arrives.
+	DELIVERY_FIRE_AND_FORGET, // sent once. never cached or ACK'd.
+	DELIVERY_LATEST_VALUE,    // like fire-and-forget, but replaces an unsent frame with the same command.
+} DeliveryPolicy;
+
 typedef struct
 {
 	uint8_t body_size;
 	uint8_t priority;
+	uint16_t timeout; // ms to wait for an ACK. 0 uses the default.
+	uint8_t policy;   // see DeliveryPolicy.
+	uint8_t max_retries; // resends after a timeout before giving up.
+	uint16_t backoff;    // ms before the first resend. doubles with each resend.
+	uint16_t jitter;     // max random ms added to each backoff.
 } CmdConfig;
 
-extern const CmdConfig cmd_configs[0x70];
+extern const CmdConfig cmd_configs[CMD_ID_COUNT];
 
 #endif /* CAN_WRAPPER_MODULE_INC_CAN_COMMAND_LIST_H_ */
@@ -0,0 +1,130 @@
+/**
+ * @file can_command_schema.h
+ * The single definition of every command: its ID, delivery settings and
+ * argument layout.
+ *
+ * This file is an X-macro list. It has no include guard on purpose. Each
+ * includer defines CMD, ARG and ARRAY to generate what it needs:
+ *  - can_command_list.h generates the CmdID enum.
+ *  - can_command_codec.h generates the argument structs and the
+ *    Encode_<CMD>/Decode_<CMD> functions.
+ *  - can_command_list.c generates cmd_configs.
+ *
+ * CMD(NAME, ID, PRIORITY, TIMEOUT, POLICY, RETRIES, BACKOFF, JITTER, ARGS...)
+ *  NAME      command name without the CMD_ prefix.
+ *  ID        command ID. must be unique and below CMD_ID_COUNT.
+ *  PRIORITY  6-bit priority. lower wins arbitration. below 32 is urgent.
+ *  TIMEOUT   ms to wait for an ACK. 0 uses the default.
+ *  POLICY    see DeliveryPolicy.
+ *  RETRIES   times to resend an ACK'd message that timed out.
+ *  BACKOFF   ms to wait before the first resend. doubles with each resend.
+ *  JITTER    up to this many ms are added to each backoff at random.
+ *  ARGS      the message body, in order. ARG(type, name) for a single value,
+ *            ARRAY(type, name, count) for several, or NO_ARGS.
+ *            multi-byte values are in the host's byte order, which is
+ *            little-endian on Cortex-M4 and x86.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 5, 2024
+ */
+
+#ifndef NO_ARGS
+#define NO_ARGS
+#endif
+
+//////////////////////////////////////////////////////////////
+/// COMMON
+//////////////////////////////////////////////////////////////
+//  NAME                             ID    PRIORITY TIMEOUT POLICY                    RETRIES BACKOFF JITTER
+CMD(COMMON_PREPRARE_FOR_SHUTDOWN,    0x00, 0,       0,      DELIVERY_ACKED,           5,      5,      2,     NO_ARGS)
+CMD(COMMON_RESET,                    0x01, 1,       0,      DELIVERY_ACKED,           5,      5,      2,     NO_ARGS)
+CMD(COMMON_GET_PCB_TEMP,             0x02, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    NO_ARGS)
+CMD(COMMON_GET_MCU_TEMP,             0x03, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    NO_ARGS)
+
+// Segmented transport. (see can_transport.h)
+CMD(COMMON_SEGMENT_START,            0x04, 40,      0,      DELIVERY_FIRE_AND_FORGET, 0,      0,      0,     ARG(uint8_t, xfer_id) ARG(uint16_t, length) ARG(uint8_t, tag))
+CMD(COMMON_SEGMENT_DATA,             0x05, 40,      0,      DELIVERY_FIRE_AND_FORGET, 0,      0,      0,     ARRAY(uint8_t, header, 2) ARRAY(uint8_t, payload, 5))
+CMD(COMMON_SEGMENT_ACK,              0x06, 16,      0,      DELIVERY_FIRE_AND_FORGET, 0,      0,      0,     ARG(uint8_t, xfer_id) ARG(uint16_t, base) ARG(uint16_t, received) ARG(uint8_t, credits) ARG(uint8_t, status))
+
+// Wrapper statistics. (see can_stats.h)
+CMD(COMMON_STATS,                    0x07, 60,      0,      DELIVERY_FIRE_AND_FORGET, 0,      0,      0,     ARG(uint16_t, index) ARRAY(uint8_t, data, 5))
+
+//////////////////////////////////////////////////////////////
+/// CDH
+//////////////////////////////////////////////////////////////
+//  NAME                             ID    PRIORITY TIMEOUT POLICY                    RETRIES BACKOFF JITTER
+// Event Processing.
+CMD(CDH_PROCESS_HEARTBEAT,           0x10, 32,      0,      DELIVERY_FIRE_AND_FORGET, 0,      0,      0,     NO_ARGS)
+CMD(CDH_PROCESS_ERROR,               0x11, 8,       0,      DELIVERY_ACKED,           5,      5,      2,     ARRAY(uint8_t, error, 7))
+CMD(CDH_PROCESS_READY_FOR_SHUTDOWN,  0x12, 2,       0,      DELIVERY_ACKED,           5,      5,      2,     NO_ARGS)
+CMD(CDH_PROCESS_STARTUP,             0x13, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    NO_ARGS)
+CMD(CDH_PROCESS_PCB_TEMP,            0x14, 32,      0,      DELIVERY_LATEST_VALUE,    0,      0,      0,     ARG(uint16_t, temp))
+CMD(CDH_PROCESS_MCU_TEMP,            0x15, 32,      0,      DELIVERY_LATEST_VALUE,    0,      0,      0,     ARG(uint16_t, temp))
+CMD(CDH_PROCESS_CONVERTER_STATUS,    0x16, 32,      0,      DELIVERY_LATEST_VALUE,    0,      0,      0,     ARG(uint8_t, status))
+CMD(CDH_PROCESS_BATTERY_VOLTAGE,     0x17, 32,      0,      DELIVERY_LATEST_VALUE,    0,      0,      0,     NO_ARGS)
+CMD(CDH_PROCESS_MAGNETIC_FIELD,      0x18, 32,      0,      DELIVERY_LATEST_VALUE,    0,      0,      0,     ARG(int16_t, x) ARG(int16_t, y) ARG(int16_t, z))
+CMD(CDH_PROCESS_ANGULAR_VELOCITY,    0x19, 32,      0,      DELIVERY_LATEST_VALUE,    0,      0,      0,     ARG(int16_t, x) ARG(int16_t, y) ARG(int16_t, z))
+CMD(CDH_PROCESS_WELL_LIGHT,          0x1A, 32,      0,      DELIVERY_LATEST_VALUE,    0,      0,      0,     ARG(uint8_t, well_id) ARG(uint16_t, light))
+CMD(CDH_PROCESS_WELL_TEMP,           0x1B, 32,      0,      DELIVERY_LATEST_VALUE,    0,      0,      0,     ARG(uint8_t, well_id) ARG(uint16_t, temp))
+CMD(CDH_PROCESS_LED_TEST,            0x1C, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    ARG(uint16_t, result))
+
+// Tests
+CMD(CDH_TEST_FLASH,                  0x1D, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    NO_ARGS)
+CMD(CHD_TEST_MRAM,                   0x1E, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    NO_ARGS)
+
+// Antenna
+CMD(CDH_ENABLE_ANTENNA_DEPLOYMENT,   0x1F, 4,       0,      DELIVERY_ACKED,           5,      5,      2,     NO_ARGS)
+CMD(CDH_DEPLOY_ANTENNA,              0x20, 4,       0,      DELIVERY_ACKED,           5,      5,      2,     NO_ARGS)
+CMD(CDH_TRANSMIT_UHF_BEACON,         0x21, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    NO_ARGS)
+
+// RTOS
+CMD(CDH_GET_NUM_TASKS,               0x22, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    NO_ARGS)
+CMD(CDH_SCHEDULE_SAMPLE_TASK,        0x23, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    ARG(uint32_t, delay_ms))
+
+// Clock
+CMD(CDH_SET_RTC,                     0x24, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    ARG(uint32_t, timestamp))
+CMD(CDH_GET_RTC,                     0x25, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    NO_ARGS)
+
+CMD(CDH_SET_TELEMETRY_INTERVAL,      0x26, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    ARG(uint8_t, sensor) ARG(uint16_t, interval_ms))
+
+//////////////////////////////////////////////////////////////
+/// POWER
+//////////////////////////////////////////////////////////////
+//  NAME                             ID    PRIORITY TIMEOUT POLICY                    RETRIES BACKOFF JITTER
+CMD(PWR_SET_LINE_POWER,              0x30, 6,       0,      DELIVERY_ACKED,           5,      5,      2,     ARG(uint8_t, line) ARG(uint8_t, state))
+CMD(PWR_SET_BATTERY_HEATER,          0x31, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    ARG(uint8_t, state))
+CMD(PWR_GET_CONVERTER_STATUS,        0x32, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    NO_ARGS)
+CMD(PWR_SET_TELEMETRY_INTERVAL,      0x33, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    ARG(uint8_t, sensor) ARG(uint16_t, interval_ms))
+
+//////////////////////////////////////////////////////////////
+/// ADCS
+//////////////////////////////////////////////////////////////
+//  NAME                             ID    PRIORITY TIMEOUT POLICY                    RETRIES BACKOFF JITTER
+CMD(ADCS_GET_MAGNETIC_FIELD,         0x40, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    NO_ARGS)
+CMD(ADCS_GET_ANGULAR_VELOCITY,       0x41, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    NO_ARGS)
+CMD(ADCS_SET_TELEMETRY_INTERVAL,     0x42, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    ARG(uint8_t, sensor) ARG(uint16_t, interval_ms))
+CMD(ADCS_SET_MAGNETORQUER_POWER,     0x43, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    ARG(uint8_t, axis) ARG(uint8_t, power))
+CMD(ADCS_SET_MAGNETORQUER_DIRECTION, 0x44, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    ARG(uint8_t, axis) ARG(uint8_t, direction))
+
+//////////////////////////////////////////////////////////////
+/// PAYLOAD
+//////////////////////////////////////////////////////////////
+//  NAME                             ID    PRIORITY TIMEOUT POLICY                    RETRIES BACKOFF JITTER
+CMD(PLD_SET_WELL_LED,                0x50, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    ARG(uint8_t, well_id) ARG(uint8_t, power))
+CMD(PLD_SET_WELL_HEATER,             0x51, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    ARG(uint8_t, well_id) ARG(uint8_t, power))
+CMD(PLD_SET_WELL_TEMP,               0x52, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    ARG(uint8_t, well_id) ARG(uint16_t, temp))
+CMD(PLD_GET_WELL_TEMP,               0x53, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    ARG(uint8_t, well_id))
+CMD(PLD_GET_WELL_LIGHT,              0x54, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    ARG(uint8_t, well_id))
+CMD(PLD_SET_TELEMETRY_INTERVAL,      0x55, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    ARG(uint8_t, sensor) ARG(uint8_t, well_id) ARG(uint16_t, interval_ms))
+CMD(PLD_TEST_LEDS,                   0x56, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    NO_ARGS)
+
+//////////////////////////////////////////////////////////////
+/// GROUND STATION
+//////////////////////////////////////////////////////////////
+//  NAME                             ID    PRIORITY TIMEOUT POLICY                    RETRIES BACKOFF JITTER
+CMD(GND_VERIFY_FLASH_TEST,           0x60, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    ARG(uint8_t, result))
+CMD(GND_VERIFY_MRAM_TEST,            0x61, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    ARG(uint8_t, result))
+CMD(GDN_VERIFY_CDH_NUM_TASKS,        0x62, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    ARG(uint8_t, num_tasks))
+CMD(GND_VERIFY_SAMPLE_TASK,          0x63, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    NO_ARGS)
+CMD(GND_VERIFY_RTC,                  0x64, 32,      0,      DELIVERY_ACKED,           3,      10,     10,    ARG(uint32_t, timestamp))
@@ -0,0 +1,124 @@
+/**
+ * @file can_id.h
+ * Packing and unpacking of CAN Wrapper's frame identifiers.
+ *
+ * Standard (11-bit) identifiers:
+ *   [10:5] priority, [4:3] sender, [2:1] recipient, [0] ACK.
+ *
+ * Extended (29-bit) identifiers, used with extended_ids:
+ *   [28:23] priority, [22:16] command, [15:11] sender, [10:6] recipient,
+ *   [5:1] sequence number, [0] ACK.
+ *
+ * The top priority bit is clear for urgent frames in both layouts. This
+ * header doesn't depend on the HAL, so it can be built and timed off-target.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 11, 2024
+ */
+
+#ifndef CAN_WRAPPER_MODULE_INC_CAN_ID_H_
+#define CAN_WRAPPER_MODULE_INC_CAN_ID_H_
+
+#include "can_message.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CAN_ID_ACK_MASK       0b00000000001
+#define CAN_ID_RECIPIENT_MASK 0b00000000110
+#define CAN_ID_SENDER_MASK    0b00000011000
+#define CAN_ID_PRIORITY_MASK  0b11111100000
+
+// frames with this priority bit clear are urgent and are received through FIFO1.
+#define CAN_ID_URGENT_MASK    0b10000000000
+
+#define CAN_ID_RECIPIENT_SHIFT 1
+#define CAN_ID_SENDER_SHIFT    3
+#define CAN_ID_PRIORITY_SHIFT  5
+
+// 29-bit identifier layout. the command is repeated in the identifier so
+// that filters can select on it.
+#define CAN_ID_EXT_ACK_MASK       0x00000001u
+#define CAN_ID_EXT_SEQ_MASK       0x0000003Eu
+#define CAN_ID_EXT_RECIPIENT_MASK 0x000007C0u
+#define CAN_ID_EXT_SENDER_MASK    0x0000F800u
+#define CAN_ID_EXT_CMD_MASK       0x007F0000u
+#define CAN_ID_EXT_PRIORITY_MASK  0x1F800000u
+#define CAN_ID_EXT_URGENT_MASK    0x10000000u
+
+#define CAN_ID_EXT_SEQ_SHIFT       1
+#define CAN_ID_EXT_RECIPIENT_SHIFT 6
+#define CAN_ID_EXT_SENDER_SHIFT    11
+#define CAN_ID_EXT_CMD_SHIFT       16
+#define CAN_ID_EXT_PRIORITY_SHIFT  23
+
+#define CAN_ID_EXT_SEQ_BITS 5
+
+_Static_assert(CMD_ID_COUNT <= (CAN_ID_EXT_CMD_MASK >> CAN_ID_EXT_CMD_SHIFT) + 1, "command ID's don't fit in the extended identifier");
+
+typedef struct
+{
+	uint8_t priority;
+	uint8_t cmd;       // extended identifiers only.
+	NodeID sender;
+	NodeID recipient;
+	uint8_t seq;       // extended identifiers only.
+	bool is_ack;
+} CANIdFields;
+
+/**
+ * @brief               Packs fields into an identifier. Fields too wide for
+ *                      the layout are truncated.
+ *
+ * @param fields        The fields.
+ * @param extended      true for a 29-bit identifier, false for 11-bit.
+ */
+static inline uint32_t CANId_Pack(const CANIdFields *fields, bool extended)
+{
+	if (extended)
+	{
+		return ((uint32_t)fields->priority  << CAN_ID_EXT_PRIORITY_SHIFT  & CAN_ID_EXT_PRIORITY_MASK)
+		     | ((uint32_t)fields->cmd       << CAN_ID_EXT_CMD_SHIFT       & CAN_ID_EXT_CMD_MASK)
+		     | ((uint32_t)fields->sender    << CAN_ID_EXT_SENDER_SHIFT    & CAN_ID_EXT_SENDER_MASK)
+		     | ((uint32_t)fields->recipient << CAN_ID_EXT_RECIPIENT_SHIFT & CAN_ID_EXT_RECIPIENT_MASK)
+		     | ((uint32_t)fields->seq       << CAN_ID_EXT_SEQ_SHIFT       & CAN_ID_EXT_SEQ_MASK)
+		     | (fields->is_ack ? CAN_ID_EXT_ACK_MASK : 0);
+	}
+
+	// the command and sequence number don't fit in a standard identifier.
+	return ((uint32_t)fields->priority  << CAN_ID_PRIORITY_SHIFT  & CAN_ID_PRIORITY_MASK)
+	     | ((uint32_t)fields->sender    << CAN_ID_SENDER_SHIFT    & CAN_ID_SENDER_MASK)
+	     | ((uint32_t)fields->recipient << CAN_ID_RECIPIENT_SHIFT & CAN_ID_RECIPIENT_MASK)
+	     | (fields->is_ack ? CAN_ID_ACK_MASK : 0);
+}
+
+/**
+ * @brief               Unpacks an identifier into its fields.
+ *
+ * @param id            The identifier.
+ * @param extended      true for a 29-bit identifier, false for 11-bit.
+ * @param out_fields    Output location for the fields. cmd and seq are 0 for
+ *                      standard identifiers.
+ */
+static inline void CANId_Unpack(uint32_t id, bool extended, CANIdFields *out_fields)
+{
+	if (extended)
+	{
+		out_fields->priority  = (id & CAN_ID_EXT_PRIORITY_MASK)  >> CAN_ID_EXT_PRIORITY_SHIFT;
+		out_fields->cmd       = (id & CAN_ID_EXT_CMD_MASK)       >> CAN_ID_EXT_CMD_SHIFT;
+		out_fields->sender    = (id & CAN_ID_EXT_SENDER_MASK)    >> CAN_ID_EXT_SENDER_SHIFT;
+		out_fields->recipient = (id & CAN_ID_EXT_RECIPIENT_MASK) >> CAN_ID_EXT_RECIPIENT_SHIFT;
+		out_fields->seq       = (id & CAN_ID_EXT_SEQ_MASK)       >> CAN_ID_EXT_SEQ_SHIFT;
+		out_fields->is_ack    = id & CAN_ID_EXT_ACK_MASK;
+		return;
+	}
+
+	out_fields->priority  = (id & CAN_ID_PRIORITY_MASK)  >> CAN_ID_PRIORITY_SHIFT;
+	out_fields->cmd       = 0;
+	out_fields->sender    = (id & CAN_ID_SENDER_MASK)    >> CAN_ID_SENDER_SHIFT;
+	out_fields->recipient = (id & CAN_ID_RECIPIENT_MASK) >> CAN_ID_RECIPIENT_SHIFT;
+	out_fields->seq       = 0;
+	out_fields->is_ack    = id & CAN_ID_ACK_MASK;
+}
+
+#endif /* CAN_WRAPPER_MODULE_INC_CAN_ID_H_ */
@@ -11,12 +11,14 @@
 #define CAN_WRAPPER_MODULE_INC_CAN_MESSAGE_H_
 
 #include "can_command_list.h"
-#include <sys/_stdint.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
 
 #define CAN_MAX_BODY_SIZE 7
 
+#define CAN_WRAPPER_MAX_NODES 32 // node ID's that fit in the extended identifier. 4 fit in a standard one.
+
 typedef enum
 {
 	NODE_CDH     = 0,
@@ -42,6 +44,7 @@ typedef struct
 	uint8_t sender;
 	uint8_t recipient;
 	uint8_t is_ack;
+	uint8_t dlc;       // number of data bytes on the wire.
 } CachedCANMessage;
 
 static inline bool CANMessage_Equals(const CANMessage *msg1, const CANMessage *msg2)
@@ -50,15 +53,35 @@ static inline bool CANMessage_Equals(const CANMessage *msg1, const CANMessage *m
 			&& memcmp(msg1->body, msg2->body, cmd_configs[msg1->cmd].body_size) == 0;
 }
 
+/**
+ * @brief Returns a 32-bit FNV-1a hash of the command ID and message body.
+ *
+ * Only the bytes in use by the command (see cmd_configs) are hashed.
+ */
+static inline uint32_t CANMessage_Hash(const CANMessage *msg)
+{
+	uint32_t hash = 2166136261u;
+	for (uint8_t i = 0; i <= cmd_configs[msg->cmd].body_size; i++)
+	{
+		hash = (hash ^ msg->data[i]) * 16777619u;
+	}
+	return hash;
+}
+
 // macros to get/set arguments in a command.
 // NOTE: these depend on the fact that TSAT's MCUs are all of the same endianness.
 // If that were to change, you would have to set/get the elements in the message
 // body directly.
+// Prefer the Encode_<CMD>/Decode_<CMD> functions in can_command_codec.h, which
+// know each command's argument layout.
 
 #define GET_ARG(msg, pos, var) \
-	var = *((typeof(var)*)(msg.body + pos))
+	memcpy(&(var), (msg).body + (pos), sizeof(var))
 
 #define SET_ARG(msg, pos, var) \
-	*((typeof(var)*)(msg.body + pos)) = var;
+	do { \
+		typeof(var) _arg = (var); \
+		memcpy((msg).body + (pos), &_arg, sizeof(_arg)); \
+	} while (0)
 
 #endif /* CAN_WRAPPER_MODULE_INC_CAN_MESSAGE_H_ */
@@ -0,0 +1,92 @@
+/**
+ * @file can_os.h
+ * The little CAN Wrapper needs from an operating system to let a task sleep
+ * until there is work for CANWrapper_Poll_Messages.
+ *
+ * Define one of these to pick a port:
+ *  - CAN_WRAPPER_OS_FREERTOS: a binary semaphore (can_os_freertos.c).
+ *  - CAN_WRAPPER_OS_POSIX: a condition variable, for host builds (can_os_posix.c).
+ *
+ * With neither, there is no OS layer and CANWrapper_Poll_Messages has to be
+ * called in a loop as before.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 13, 2024
+ */
+
+#ifndef CAN_WRAPPER_MODULE_INC_CAN_OS_H_
+#define CAN_WRAPPER_MODULE_INC_CAN_OS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#if defined(CAN_WRAPPER_OS_FREERTOS) && defined(CAN_WRAPPER_OS_POSIX)
+#error "define only one of CAN_WRAPPER_OS_FREERTOS and CAN_WRAPPER_OS_POSIX"
+#endif
+
+#if defined(CAN_WRAPPER_OS_FREERTOS) || defined(CAN_WRAPPER_OS_POSIX)
+#define CAN_WRAPPER_OS
+#endif
+
+#define CAN_OS_WAIT_FOREVER UINT32_MAX
+
+#if defined(CAN_WRAPPER_OS_FREERTOS)
+
+#include <FreeRTOS.h>
+#include <semphr.h>
+
+typedef struct
+{
+	StaticSemaphore_t buffer;
+	SemaphoreHandle_t semaphore;
+} CANOSEvent;
+
+#elif defined(CAN_WRAPPER_OS_POSIX)
+
+#include <pthread.h>
+
+typedef struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool signalled;
+} CANOSEvent;
+
+#else
+
+typedef struct
+{
+	uint8_t unused;
+} CANOSEvent;
+
+#endif
+
+#ifdef CAN_WRAPPER_OS
+
+/**
+ * @brief               Creates an event that isn't signalled.
+ */
+void CANOS_Event_Init(CANOSEvent *event);
+
+/**
+ * @brief               Wakes the task waiting on an event, or the next one
+ *                      to wait if none is. Signals before a wait collapse
+ *                      into one.
+ *
+ * Safe to call from interrupts.
+ */
+void CANOS_Event_Signal(CANOSEvent *event);
+
+/**
+ * @brief               Sleeps until the event is signalled, and clears it.
+ *
+ * @param event         The event.
+ * @param timeout_ms    Longest to sleep. CAN_OS_WAIT_FOREVER for no limit.
+ * @return              true if the event was signalled. false on timeout.
+ */
+bool CANOS_Event_Wait(CANOSEvent *event, uint32_t timeout_ms);
+
+#endif /* CAN_WRAPPER_OS */
+
+#endif /* CAN_WRAPPER_MODULE_INC_CAN_OS_H_ */
@@ -0,0 +1,105 @@
+/**
+ * @file can_probe.h
+ * Execution time probes for the wrapper's interrupt handlers and hot paths.
+ *
+ * Build with CAN_WRAPPER_PROBES defined to time every call to the probed
+ * functions. Each probe keeps the count, min, max and total of its call
+ * times, read with CANProbe_Get. Without CAN_WRAPPER_PROBES, the probes
+ * compile to nothing.
+ *
+ * On target, times are in CPU cycles from the Cortex-M4 DWT cycle counter.
+ * In a host build (CAN_WRAPPER_HAL_HEADER defined), they are nanoseconds
+ * from clock_gettime. CAN_PROBE_TICKS_PER_US converts either to time.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 10, 2024
+ */
+
+#ifndef CAN_WRAPPER_MODULE_INC_CAN_PROBE_H_
+#define CAN_WRAPPER_MODULE_INC_CAN_PROBE_H_
+
+#include <stdint.h>
+
+typedef enum
+{
+	CAN_PROBE_RX_FIFO0_ISR = 0, // HAL_CAN_RxFifo0MsgPendingCallback.
+	CAN_PROBE_RX_FIFO1_ISR,     // HAL_CAN_RxFifo1MsgPendingCallback.
+	CAN_PROBE_TX_COMPLETE_ISR,  // HAL_CAN_TxMailbox*CompleteCallback.
+	CAN_PROBE_ERROR_ISR,        // HAL_CAN_ErrorCallback.
+	CAN_PROBE_POLL,             // CANWrapper_Poll_Messages, including message callbacks.
+	CAN_PROBE_TRANSMIT,         // CANWrapper_Transmit.
+	CAN_PROBE_COUNT
+} CANProbeID;
+
+typedef struct
+{
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t total; // total / count is the mean.
+} CANProbeRecord;
+
+#ifdef CAN_WRAPPER_PROBES
+
+#ifdef CAN_WRAPPER_HAL_HEADER
+#define CAN_PROBE_TICKS_PER_US 1000u
+#else
+#define CAN_PROBE_TICKS_PER_US (SystemCoreClock / 1000000u)
+#endif
+
+/**
+ * @brief               Starts timing the enclosing block. Must come before
+ *                      CAN_PROBE_END in the same block.
+ */
+#define CAN_PROBE_BEGIN() \
+	const uint32_t can_probe_start = CANProbe_Now()
+
+/**
+ * @brief               Records the time since CAN_PROBE_BEGIN against a probe.
+ */
+#define CAN_PROBE_END(probe) \
+	CANProbe_Record((probe), CANProbe_Now() - can_probe_start)
+
+/**
+ * @brief               Starts the cycle counter. Called by CANWrapper_Init.
+ *                      Records are kept from startup, not from this call.
+ */
+void CANProbe_Init();
+
+/**
+ * @brief               Returns the current probe time in ticks. Wraps around.
+ */
+uint32_t CANProbe_Now();
+
+/**
+ * @brief               Adds a call time to a probe's record.
+ */
+void CANProbe_Record(CANProbeID probe, uint32_t ticks);
+
+/**
+ * @brief               Reads a probe's record.
+ *
+ * @param probe         The probe.
+ * @param out_record    Output location for the record.
+ */
+void CANProbe_Get(CANProbeID probe, CANProbeRecord *out_record);
+
+/**
+ * @brief               Clears every probe's record.
+ */
+void CANProbe_Reset();
+
+/**
+ * @brief               Returns a probe's name for reports, e.g. "poll".
+ */
+const char *CANProbe_Name(CANProbeID probe);
+
+#else
+
+#define CAN_PROBE_BEGIN()    do {} while (0)
+#define CAN_PROBE_END(probe) do {} while (0)
+
+#endif /* CAN_WRAPPER_PROBES */
+
+#endif /* CAN_WRAPPER_MODULE_INC_CAN_PROBE_H_ */
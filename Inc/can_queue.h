@@ -1,7 +1,12 @@
 /**
  * @file can_queue.h
  * Queue ADT for storing CAN messages.
- * Implemented using circular buffer.
+ * Implemented using a lock-free single-producer/single-consumer ring buffer.
+ *
+ * Exactly one context may enqueue (e.g. the RX interrupt) and exactly one
+ * context may dequeue (e.g. CANWrapper_Poll_Messages) at the same time.
+ * Indices are free-running and published with release/acquire ordering, so
+ * an item is fully written before the consumer can see it.
  *
  * @author Logan Furedi <logan.furedi@umsats.ca>
  * @author Om Sevak <om.sevak@umsats.ca>
@@ -13,10 +18,14 @@
 #define CAN_WRAPPER_MODULE_INC_CAN_QUEUE_H_
 
 #include <can_message.h>
+#include <stdatomic.h>
 #include <stdbool.h>
-#include <sys/_stdint.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAN_QUEUE_SIZE 128 // must be a power of two.
 
-#define CAN_QUEUE_SIZE 100
+_Static_assert((CAN_QUEUE_SIZE & (CAN_QUEUE_SIZE - 1)) == 0, "CAN_QUEUE_SIZE must be a power of two");
 
 typedef struct
 {
@@ -25,8 +34,8 @@ typedef struct
 
 typedef struct
 {
-    uint32_t head;
-    uint32_t tail;
+    _Atomic uint32_t head; // written by the consumer only.
+    _Atomic uint32_t tail; // written by the producer only.
     CANQueueItem items[CAN_QUEUE_SIZE];
 } CANQueue;
 
@@ -45,6 +54,11 @@ bool CANQueue_IsEmpty(const CANQueue* queue);
  */
 bool CANQueue_IsFull(const CANQueue* queue);
 
+/**
+ * @brief               Returns the number of messages in the given queue.
+ */
+size_t CANQueue_Size(const CANQueue* queue);
+
 /**
  * @brief               Enqueues a message into the given queue.
  *
@@ -52,7 +66,23 @@ bool CANQueue_IsFull(const CANQueue* queue);
  * @param message       The CAN message to enqueue.
  * @return              true on success. false on fail.
  */
-bool CANQueue_Enqueue(CANQueue* queue, CANQueueItem message);
+bool CANQueue_Enqueue(CANQueue* queue, const CANQueueItem *message);
+
+/**
+ * @brief               Reserves the next free slot for writing in place.
+ *
+ * The item is not visible to the consumer until CANQueue_Commit is called.
+ * Reserving again without committing returns the same slot.
+ *
+ * @param queue         The CAN message queue.
+ * @return              The slot to write to. NULL if the queue is full.
+ */
+CANQueueItem *CANQueue_Reserve(CANQueue* queue);
+
+/**
+ * @brief               Publishes the slot returned by CANQueue_Reserve.
+ */
+void CANQueue_Commit(CANQueue* queue);
 
 /**
  * @brief:              Dequeues a message out of the given queue.
@@ -63,4 +93,14 @@ bool CANQueue_Enqueue(CANQueue* queue, CANQueueItem message);
  */
 bool CANQueue_Dequeue(CANQueue* queue, CANQueueItem* out_message);
 
+/**
+ * @brief               Dequeues up to max_count messages with one index update.
+ *
+ * @param queue         The CAN message queue.
+ * @param out_messages  The output location for at least max_count messages.
+ * @param max_count     The maximum number of messages to dequeue.
+ * @return              The number of messages dequeued.
+ */
+size_t CANQueue_DequeueBatch(CANQueue* queue, CANQueueItem* out_messages, size_t max_count);
+
 #endif /* CAN_WRAPPER_MODULE_INC_CAN_QUEUE_H_ */
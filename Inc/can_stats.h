@@ -0,0 +1,99 @@
+/**
+ * @file can_stats.h
+ * Runtime statistics kept by each wrapper instance.
+ *
+ * Counters are bumped where the event happens, so each update is a load, an
+ * add and a store. High-water marks add a compare. See CANWrapper_Get_Stats.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 9, 2024
+ */
+
+#ifndef CAN_WRAPPER_MODULE_INC_CAN_STATS_H_
+#define CAN_WRAPPER_MODULE_INC_CAN_STATS_H_
+
+#include "can_message.h"
+#include "can_command_list.h"
+#include <stdint.h>
+
+// bucket i counts ACK round trips of 2^i to 2^(i+1) - 1 timer ticks (us).
+// the last bucket also counts anything longer.
+#define CAN_STATS_RTT_BUCKETS 20
+
+#define CAN_STATS_BYTES_PER_FRAME 5 // snapshot bytes per CMD_COMMON_STATS frame.
+
+typedef struct
+{
+	uint32_t tx_msgs;       // messages sent to this node, not counting retries.
+	uint32_t tx_retries;    // messages resent to this node after an ACK timeout.
+	uint32_t tx_timeouts;   // ACK's from this node that didn't arrive in time.
+	uint32_t tx_failures;   // messages to this node given up on after retrying.
+	uint32_t acks_received; // our messages this node ACK'd.
+	uint32_t rx_frames;     // frames received from this node, including ACK's.
+	uint32_t rx_dropped;    // frames from this node dropped for lack of queue or ACK space.
+	uint32_t acks_sent;     // messages from this node we ACK'd.
+} CANNodeStats;
+
+typedef struct
+{
+	CANNodeStats nodes[CAN_WRAPPER_MAX_NODES]; // indexed by node ID.
+
+	uint32_t cmd_tx[CMD_ID_COUNT]; // frames sent per command, including retries.
+	uint32_t cmd_rx[CMD_ID_COUNT]; // frames received per command, not counting ACK's.
+
+	uint32_t tx_queue_full;       // messages and ACK frames the TX queue had no room for.
+	uint32_t tx_cache_full;       // ACK'd messages sent untracked, as the TX cache was full.
+	uint32_t fifo_overruns[2];    // per RX FIFO.
+	uint32_t duplicates;          // see CANWrapper_Get_Duplicate_Count.
+	uint32_t unhandled;           // see CANWrapper_Get_Unhandled_Count.
+	uint32_t lost_errors;         // errors that didn't fit in the error queue.
+	uint32_t bus_offs;
+	uint32_t lec_masks;           // times the last error code interrupt was turned off. see CAN_WRAPPER_LEC_REARM_MS.
+
+	// high-water marks.
+	uint16_t msg_queue_hwm;
+	uint16_t urgent_queue_hwm;
+	uint16_t tx_queue_hwm;
+	uint16_t tx_cache_hwm;
+	uint16_t pending_acks_hwm;
+	uint16_t reserved;
+
+	uint32_t ack_rtt[CAN_STATS_RTT_BUCKETS]; // log2 histogram of ACK round trip times.
+} CANWrapper_Stats;
+
+/**
+ * @brief               Raises a high-water mark.
+ */
+#define CAN_STATS_HWM(hwm, level) \
+	do { if ((level) > (hwm)) (hwm) = (level); } while (0)
+
+/**
+ * @brief               Returns the ack_rtt bucket for a round trip time.
+ */
+static inline uint8_t CANStats_RTT_Bucket(uint64_t ticks)
+{
+	if (ticks >> 32) return CAN_STATS_RTT_BUCKETS - 1;
+
+	uint8_t bucket = 31 - __builtin_clz((uint32_t)ticks | 1);
+	return bucket < CAN_STATS_RTT_BUCKETS ? bucket : CAN_STATS_RTT_BUCKETS - 1;
+}
+
+/**
+ * @brief               Packs part of a statistics snapshot into a
+ *                      CMD_COMMON_STATS message for downlink.
+ *
+ * The snapshot is sent as its raw bytes, CAN_STATS_BYTES_PER_FRAME per frame.
+ * Send frames 0 to the returned count - 1, and reassemble on the ground
+ * by index. Those bytes are CANWrapper_Stats as the sender lays it out, in
+ * its byte order and with its padding, so the decoder on the ground must
+ * use the sender's ABI (little-endian, 4-byte aligned on Cortex-M4).
+ *
+ * @param stats         The snapshot. See CANWrapper_Get_Stats.
+ * @param index         Which part of the snapshot to pack.
+ * @param out_msg       Output location for the message.
+ * @return              The number of frames the snapshot takes.
+ */
+uint16_t CANStats_Pack(const CANWrapper_Stats *stats, uint16_t index, CANMessage *out_msg);
+
+#endif /* CAN_WRAPPER_MODULE_INC_CAN_STATS_H_ */
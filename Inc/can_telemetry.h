@@ -0,0 +1,128 @@
+/**
+ * @file can_telemetry.h
+ * Periodic telemetry, sent on a schedule that spreads it over time.
+ *
+ * The application registers a producer for each periodic message (e.g.
+ * CDH_PROCESS_PCB_TEMP every 1000 ms) with a callback that fills in its body.
+ * Each producer is given a fixed phase within its period, worked out from
+ * the node ID and the producer's index, so that nodes which booted together
+ * don't all send at the same instant. Node i of node_count sends in the i'th
+ * slice of each period, and a node's producers are spread over its slice.
+ *
+ * Periods are changed over the bus by the node's SET_TELEMETRY_INTERVAL
+ * command, which the scheduler handles itself.
+ *
+ * Telemetry gives way to other traffic: while the TX queue holds more than
+ * CAN_TELEMETRY_MAX_BACKLOG frames, due messages wait. A message that is a
+ * whole period late is skipped rather than sent twice in a row.
+ *
+ * Callbacks are called from CANWrapper_Poll_Messages.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 14, 2024
+ */
+
+#ifndef CAN_WRAPPER_MODULE_INC_CAN_TELEMETRY_H_
+#define CAN_WRAPPER_MODULE_INC_CAN_TELEMETRY_H_
+
+#include "can_wrapper.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CAN_TELEMETRY_MAX_PRODUCERS 16
+
+#define CAN_TELEMETRY_DEFAULT_NODE_COUNT 4 // CDH, power, ADCS and payload. used if node_count is 0.
+
+#define CAN_TELEMETRY_MAX_BACKLOG (TX_QUEUE_SIZE / 2) // queued frames above which telemetry waits.
+#define CAN_TELEMETRY_BACKLOG_RETRY_MS 1              // how soon to try again while it waits.
+
+#define CAN_TELEMETRY_ANY_WELL 0xFF // well_id of a producer that isn't tied to a well.
+
+/**
+ * @brief Called when a producer is due. msg->cmd is already set and the body
+ *        is zeroed. Returns false to skip this period, e.g. if there is no
+ *        new reading.
+ */
+typedef bool (*CANTelemetryFillCallback)(CANMessage *msg, void *ctx);
+
+typedef struct
+{
+	CmdID interval_cmd; // this node's SET_TELEMETRY_INTERVAL command, e.g. CMD_PWR_SET_TELEMETRY_INTERVAL.
+	uint8_t node_count; // nodes sending telemetry on the bus. 0 uses CAN_TELEMETRY_DEFAULT_NODE_COUNT.
+} CANTelemetry_InitTypeDef;
+
+typedef struct
+{
+	CmdID cmd;            // the message to send, e.g. CMD_CDH_PROCESS_PCB_TEMP.
+	NodeID recipient;
+	uint8_t sensor;       // SensorID that SET_TELEMETRY_INTERVAL refers to this producer by.
+	uint8_t well_id;      // well that PLD_SET_TELEMETRY_INTERVAL refers to it by, or CAN_TELEMETRY_ANY_WELL.
+	uint16_t interval_ms; // period. 0 doesn't send until an interval is set.
+	CANTelemetryFillCallback fill;
+	void *ctx;            // passed to fill.
+} CANTelemetry_ProducerTypeDef;
+
+typedef struct
+{
+	CANTelemetry_ProducerTypeDef config;
+	uint64_t phase;     // ticks into each period at which to send.
+	uint64_t next_tick; // when the producer is next due. UINT64_MAX if disabled.
+} CANTelemetryProducer;
+
+typedef struct CANTelemetry
+{
+	CANTelemetry_InitTypeDef init_struct;
+	CANWrapper_Handle *hcw;
+	CANTelemetryProducer producers[CAN_TELEMETRY_MAX_PRODUCERS];
+	uint8_t count;
+	uint64_t retry_tick; // when to try again after giving way to a backlog. 0 if not waiting.
+	uint32_t skipped;    // messages skipped for being a whole period late.
+} CANTelemetry;
+
+/**
+ * @brief               Attaches a telemetry scheduler to an initialised
+ *                      wrapper instance, and registers it as the handler of
+ *                      interval_cmd.
+ *
+ * @param tel           The scheduler. Must stay at the same address while attached.
+ * @param hcw           The wrapper instance. See CANWrapper_Get_Default_Handle.
+ * @param init_struct   Configuration for initialisation.
+ */
+CANWrapper_StatusTypeDef CANTelemetry_Init(CANTelemetry *tel, CANWrapper_Handle *hcw, CANTelemetry_InitTypeDef init_struct);
+
+/**
+ * @brief               Registers a periodic message.
+ *
+ * The phases of the producers already registered shift to make room, so
+ * register them all at startup.
+ *
+ * @return              CAN_WRAPPER_NO_FREE_PRODUCER if CAN_TELEMETRY_MAX_PRODUCERS
+ *                      producers are already registered.
+ */
+CANWrapper_StatusTypeDef CANTelemetry_Add_Producer(CANTelemetry *tel, const CANTelemetry_ProducerTypeDef *producer);
+
+/**
+ * @brief               Changes the period of every producer of a sensor, as
+ *                      SET_TELEMETRY_INTERVAL does.
+ *
+ * @param well_id       The well, or CAN_TELEMETRY_ANY_WELL for every producer of the sensor.
+ * @param interval_ms   The new period. 0 stops sending.
+ * @return              The number of producers changed.
+ */
+uint8_t CANTelemetry_Set_Interval(CANTelemetry *tel, uint8_t sensor, uint8_t well_id, uint16_t interval_ms);
+
+/**
+ * @brief               Sends the messages that are due.
+ *
+ * Called by CANWrapper_Poll_Messages.
+ */
+void CANTelemetry_Update(CANTelemetry *tel);
+
+/**
+ * @brief               Returns the tick at which a message is next due, or
+ *                      UINT64_MAX if none is.
+ */
+uint64_t CANTelemetry_Next_Deadline(const CANTelemetry *tel);
+
+#endif /* CAN_WRAPPER_MODULE_INC_CAN_TELEMETRY_H_ */
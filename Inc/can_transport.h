@@ -0,0 +1,166 @@
+/**
+ * @file can_transport.h
+ * Segmented transport for payloads larger than CAN_MAX_BODY_SIZE.
+ *
+ * A transfer starts with a SEGMENT_START frame carrying the total length and
+ * a tag chosen by the application. The receiver supplies a buffer for it and
+ * answers with a SEGMENT_ACK. The payload then follows in SEGMENT_DATA frames
+ * of CAN_TRANSPORT_SEGMENT_SIZE bytes, each with a 13-bit sequence number.
+ *
+ * At most CAN_TRANSPORT_WINDOW segments are in flight. The receiver answers
+ * with block ACK's holding the next expected sequence number and a bitmap of
+ * the segments received after it, so only missing segments are resent. The
+ * receiver can shrink the window (rx_window) to slow a sender down.
+ *
+ * Payloads are read from and written to the caller's buffers directly.
+ * Callbacks are called from CANWrapper_Poll_Messages.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 2, 2024
+ */
+
+#ifndef CAN_WRAPPER_MODULE_INC_CAN_TRANSPORT_H_
+#define CAN_WRAPPER_MODULE_INC_CAN_TRANSPORT_H_
+
+#include "can_wrapper.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CAN_TRANSPORT_SEGMENT_SIZE 5   // payload bytes per SEGMENT_DATA frame.
+#define CAN_TRANSPORT_WINDOW       16  // max segments in flight. at most 16 (one ACK bitmap).
+#define CAN_TRANSPORT_MAX_LENGTH   (CAN_TRANSPORT_SEGMENT_SIZE << 13) // 13-bit sequence numbers.
+
+#define CAN_TRANSPORT_MAX_TX 2 // concurrent outgoing transfers.
+#define CAN_TRANSPORT_MAX_RX 4 // concurrent incoming transfers.
+
+#define CAN_TRANSPORT_TIMEOUT_MS  50 // time without progress before resending.
+#define CAN_TRANSPORT_MAX_RETRIES 5  // resends without progress before giving up.
+
+/**
+ * @brief Called when a transfer starts. Returns the buffer to reassemble into,
+ *        which must hold at least length bytes, or NULL to reject the transfer.
+ */
+typedef uint8_t *(*CANTransportBufferCallback)(NodeID sender, uint8_t tag, uint16_t length, void *ctx);
+
+/**
+ * @brief Called when an incoming transfer ends. The buffer is free to reuse
+ *        afterwards. If success is false, its contents are incomplete.
+ */
+typedef void (*CANTransportReceiveCallback)(NodeID sender, uint8_t tag, uint8_t *buffer, uint16_t length, bool success, void *ctx);
+
+/**
+ * @brief Called when an outgoing transfer ends. The buffer is free to reuse
+ *        afterwards. If success is false, the recipient rejected the transfer
+ *        or stopped responding.
+ */
+typedef void (*CANTransportSendCallback)(NodeID recipient, uint8_t tag, bool success, void *ctx);
+
+typedef struct
+{
+	uint8_t rx_window; // segments a sender may have in flight to us. 0 uses CAN_TRANSPORT_WINDOW.
+
+	CANTransportBufferCallback buffer_callback;   // called when a transfer to us starts.
+	CANTransportReceiveCallback receive_callback; // called when a transfer to us ends.
+	CANTransportSendCallback send_callback;       // called when a transfer from us ends. may be NULL.
+	void *ctx;                                    // passed to every callback.
+} CANTransport_InitTypeDef;
+
+typedef struct
+{
+	const uint8_t *buffer;
+	uint16_t length;
+	uint16_t segments;  // total number of segments.
+	uint16_t base;      // oldest segment not yet ACK'd.
+	uint16_t next;      // next segment to send for the first time.
+	uint32_t acked;     // bit i set if segment base + i was ACK'd.
+	uint32_t resend;    // bit i set if segment base + i must be sent again.
+	uint8_t credits;    // segments the recipient allows in flight.
+	uint8_t state;
+	uint8_t retries;
+	uint8_t xfer_id;
+	uint8_t tag;
+	NodeID recipient;
+	uint64_t deadline;  // when to resend if no progress is made.
+} CANTransportTx;
+
+typedef struct
+{
+	uint8_t *buffer;
+	uint16_t length;
+	uint16_t segments;
+	uint16_t base;      // next segment expected in order.
+	uint16_t received;  // bit i set if segment base + 1 + i was received.
+	uint8_t since_ack;  // segments received since the last ACK.
+	uint8_t state;
+	uint8_t xfer_id;
+	uint8_t tag;
+	NodeID sender;
+	uint64_t deadline;  // when to give up (or, once done, forget) the transfer.
+} CANTransportRx;
+
+typedef struct CANTransport
+{
+	CANTransport_InitTypeDef init_struct;
+	CANWrapper_Handle *hcw;
+	CANTransportTx tx[CAN_TRANSPORT_MAX_TX];
+	CANTransportRx rx[CAN_TRANSPORT_MAX_RX];
+	uint8_t next_xfer_id;
+} CANTransport;
+
+/**
+ * @brief               Attaches a transport to an initialised wrapper instance.
+ *
+ * @param tp            The transport. Must stay at the same address while attached.
+ * @param hcw           The wrapper instance. See CANWrapper_Get_Default_Handle.
+ * @param init_struct   Configuration for initialisation.
+ */
+CANWrapper_StatusTypeDef CANTransport_Init(CANTransport *tp, CANWrapper_Handle *hcw, CANTransport_InitTypeDef init_struct);
+
+/**
+ * @brief               Starts sending a buffer to another node.
+ *
+ * The buffer is read as segments are sent, so it must not change until
+ * send_callback is called.
+ *
+ * May be called from any task. The transfer is then carried on, and
+ * send_callback called, by the task that polls the wrapper.
+ *
+ * @param tp            The transport.
+ * @param recipient     ID of the intended recipient. Must not be the broadcast ID.
+ * @param tag           Application-defined. Passed to the recipient's callbacks.
+ * @param buffer        The payload.
+ * @param length        Payload size in bytes. At most CAN_TRANSPORT_MAX_LENGTH.
+ * @return              CAN_WRAPPER_NO_FREE_TRANSFER if CAN_TRANSPORT_MAX_TX
+ *                      transfers are already in progress.
+ *                      CAN_WRAPPER_NOT_INITIALISED if the wrapper isn't.
+ */
+CANWrapper_StatusTypeDef CANTransport_Send(CANTransport *tp, NodeID recipient, uint8_t tag, const uint8_t *buffer, uint16_t length);
+
+/**
+ * @brief               Returns true if the command belongs to the transport.
+ */
+bool CANTransport_Is_Transport_Cmd(uint8_t cmd);
+
+/**
+ * @brief               Handles a received SEGMENT_* message.
+ *
+ * Messages addressed to another node are ignored.
+ * Called by CANWrapper_Poll_Messages.
+ */
+void CANTransport_Process_Message(CANTransport *tp, const CANMessage *msg, NodeID sender, NodeID recipient);
+
+/**
+ * @brief               Sends queued segments and handles timeouts.
+ *
+ * Called by CANWrapper_Poll_Messages.
+ */
+void CANTransport_Update(CANTransport *tp);
+
+/**
+ * @brief               Returns the tick of the next timeout, or UINT64_MAX
+ *                      if no transfer is in progress.
+ */
+uint64_t CANTransport_Next_Deadline(const CANTransport *tp);
+
+#endif /* CAN_WRAPPER_MODULE_INC_CAN_TRANSPORT_H_ */
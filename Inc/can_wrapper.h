@@ -12,13 +12,62 @@
 #define CAN_WRAPPER_MODULE_INC_CAN_WRAPPER_H_
 
 #include "can_command_list.h"
+#include "can_command_codec.h"
 #include "can_message.h"
+#include "can_queue.h"
+#include "tx_cache.h"
+#include "tx_queue.h"
+#include "timing_wheel.h"
+#include "ack_list.h"
+#include "can_stats.h"
+#include "can_os.h"
 #include <stdbool.h>
+#include <stdint.h>
+
+// define CAN_WRAPPER_HAL_HEADER (e.g. -DCAN_WRAPPER_HAL_HEADER='"fake_hal.h"')
+// to build against something other than the STM32L4 HAL, such as a host-side
+// stand-in. See README.md for what it has to provide.
+#ifdef CAN_WRAPPER_HAL_HEADER
+#include CAN_WRAPPER_HAL_HEADER
+#else
 #include <stm32l4xx.h>
 #include <stm32l4xx_hal_can.h>
 #include <stm32l4xx_hal_tim.h>
 #include <stm32l4xx_hal_def.h>
-#include <sys/_stdint.h>
+#endif
+
+#define CAN_WRAPPER_MAX_INSTANCES 4 // e.g. CAN1 and CAN2, or several simulated nodes.
+
+#define CAN_WRAPPER_TICKS_PER_MS 1000 // TIM16 runs at 1MHz.
+
+#define CAN_WRAPPER_ERROR_QUEUE_SIZE 8 // errors reported per call to CANWrapper_Poll_Messages.
+
+#define CAN_WRAPPER_DEFAULT_REJOIN_DELAY_MS     10   // used if rejoin_delay_ms is 0.
+#define CAN_WRAPPER_DEFAULT_MAX_REJOIN_DELAY_MS 1000 // used if max_rejoin_delay_ms is 0.
+
+// after a protocol error (stuff, form, CRC...), the error interrupt ignores
+// further ones for this long, so a noisy bus can't hold the CPU in the ISR.
+#define CAN_WRAPPER_LEC_REARM_MS 10
+
+#define CAN_WRAPPER_EXT_BROADCAST_ID 31 // broadcast_id by convention when using extended_ids.
+
+// received sequence numbers are remembered for this many messages per sender
+// (at most 64, one bit each, and at most 16 with extended_ids). senders give
+// up on a message rather than retry it once it falls out of the window. the
+// numbers are forgotten if the sender is silent for longer than the expiry
+// (e.g. because it restarted).
+#define CAN_WRAPPER_DUPLICATE_WINDOW    64
+#define CAN_WRAPPER_DUPLICATE_EXPIRY_MS 1000
+
+#define CAN_WRAPPER_MAX_REQUESTS    64 // requests awaiting a reply at once. see CANWrapper_Request.
+#define CAN_WRAPPER_REQUEST_BUCKETS 32 // must be a power of two.
+
+_Static_assert(CAN_WRAPPER_MAX_REQUESTS <= 127, "request indices are stored in an int8_t");
+_Static_assert((CAN_WRAPPER_REQUEST_BUCKETS & (CAN_WRAPPER_REQUEST_BUCKETS - 1)) == 0, "CAN_WRAPPER_REQUEST_BUCKETS must be a power of two");
+
+struct CANTransport;
+struct CANCapture;
+struct CANTelemetry;
 
 typedef enum
 {
@@ -32,14 +81,24 @@ typedef enum
 	CAN_WRAPPER_FAILED_TO_START_CAN,
 	CAN_WRAPPER_FAILED_TO_ENABLE_INTERRUPT,
 	CAN_WRAPPER_FAILED_TO_START_TIMER,
+	CAN_WRAPPER_TX_QUEUE_FULL,
+	CAN_WRAPPER_NO_FREE_FILTER,
+	CAN_WRAPPER_NO_FREE_INSTANCE,
+	CAN_WRAPPER_NO_FREE_TRANSFER,
+	CAN_WRAPPER_NO_FREE_REQUEST,
+	CAN_WRAPPER_NO_FREE_PRODUCER,
 } CANWrapper_StatusTypeDef;
 
 typedef struct
 {
 	enum
 	{
-		CAN_WRAPPER_ERROR_TIMEOUT = 0,
-		CAN_WRAPPER_ERROR_CAN_TIMEOUT,
+		CAN_WRAPPER_ERROR_TIMEOUT = 0,   // a message wasn't ACK'd. msg and recipient are set.
+		CAN_WRAPPER_ERROR_CAN_TIMEOUT,   // no node acknowledged our frame on the bus (are we alone on it?).
+		CAN_WRAPPER_ERROR_BUS_WARNING,   // an error counter reached 96.
+		CAN_WRAPPER_ERROR_BUS_PASSIVE,   // an error counter reached 128.
+		CAN_WRAPPER_ERROR_BUS_OFF,       // we left the bus. TX is paused until we rejoin.
+		CAN_WRAPPER_ERROR_BUS_RECOVERED, // back to error active, e.g. after rejoining.
 	} error;
 	union
 	{
@@ -47,25 +106,131 @@ typedef struct
 			CANMessage msg;
 			NodeID recipient;
 		};
-		// TODO: more error information.
+		struct {
+			uint8_t tec; // transmit error counter when the error was raised. set for CAN_TIMEOUT and BUS_*.
+			uint8_t rec; // receive error counter.
+		};
 	};
 } CANWrapper_ErrorInfo;
 
+typedef enum
+{
+	CAN_WRAPPER_BUS_ACTIVE = 0, // error active. normal operation.
+	CAN_WRAPPER_BUS_WARNING,    // an error counter reached 96.
+	CAN_WRAPPER_BUS_PASSIVE,    // an error counter reached 128.
+	CAN_WRAPPER_BUS_OFF,        // waiting to rejoin. TX is paused.
+	CAN_WRAPPER_BUS_REJOINING,  // restarted, waiting on the bus to be idle. TX is paused.
+} CANWrapper_BusState;
+
+typedef struct
+{
+	NodeID sender;     // who sent the message.
+	uint8_t priority;  // priority field of the CAN identifier.
+	bool is_ack;       // true if the message is ours, and this notifies you that it was ACK'd.
+} CANMessageInfo;
+
 typedef void (*CANMessageCallback)(CANMessage, NodeID, bool);
 typedef void (*CANErrorCallback)(CANWrapper_ErrorInfo);
+typedef void (*CANMessageHandler)(const CANMessage *msg, const CANMessageInfo *info, void *ctx);
+typedef void (*CANReplyCallback)(const CANMessage *reply, NodeID sender, void *ctx); // reply is NULL on timeout.
 
 typedef struct
 {
 	NodeID node_id;           // your subsystem's unique ID in the CAN network.
 	bool notify_of_acks;      // whether to notify you of incoming ACK's.
 
+	bool accept_broadcast;    // whether to also receive messages sent to broadcast_id.
+	NodeID broadcast_id;      // recipient ID shared by every node. never ACK'd.
+
+	bool sequence_numbers;    // whether to number ACK'd messages, so the recipient can drop retransmitted duplicates.
+
+	bool extended_ids;        // use 29-bit identifiers. allows node ID's up to 31, and always numbers ACK'd messages.
+
+	uint16_t rejoin_delay_ms;     // time after a bus-off before rejoining. doubles with each bus-off in a row. 0 uses the default.
+	uint16_t max_rejoin_delay_ms; // limit of the doubling. 0 uses the default.
+
 	CAN_HandleTypeDef *hcan;  // pointer to the CAN peripheral handle.
 	TIM_HandleTypeDef *htim;  // pointer to the timer handle.
 
-	CANMessageCallback message_callback; // called when a new message is polled.
+	CANMessageCallback message_callback; // called for messages with no registered handler. may be NULL.
 	CANErrorCallback error_callback;     // called when an error occurs.
 } CANWrapper_InitTypeDef;
 
+/**
+ * State of one wrapper instance. Each instance drives one CAN peripheral.
+ *
+ * Treat the members as private. The handle must stay at the same address
+ * from CANWrapperEx_Init onwards, since the HAL callbacks find it by pointer.
+ */
+typedef struct
+{
+	CANWrapper_InitTypeDef init_struct;
+
+	CANQueue msg_queue;    // bulk messages received through FIFO0.
+	CANQueue urgent_queue; // ACK's and urgent messages received through FIFO1.
+
+	TxCache tx_cache;      // messages waiting on an ACK.
+	TxQueue tx_queue;      // frames waiting on a free TX mailbox.
+	AckList pending_acks;  // ACK's recorded by the RX interrupts.
+
+	uint32_t next_seq[CAN_WRAPPER_MAX_NODES]; // numbered messages sent, per recipient. the low bits are the sequence number.
+	struct
+	{
+		uint64_t last_tick; // when the newest sequence number was received.
+		uint64_t window;    // bit i set if sequence number newest - i was received.
+		uint8_t newest;
+		bool valid;
+	} rx_seq[CAN_WRAPPER_MAX_NODES];   // indexed by sender.
+
+	TimingWheelNode timeout_nodes[TX_CACHE_SIZE]; // one per TX cache slot.
+	TimingWheel timeouts;  // ACK timeouts and retry backoffs.
+	uint32_t rng_state;    // for backoff jitter.
+
+	CANWrapper_ErrorInfo errors[CAN_WRAPPER_ERROR_QUEUE_SIZE]; // waiting to be passed to error_callback.
+	uint8_t error_count;
+	volatile uint32_t tick_overflows;
+
+	volatile uint8_t bus_state; // CANWrapper_BusState.
+	uint64_t rejoin_tick;       // when to rejoin after a bus-off.
+	uint8_t bus_offs;           // bus-offs since a frame was last sent.
+	bool ack_error_raised;      // CAN_TIMEOUT was raised since a frame was last sent.
+	volatile bool lec_masked;   // the last error code interrupt is off until lec_rearm_tick.
+	uint64_t lec_rearm_tick;
+
+	struct
+	{
+		CANMessageHandler handler;
+		void *ctx;
+	} handlers[CMD_ID_COUNT];          // indexed by command ID.
+
+	struct
+	{
+		CANReplyCallback on_reply; // NULL if the slot is free.
+		void *ctx;
+		NodeID recipient;
+		uint8_t reply_cmd;
+		int8_t next;               // next request in the same bucket (oldest first), or the next free slot.
+		uint16_t generation;       // counts the times the slot was taken, to tell a request from a later one in the same slot.
+	} requests[CAN_WRAPPER_MAX_REQUESTS];
+	int8_t request_buckets[CAN_WRAPPER_REQUEST_BUCKETS]; // requests by hash of (recipient, reply_cmd). -1 if none.
+	int8_t free_request;                                 // first free slot. -1 if none.
+	TimingWheelNode request_timeout_nodes[CAN_WRAPPER_MAX_REQUESTS];
+	TimingWheel request_timeouts;
+
+	CANWrapper_Stats stats;
+
+	uint32_t next_filter_bank;
+	struct CANTransport *transport; // see can_transport.h. may be NULL.
+	struct CANCapture *capture;     // see can_capture.h. may be NULL.
+	struct CANTelemetry *telemetry; // see can_telemetry.h. may be NULL.
+
+	uint64_t wake_tick;             // when a task in Wait_And_Process will wake. UINT64_MAX if none is waiting.
+#ifdef CAN_WRAPPER_OS
+	CANOSEvent work_event;          // signalled when there is work for the poll.
+#endif
+	bool init;
+} CANWrapper_Handle;
+
 /**
  * @brief				Performs necessary setup for normal functioning.
  *
@@ -80,12 +245,268 @@ CANWrapper_StatusTypeDef CANWrapper_Init(CANWrapper_InitTypeDef init_struct);
  */
 CANWrapper_StatusTypeDef CANWrapper_Poll_Messages();
 
+#ifdef CAN_WRAPPER_OS
+/**
+ * @brief               Sleeps until there is work, then polls.
+ *
+ * Wakes when a frame is received, a bus error is raised or the next ACK
+ * timeout (or other deadline) is due, whichever comes first. Only one task
+ * may wait on an instance. Needs an OS port, see can_os.h.
+ *
+ * e.g. the body of a dedicated CAN task:
+ *   while (1) CANWrapper_Wait_And_Process(CAN_OS_WAIT_FOREVER);
+ *
+ * @param timeout_ms    Longest to sleep. CAN_OS_WAIT_FOREVER for no limit.
+ */
+CANWrapper_StatusTypeDef CANWrapper_Wait_And_Process(uint32_t timeout_ms);
+#endif
+
+/**
+ * @brief               Adds a hardware filter for extra identifiers.
+ *
+ * By default only messages addressed to this node (or to the broadcast ID)
+ * pass the hardware filters. Use this to receive other traffic, for example
+ * on a logging node. Messages that pass only because of these filters are
+ * delivered to message_callback but are never ACK'd.
+ *
+ * A frame passes if (frame ID & mask) == (id & mask). The filter matches
+ * extended identifiers if extended_ids is set, and standard ones otherwise.
+ *
+ * @param id            11-bit (or 29-bit) identifier to match.
+ * @param mask          11-bit (or 29-bit) mask of the identifier bits that must match.
+ */
+CANWrapper_StatusTypeDef CANWrapper_Add_Filter(uint32_t id, uint32_t mask);
+
+/**
+ * @brief               Returns the number of times an RX FIFO overflowed.
+ *
+ * FIFO0 receives bulk messages. FIFO1 receives ACK's and urgent messages
+ * (priority below 32).
+ *
+ * @param rx_fifo       CAN_RX_FIFO0 or CAN_RX_FIFO1.
+ */
+uint32_t CANWrapper_Get_FIFO_Overruns(uint32_t rx_fifo);
+
 /**
- * @brief               Sends a message over CAN.
+ * @brief               Queues a message for transmission over CAN.
+ *
+ * Never blocks. The message is placed in a priority-ordered software queue
+ * that is drained into the TX mailboxes from the TX complete interrupt.
  *
  * @param recipient     ID of the intended recipient.
  * @param msg           See CANMessage definition.
+ * @return              CAN_WRAPPER_HAL_OK if queued.
+ *                      CAN_WRAPPER_TX_QUEUE_FULL if the queue has no room.
  */
 CANWrapper_StatusTypeDef CANWrapper_Transmit(NodeID recipient, CANMessage *msg);
 
+/**
+ * @brief               Sends a message and waits, without blocking, for the
+ *                      recipient's reply.
+ *
+ * The first message with command reply_cmd from the recipient, addressed to
+ * this node, completes the request. It goes to on_reply instead of its handler or message_callback.
+ * Several requests may be outstanding at once, even to the same node for the
+ * same reply, in which case replies complete them in the order they were made.
+ *
+ * e.g. CDH reading the power board's temperature:
+ *   CANMessage msg = { .cmd = CMD_COMMON_GET_PCB_TEMP };
+ *   CANWrapper_Request(NODE_POWER, &msg, CMD_CDH_PROCESS_PCB_TEMP, on_temp, NULL, 100);
+ *
+ * @param recipient     ID of the node to ask. Not the broadcast ID, since
+ *                      several nodes would reply.
+ * @param msg           The request. See CANWrapper_Transmit.
+ * @param reply_cmd     The command ID the recipient replies with.
+ * @param on_reply      Called from CANWrapper_Poll_Messages with the reply, or
+ *                      with NULL if none arrived within timeout_ms. Called
+ *                      exactly once per request, unless this returns an error.
+ * @param ctx           Passed to on_reply as is.
+ * @param timeout_ms    How long to wait for the reply. Must not be 0.
+ * @return              CAN_WRAPPER_HAL_OK if sent.
+ *                      CAN_WRAPPER_NO_FREE_REQUEST if CAN_WRAPPER_MAX_REQUESTS
+ *                      requests are already outstanding.
+ *                      Otherwise, see CANWrapper_Transmit.
+ */
+CANWrapper_StatusTypeDef CANWrapper_Request(NodeID recipient, CANMessage *msg, CmdID reply_cmd,
+		CANReplyCallback on_reply, void *ctx, uint32_t timeout_ms);
+
+/**
+ * @brief               Extends the wrapper's timer to 64 bits.
+ *
+ * Must be called from the timer's interrupt handler (e.g.
+ * TIM1_UP_TIM16_IRQHandler), before HAL_TIM_IRQHandler. It counts the
+ * update event and clears its flag, so HAL_TIM_PeriodElapsedCallback is no
+ * longer called for this timer.
+ *
+ * @param htim          The wrapper's timer.
+ */
+void CANWrapper_TIM_IRQHandler(TIM_HandleTypeDef *htim);
+
+/**
+ * @brief               Registers a handler for one command.
+ *
+ * Received messages with this command ID, and ACK notifications for our own
+ * messages with it (see notify_of_acks), go to the handler instead of
+ * message_callback. Registering again replaces the handler.
+ * Handlers are cleared by CANWrapper_Init, so register them afterwards.
+ *
+ * @param cmd           The command ID.
+ * @param handler       Called from CANWrapper_Poll_Messages. NULL removes the handler.
+ * @param ctx           Passed to the handler as is.
+ */
+CANWrapper_StatusTypeDef CANWrapper_Register_Handler(CmdID cmd, CANMessageHandler handler, void *ctx);
+
+/**
+ * @brief               Registers a handler for every command from first to last (inclusive).
+ *
+ * Useful for handling a whole block of can_command_list.h (e.g. all of
+ * CMD_PLD_*) in one place. See CANWrapper_Register_Handler.
+ */
+CANWrapper_StatusTypeDef CANWrapper_Register_Handler_Range(CmdID first, CmdID last, CANMessageHandler handler, void *ctx);
+
+/**
+ * @brief               Returns the number of messages received with no registered handler.
+ *
+ * These are passed to message_callback, if there is one.
+ */
+uint32_t CANWrapper_Get_Unhandled_Count();
+
+/**
+ * @brief               Returns the number of retransmitted messages that were
+ *                      ACK'd again but not passed on, since they had already
+ *                      been received.
+ *
+ * Only messages sent by nodes with sequence_numbers enabled can be detected.
+ */
+uint32_t CANWrapper_Get_Duplicate_Count();
+
+/**
+ * @brief               Copies the instance's statistics.
+ *
+ * The copy isn't atomic: counters bumped by interrupts while it is taken
+ * may or may not be included.
+ *
+ * @param out_stats     Output location for the statistics.
+ */
+void CANWrapper_Get_Stats(CANWrapper_Stats *out_stats);
+
+/**
+ * @brief               Zeroes the statistics.
+ */
+void CANWrapper_Reset_Stats();
+
+/**
+ * @brief               Returns the state of the CAN controller on the bus.
+ *
+ * After a bus-off, the wrapper waits rejoin_delay_ms, restarts the controller,
+ * and resumes sending once the controller is back on the bus. Frames queued
+ * in the meantime are kept.
+ */
+CANWrapper_BusState CANWrapper_Get_Bus_State();
+
+/**
+ * @brief               Returns the time since initialisation in timer ticks.
+ *
+ * See CAN_WRAPPER_TICKS_PER_MS.
+ */
+uint64_t CANWrapper_Get_Tick();
+
+/**
+ * @brief               Returns the instance used by the CANWrapper_* functions.
+ */
+CANWrapper_Handle *CANWrapper_Get_Default_Handle();
+
+/*
+ * The functions above act on a default instance. The CANWrapperEx_* functions
+ * below do the same on an instance of your own, so that one MCU can drive
+ * more than one CAN peripheral (e.g. CAN1 and CAN2) at once.
+ * Each instance must use a different CAN peripheral. They may share a timer.
+ */
+
+/**
+ * @brief               Initialises the given instance. See CANWrapper_Init.
+ *
+ * @param hcw           The instance. Must outlive its use of the CAN peripheral.
+ * @param init_struct   Configuration for initialisation.
+ * @return              CAN_WRAPPER_NO_FREE_INSTANCE if CAN_WRAPPER_MAX_INSTANCES
+ *                      instances already exist, or another instance uses the
+ *                      same CAN peripheral. After any failure the instance
+ *                      holds no slot and its CAN peripheral is stopped, so
+ *                      Init can be retried.
+ */
+CANWrapper_StatusTypeDef CANWrapperEx_Init(CANWrapper_Handle *hcw, CANWrapper_InitTypeDef init_struct);
+
+/**
+ * @brief               See CANWrapper_Poll_Messages.
+ */
+CANWrapper_StatusTypeDef CANWrapperEx_Poll_Messages(CANWrapper_Handle *hcw);
+
+#ifdef CAN_WRAPPER_OS
+/**
+ * @brief               See CANWrapper_Wait_And_Process.
+ */
+CANWrapper_StatusTypeDef CANWrapperEx_Wait_And_Process(CANWrapper_Handle *hcw, uint32_t timeout_ms);
+#endif
+
+/**
+ * @brief               See CANWrapper_Add_Filter.
+ */
+CANWrapper_StatusTypeDef CANWrapperEx_Add_Filter(CANWrapper_Handle *hcw, uint32_t id, uint32_t mask);
+
+/**
+ * @brief               See CANWrapper_Get_FIFO_Overruns.
+ */
+uint32_t CANWrapperEx_Get_FIFO_Overruns(const CANWrapper_Handle *hcw, uint32_t rx_fifo);
+
+/**
+ * @brief               See CANWrapper_Transmit.
+ */
+CANWrapper_StatusTypeDef CANWrapperEx_Transmit(CANWrapper_Handle *hcw, NodeID recipient, CANMessage *msg);
+
+/**
+ * @brief               See CANWrapper_Request.
+ */
+CANWrapper_StatusTypeDef CANWrapperEx_Request(CANWrapper_Handle *hcw, NodeID recipient, CANMessage *msg, CmdID reply_cmd,
+		CANReplyCallback on_reply, void *ctx, uint32_t timeout_ms);
+
+/**
+ * @brief               See CANWrapper_Register_Handler.
+ */
+CANWrapper_StatusTypeDef CANWrapperEx_Register_Handler(CANWrapper_Handle *hcw, CmdID cmd, CANMessageHandler handler, void *ctx);
+
+/**
+ * @brief               See CANWrapper_Register_Handler_Range.
+ */
+CANWrapper_StatusTypeDef CANWrapperEx_Register_Handler_Range(CANWrapper_Handle *hcw, CmdID first, CmdID last, CANMessageHandler handler, void *ctx);
+
+/**
+ * @brief               See CANWrapper_Get_Unhandled_Count.
+ */
+uint32_t CANWrapperEx_Get_Unhandled_Count(const CANWrapper_Handle *hcw);
+
+/**
+ * @brief               See CANWrapper_Get_Duplicate_Count.
+ */
+uint32_t CANWrapperEx_Get_Duplicate_Count(const CANWrapper_Handle *hcw);
+
+/**
+ * @brief               See CANWrapper_Get_Stats.
+ */
+void CANWrapperEx_Get_Stats(const CANWrapper_Handle *hcw, CANWrapper_Stats *out_stats);
+
+/**
+ * @brief               See CANWrapper_Reset_Stats.
+ */
+void CANWrapperEx_Reset_Stats(CANWrapper_Handle *hcw);
+
+/**
+ * @brief               See CANWrapper_Get_Bus_State.
+ */
+CANWrapper_BusState CANWrapperEx_Get_Bus_State(const CANWrapper_Handle *hcw);
+
+/**
+ * @brief               See CANWrapper_Get_Tick.
+ */
+uint64_t CANWrapperEx_Get_Tick(CANWrapper_Handle *hcw);
+
 #endif /* CAN_WRAPPER_MODULE_INC_CAN_WRAPPER_H_ */
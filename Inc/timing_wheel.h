@@ -0,0 +1,92 @@
+/**
+ * @file timing_wheel.h
+ * Hierarchical timing wheel for scheduling timeouts.
+ *
+ * Entries are identified by an index into a caller-provided node array, so
+ * the wheel can sit alongside any slot-based store (e.g. TxCache).
+ * Scheduling and cancelling are O(1). Advancing costs O(1) per elapsed
+ * granule plus O(1) per expired entry.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date March 24, 2024
+ */
+
+#ifndef CAN_WRAPPER_MODULE_INC_TIMING_WHEEL_H_
+#define CAN_WRAPPER_MODULE_INC_TIMING_WHEEL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TIMING_WHEEL_RESOLUTION_BITS 10 // 1 granule = 1024 ticks.
+#define TIMING_WHEEL_SLOT_BITS 6        // 64 slots per level.
+#define TIMING_WHEEL_LEVELS 3           // range of 2^18 granules.
+
+#define TIMING_WHEEL_NONE (-1)
+
+typedef struct
+{
+	uint64_t expiry;     // tick at which the entry is due.
+	int16_t next, prev;
+	int8_t level;        // -1 when in the expired list.
+	uint8_t slot;
+	bool scheduled;
+} TimingWheelNode;
+
+typedef struct
+{
+	TimingWheelNode *nodes;
+	size_t capacity;
+	uint64_t current;    // last granule the wheel was advanced to.
+	size_t count;        // number of scheduled entries (including expired).
+	int16_t expired;     // entries that are due, waiting to be popped.
+	int16_t slots[TIMING_WHEEL_LEVELS][1 << TIMING_WHEEL_SLOT_BITS];
+} TimingWheel;
+
+/**
+ * @brief               Creates an empty timing wheel.
+ *
+ * @param nodes         Storage for one node per schedulable index.
+ * @param capacity      The number of nodes.
+ * @param now           The current tick.
+ */
+TimingWheel TimingWheel_Create(TimingWheelNode *nodes, size_t capacity, uint64_t now);
+
+/**
+ * @brief               Schedules (or reschedules) an entry.
+ *
+ * @param tw            The timing wheel.
+ * @param index         Index of the entry in the node array.
+ * @param expiry        Tick at which the entry becomes due.
+ * @return              true on success. false if index is out of range.
+ */
+bool TimingWheel_Schedule(TimingWheel *tw, int index, uint64_t expiry);
+
+/**
+ * @brief               Removes an entry from the wheel if it is scheduled.
+ */
+void TimingWheel_Cancel(TimingWheel *tw, int index);
+
+/**
+ * @brief               Moves every entry due at or before now to the expired list.
+ */
+void TimingWheel_Advance(TimingWheel *tw, uint64_t now);
+
+/**
+ * @brief               Removes and returns one expired entry.
+ *
+ * @return              The index of the entry. TIMING_WHEEL_NONE if none are due.
+ */
+int TimingWheel_Pop_Expired(TimingWheel *tw);
+
+/**
+ * @brief               Returns the tick at which TimingWheel_Advance will
+ *                      next expire an entry.
+ *
+ * @return              0 if entries are already waiting to be popped.
+ *                      UINT64_MAX if nothing is scheduled.
+ */
+uint64_t TimingWheel_Next_Expiry(const TimingWheel *tw);
+
+#endif /* CAN_WRAPPER_MODULE_INC_TIMING_WHEEL_H_ */
@@ -1,7 +1,10 @@
 /**
  * @file tx_cache.h
- * List ADT that caches transmitted CAN messages.
- * Implemented using circular buffer.
+ * Table ADT that caches transmitted CAN messages until they are ACK'd.
+ * Implemented using a fixed slot pool indexed by a chained hash table.
+ *
+ * Slots never move once inserted, so the index returned by
+ * TxCache_Push_Back stays valid until that slot is erased.
  *
  * @author Logan Furedi <logan.furedi@umsats.ca>
  *
@@ -18,35 +21,115 @@
 #include <stddef.h>
 
 #define TX_CACHE_SIZE 100
+#define TX_CACHE_BUCKET_BITS 7 // 128 buckets.
+
+#define TX_CACHE_NONE (-1)
+
+// numbered entries are indexed by the low bits of their sequence number,
+// which every identifier layout carries in full.
+#define TX_CACHE_SEQ_KEY_MASK 0x1F
 
 typedef struct
 {
-	struct
-	{
-		uint32_t counter_value;
-		uint32_t rcr_value;
-	} timestamp;
+	uint64_t timestamp;  // tick at which the message was last queued.
 	CachedCANMessage msg;
+	uint32_t id;         // CAN identifier the message is sent with.
+	uint32_t seq;        // sequence counter, if numbered. the low bits are sent.
+	bool numbered;       // whether the message carries a sequence number.
+	uint8_t attempts;    // transmissions so far, including the first.
+	bool awaiting_retry; // true while backing off before the next attempt.
 } TxCacheItem;
 
+typedef struct
+{
+	TxCacheItem item;
+	uint32_t hash;         // CANMessage_Hash of the cached message.
+	uint8_t key;           // indexed by. low bits of seq if numbered, else of hash.
+	int16_t next, prev;    // bucket chain. next also links the free list.
+	int16_t newer, older;  // insertion order, used to find the oldest entry.
+	bool in_use;
+} TxCacheSlot;
+
 typedef struct
 {
 	size_t size;
-    uint32_t head;
-    uint32_t tail;
-    TxCacheItem items[TX_CACHE_SIZE];
+	int16_t free_head;
+	int16_t oldest;
+	int16_t newest;
+	int16_t buckets[1 << TX_CACHE_BUCKET_BITS];
+	TxCacheSlot slots[TX_CACHE_SIZE];
 } TxCache;
 
+/**
+ * @brief               Creates an empty TX cache.
+ */
 TxCache TxCache_Create();
 
+/**
+ * @brief               Returns true if the given cache is full.
+ */
 bool TxCache_IsFull(const TxCache* txc);
 
-bool TxCache_Push_Back(TxCache *txc, TxCacheItem *item);
+/**
+ * @brief               Inserts a message into the cache in O(1).
+ *
+ * @param txc           The TX cache.
+ * @param item          The item to insert.
+ * @return              The slot index of the new entry.
+ *                      TX_CACHE_NONE if the cache is full.
+ */
+int TxCache_Push_Back(TxCache *txc, const TxCacheItem *item);
+
+/**
+ * @brief               Finds the unnumbered cached message that an ACK entry answers.
+ *
+ * Runs in O(1) on average. If several cached messages match, the oldest
+ * one is returned.
+ *
+ * @param txc           The TX cache.
+ * @param recipient     The node that sent the ACK.
+ * @param cmd           The command ID being ACK'd.
+ * @param hash          The low byte of CANMessage_Hash of the ACK'd message.
+ * @return              The slot index of the match. TX_CACHE_NONE if no match.
+ */
+int TxCache_Find(const TxCache *txc, uint8_t recipient, uint8_t cmd, uint8_t hash);
+
+/**
+ * @brief               Finds the numbered cached message that an ACK entry answers.
+ *
+ * Runs in O(1) on average. Unlike a hash, the sequence number tells apart
+ * messages with the same command and body. If several cached messages
+ * match, the oldest one is returned.
+ *
+ * @param txc           The TX cache.
+ * @param recipient     The node that sent the ACK.
+ * @param cmd           The command ID being ACK'd.
+ * @param seq           The sequence number the ACK'd message was sent with.
+ * @param seq_mask      The bits of the sequence number that are sent.
+ *                      Must include TX_CACHE_SEQ_KEY_MASK.
+ * @return              The slot index of the match. TX_CACHE_NONE if no match.
+ */
+int TxCache_Find_Seq(const TxCache *txc, uint8_t recipient, uint8_t cmd, uint8_t seq, uint8_t seq_mask);
 
-int TxCache_Find(const TxCache *txc, const CachedCANMessage *ack);
+/**
+ * @brief               Removes the entry in the given slot in O(1).
+ *
+ * @return              true on success. false if the slot is not in use.
+ */
+bool TxCache_Erase(TxCache *txc, int slot);
 
-bool TxCache_Erase(TxCache *txc, int index);
+/**
+ * @brief               Returns the entry in the given slot.
+ *
+ * @return              NULL if the slot is not in use.
+ */
+TxCacheItem *TxCache_At(TxCache *txc, int slot);
 
-const TxCacheItem *TxCache_At(const TxCache *txc, int index);
+/**
+ * @brief               Returns the slot index of the oldest entry.
+ *
+ * @return              TX_CACHE_NONE if the cache is empty.
+ */
+int TxCache_Front(const TxCache *txc);
 
 #endif /* CAN_WRAPPER_MODULE_INC_TX_CACHE_H_ */
@@ -0,0 +1,95 @@
+/**
+ * @file tx_queue.h
+ * Priority queue ADT for CAN frames waiting on a free TX mailbox.
+ * Implemented using binary heap.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date March 22, 2024
+ */
+
+#ifndef CAN_WRAPPER_MODULE_INC_TX_QUEUE_H_
+#define CAN_WRAPPER_MODULE_INC_TX_QUEUE_H_
+
+#include "can_message.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TX_QUEUE_SIZE 32
+
+typedef struct
+{
+	uint32_t id;  // CAN identifier. lower values win arbitration.
+	uint8_t dlc;  // number of bytes in data.
+	CANMessage msg;
+} TxQueueItem;
+
+typedef struct
+{
+	size_t size;
+	uint32_t next_order; // insertion counter. keeps equal ID's in FIFO order.
+	struct
+	{
+		uint32_t order;
+		TxQueueItem frame;
+	} items[TX_QUEUE_SIZE];
+} TxQueue;
+
+/**
+ * @brief               Creates an empty TX queue.
+ */
+TxQueue TxQueue_Create();
+
+/**
+ * @brief               Returns true if the given queue is empty.
+ */
+bool TxQueue_IsEmpty(const TxQueue *txq);
+
+/**
+ * @brief               Returns true if the given queue is full.
+ */
+bool TxQueue_IsFull(const TxQueue *txq);
+
+/**
+ * @brief               Inserts a frame into the queue.
+ *
+ * Frames leave the queue lowest ID first. Frames with equal ID's leave in the
+ * order they were pushed.
+ *
+ * @param txq           The TX queue.
+ * @param frame         The frame to insert.
+ * @return              true on success. false if the queue is full.
+ */
+bool TxQueue_Push(TxQueue *txq, const TxQueueItem *frame);
+
+/**
+ * @brief               Overwrites the data of a queued frame for the same command.
+ *
+ * A frame matches if it has the same ID and command ID. The match keeps its
+ * place in the queue.
+ *
+ * @param txq           The TX queue.
+ * @param frame         The new frame.
+ * @return              true if a frame was replaced. false if none matched.
+ */
+bool TxQueue_Replace(TxQueue *txq, const TxQueueItem *frame);
+
+/**
+ * @brief               Returns the most urgent frame without removing it.
+ *
+ * @return              NULL if the queue is empty.
+ */
+const TxQueueItem *TxQueue_Peek(const TxQueue *txq);
+
+/**
+ * @brief               Removes the most urgent frame from the queue.
+ *
+ * @param txq           The TX queue.
+ * @param out_frame     The output location for the frame. May be NULL.
+ * @return              true on success. false if the queue is empty.
+ */
+bool TxQueue_Pop(TxQueue *txq, TxQueueItem *out_frame);
+
+#endif /* CAN_WRAPPER_MODULE_INC_TX_QUEUE_H_ */
@@ -0,0 +1,45 @@
+/**
+ * @file ack_list.c
+ * List ADT of received messages that still need to be ACK'd.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date March 27, 2024
+ */
+
+#include "ack_list.h"
+#include <string.h>
+
+AckList AckList_Create()
+{
+	AckList list;
+
+	list.size = 0;
+
+	return list;
+}
+
+bool AckList_IsFull(const AckList *list)
+{
+	return list->size == ACK_LIST_SIZE;
+}
+
+bool AckList_Push(AckList *list, const PendingAck *ack)
+{
+	if (AckList_IsFull(list))
+		return false;
+
+	list->items[list->size++] = *ack;
+
+	return true;
+}
+
+size_t AckList_Take_All(AckList *list, PendingAck *out_acks)
+{
+	size_t count = list->size;
+
+	memcpy(out_acks, list->items, count * sizeof(PendingAck));
+	list->size = 0;
+
+	return count;
+}
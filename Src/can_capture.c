@@ -0,0 +1,167 @@
+/**
+ * @file can_capture.c
+ * Capture of the raw frames a wrapper instance sends and receives.
+ *
+ * The ring is a bounded multi-producer/single-consumer queue. A producer
+ * claims a slot by advancing tail with compare-and-swap, then publishes it
+ * by setting the slot's sequence number. The consumer reads slots in order
+ * and hands them back by advancing their sequence number a full pass.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 12, 2024
+ */
+
+#include "can_capture.h"
+#include <string.h>
+
+/**
+ * @brief Moves published records from the ring into the block.
+ *
+ * @return true if the block is full.
+ */
+static bool fill_block(CANCapture *cap);
+
+/**
+ * @brief Passes the block to the sink.
+ *
+ * @return false if the sink refused it.
+ */
+static bool send_block(CANCapture *cap);
+
+CANWrapper_StatusTypeDef CANCapture_Init(CANCapture *cap, CANWrapper_Handle *hcw, CANCapture_InitTypeDef init_struct)
+{
+	if (cap == NULL || hcw == NULL || init_struct.sink == NULL)
+		return CAN_WRAPPER_INVALID_ARGS;
+
+	if (!hcw->init) return CAN_WRAPPER_NOT_INITIALISED;
+
+	memset(cap, 0, sizeof(*cap));
+	cap->init_struct = init_struct;
+	cap->hcw = hcw;
+	cap->last_flush = CANWrapperEx_Get_Tick(hcw);
+
+	for (uint32_t i = 0; i < CAN_CAPTURE_SIZE; i++)
+	{
+		atomic_init(&cap->slots[i].seq, i);
+	}
+
+	hcw->capture = cap;
+
+	return CAN_WRAPPER_HAL_OK;
+}
+
+void CANCapture_Frame(CANCapture *cap, uint32_t id, bool extended, bool transmitted, uint8_t dlc, const uint8_t *data)
+{
+	uint32_t pos = atomic_load_explicit(&cap->tail, memory_order_relaxed);
+	CANCaptureSlot *slot;
+
+	while (true)
+	{
+		slot = &cap->slots[pos & (CAN_CAPTURE_SIZE - 1)];
+		int32_t diff = (int32_t)(atomic_load_explicit(&slot->seq, memory_order_acquire) - pos);
+
+		if (diff == 0)
+		{
+			// free for this pass. claim it, unless another context just did.
+			if (atomic_compare_exchange_weak_explicit(&cap->tail, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0)
+		{
+			// the consumer hasn't read this slot from the last pass yet.
+			atomic_fetch_add_explicit(&cap->dropped, 1, memory_order_relaxed);
+			return;
+		}
+		else
+		{
+			pos = atomic_load_explicit(&cap->tail, memory_order_relaxed);
+		}
+	}
+
+	uint32_t dropped = atomic_exchange_explicit(&cap->dropped, 0, memory_order_relaxed);
+
+	CANCaptureRecord *record = &slot->record;
+	record->tick = (uint32_t)CANWrapperEx_Get_Tick(cap->hcw);
+	record->id = id;
+	record->dlc = dlc;
+	record->flags = (transmitted ? CAN_CAPTURE_FLAG_TX : 0) | (extended ? CAN_CAPTURE_FLAG_EXTENDED : 0);
+	record->dropped = dropped > UINT16_MAX ? UINT16_MAX : dropped;
+
+	memset(record->data, 0, sizeof(record->data));
+	memcpy(record->data, data, dlc <= 8 ? dlc : 8);
+
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+void CANCapture_Update(CANCapture *cap)
+{
+	while (fill_block(cap))
+	{
+		if (!send_block(cap))
+			return;
+	}
+
+	uint64_t interval = (uint64_t)cap->init_struct.flush_interval_ms * CAN_WRAPPER_TICKS_PER_MS;
+	if (cap->block_count > 0 && interval > 0
+			&& CANWrapperEx_Get_Tick(cap->hcw) - cap->last_flush >= interval)
+	{
+		send_block(cap);
+	}
+}
+
+bool CANCapture_Flush(CANCapture *cap)
+{
+	while (fill_block(cap) || cap->block_count > 0)
+	{
+		if (!send_block(cap))
+			return false;
+	}
+
+	return true;
+}
+
+uint64_t CANCapture_Next_Deadline(const CANCapture *cap)
+{
+	if (cap->init_struct.flush_interval_ms == 0)
+		return UINT64_MAX;
+
+	// records may be waiting in the ring as well as the block.
+	const CANCaptureSlot *slot = &cap->slots[cap->head & (CAN_CAPTURE_SIZE - 1)];
+	bool published = atomic_load_explicit(&slot->seq, memory_order_acquire) == cap->head + 1;
+
+	if (cap->block_count == 0 && !published)
+		return UINT64_MAX;
+
+	return cap->last_flush + (uint64_t)cap->init_struct.flush_interval_ms * CAN_WRAPPER_TICKS_PER_MS;
+}
+
+static bool fill_block(CANCapture *cap)
+{
+	while (cap->block_count < CAN_CAPTURE_BLOCK_SIZE)
+	{
+		CANCaptureSlot *slot = &cap->slots[cap->head & (CAN_CAPTURE_SIZE - 1)];
+
+		if (atomic_load_explicit(&slot->seq, memory_order_acquire) != cap->head + 1)
+			break; // not yet published.
+
+		cap->block[cap->block_count++] = slot->record;
+
+		atomic_store_explicit(&slot->seq, cap->head + CAN_CAPTURE_SIZE, memory_order_release);
+		cap->head++;
+	}
+
+	return cap->block_count == CAN_CAPTURE_BLOCK_SIZE;
+}
+
+static bool send_block(CANCapture *cap)
+{
+	if (!cap->init_struct.sink(cap->block, cap->block_count, cap->init_struct.ctx))
+		return false;
+
+	cap->block_count = 0;
+	cap->last_flush = CANWrapperEx_Get_Tick(cap->hcw);
+
+	return true;
+}
@@ -0,0 +1,48 @@
+/**
+ * @file can_os_freertos.c
+ * FreeRTOS port of the OS layer. Needs configSUPPORT_STATIC_ALLOCATION.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 13, 2024
+ */
+
+#include "can_os.h"
+
+#ifdef CAN_WRAPPER_OS_FREERTOS
+
+#include <task.h>
+
+void CANOS_Event_Init(CANOSEvent *event)
+{
+	event->semaphore = xSemaphoreCreateBinaryStatic(&event->buffer);
+}
+
+void CANOS_Event_Signal(CANOSEvent *event)
+{
+	if (xPortIsInsideInterrupt())
+	{
+		BaseType_t higher_priority_task_woken = pdFALSE;
+		xSemaphoreGiveFromISR(event->semaphore, &higher_priority_task_woken);
+
+		// switch straight to the woken task rather than at the next tick.
+		portYIELD_FROM_ISR(higher_priority_task_woken);
+	}
+	else
+	{
+		xSemaphoreGive(event->semaphore);
+	}
+}
+
+bool CANOS_Event_Wait(CANOSEvent *event, uint32_t timeout_ms)
+{
+	TickType_t ticks = timeout_ms == CAN_OS_WAIT_FOREVER ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms);
+
+	// never round a short wait down to no wait at all.
+	if (ticks == 0 && timeout_ms > 0)
+		ticks = 1;
+
+	return xSemaphoreTake(event->semaphore, ticks) == pdTRUE;
+}
+
+#endif /* CAN_WRAPPER_OS_FREERTOS */
@@ -0,0 +1,70 @@
+/**
+ * @file can_os_posix.c
+ * POSIX port of the OS layer, for running the wrapper in a host process.
+ * "Interrupts" there are other threads, so signalling takes the mutex.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 13, 2024
+ */
+
+#include "can_os.h"
+
+#ifdef CAN_WRAPPER_OS_POSIX
+
+#include <time.h>
+
+void CANOS_Event_Init(CANOSEvent *event)
+{
+	pthread_mutex_init(&event->mutex, NULL);
+
+	// time waits by the monotonic clock, so setting the date doesn't stretch them.
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&event->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	event->signalled = false;
+}
+
+void CANOS_Event_Signal(CANOSEvent *event)
+{
+	pthread_mutex_lock(&event->mutex);
+	event->signalled = true;
+	pthread_cond_signal(&event->cond);
+	pthread_mutex_unlock(&event->mutex);
+}
+
+bool CANOS_Event_Wait(CANOSEvent *event, uint32_t timeout_ms)
+{
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&event->mutex);
+
+	int result = 0;
+	while (!event->signalled && result == 0)
+	{
+		if (timeout_ms == CAN_OS_WAIT_FOREVER)
+			result = pthread_cond_wait(&event->cond, &event->mutex);
+		else
+			result = pthread_cond_timedwait(&event->cond, &event->mutex, &deadline);
+	}
+
+	bool signalled = event->signalled;
+	event->signalled = false;
+
+	pthread_mutex_unlock(&event->mutex);
+
+	return signalled;
+}
+
+#endif /* CAN_WRAPPER_OS_POSIX */
@@ -0,0 +1,93 @@
+/**
+ * @file can_probe.c
+ * Execution time probes for the wrapper's interrupt handlers and hot paths.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 10, 2024
+ */
+
+#include "can_probe.h"
+
+#ifdef CAN_WRAPPER_PROBES
+
+#include "can_wrapper.h"
+#include <string.h>
+
+#ifdef CAN_WRAPPER_HAL_HEADER
+#include <time.h>
+#endif
+
+static CANProbeRecord s_records[CAN_PROBE_COUNT];
+
+static const char *const s_names[CAN_PROBE_COUNT] = {
+	[CAN_PROBE_RX_FIFO0_ISR]    = "rx_fifo0_isr",
+	[CAN_PROBE_RX_FIFO1_ISR]    = "rx_fifo1_isr",
+	[CAN_PROBE_TX_COMPLETE_ISR] = "tx_complete_isr",
+	[CAN_PROBE_ERROR_ISR]       = "error_isr",
+	[CAN_PROBE_POLL]            = "poll",
+	[CAN_PROBE_TRANSMIT]        = "transmit",
+};
+
+void CANProbe_Init()
+{
+#ifndef CAN_WRAPPER_HAL_HEADER
+	// the cycle counter is part of the debug block, which is off out of reset.
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+}
+
+uint32_t CANProbe_Now()
+{
+#ifdef CAN_WRAPPER_HAL_HEADER
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)ts.tv_sec * 1000000000u + (uint32_t)ts.tv_nsec;
+#else
+	return DWT->CYCCNT;
+#endif
+}
+
+void CANProbe_Record(CANProbeID probe, uint32_t ticks)
+{
+	// interrupts can record against other probes in the middle of this. a
+	// probe hit from both a task and an interrupt (CANWrapper_Transmit called
+	// from an interrupt, say) may lose the odd call.
+	CANProbeRecord *record = &s_records[probe];
+
+	if (record->count == 0 || ticks < record->min)
+		record->min = ticks;
+	if (ticks > record->max)
+		record->max = ticks;
+
+	record->count++;
+	record->total += ticks;
+}
+
+void CANProbe_Get(CANProbeID probe, CANProbeRecord *out_record)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	*out_record = s_records[probe];
+
+	__set_PRIMASK(primask);
+}
+
+void CANProbe_Reset()
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	memset(s_records, 0, sizeof(s_records));
+
+	__set_PRIMASK(primask);
+}
+
+const char *CANProbe_Name(CANProbeID probe)
+{
+	return probe < CAN_PROBE_COUNT ? s_names[probe] : "unknown";
+}
+
+#endif /* CAN_WRAPPER_PROBES */
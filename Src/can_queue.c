@@ -1,7 +1,7 @@
 /**
  * @file can_queue.c
  * Queue ADT for storing CAN messages.
- * Implemented using circular buffer.
+ * Implemented using a lock-free single-producer/single-consumer ring buffer.
  *
  * @author Logan Furedi <logan.furedi@umsats.ca>
  * @author Om Sevak <om.sevak@umsats.ca>
@@ -11,44 +11,89 @@
 
 #include <can_queue.h>
 
+#define INDEX_MASK (CAN_QUEUE_SIZE - 1)
+
 CANQueue CANQueue_Create()
 {
 	CANQueue queue;
 
-    queue.head = 0;
-    queue.tail = 0;
+    atomic_init(&queue.head, 0);
+    atomic_init(&queue.tail, 0);
 
     return queue;
 }
 
 bool CANQueue_IsEmpty(const CANQueue* queue)
 {
-    return queue->head == queue->tail;
+    return atomic_load_explicit(&queue->head, memory_order_acquire)
+        == atomic_load_explicit(&queue->tail, memory_order_acquire);
 }
 
 bool CANQueue_IsFull(const CANQueue* queue)
 {
-    return (queue->tail + 1) % CAN_QUEUE_SIZE == queue->head;
+    return atomic_load_explicit(&queue->tail, memory_order_acquire)
+        - atomic_load_explicit(&queue->head, memory_order_acquire) == CAN_QUEUE_SIZE;
 }
 
-bool CANQueue_Enqueue(CANQueue* queue, CANQueueItem item)
+bool CANQueue_Enqueue(CANQueue* queue, const CANQueueItem *item)
 {
-    if (CANQueue_IsFull(queue))
+    CANQueueItem *slot = CANQueue_Reserve(queue);
+    if (slot == NULL)
         return false;
 
-    queue->items[queue->tail] = item;
-    queue->tail = (queue->tail + 1) % CAN_QUEUE_SIZE;
+    *slot = *item;
+    CANQueue_Commit(queue);
 
     return true;
 }
 
+size_t CANQueue_Size(const CANQueue* queue)
+{
+    return atomic_load_explicit(&queue->tail, memory_order_acquire)
+        - atomic_load_explicit(&queue->head, memory_order_acquire);
+}
+
+CANQueueItem *CANQueue_Reserve(CANQueue* queue)
+{
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+    if (tail - head == CAN_QUEUE_SIZE)
+        return NULL;
+
+    return &queue->items[tail & INDEX_MASK];
+}
+
+void CANQueue_Commit(CANQueue* queue)
+{
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+    // release: the item's contents become visible before the new tail.
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+}
+
 bool CANQueue_Dequeue(CANQueue* queue, CANQueueItem* out)
 {
-    if (CANQueue_IsEmpty(queue))
-        return false;
+    return CANQueue_DequeueBatch(queue, out, 1) == 1;
+}
 
-    *out = queue->items[queue->head];
-	queue->head = (queue->head + 1) % CAN_QUEUE_SIZE;
+size_t CANQueue_DequeueBatch(CANQueue* queue, CANQueueItem* out, size_t max_count)
+{
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
 
-    return true;
+    size_t count = tail - head;
+    if (count > max_count)
+        count = max_count;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        out[i] = queue->items[(head + i) & INDEX_MASK];
+    }
+
+    // release: the slots are read before the producer may reuse them.
+    if (count > 0)
+        atomic_store_explicit(&queue->head, head + count, memory_order_release);
+
+    return count;
 }
@@ -0,0 +1,37 @@
+/**
+ * @file can_stats.c
+ * Runtime statistics kept by each wrapper instance.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 9, 2024
+ */
+
+#include "can_stats.h"
+#include "can_command_codec.h"
+#include <string.h>
+
+_Static_assert(sizeof(((CmdArgs_COMMON_STATS *)0)->data) == CAN_STATS_BYTES_PER_FRAME,
+		"CMD_COMMON_STATS doesn't carry CAN_STATS_BYTES_PER_FRAME bytes");
+
+uint16_t CANStats_Pack(const CANWrapper_Stats *stats, uint16_t index, CANMessage *out_msg)
+{
+	const uint16_t frames = (sizeof(*stats) + CAN_STATS_BYTES_PER_FRAME - 1) / CAN_STATS_BYTES_PER_FRAME;
+
+	CmdArgs_COMMON_STATS args = { .index = index };
+
+	// the last frame is padded with zeros.
+	size_t offset = (size_t)index * CAN_STATS_BYTES_PER_FRAME;
+	if (offset < sizeof(*stats))
+	{
+		size_t size = sizeof(*stats) - offset;
+		if (size > CAN_STATS_BYTES_PER_FRAME)
+			size = CAN_STATS_BYTES_PER_FRAME;
+
+		memcpy(args.data, (const uint8_t *)stats + offset, size);
+	}
+
+	Encode_COMMON_STATS(out_msg, &args);
+
+	return frames;
+}
@@ -0,0 +1,212 @@
+/**
+ * @file can_telemetry.c
+ * Periodic telemetry, sent on a schedule that spreads it over time.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 14, 2024
+ */
+
+#include "can_telemetry.h"
+#include "can_command_codec.h"
+#include <string.h>
+
+_Static_assert(sizeof(CmdArgs_PWR_SET_TELEMETRY_INTERVAL) == sizeof(CmdArgs_CDH_SET_TELEMETRY_INTERVAL)
+		&& sizeof(CmdArgs_ADCS_SET_TELEMETRY_INTERVAL) == sizeof(CmdArgs_CDH_SET_TELEMETRY_INTERVAL),
+		"on_set_interval decodes every SET_TELEMETRY_INTERVAL but PLD's as CDH's");
+
+/**
+ * @brief Works out a producer's phase and the next time it is due after now.
+ */
+static void schedule(CANTelemetry *tel, uint8_t index, uint64_t now);
+
+/**
+ * @brief Handler of the node's SET_TELEMETRY_INTERVAL command.
+ */
+static void on_set_interval(const CANMessage *msg, const CANMessageInfo *info, void *ctx);
+
+CANWrapper_StatusTypeDef CANTelemetry_Init(CANTelemetry *tel, CANWrapper_Handle *hcw, CANTelemetry_InitTypeDef init_struct)
+{
+	if ( !(tel != NULL
+		&& hcw != NULL
+		&& (init_struct.interval_cmd == CMD_CDH_SET_TELEMETRY_INTERVAL
+			|| init_struct.interval_cmd == CMD_PWR_SET_TELEMETRY_INTERVAL
+			|| init_struct.interval_cmd == CMD_ADCS_SET_TELEMETRY_INTERVAL
+			|| init_struct.interval_cmd == CMD_PLD_SET_TELEMETRY_INTERVAL)))
+	{
+		return CAN_WRAPPER_INVALID_ARGS;
+	}
+
+	if (!hcw->init) return CAN_WRAPPER_NOT_INITIALISED;
+
+	if (init_struct.node_count == 0)
+		init_struct.node_count = CAN_TELEMETRY_DEFAULT_NODE_COUNT;
+
+	memset(tel, 0, sizeof(*tel));
+	tel->init_struct = init_struct;
+	tel->hcw = hcw;
+
+	CANWrapper_StatusTypeDef status = CANWrapperEx_Register_Handler(hcw, init_struct.interval_cmd, &on_set_interval, tel);
+	if (status != CAN_WRAPPER_HAL_OK)
+		return status;
+
+	hcw->telemetry = tel;
+
+	return CAN_WRAPPER_HAL_OK;
+}
+
+CANWrapper_StatusTypeDef CANTelemetry_Add_Producer(CANTelemetry *tel, const CANTelemetry_ProducerTypeDef *producer)
+{
+	if (producer->cmd >= CMD_ID_COUNT || producer->recipient >= CAN_WRAPPER_MAX_NODES || producer->fill == NULL)
+		return CAN_WRAPPER_INVALID_ARGS;
+
+	if (tel->count >= CAN_TELEMETRY_MAX_PRODUCERS)
+		return CAN_WRAPPER_NO_FREE_PRODUCER;
+
+	tel->producers[tel->count].config = *producer;
+	tel->count++;
+
+	// every phase depends on the number of producers.
+	uint64_t now = CANWrapperEx_Get_Tick(tel->hcw);
+	for (uint8_t i = 0; i < tel->count; i++)
+	{
+		schedule(tel, i, now);
+	}
+
+	return CAN_WRAPPER_HAL_OK;
+}
+
+uint8_t CANTelemetry_Set_Interval(CANTelemetry *tel, uint8_t sensor, uint8_t well_id, uint16_t interval_ms)
+{
+	uint64_t now = CANWrapperEx_Get_Tick(tel->hcw);
+	uint8_t changed = 0;
+
+	for (uint8_t i = 0; i < tel->count; i++)
+	{
+		CANTelemetry_ProducerTypeDef *config = &tel->producers[i].config;
+
+		if (config->sensor != sensor)
+			continue;
+
+		if (well_id != CAN_TELEMETRY_ANY_WELL && config->well_id != CAN_TELEMETRY_ANY_WELL && config->well_id != well_id)
+			continue;
+
+		config->interval_ms = interval_ms;
+		schedule(tel, i, now);
+		changed++;
+	}
+
+	return changed;
+}
+
+void CANTelemetry_Update(CANTelemetry *tel)
+{
+	uint64_t now = CANWrapperEx_Get_Tick(tel->hcw);
+
+	if (now < tel->retry_tick)
+		return;
+
+	tel->retry_tick = 0;
+
+	for (uint8_t i = 0; i < tel->count; i++)
+	{
+		CANTelemetryProducer *producer = &tel->producers[i];
+		if (now < producer->next_tick) continue;
+
+		uint64_t period = (uint64_t)producer->config.interval_ms*CAN_WRAPPER_TICKS_PER_MS;
+
+		// sending now would put two in a row. wait for the next slot instead.
+		if (now - producer->next_tick >= period)
+		{
+			tel->skipped++;
+			schedule(tel, i, now);
+			continue;
+		}
+
+		// leave the TX queue to commands and replies while it is backed up.
+		// the size is read without a lock, since a stale value only moves
+		// the message by one poll.
+		if (tel->hcw->tx_queue.size >= CAN_TELEMETRY_MAX_BACKLOG)
+		{
+			tel->retry_tick = now + CAN_TELEMETRY_BACKLOG_RETRY_MS*CAN_WRAPPER_TICKS_PER_MS;
+			return;
+		}
+
+		CANMessage msg = {0};
+		msg.cmd = producer->config.cmd;
+
+		if (producer->config.fill(&msg, producer->config.ctx)
+				&& CANWrapperEx_Transmit(tel->hcw, producer->config.recipient, &msg) == CAN_WRAPPER_TX_QUEUE_FULL)
+		{
+			tel->retry_tick = now + CAN_TELEMETRY_BACKLOG_RETRY_MS*CAN_WRAPPER_TICKS_PER_MS;
+			return;
+		}
+
+		// stay on the grid, even if this one went out late.
+		producer->next_tick += period;
+	}
+}
+
+uint64_t CANTelemetry_Next_Deadline(const CANTelemetry *tel)
+{
+	uint64_t deadline = UINT64_MAX;
+
+	for (uint8_t i = 0; i < tel->count; i++)
+	{
+		if (tel->producers[i].next_tick < deadline)
+			deadline = tel->producers[i].next_tick;
+	}
+
+	// due messages are waiting on the backlog.
+	if (deadline < tel->retry_tick)
+		deadline = tel->retry_tick;
+
+	return deadline;
+}
+
+static void schedule(CANTelemetry *tel, uint8_t index, uint64_t now)
+{
+	CANTelemetryProducer *producer = &tel->producers[index];
+
+	if (producer->config.interval_ms == 0)
+	{
+		producer->next_tick = UINT64_MAX;
+		return;
+	}
+
+	uint64_t period = (uint64_t)producer->config.interval_ms*CAN_WRAPPER_TICKS_PER_MS;
+
+	// this node's slice of the period, split evenly between its producers.
+	uint64_t node_slot = tel->hcw->init_struct.node_id % tel->init_struct.node_count;
+	uint64_t slots = (uint64_t)tel->init_struct.node_count*tel->count;
+	producer->phase = period*(node_slot*tel->count + index) / slots;
+
+	// periods are counted from tick 0, i.e. from when the wrapper started,
+	// which is about the same time on every node.
+	if (now < producer->phase)
+		producer->next_tick = producer->phase;
+	else
+		producer->next_tick = producer->phase + ((now - producer->phase) / period + 1)*period;
+}
+
+static void on_set_interval(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	CANTelemetry *tel = ctx;
+
+	// the ACK of one we sent to another node.
+	if (info->is_ack) return;
+
+	if (msg->cmd == CMD_PLD_SET_TELEMETRY_INTERVAL)
+	{
+		CmdArgs_PLD_SET_TELEMETRY_INTERVAL args;
+		Decode_PLD_SET_TELEMETRY_INTERVAL(msg, &args);
+		CANTelemetry_Set_Interval(tel, args.sensor, args.well_id, args.interval_ms);
+	}
+	else
+	{
+		// the other nodes' commands share this layout.
+		CmdArgs_CDH_SET_TELEMETRY_INTERVAL args;
+		Decode_CDH_SET_TELEMETRY_INTERVAL(msg, &args);
+		CANTelemetry_Set_Interval(tel, args.sensor, CAN_TELEMETRY_ANY_WELL, args.interval_ms);
+	}
+}
@@ -0,0 +1,556 @@
+/**
+ * @file can_transport.c
+ * Segmented transport for payloads larger than CAN_MAX_BODY_SIZE.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 2, 2024
+ */
+
+#include "can_transport.h"
+#include <stddef.h>
+#include <string.h>
+
+// time a receiver waits for the next segment before giving up. long enough
+// for the sender to go through all of its retries.
+#define RX_TIMEOUT_MS (2 * CAN_TRANSPORT_TIMEOUT_MS * (CAN_TRANSPORT_MAX_RETRIES + 1))
+
+// SEGMENT_ACK status byte.
+#define ACK_STATUS_OK       0
+#define ACK_STATUS_REJECTED 1 // no buffer for the transfer.
+#define ACK_STATUS_UNKNOWN  2 // the transfer isn't known to the receiver.
+
+enum
+{
+	TX_IDLE = 0,
+	TX_STARTING, // waiting for the recipient to accept the transfer.
+	TX_SENDING,
+};
+
+enum
+{
+	RX_IDLE = 0,
+	RX_ACTIVE,
+	RX_DONE,     // complete. kept for a while to re-ACK resent segments.
+};
+
+static void send_start(CANTransport *tp, const CANTransportTx *tx);
+
+/**
+ * @brief Sends one segment of a transfer.
+ *
+ * @return false if the wrapper's TX queue is full.
+ */
+static bool send_data(CANTransport *tp, const CANTransportTx *tx, uint16_t seq);
+
+static void send_ack(CANTransport *tp, NodeID recipient, uint8_t xfer_id,
+		uint16_t base, uint16_t received, uint8_t credits, uint8_t status);
+
+static void send_rx_ack(CANTransport *tp, CANTransportRx *rx);
+
+/**
+ * @brief Sends resent and new segments, as far as the window allows.
+ */
+static void fill_window(CANTransport *tp, CANTransportTx *tx);
+
+static void finish_tx(CANTransport *tp, CANTransportTx *tx, bool success);
+
+static void process_start(CANTransport *tp, const CANMessage *msg, NodeID sender);
+static void process_data(CANTransport *tp, const CANMessage *msg, NodeID sender);
+static void process_ack(CANTransport *tp, const CANMessage *msg, NodeID sender);
+
+static CANTransportRx *find_rx(CANTransport *tp, NodeID sender, uint8_t xfer_id);
+
+static uint8_t rx_window(const CANTransport *tp);
+
+CANWrapper_StatusTypeDef CANTransport_Init(CANTransport *tp, CANWrapper_Handle *hcw, CANTransport_InitTypeDef init_struct)
+{
+	if ( !(tp != NULL
+		&& hcw != NULL
+		&& init_struct.rx_window <= CAN_TRANSPORT_WINDOW
+		&& init_struct.buffer_callback != NULL
+		&& init_struct.receive_callback != NULL))
+	{
+		return CAN_WRAPPER_INVALID_ARGS;
+	}
+
+	if (!hcw->init) return CAN_WRAPPER_NOT_INITIALISED;
+
+	memset(tp, 0, sizeof(*tp));
+	tp->init_struct = init_struct;
+	tp->hcw = hcw;
+
+	hcw->transport = tp;
+
+	return CAN_WRAPPER_HAL_OK;
+}
+
+CANWrapper_StatusTypeDef CANTransport_Send(CANTransport *tp, NodeID recipient, uint8_t tag, const uint8_t *buffer, uint16_t length)
+{
+	const CANWrapper_InitTypeDef *wrapper_init = &tp->hcw->init_struct;
+
+	if (buffer == NULL || length == 0 || length > CAN_TRANSPORT_MAX_LENGTH
+			|| recipient == wrapper_init->node_id
+			|| (wrapper_init->accept_broadcast && recipient == wrapper_init->broadcast_id))
+	{
+		return CAN_WRAPPER_INVALID_ARGS;
+	}
+
+	if (!tp->hcw->init) return CAN_WRAPPER_NOT_INITIALISED;
+
+	// other tasks may send while the polling task updates the transfers.
+	// CANTransport_Update and CANTransport_Process_Message skip idle slots,
+	// so the slot is claimed, and only marked busy once it is filled in, with
+	// interrupts off.
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	CANTransportTx *tx = NULL;
+	for (size_t i = 0; i < CAN_TRANSPORT_MAX_TX; i++)
+	{
+		if (tp->tx[i].state == TX_IDLE)
+		{
+			tx = &tp->tx[i];
+			break;
+		}
+	}
+
+	if (tx == NULL)
+	{
+		__set_PRIMASK(primask);
+		return CAN_WRAPPER_NO_FREE_TRANSFER;
+	}
+
+	// the transfer ID only has to differ from our other transfers in progress.
+	uint8_t xfer_id;
+	bool in_use;
+	do
+	{
+		xfer_id = tp->next_xfer_id++ & 0x07;
+		in_use = false;
+		for (size_t i = 0; i < CAN_TRANSPORT_MAX_TX; i++)
+		{
+			if (tp->tx[i].state != TX_IDLE && tp->tx[i].xfer_id == xfer_id)
+				in_use = true;
+		}
+	} while (in_use);
+
+	memset(tx, 0, sizeof(*tx));
+	tx->buffer = buffer;
+	tx->length = length;
+	tx->segments = (length + CAN_TRANSPORT_SEGMENT_SIZE - 1) / CAN_TRANSPORT_SEGMENT_SIZE;
+	tx->xfer_id = xfer_id;
+	tx->tag = tag;
+	tx->recipient = recipient;
+	tx->deadline = CANWrapperEx_Get_Tick(tp->hcw) + CAN_TRANSPORT_TIMEOUT_MS*CAN_WRAPPER_TICKS_PER_MS;
+	tx->state = TX_STARTING;
+
+	__set_PRIMASK(primask);
+
+	// if the TX queue is full, the start is resent on timeout.
+	send_start(tp, tx);
+
+	return CAN_WRAPPER_HAL_OK;
+}
+
+bool CANTransport_Is_Transport_Cmd(uint8_t cmd)
+{
+	return cmd == CMD_COMMON_SEGMENT_START
+		|| cmd == CMD_COMMON_SEGMENT_DATA
+		|| cmd == CMD_COMMON_SEGMENT_ACK;
+}
+
+void CANTransport_Process_Message(CANTransport *tp, const CANMessage *msg, NodeID sender, NodeID recipient)
+{
+	// a logging node's filters may pass other nodes' transfers. their
+	// transfer ID's and sequence numbers could be taken for ours.
+	if (recipient != tp->hcw->init_struct.node_id)
+		return;
+
+	switch (msg->cmd)
+	{
+	case CMD_COMMON_SEGMENT_START:
+		process_start(tp, msg, sender);
+		break;
+	case CMD_COMMON_SEGMENT_DATA:
+		process_data(tp, msg, sender);
+		break;
+	case CMD_COMMON_SEGMENT_ACK:
+		process_ack(tp, msg, sender);
+		break;
+	default:
+		break;
+	}
+}
+
+void CANTransport_Update(CANTransport *tp)
+{
+	uint64_t now = CANWrapperEx_Get_Tick(tp->hcw);
+
+	for (size_t i = 0; i < CAN_TRANSPORT_MAX_TX; i++)
+	{
+		CANTransportTx *tx = &tp->tx[i];
+		if (tx->state == TX_IDLE) continue;
+
+		if (now >= tx->deadline)
+		{
+			if (tx->retries >= CAN_TRANSPORT_MAX_RETRIES)
+			{
+				finish_tx(tp, tx, false);
+				continue;
+			}
+
+			tx->retries++;
+			tx->deadline = now + CAN_TRANSPORT_TIMEOUT_MS*CAN_WRAPPER_TICKS_PER_MS;
+
+			if (tx->state == TX_STARTING)
+			{
+				send_start(tp, tx);
+				continue;
+			}
+
+			// resend everything in flight that wasn't ACK'd.
+			uint32_t in_flight = (1ul << (tx->next - tx->base)) - 1;
+			tx->resend = in_flight & ~tx->acked;
+		}
+
+		// segments that didn't fit in the TX queue last time are sent now.
+		if (tx->state == TX_SENDING)
+			fill_window(tp, tx);
+	}
+
+	for (size_t i = 0; i < CAN_TRANSPORT_MAX_RX; i++)
+	{
+		CANTransportRx *rx = &tp->rx[i];
+		if (rx->state == RX_IDLE || now < rx->deadline) continue;
+
+		bool timed_out = rx->state == RX_ACTIVE;
+		rx->state = RX_IDLE;
+
+		if (timed_out)
+		{
+			tp->init_struct.receive_callback(rx->sender, rx->tag, rx->buffer, rx->length, false, tp->init_struct.ctx);
+		}
+	}
+}
+
+uint64_t CANTransport_Next_Deadline(const CANTransport *tp)
+{
+	uint64_t deadline = UINT64_MAX;
+
+	for (size_t i = 0; i < CAN_TRANSPORT_MAX_TX; i++)
+	{
+		if (tp->tx[i].state != TX_IDLE && tp->tx[i].deadline < deadline)
+			deadline = tp->tx[i].deadline;
+	}
+
+	for (size_t i = 0; i < CAN_TRANSPORT_MAX_RX; i++)
+	{
+		if (tp->rx[i].state != RX_IDLE && tp->rx[i].deadline < deadline)
+			deadline = tp->rx[i].deadline;
+	}
+
+	return deadline;
+}
+
+static void process_start(CANTransport *tp, const CANMessage *msg, NodeID sender)
+{
+	CmdArgs_COMMON_SEGMENT_START args;
+	Decode_COMMON_SEGMENT_START(msg, &args);
+
+	uint8_t xfer_id = args.xfer_id & 0x07;
+	uint16_t length = args.length;
+	uint8_t tag = args.tag;
+
+	CANTransportRx *rx = find_rx(tp, sender, xfer_id);
+
+	if (rx != NULL && rx->state == RX_ACTIVE)
+	{
+		if (rx->length == length && rx->tag == tag)
+		{
+			// our ACK was lost and the sender is asking again.
+			send_rx_ack(tp, rx);
+			return;
+		}
+
+		// the sender gave up on the old transfer and reused its ID.
+		rx->state = RX_DONE;
+		tp->init_struct.receive_callback(rx->sender, rx->tag, rx->buffer, rx->length, false, tp->init_struct.ctx);
+	}
+
+	// a finished transfer with the same ID is over. take its slot.
+	if (rx == NULL)
+	{
+		for (size_t i = 0; i < CAN_TRANSPORT_MAX_RX && rx == NULL; i++)
+		{
+			if (tp->rx[i].state == RX_IDLE)
+				rx = &tp->rx[i];
+		}
+
+		for (size_t i = 0; i < CAN_TRANSPORT_MAX_RX && rx == NULL; i++)
+		{
+			if (tp->rx[i].state == RX_DONE)
+				rx = &tp->rx[i];
+		}
+	}
+
+	uint8_t *buffer = NULL;
+	if (rx != NULL && length > 0 && length <= CAN_TRANSPORT_MAX_LENGTH)
+	{
+		buffer = tp->init_struct.buffer_callback(sender, tag, length, tp->init_struct.ctx);
+	}
+
+	if (buffer == NULL)
+	{
+		send_ack(tp, sender, xfer_id, 0, 0, 0, ACK_STATUS_REJECTED);
+		return;
+	}
+
+	memset(rx, 0, sizeof(*rx));
+	rx->buffer = buffer;
+	rx->length = length;
+	rx->segments = (length + CAN_TRANSPORT_SEGMENT_SIZE - 1) / CAN_TRANSPORT_SEGMENT_SIZE;
+	rx->xfer_id = xfer_id;
+	rx->tag = tag;
+	rx->sender = sender;
+	rx->state = RX_ACTIVE;
+	rx->deadline = CANWrapperEx_Get_Tick(tp->hcw) + RX_TIMEOUT_MS*CAN_WRAPPER_TICKS_PER_MS;
+
+	send_rx_ack(tp, rx);
+}
+
+static void process_data(CANTransport *tp, const CANMessage *msg, NodeID sender)
+{
+	CmdArgs_COMMON_SEGMENT_DATA args;
+	Decode_COMMON_SEGMENT_DATA(msg, &args);
+
+	uint8_t xfer_id = args.header[0] >> 5;
+	uint16_t seq = (uint16_t)(args.header[0] & 0x1F) << 8 | args.header[1];
+
+	CANTransportRx *rx = find_rx(tp, sender, xfer_id);
+
+	if (rx == NULL)
+	{
+		send_ack(tp, sender, xfer_id, 0, 0, 0, ACK_STATUS_UNKNOWN);
+		return;
+	}
+
+	if (rx->state == RX_DONE || seq < rx->base)
+	{
+		// a resend of something we already have. our ACK must have been lost.
+		send_rx_ack(tp, rx);
+		return;
+	}
+
+	// beyond what an ACK can describe. the sender is ignoring the window.
+	if (seq >= rx->segments || seq > rx->base + CAN_TRANSPORT_WINDOW)
+		return;
+
+	uint16_t offset = seq * CAN_TRANSPORT_SEGMENT_SIZE;
+	uint16_t size = rx->length - offset < CAN_TRANSPORT_SEGMENT_SIZE
+			? rx->length - offset : CAN_TRANSPORT_SEGMENT_SIZE;
+	memcpy(rx->buffer + offset, args.payload, size);
+
+	bool ack_now = false;
+
+	if (seq == rx->base)
+	{
+		// slide past this segment and any received after it.
+		bool have_next;
+		do
+		{
+			rx->base++;
+			have_next = rx->received & 1;
+			rx->received >>= 1;
+		} while (have_next);
+	}
+	else
+	{
+		// ACK the first gap straight away so the sender can fill it.
+		ack_now = rx->received == 0;
+		rx->received |= 1u << (seq - rx->base - 1);
+	}
+
+	rx->since_ack++;
+	rx->deadline = CANWrapperEx_Get_Tick(tp->hcw) + RX_TIMEOUT_MS*CAN_WRAPPER_TICKS_PER_MS;
+
+	if (rx->base >= rx->segments)
+	{
+		rx->state = RX_DONE;
+		send_rx_ack(tp, rx);
+		tp->init_struct.receive_callback(rx->sender, rx->tag, rx->buffer, rx->length, true, tp->init_struct.ctx);
+		return;
+	}
+
+	// ACK every half window so the sender never has to stall.
+	uint8_t ack_interval = rx_window(tp) / 2 > 0 ? rx_window(tp) / 2 : 1;
+	if (ack_now || rx->since_ack >= ack_interval)
+		send_rx_ack(tp, rx);
+}
+
+static void process_ack(CANTransport *tp, const CANMessage *msg, NodeID sender)
+{
+	CmdArgs_COMMON_SEGMENT_ACK args;
+	Decode_COMMON_SEGMENT_ACK(msg, &args);
+
+	uint8_t xfer_id = args.xfer_id & 0x07;
+	uint16_t base = args.base;
+	uint16_t received = args.received;
+	uint8_t credits = args.credits;
+	uint8_t status = args.status;
+
+	CANTransportTx *tx = NULL;
+	for (size_t i = 0; i < CAN_TRANSPORT_MAX_TX; i++)
+	{
+		if (tp->tx[i].state != TX_IDLE && tp->tx[i].recipient == sender && tp->tx[i].xfer_id == xfer_id)
+			tx = &tp->tx[i];
+	}
+
+	if (tx == NULL) return;
+
+	if (status != ACK_STATUS_OK)
+	{
+		finish_tx(tp, tx, false);
+		return;
+	}
+
+	if (tx->state == TX_STARTING)
+		tx->state = TX_SENDING;
+
+	// stale ACK's arrive after a newer one when they cross a resend.
+	if (base < tx->base || base > tx->next)
+		return;
+
+	uint32_t acked = tx->acked;
+	uint16_t shift = base - tx->base;
+	if (shift > 0)
+	{
+		tx->acked >>= shift;
+		tx->resend >>= shift;
+		tx->base = base;
+	}
+
+	tx->acked = (uint32_t)received << 1;
+	tx->resend &= ~tx->acked;
+	tx->credits = credits > CAN_TRANSPORT_WINDOW ? CAN_TRANSPORT_WINDOW : credits;
+
+	if (tx->base >= tx->segments)
+	{
+		finish_tx(tp, tx, true);
+		return;
+	}
+
+	// a segment older than one the receiver has is missing.
+	if (received != 0)
+	{
+		uint32_t highest = 1ul << (31 - __builtin_clz(tx->acked));
+		tx->resend |= (highest - 1) & ~tx->acked;
+	}
+
+	if (shift > 0 || tx->acked != acked)
+		tx->retries = 0;
+
+	tx->deadline = CANWrapperEx_Get_Tick(tp->hcw) + CAN_TRANSPORT_TIMEOUT_MS*CAN_WRAPPER_TICKS_PER_MS;
+
+	fill_window(tp, tx);
+}
+
+static void fill_window(CANTransport *tp, CANTransportTx *tx)
+{
+	for (uint16_t i = 0; tx->resend != 0 && i < tx->next - tx->base; i++)
+	{
+		if (!(tx->resend & 1ul << i)) continue;
+
+		if (!send_data(tp, tx, tx->base + i))
+			return;
+
+		tx->resend &= ~(1ul << i);
+	}
+
+	uint16_t limit = tx->base + tx->credits;
+	if (limit > tx->segments)
+		limit = tx->segments;
+
+	while (tx->next < limit && send_data(tp, tx, tx->next))
+	{
+		tx->next++;
+	}
+}
+
+static void finish_tx(CANTransport *tp, CANTransportTx *tx, bool success)
+{
+	tx->state = TX_IDLE;
+
+	if (tp->init_struct.send_callback != NULL)
+	{
+		tp->init_struct.send_callback(tx->recipient, tx->tag, success, tp->init_struct.ctx);
+	}
+}
+
+static void send_start(CANTransport *tp, const CANTransportTx *tx)
+{
+	CANMessage msg;
+	Encode_COMMON_SEGMENT_START(&msg, &(CmdArgs_COMMON_SEGMENT_START){
+			.xfer_id = tx->xfer_id,
+			.length = tx->length,
+			.tag = tx->tag,
+	});
+
+	CANWrapperEx_Transmit(tp->hcw, tx->recipient, &msg);
+}
+
+static bool send_data(CANTransport *tp, const CANTransportTx *tx, uint16_t seq)
+{
+	CmdArgs_COMMON_SEGMENT_DATA args = {
+			.header = { tx->xfer_id << 5 | seq >> 8, seq & 0xFF },
+	};
+
+	uint16_t offset = seq * CAN_TRANSPORT_SEGMENT_SIZE;
+	uint16_t size = tx->length - offset < CAN_TRANSPORT_SEGMENT_SIZE
+			? tx->length - offset : CAN_TRANSPORT_SEGMENT_SIZE;
+	memcpy(args.payload, tx->buffer + offset, size);
+
+	CANMessage msg;
+	Encode_COMMON_SEGMENT_DATA(&msg, &args);
+
+	return CANWrapperEx_Transmit(tp->hcw, tx->recipient, &msg) == CAN_WRAPPER_HAL_OK;
+}
+
+static void send_ack(CANTransport *tp, NodeID recipient, uint8_t xfer_id,
+		uint16_t base, uint16_t received, uint8_t credits, uint8_t status)
+{
+	CANMessage msg;
+	Encode_COMMON_SEGMENT_ACK(&msg, &(CmdArgs_COMMON_SEGMENT_ACK){
+			.xfer_id = xfer_id,
+			.base = base,
+			.received = received,
+			.credits = credits,
+			.status = status,
+	});
+
+	// if the TX queue is full the ACK is lost, and the sender resends.
+	CANWrapperEx_Transmit(tp->hcw, recipient, &msg);
+}
+
+static void send_rx_ack(CANTransport *tp, CANTransportRx *rx)
+{
+	rx->since_ack = 0;
+	send_ack(tp, rx->sender, rx->xfer_id, rx->base, rx->received, rx_window(tp), ACK_STATUS_OK);
+}
+
+static CANTransportRx *find_rx(CANTransport *tp, NodeID sender, uint8_t xfer_id)
+{
+	for (size_t i = 0; i < CAN_TRANSPORT_MAX_RX; i++)
+	{
+		CANTransportRx *rx = &tp->rx[i];
+		if (rx->state != RX_IDLE && rx->sender == sender && rx->xfer_id == xfer_id)
+			return rx;
+	}
+
+	return NULL;
+}
+
+static uint8_t rx_window(const CANTransport *tp)
+{
+	return tp->init_struct.rx_window != 0 ? tp->init_struct.rx_window : CAN_TRANSPORT_WINDOW;
+}
@@ -10,239 +10,2054 @@
 #include <can_queue.h>
 #include <can_wrapper.h>
 #include "tx_cache.h"
+#include "tx_queue.h"
+#include "timing_wheel.h"
+#include "ack_list.h"
+#include "can_transport.h"
+#include "can_capture.h"
+#include "can_telemetry.h"
+#include "can_probe.h"
+#include "can_id.h"
 #include <stddef.h>
+#include <string.h>
 
-#define ACK_MASK       0b00000000001
-#define RECIPIENT_MASK 0b00000000110
-#define SENDER_MASK    0b00000011000
-#define PRIORITY_MASK  0b11111100000
+#define STD_SEQ_BITS 8 // in the byte after the body.
 
-#define TIMEOUT 3600
+// bxCAN filter register layout of a standard identifier in 16-bit scale.
+#define FILTER16_STD_ID_SHIFT 5
+#define FILTER16_RTR          0x0010
+#define FILTER16_IDE          0x0008
 
-#define PERIOD_TICKS 5000
+// bxCAN filter register layout of a standard identifier in 32-bit scale.
+#define FILTER32_STD_ID_SHIFT 21
+#define FILTER32_RTR          0x00000002
+#define FILTER32_IDE          0x00000004
 
-static CANWrapper_InitTypeDef s_init_struct = {0};
+// bxCAN filter register layout of an extended identifier in 32-bit scale.
+#define FILTER32_EXT_ID_SHIFT 3
 
-static CANQueue s_msg_queue = {0};
-static TxCache s_tx_cache = {0};
+#define STD_FILTER_BANKS 4 // banks used by the default filters.
+#define EXT_FILTER_BANKS 6
 
-static bool s_init = false;
+#define SLAVE_START_FILTER_BANK 14 // banks below this belong to CAN1.
 
-static CANWrapper_StatusTypeDef transmit_internal(NodeID recipient, CANMessage *msg, bool is_ack);
+#define DEFAULT_TIMEOUT_MS 50 // used by commands with no timeout configured.
+
+// the CAN interrupts the wrapper handles.
+#define ENABLED_NOTIFICATIONS \
+	( CAN_IT_RX_FIFO0_MSG_PENDING | CAN_IT_RX_FIFO1_MSG_PENDING \
+	| CAN_IT_RX_FIFO0_OVERRUN | CAN_IT_RX_FIFO1_OVERRUN \
+	| CAN_IT_TX_MAILBOX_EMPTY \
+	| CAN_IT_ERROR_WARNING | CAN_IT_ERROR_PASSIVE | CAN_IT_BUSOFF \
+	| CAN_IT_LAST_ERROR_CODE | CAN_IT_ERROR )
+
+_Static_assert(CMD_ID_COUNT <= ACK_ENTRY_NUMBERED, "ACK entries flag numbered messages in the command ID's top bit");
+_Static_assert((TX_CACHE_SEQ_KEY_MASK & ((1 << CAN_ID_EXT_SEQ_BITS) - 1)) == TX_CACHE_SEQ_KEY_MASK,
+		"the TX cache must be keyed on sequence number bits that every identifier layout sends");
+
+#define POLL_BATCH_SIZE 8 // messages dequeued per queue index update.
+
+#define REQUEST_NONE (-1)
+
+static CANWrapper_Handle s_default_handle = {0}; // used by the CANWrapper_* functions.
+
+// every initialised instance. used to route HAL callbacks to their instance.
+static CANWrapper_Handle *s_instances[CAN_WRAPPER_MAX_INSTANCES] = {0};
+
+/**
+ * @brief Adds an instance to s_instances. Does nothing if it is already there.
+ *
+ * @return false if there is no room, or another instance uses the same CAN peripheral.
+ */
+static bool register_instance(CANWrapper_Handle *hcw);
+
+/**
+ * @brief Removes an instance from s_instances, if it is there.
+ */
+static void unregister_instance(CANWrapper_Handle *hcw);
+
+/**
+ * @brief Returns the instance that owns the given CAN peripheral, or NULL.
+ */
+static CANWrapper_Handle *find_instance(const CAN_HandleTypeDef *hcan);
+
+/**
+ * @brief Returns the first filter bank owned by the given CAN peripheral.
+ */
+static uint32_t first_filter_bank(const CAN_HandleTypeDef *hcan);
+
+static CANWrapper_StatusTypeDef transmit_internal(CANWrapper_Handle *hcw, NodeID recipient, CANMessage *msg);
+
+/**
+ * @brief Builds an identifier from our node ID and the given fields.
+ *
+ * Extended if extended_ids is set. Standard identifiers have no room for
+ * cmd or seq.
+ */
+static uint32_t make_id(CANWrapper_Handle *hcw, uint8_t priority, uint8_t cmd, NodeID recipient, uint8_t seq, bool is_ack);
+
+/**
+ * @brief Returns the number of bits in a sequence number.
+ */
+static uint8_t seq_bits(bool extended_ids);
+
+/**
+ * @brief Returns how far sequence number a is ahead of b. Negative if behind.
+ */
+static int seq_distance(uint8_t a, uint8_t b, uint8_t bits);
+
+/**
+ * @brief Returns the number of messages the duplicate window covers.
+ */
+static int seq_window(uint8_t bits);
+
+/**
+ * @brief Pushes a frame onto the TX queue and starts sending if a mailbox is free.
+ *
+ * Safe to call from any context.
+ *
+ * @param replace  whether to overwrite a queued frame with the same ID and
+ *                 command instead of adding another one.
+ */
+static bool queue_frame(CANWrapper_Handle *hcw, uint32_t id, const CANMessage *data, uint8_t dlc, bool replace);
+
+/**
+ * @brief Sends the ACK's recorded by the RX interrupts.
+ *
+ * ACK's to the same sender are merged into frames of up to
+ * ACK_ENTRIES_PER_FRAME (cmd, key) pairs. The key is the message's sequence
+ * number if it had one, flagged by ACK_ENTRY_NUMBERED, and otherwise the low
+ * byte of its hash.
+ */
+static void flush_pending_acks(CANWrapper_Handle *hcw);
+
+/**
+ * @brief Programs a filter bank with two 16-bit (id, mask) pairs of standard identifiers.
+ */
+static HAL_StatusTypeDef config_filter_pair(CAN_HandleTypeDef *hcan, uint32_t bank, uint32_t fifo,
+		uint16_t id1, uint16_t mask1, uint16_t id2, uint16_t mask2);
+
+/**
+ * @brief Configures one filter bank in 32-bit scale, identifier mask mode.
+ *
+ * id and mask are in the filter register layout.
+ */
+static HAL_StatusTypeDef config_filter32(CAN_HandleTypeDef *hcan, uint32_t bank, uint32_t fifo,
+		uint32_t id, uint32_t mask);
+
+/**
+ * @brief Configures the default filters for standard identifiers.
+ *
+ * Uses STD_FILTER_BANKS banks from bank.
+ */
+static HAL_StatusTypeDef config_std_filters(CAN_HandleTypeDef *hcan, uint32_t bank, const NodeID recipients[2]);
+
+/**
+ * @brief Configures the default filters for extended identifiers.
+ *
+ * Uses EXT_FILTER_BANKS banks from bank.
+ */
+static HAL_StatusTypeDef config_ext_filters(CAN_HandleTypeDef *hcan, uint32_t bank, const NodeID recipients[2]);
+
+/**
+ * @brief Moves queued frames into free TX mailboxes until either runs out.
+ *
+ * Must be called with interrupts disabled or from a CAN interrupt.
+ */
+static void submit_queued_frames(CANWrapper_Handle *hcw);
+
+/**
+ * @brief Returns a monotonic 64-bit tick extended from the TIM16 counter.
+ */
+static uint64_t get_tick(CANWrapper_Handle *hcw);
+
+/**
+ * @brief Reads one frame out of an RX FIFO into the given queue.
+ */
+static void receive_frame(CANWrapper_Handle *hcw, CAN_HandleTypeDef *hcan, uint32_t rx_fifo, CANQueue *queue);
+
+/**
+ * @brief Returns true if the sequence number was already received from the sender.
+ *
+ * If mark is set and it wasn't, records that it now has been.
+ * Must be called in a critical section.
+ */
+static bool check_sequence(CANWrapper_Handle *hcw, NodeID sender, uint8_t seq, uint8_t bits, bool mark);
+
+/**
+ * @brief Handles an expired timer of a message waiting on an ACK.
+ *
+ * Starts a backoff after a timeout, resends the message after a backoff, or
+ * reports an error once the command's retries are used up. Must be called in
+ * a critical section.
+ */
+static void handle_expiry(CANWrapper_Handle *hcw, int index, TxCacheItem *item);
+
+/**
+ * @brief Queues an error for error_callback.
+ */
+static void push_error(CANWrapper_Handle *hcw, const CANWrapper_ErrorInfo *error_info);
+
+/**
+ * @brief Passes the queued errors to error_callback.
+ */
+static void report_errors(CANWrapper_Handle *hcw);
+
+/**
+ * @brief Returns the ticks to wait before the given attempt's resend.
+ */
+static uint64_t backoff_ticks(CANWrapper_Handle *hcw, const CmdConfig *config, uint8_t attempts);
+
+/**
+ * @brief Returns the ticks to wait for an ACK.
+ */
+static uint64_t timeout_ticks(const CmdConfig *config);
+
+/**
+ * @brief Queues an error with the current error counters.
+ *
+ * Safe to call from any context.
+ */
+static void push_bus_error(CANWrapper_Handle *hcw, int error);
+
+/**
+ * @brief Follows the controller's error state changes reported by HAL.
+ *
+ * Called from the CAN error interrupt.
+ */
+static void handle_bus_errors(CANWrapper_Handle *hcw, uint32_t errors);
+
+/**
+ * @brief Rejoins the bus after a bus-off, and notices recoveries that the
+ *        controller raises no interrupt for.
+ */
+static void update_bus_state(CANWrapper_Handle *hcw);
+
+/**
+ * @brief Returns the ticks to wait before rejoining after a bus-off.
+ */
+static uint64_t rejoin_delay_ticks(const CANWrapper_Handle *hcw);
+
+/**
+ * @brief Turns the last error code interrupt off for CAN_WRAPPER_LEC_REARM_MS.
+ *
+ * Called from the CAN error interrupt.
+ */
+static void mask_lec_interrupt(CANWrapper_Handle *hcw);
+
+/**
+ * @brief Turns the last error code interrupt back on once its time is up.
+ */
+static void rearm_lec_interrupt(CANWrapper_Handle *hcw);
+
+/**
+ * @brief Notes a successful transmission and refills the TX mailboxes.
+ */
+static void tx_complete(CANWrapper_Handle *hcw);
+
+/**
+ * @brief Handles one received message (ACK matching and callbacks).
+ */
+static void process_message(CANWrapper_Handle *hcw, const CANQueueItem *queue_item);
+
+/**
+ * @brief Passes a message to its registered handler, or to message_callback.
+ */
+static void dispatch(CANWrapper_Handle *hcw, const CANMessage *msg, const CANMessageInfo *info);
+
+/**
+ * @brief Completes the oldest request awaiting this reply, if there is one.
+ *
+ * @return true if the reply was passed to a request's on_reply.
+ */
+static bool complete_request(CANWrapper_Handle *hcw, const CANMessage *reply, NodeID sender);
+
+/**
+ * @brief Calls on_reply with NULL for requests that have timed out.
+ */
+static void expire_requests(CANWrapper_Handle *hcw);
+
+/**
+ * @brief Removes a request from its bucket. Call in a critical section.
+ */
+static void unlink_request(CANWrapper_Handle *hcw, int index);
+
+/**
+ * @brief Returns a request slot to the free list. Call in a critical section.
+ */
+static void free_request(CANWrapper_Handle *hcw, int index);
+
+/**
+ * @brief Returns the bucket of requests awaiting a reply with the given
+ *        command from the given node.
+ */
+static inline uint32_t request_bucket(NodeID recipient, uint8_t reply_cmd);
+
+#ifdef CAN_WRAPPER_OS
+/**
+ * @brief Returns the tick by which CANWrapper_Poll_Messages has time-based
+ *        work to do (timeouts, rejoining, transport, telemetry and capture
+ *        deadlines).
+ */
+static uint64_t next_deadline(CANWrapper_Handle *hcw);
+#endif
+
+/**
+ * @brief Wakes a task waiting in CANWrapper_Wait_And_Process, if the OS
+ *        layer is in use. Must not be called in a critical section.
+ */
+static inline void wake_waiter(CANWrapper_Handle *hcw);
+
+static inline uint32_t enter_critical();
+static inline void exit_critical(uint32_t primask);
 
 CANWrapper_StatusTypeDef CANWrapper_Init(CANWrapper_InitTypeDef init_struct)
 {
-	if ( !(init_struct.node_id <= 3
-		&& init_struct.message_callback != NULL
-		&& init_struct.hcan != NULL
-		&& init_struct.htim != NULL)) // TODO
+	return CANWrapperEx_Init(&s_default_handle, init_struct);
+}
+
+CANWrapper_StatusTypeDef CANWrapper_Poll_Messages()
+{
+	return CANWrapperEx_Poll_Messages(&s_default_handle);
+}
+
+CANWrapper_StatusTypeDef CANWrapper_Add_Filter(uint32_t id, uint32_t mask)
+{
+	return CANWrapperEx_Add_Filter(&s_default_handle, id, mask);
+}
+
+uint32_t CANWrapper_Get_FIFO_Overruns(uint32_t rx_fifo)
+{
+	return CANWrapperEx_Get_FIFO_Overruns(&s_default_handle, rx_fifo);
+}
+
+CANWrapper_StatusTypeDef CANWrapper_Transmit(NodeID recipient, CANMessage *msg)
+{
+	return CANWrapperEx_Transmit(&s_default_handle, recipient, msg);
+}
+
+CANWrapper_StatusTypeDef CANWrapper_Request(NodeID recipient, CANMessage *msg, CmdID reply_cmd,
+		CANReplyCallback on_reply, void *ctx, uint32_t timeout_ms)
+{
+	return CANWrapperEx_Request(&s_default_handle, recipient, msg, reply_cmd, on_reply, ctx, timeout_ms);
+}
+
+#ifdef CAN_WRAPPER_OS
+CANWrapper_StatusTypeDef CANWrapper_Wait_And_Process(uint32_t timeout_ms)
+{
+	return CANWrapperEx_Wait_And_Process(&s_default_handle, timeout_ms);
+}
+#endif
+
+CANWrapper_StatusTypeDef CANWrapper_Register_Handler(CmdID cmd, CANMessageHandler handler, void *ctx)
+{
+	return CANWrapperEx_Register_Handler(&s_default_handle, cmd, handler, ctx);
+}
+
+CANWrapper_StatusTypeDef CANWrapper_Register_Handler_Range(CmdID first, CmdID last, CANMessageHandler handler, void *ctx)
+{
+	return CANWrapperEx_Register_Handler_Range(&s_default_handle, first, last, handler, ctx);
+}
+
+uint32_t CANWrapper_Get_Unhandled_Count()
+{
+	return CANWrapperEx_Get_Unhandled_Count(&s_default_handle);
+}
+
+uint32_t CANWrapper_Get_Duplicate_Count()
+{
+	return CANWrapperEx_Get_Duplicate_Count(&s_default_handle);
+}
+
+void CANWrapper_Get_Stats(CANWrapper_Stats *out_stats)
+{
+	CANWrapperEx_Get_Stats(&s_default_handle, out_stats);
+}
+
+void CANWrapper_Reset_Stats()
+{
+	CANWrapperEx_Reset_Stats(&s_default_handle);
+}
+
+CANWrapper_BusState CANWrapper_Get_Bus_State()
+{
+	return CANWrapperEx_Get_Bus_State(&s_default_handle);
+}
+
+uint64_t CANWrapper_Get_Tick()
+{
+	return CANWrapperEx_Get_Tick(&s_default_handle);
+}
+
+CANWrapper_Handle *CANWrapper_Get_Default_Handle()
+{
+	return &s_default_handle;
+}
+
+CANWrapper_StatusTypeDef CANWrapperEx_Init(CANWrapper_Handle *hcw, CANWrapper_InitTypeDef init_struct)
+{
+	const NodeID max_node_id = init_struct.extended_ids ? CAN_WRAPPER_MAX_NODES - 1 : 3;
+
+	if ( !(init_struct.node_id <= max_node_id
+		&& (!init_struct.accept_broadcast || init_struct.broadcast_id <= max_node_id)
+		&& init_struct.hcan != NULL
+		&& init_struct.htim != NULL
+		&& hcw != NULL)) // TODO
+	{
+		return CAN_WRAPPER_INVALID_ARGS;
+	}
+
+	hcw->init = false;
+
+#ifdef CAN_WRAPPER_PROBES
+	CANProbe_Init();
+#endif
+
+	hcw->msg_queue = CANQueue_Create();
+	hcw->urgent_queue = CANQueue_Create();
+	hcw->tx_cache = TxCache_Create();
+	hcw->tx_queue = TxQueue_Create();
+	hcw->pending_acks = AckList_Create();
+	memset(hcw->next_seq, 0, sizeof(hcw->next_seq));
+	memset(hcw->rx_seq, 0, sizeof(hcw->rx_seq));
+	hcw->transport = NULL;
+	hcw->capture = NULL;
+	hcw->telemetry = NULL;
+
+	hcw->wake_tick = UINT64_MAX;
+#ifdef CAN_WRAPPER_OS
+	CANOS_Event_Init(&hcw->work_event);
+#endif
+	memset(hcw->handlers, 0, sizeof(hcw->handlers));
+	memset(&hcw->stats, 0, sizeof(hcw->stats));
+
+	memset(hcw->requests, 0, sizeof(hcw->requests));
+	memset(hcw->request_buckets, REQUEST_NONE, sizeof(hcw->request_buckets));
+	for (int i = 0; i < CAN_WRAPPER_MAX_REQUESTS; i++)
+	{
+		hcw->requests[i].next = i + 1 < CAN_WRAPPER_MAX_REQUESTS ? i + 1 : REQUEST_NONE;
+	}
+	hcw->free_request = 0;
+
+	hcw->init_struct = init_struct;
+
+	hcw->tick_overflows = 0;
+
+	hcw->error_count = 0;
+	hcw->bus_state = CAN_WRAPPER_BUS_ACTIVE;
+	hcw->rejoin_tick = 0;
+	hcw->bus_offs = 0;
+	hcw->ack_error_raised = false;
+	hcw->lec_masked = false;
+	hcw->lec_rearm_tick = 0;
+	// seeded from what tells instances apart, so a run can be repeated.
+	hcw->rng_state = 0x9E3779B9u ^ ((uint32_t)init_struct.node_id << 16 | first_filter_bank(init_struct.hcan));
+
+	// register before any interrupt is enabled so the callbacks can find us.
+	if (!register_instance(hcw))
+	{
+		return CAN_WRAPPER_NO_FREE_INSTANCE;
+	}
+
+	// on dual CAN devices the filter banks are split between CAN1 and CAN2.
+	const uint32_t bank = first_filter_bank(init_struct.hcan);
+
+	// only accept data frames addressed to us (or to the broadcast ID), with
+	// the identifier type we use.
+	const NodeID recipients[2] = {
+			init_struct.node_id,
+			init_struct.accept_broadcast ? init_struct.broadcast_id : init_struct.node_id
+	};
+
+	HAL_StatusTypeDef filter_status = init_struct.extended_ids
+			? config_ext_filters(init_struct.hcan, bank, recipients)
+			: config_std_filters(init_struct.hcan, bank, recipients);
+
+	// on failure, leave no trace in s_instances, so that the Init can be
+	// retried, or the peripheral given to another instance.
+	if (filter_status != HAL_OK)
+	{
+		unregister_instance(hcw);
+		return CAN_WRAPPER_FAILED_TO_CONFIG_FILTER;
+	}
+
+	hcw->next_filter_bank = bank + (init_struct.extended_ids ? EXT_FILTER_BANKS : STD_FILTER_BANKS);
+
+	if (HAL_CAN_Start(init_struct.hcan) != HAL_OK)
+	{
+		unregister_instance(hcw);
+		return CAN_WRAPPER_FAILED_TO_START_CAN;
+	}
+
+	// enable CAN interrupt.
+	if (HAL_CAN_ActivateNotification(init_struct.hcan, ENABLED_NOTIFICATIONS) != HAL_OK)
+	{
+		HAL_CAN_Stop(init_struct.hcan);
+		unregister_instance(hcw);
+		return CAN_WRAPPER_FAILED_TO_ENABLE_INTERRUPT;
+	}
+
+	// the update interrupt extends the timer to 64 bits. instances may share
+	// a timer, in which case it is already running.
+	bool timer_running = false;
+	for (size_t i = 0; i < CAN_WRAPPER_MAX_INSTANCES; i++)
+	{
+		if (s_instances[i] != NULL && s_instances[i] != hcw && s_instances[i]->init
+				&& s_instances[i]->init_struct.htim == init_struct.htim)
+		{
+			timer_running = true;
+		}
+	}
+
+	if (!timer_running && HAL_TIM_Base_Start_IT(init_struct.htim) != HAL_OK)
+	{
+		HAL_CAN_DeactivateNotification(init_struct.hcan, ENABLED_NOTIFICATIONS);
+		HAL_CAN_Stop(init_struct.hcan);
+		unregister_instance(hcw);
+		return CAN_WRAPPER_FAILED_TO_START_TIMER;
+	}
+
+	hcw->timeouts = TimingWheel_Create(hcw->timeout_nodes, TX_CACHE_SIZE, get_tick(hcw));
+	hcw->request_timeouts = TimingWheel_Create(hcw->request_timeout_nodes, CAN_WRAPPER_MAX_REQUESTS, get_tick(hcw));
+
+	hcw->init = true;
+	return CAN_WRAPPER_HAL_OK;
+}
+
+CANWrapper_StatusTypeDef CANWrapperEx_Poll_Messages(CANWrapper_Handle *hcw)
+{
+	if (!hcw->init) return CAN_WRAPPER_NOT_INITIALISED;
+
+	CAN_PROBE_BEGIN();
+
+	update_bus_state(hcw);
+	rearm_lec_interrupt(hcw);
+
+	// ACK what was received since the last poll before handling it, so that
+	// slow message callbacks don't delay the ACK's.
+	flush_pending_acks(hcw);
+
+	CANQueueItem batch[POLL_BATCH_SIZE];
+	size_t count;
+
+	while (true)
+	{
+		// the urgent queue is always served first. it is re-checked after
+		// every batch of bulk messages.
+		count = CANQueue_DequeueBatch(&hcw->urgent_queue, batch, POLL_BATCH_SIZE);
+		if (count == 0)
+			count = CANQueue_DequeueBatch(&hcw->msg_queue, batch, POLL_BATCH_SIZE);
+		if (count == 0)
+			break;
+
+		for (size_t i = 0; i < count; i++)
+		{
+			process_message(hcw, &batch[i]);
+		}
+	}
+
+	// transmissions from other tasks add to the TX cache and the timing
+	// wheel, so one expiry at a time is handled in a critical section.
+	uint32_t primask = enter_critical();
+	TimingWheel_Advance(&hcw->timeouts, get_tick(hcw));
+	exit_critical(primask);
+
+	while (true)
+	{
+		primask = enter_critical();
+
+		int index = TimingWheel_Pop_Expired(&hcw->timeouts);
+		if (index == TIMING_WHEEL_NONE)
+		{
+			exit_critical(primask);
+			break;
+		}
+
+		TxCacheItem *item = TxCache_At(&hcw->tx_cache, index);
+		if (item != NULL)
+			handle_expiry(hcw, index, item);
+
+		exit_critical(primask);
+	}
+
+	// after the messages, so a reply that arrived in time wins over its timeout.
+	expire_requests(hcw);
+
+	// only now is the callback free to transmit again.
+	report_errors(hcw);
+
+	if (hcw->transport != NULL)
+		CANTransport_Update(hcw->transport);
+
+	if (hcw->telemetry != NULL)
+		CANTelemetry_Update(hcw->telemetry);
+
+	if (hcw->capture != NULL)
+		CANCapture_Update(hcw->capture);
+
+	CAN_PROBE_END(CAN_PROBE_POLL);
+
+	return CAN_WRAPPER_HAL_OK;
+}
+
+#ifdef CAN_WRAPPER_OS
+CANWrapper_StatusTypeDef CANWrapperEx_Wait_And_Process(CANWrapper_Handle *hcw, uint32_t timeout_ms)
+{
+	if (!hcw->init) return CAN_WRAPPER_NOT_INITIALISED;
+
+	uint32_t primask = enter_critical();
+
+	uint64_t now = get_tick(hcw);
+	uint64_t deadline = next_deadline(hcw);
+
+	uint32_t wait_ms = timeout_ms;
+	if (deadline <= now)
+	{
+		wait_ms = 0;
+	}
+	else if (deadline != UINT64_MAX)
+	{
+		uint64_t until_ms = (deadline - now + CAN_WRAPPER_TICKS_PER_MS - 1) / CAN_WRAPPER_TICKS_PER_MS;
+		if (until_ms < wait_ms)
+			wait_ms = until_ms;
+	}
+
+	// transmissions from other tasks wake us if they need an earlier timeout.
+	hcw->wake_tick = wait_ms == CAN_OS_WAIT_FOREVER ? UINT64_MAX - 1 : now + (uint64_t)wait_ms*CAN_WRAPPER_TICKS_PER_MS;
+
+	exit_critical(primask);
+
+	// a frame received since the last poll has already signalled the event,
+	// so this returns straight away rather than missing it.
+	if (wait_ms > 0)
+		CANOS_Event_Wait(&hcw->work_event, wait_ms);
+
+	hcw->wake_tick = UINT64_MAX;
+
+	return CANWrapperEx_Poll_Messages(hcw);
+}
+#endif
+
+CANWrapper_StatusTypeDef CANWrapperEx_Add_Filter(CANWrapper_Handle *hcw, uint32_t id, uint32_t mask)
+{
+	if (!hcw->init) return CAN_WRAPPER_NOT_INITIALISED;
+
+	const uint32_t max_id = hcw->init_struct.extended_ids ? 0x1FFFFFFF : 0x7FF;
+
+	if (id > max_id || mask > max_id)
+		return CAN_WRAPPER_INVALID_ARGS;
+
+	if (hcw->next_filter_bank >= first_filter_bank(hcw->init_struct.hcan) + SLAVE_START_FILTER_BANK)
+		return CAN_WRAPPER_NO_FREE_FILTER;
+
+	uint32_t id_bits, mask_bits;
+	if (hcw->init_struct.extended_ids)
+	{
+		id_bits   = id << FILTER32_EXT_ID_SHIFT | FILTER32_IDE;
+		mask_bits = mask << FILTER32_EXT_ID_SHIFT | FILTER32_RTR | FILTER32_IDE;
+	}
+	else
+	{
+		id_bits   = id << FILTER32_STD_ID_SHIFT;
+		mask_bits = mask << FILTER32_STD_ID_SHIFT | FILTER32_RTR | FILTER32_IDE;
+	}
+
+	if (config_filter32(hcw->init_struct.hcan, hcw->next_filter_bank, CAN_FILTER_FIFO0, id_bits, mask_bits) != HAL_OK)
+	{
+		return CAN_WRAPPER_FAILED_TO_CONFIG_FILTER;
+	}
+
+	hcw->next_filter_bank++;
+	return CAN_WRAPPER_HAL_OK;
+}
+
+uint32_t CANWrapperEx_Get_FIFO_Overruns(const CANWrapper_Handle *hcw, uint32_t rx_fifo)
+{
+	if (rx_fifo != CAN_RX_FIFO0 && rx_fifo != CAN_RX_FIFO1)
+		return 0;
+
+	return hcw->stats.fifo_overruns[rx_fifo];
+}
+
+CANWrapper_StatusTypeDef CANWrapperEx_Transmit(CANWrapper_Handle *hcw, NodeID recipient, CANMessage *msg)
+{
+	CAN_PROBE_BEGIN();
+
+	CANWrapper_StatusTypeDef status = transmit_internal(hcw, recipient, msg);
+
+	CAN_PROBE_END(CAN_PROBE_TRANSMIT);
+
+	return status;
+}
+
+CANWrapper_StatusTypeDef CANWrapperEx_Request(CANWrapper_Handle *hcw, NodeID recipient, CANMessage *msg, CmdID reply_cmd,
+		CANReplyCallback on_reply, void *ctx, uint32_t timeout_ms)
+{
+	if (!hcw->init) return CAN_WRAPPER_NOT_INITIALISED;
+
+	if (recipient >= CAN_WRAPPER_MAX_NODES || reply_cmd >= CMD_ID_COUNT || on_reply == NULL || timeout_ms == 0)
+		return CAN_WRAPPER_INVALID_ARGS;
+
+	// every node would reply to a broadcast.
+	if (hcw->init_struct.accept_broadcast && recipient == hcw->init_struct.broadcast_id)
+		return CAN_WRAPPER_INVALID_ARGS;
+
+	uint32_t primask = enter_critical();
+
+	int index = hcw->free_request;
+	if (index == REQUEST_NONE)
+	{
+		exit_critical(primask);
+		return CAN_WRAPPER_NO_FREE_REQUEST;
+	}
+
+	hcw->free_request = hcw->requests[index].next;
+
+	hcw->requests[index].on_reply = on_reply;
+	hcw->requests[index].ctx = ctx;
+	hcw->requests[index].recipient = recipient;
+	hcw->requests[index].reply_cmd = reply_cmd;
+	hcw->requests[index].next = REQUEST_NONE;
+	uint16_t generation = ++hcw->requests[index].generation;
+
+	// append, so that replies complete requests for the same thing in order.
+	int8_t *link = &hcw->request_buckets[request_bucket(recipient, reply_cmd)];
+	while (*link != REQUEST_NONE)
+		link = &hcw->requests[*link].next;
+	*link = index;
+
+	uint64_t expiry = get_tick(hcw) + (uint64_t)timeout_ms*CAN_WRAPPER_TICKS_PER_MS;
+	TimingWheel_Schedule(&hcw->request_timeouts, index, expiry);
+
+	bool wake = expiry < hcw->wake_tick;
+
+	exit_critical(primask);
+
+	// registered before sending, since another task may poll in the reply
+	// before the transmit returns.
+	CANWrapper_StatusTypeDef status = CANWrapperEx_Transmit(hcw, recipient, msg);
+
+	if (status != CAN_WRAPPER_HAL_OK)
+	{
+		primask = enter_critical();
+
+		// unless it has already timed out, and the slot may even have been
+		// taken by another request since.
+		if (hcw->requests[index].on_reply != NULL && hcw->requests[index].generation == generation)
+		{
+			TimingWheel_Cancel(&hcw->request_timeouts, index);
+			unlink_request(hcw, index);
+			free_request(hcw, index);
+		}
+
+		exit_critical(primask);
+		return status;
+	}
+
+	// a task in CANWrapper_Wait_And_Process may sleep past the timeout.
+	if (wake)
+		wake_waiter(hcw);
+
+	return CAN_WRAPPER_HAL_OK;
+}
+
+CANWrapper_StatusTypeDef CANWrapperEx_Register_Handler(CANWrapper_Handle *hcw, CmdID cmd, CANMessageHandler handler, void *ctx)
+{
+	return CANWrapperEx_Register_Handler_Range(hcw, cmd, cmd, handler, ctx);
+}
+
+CANWrapper_StatusTypeDef CANWrapperEx_Register_Handler_Range(CANWrapper_Handle *hcw, CmdID first, CmdID last, CANMessageHandler handler, void *ctx)
+{
+	if (!hcw->init) return CAN_WRAPPER_NOT_INITIALISED;
+
+	if (first > last || last >= CMD_ID_COUNT)
+		return CAN_WRAPPER_INVALID_ARGS;
+
+	for (uint32_t cmd = first; cmd <= last; cmd++)
+	{
+		hcw->handlers[cmd].handler = handler;
+		hcw->handlers[cmd].ctx = ctx;
+	}
+
+	return CAN_WRAPPER_HAL_OK;
+}
+
+uint32_t CANWrapperEx_Get_Unhandled_Count(const CANWrapper_Handle *hcw)
+{
+	return hcw->stats.unhandled;
+}
+
+uint32_t CANWrapperEx_Get_Duplicate_Count(const CANWrapper_Handle *hcw)
+{
+	return hcw->stats.duplicates;
+}
+
+void CANWrapperEx_Get_Stats(const CANWrapper_Handle *hcw, CANWrapper_Stats *out_stats)
+{
+	memcpy(out_stats, &hcw->stats, sizeof(*out_stats));
+}
+
+void CANWrapperEx_Reset_Stats(CANWrapper_Handle *hcw)
+{
+	uint32_t primask = enter_critical();
+	memset(&hcw->stats, 0, sizeof(hcw->stats));
+	exit_critical(primask);
+}
+
+CANWrapper_BusState CANWrapperEx_Get_Bus_State(const CANWrapper_Handle *hcw)
+{
+	return hcw->bus_state;
+}
+
+uint64_t CANWrapperEx_Get_Tick(CANWrapper_Handle *hcw)
+{
+	if (!hcw->init) return 0;
+
+	return get_tick(hcw);
+}
+
+static CANWrapper_StatusTypeDef transmit_internal(CANWrapper_Handle *hcw, NodeID recipient, CANMessage *msg)
+{
+	if (!hcw->init) return CAN_WRAPPER_NOT_INITIALISED;
+
+	if (msg->cmd >= CMD_ID_COUNT) return CAN_WRAPPER_INVALID_ARGS;
+
+	if (recipient >= CAN_WRAPPER_MAX_NODES) return CAN_WRAPPER_INVALID_ARGS;
+
+	CmdConfig config = cmd_configs[msg->cmd];
+
+	// broadcasts are never ACK'd, so there is nothing to wait for.
+	bool is_broadcast = hcw->init_struct.accept_broadcast && recipient == hcw->init_struct.broadcast_id;
+	bool is_acked = config.policy == DELIVERY_ACKED && !is_broadcast;
+
+	// cmd ID + message body.
+	CANMessage frame = *msg;
+	uint8_t dlc = 1 + config.body_size;
+
+	uint32_t primask = enter_critical();
+
+	// the sequence number goes in the identifier, or else in the byte after
+	// the body if there is one. retries resend the same frame, so they carry
+	// the same number.
+	bool extended_ids = hcw->init_struct.extended_ids;
+	bool numbered = is_acked
+			&& (extended_ids || (hcw->init_struct.sequence_numbers && config.body_size < CAN_MAX_BODY_SIZE));
+
+	uint32_t seq = 0;
+	if (numbered)
+	{
+		seq = hcw->next_seq[recipient]++;
+
+		if (!extended_ids)
+			frame.data[dlc++] = seq;
+	}
+
+	uint32_t id = make_id(hcw, config.priority, msg->cmd, recipient, seq, false);
+	bool wake = false;
+
+	if (!queue_frame(hcw, id, &frame, dlc, config.policy == DELIVERY_LATEST_VALUE))
+	{
+		exit_critical(primask);
+		return CAN_WRAPPER_TX_QUEUE_FULL;
+	}
+
+	hcw->stats.nodes[recipient].tx_msgs++;
+	hcw->stats.cmd_tx[msg->cmd]++;
+
+	if (is_acked)
+	{
+		TxCacheItem cached_msg = {
+				.timestamp = get_tick(hcw),
+				.msg = {
+						.msg = frame,
+						.priority = config.priority,
+						.sender = hcw->init_struct.node_id,
+						.recipient = recipient,
+						.is_ack = false,
+						.dlc = dlc,
+				},
+				.id = id,
+				.seq = seq,
+				.numbered = numbered,
+				.attempts = 1,
+				.awaiting_retry = false,
+		};
+
+		int index = TxCache_Push_Back(&hcw->tx_cache, &cached_msg);
+
+		// the message is already queued, so it goes out either way, but
+		// nothing will notice if it isn't ACK'd.
+		if (index == TX_CACHE_NONE)
+		{
+			hcw->stats.tx_cache_full++;
+		}
+		else
+		{
+			uint64_t expiry = cached_msg.timestamp + timeout_ticks(&config);
+			TimingWheel_Schedule(&hcw->timeouts, index, expiry);
+			CAN_STATS_HWM(hcw->stats.tx_cache_hwm, hcw->tx_cache.size);
+
+			// a task in CANWrapper_Wait_And_Process may sleep past the timeout.
+			wake = expiry < hcw->wake_tick;
+		}
+	}
+
+	exit_critical(primask);
+
+	if (wake)
+		wake_waiter(hcw);
+
+	return CAN_WRAPPER_HAL_OK;
+}
+
+static uint32_t make_id(CANWrapper_Handle *hcw, uint8_t priority, uint8_t cmd, NodeID recipient, uint8_t seq, bool is_ack)
+{
+	CANIdFields fields = {
+			.priority = priority,
+			.cmd = cmd,
+			.sender = hcw->init_struct.node_id,
+			.recipient = recipient,
+			.seq = seq,
+			.is_ack = is_ack,
+	};
+
+	return CANId_Pack(&fields, hcw->init_struct.extended_ids);
+}
+
+static uint8_t seq_bits(bool extended_ids)
+{
+	return extended_ids ? CAN_ID_EXT_SEQ_BITS : STD_SEQ_BITS;
+}
+
+static int seq_distance(uint8_t a, uint8_t b, uint8_t bits)
+{
+	int range = 1 << bits;
+	int distance = (a - b) & (range - 1);
+	return distance >= range/2 ? distance - range : distance;
+}
+
+static int seq_window(uint8_t bits)
+{
+	// beyond half the range, behind can't be told from ahead.
+	int half = 1 << (bits - 1);
+	return CAN_WRAPPER_DUPLICATE_WINDOW < half ? CAN_WRAPPER_DUPLICATE_WINDOW : half;
+}
+
+static bool queue_frame(CANWrapper_Handle *hcw, uint32_t id, const CANMessage *data, uint8_t dlc, bool replace)
+{
+	TxQueueItem frame = {
+			.id = id,
+			.dlc = dlc,
+			.msg = *data,
+	};
+
+	uint32_t primask = enter_critical();
+
+	bool success = (replace && TxQueue_Replace(&hcw->tx_queue, &frame))
+			|| TxQueue_Push(&hcw->tx_queue, &frame);
+
+	// start sending straight away if a mailbox is free.
+	// otherwise the TX complete interrupt picks this frame up later.
+	if (success)
+	{
+		CAN_STATS_HWM(hcw->stats.tx_queue_hwm, hcw->tx_queue.size);
+		submit_queued_frames(hcw);
+	}
+	else
+	{
+		hcw->stats.tx_queue_full++;
+	}
+
+	exit_critical(primask);
+
+	return success;
+}
+
+static void flush_pending_acks(CANWrapper_Handle *hcw)
+{
+	PendingAck acks[ACK_LIST_SIZE];
+
+	uint32_t primask = enter_critical();
+	size_t count = AckList_Take_All(&hcw->pending_acks, acks);
+	exit_critical(primask);
+
+	bool sent[ACK_LIST_SIZE] = {0};
+
+	for (size_t first = 0; first < count; first++)
+	{
+		if (sent[first]) continue;
+
+		// gather the ACK's for this sender, oldest first.
+		CANMessage frame = {0};
+		uint8_t entries = 0;
+		uint8_t priority = acks[first].priority;
+
+		for (size_t i = first; i < count && entries < ACK_ENTRIES_PER_FRAME; i++)
+		{
+			if (sent[i] || acks[i].sender != acks[first].sender) continue;
+
+			frame.data[2*entries]     = acks[i].cmd | (acks[i].numbered ? ACK_ENTRY_NUMBERED : 0);
+			frame.data[2*entries + 1] = acks[i].key;
+			entries++;
+
+			hcw->stats.nodes[acks[i].sender].acks_sent++;
+
+			// the merged ACK is as urgent as the most urgent message in it.
+			if (acks[i].priority < priority)
+				priority = acks[i].priority;
+
+			sent[i] = true;
+		}
+
+		// if the TX queue is full the ACK is lost, and the sender will time out.
+		// any ACK's to this sender that didn't fit are sent when the loop
+		// reaches them.
+		// an ACK may cover several commands, so its identifier names none.
+		queue_frame(hcw, make_id(hcw, priority, 0, acks[first].sender, 0, true), &frame, 2*entries, false);
+	}
+}
+
+static void submit_queued_frames(CANWrapper_Handle *hcw)
+{
+	// frames stay queued while we are off the bus.
+	if (hcw->bus_state >= CAN_WRAPPER_BUS_OFF)
+		return;
+
+	while (!TxQueue_IsEmpty(&hcw->tx_queue)
+			&& HAL_CAN_GetTxMailboxesFreeLevel(hcw->init_struct.hcan) > 0)
+	{
+		TxQueueItem frame;
+		TxQueue_Pop(&hcw->tx_queue, &frame);
+
+		CAN_TxHeaderTypeDef tx_header;
+		if (hcw->init_struct.extended_ids)
+		{
+			tx_header.IDE = CAN_ID_EXT;   // use extended identifier.
+			tx_header.ExtId = frame.id;   // define extended identifier.
+			tx_header.StdId = 0;
+		}
+		else
+		{
+			tx_header.IDE = CAN_ID_STD;   // use standard identifier.
+			tx_header.StdId = frame.id;   // define standard identifier.
+			tx_header.ExtId = 0;
+		}
+		tx_header.RTR = CAN_RTR_DATA; // specify as data frame.
+		tx_header.DLC = frame.dlc;
+		tx_header.TransmitGlobalTime = DISABLE;
+
+		uint32_t tx_mailbox; // transmit mailbox.
+		HAL_StatusTypeDef status = HAL_CAN_AddTxMessage(hcw->init_struct.hcan, &tx_header, frame.msg.data, &tx_mailbox);
+
+		if (status == HAL_OK && hcw->capture != NULL)
+			CANCapture_Frame(hcw->capture, frame.id, hcw->init_struct.extended_ids, true, frame.dlc, frame.msg.data);
+	}
+}
+
+static void receive_frame(CANWrapper_Handle *hcw, CAN_HandleTypeDef *hcan, uint32_t rx_fifo, CANQueue *queue)
+{
+	HAL_StatusTypeDef status;
+
+	// write straight into the queue. if it is full, the frame still has
+	// to be read out of the FIFO, so read it into a scratch item.
+	CANQueueItem dropped_item;
+	CANQueueItem *queue_item = CANQueue_Reserve(queue);
+	if (queue_item == NULL)
+		queue_item = &dropped_item;
+
+	memset(queue_item, 0, sizeof(*queue_item));
+
+	// get CAN message.
+	CAN_RxHeaderTypeDef rx_header; // message header.
+	status = HAL_CAN_GetRxMessage(hcan, rx_fifo, &rx_header, (uint8_t*)&queue_item->msg);
+
+	if (status != HAL_OK)
+		return; // in theory this should never happen. :p
+
+	// decode by the frame's identifier type, which our filters match, but
+	// the application's may not.
+	bool extended_id = rx_header.IDE == CAN_ID_EXT;
+	uint32_t raw_id = extended_id ? rx_header.ExtId : rx_header.StdId;
+
+	if (hcw->capture != NULL)
+		CANCapture_Frame(hcw->capture, raw_id, extended_id, false, rx_header.DLC, queue_item->msg.msg.data);
+
+	CANIdFields fields;
+	CANId_Unpack(raw_id, extended_id, &fields);
+
+	bool is_ack = fields.is_ack;
+	NodeID recipient = fields.recipient;
+	NodeID sender = fields.sender;
+	uint8_t priority = fields.priority;
+	uint8_t id_seq = fields.seq;
+
+	// the hardware filters only pass frames addressed to us, unless the
+	// application added its own filters (e.g. for logging).
+	if (sender != hcw->init_struct.node_id)
+	{
+		queue_item->msg.priority = priority;
+		queue_item->msg.sender = sender;
+		queue_item->msg.recipient = recipient;
+		queue_item->msg.is_ack = is_ack;
+		queue_item->msg.dlc = rx_header.DLC;
+
+		uint8_t cmd = queue_item->msg.msg.cmd;
+		CANNodeStats *node_stats = &hcw->stats.nodes[sender];
+		node_stats->rx_frames++;
+		if (!is_ack && cmd < CMD_ID_COUNT)
+			hcw->stats.cmd_rx[cmd]++;
+
+		// only ACK messages meant for us. broadcasts are never ACK'd.
+		bool needs_ack = !is_ack && recipient == hcw->init_struct.node_id
+				&& cmd < CMD_ID_COUNT && cmd_configs[cmd].policy == DELIVERY_ACKED;
+
+		// extended identifiers always carry a sequence number. otherwise one
+		// follows the body if the sender numbers its messages.
+		bool has_seq = needs_ack && (extended_id || rx_header.DLC == 2u + cmd_configs[cmd].body_size);
+		uint8_t seq = extended_id ? id_seq : has_seq ? queue_item->msg.msg.data[rx_header.DLC - 1] : 0;
+		uint8_t bits = seq_bits(extended_id);
+
+		// the other RX FIFO's interrupt may also be pushing.
+		uint32_t primask = enter_critical();
+
+		// a retransmit whose first copy we already have. its ACK must have
+		// been lost, so ACK it again, but don't handle it twice.
+		// a full queue is no reason not to, since nothing is queued.
+		bool is_duplicate = has_seq && check_sequence(hcw, sender, seq, bits, false);
+
+		bool accepted = false;
+		if (queue_item != &dropped_item || is_duplicate)
+		{
+			accepted = true;
+
+			if (needs_ack)
+			{
+				// record the ACK. it is sent later from CANWrapper_Poll_Messages.
+				// the sequence number tells apart messages with the same
+				// body, where the hash can't.
+				const PendingAck ack = {
+						.sender = sender,
+						.cmd = cmd,
+						.key = has_seq ? seq : CANMessage_Hash(&queue_item->msg.msg) & 0xFF,
+						.numbered = has_seq,
+						.priority = priority,
+				};
+
+				accepted = AckList_Push(&hcw->pending_acks, &ack);
+			}
+
+			// a message that can't be ACK'd is dropped so that the sender
+			// times out rather than believing it was delivered.
+			if (accepted && is_duplicate)
+			{
+				hcw->stats.duplicates++;
+			}
+			else if (accepted)
+			{
+				if (has_seq)
+					check_sequence(hcw, sender, seq, bits, true);
+
+				CANQueue_Commit(queue);
+
+				uint16_t *queue_hwm = queue == &hcw->urgent_queue
+						? &hcw->stats.urgent_queue_hwm : &hcw->stats.msg_queue_hwm;
+				CAN_STATS_HWM(*queue_hwm, CANQueue_Size(queue));
+			}
+
+			if (needs_ack && accepted)
+				CAN_STATS_HWM(hcw->stats.pending_acks_hwm, hcw->pending_acks.size);
+		}
+
+		if (!accepted)
+			node_stats->rx_dropped++;
+
+		exit_critical(primask);
+
+		if (accepted)
+			wake_waiter(hcw);
+	}
+}
+
+static bool check_sequence(CANWrapper_Handle *hcw, NodeID sender, uint8_t seq, uint8_t bits, bool mark)
+{
+	if (sender >= CAN_WRAPPER_MAX_NODES) return false;
+
+	typeof(hcw->rx_seq[0]) *state = &hcw->rx_seq[sender];
+	uint64_t now = get_tick(hcw);
+
+	// a long silence means the sender may have restarted its numbering.
+	bool expired = now - state->last_tick > (uint64_t)CAN_WRAPPER_DUPLICATE_EXPIRY_MS*CAN_WRAPPER_TICKS_PER_MS;
+
+	// signed difference keeps the ordering valid across wraparound.
+	int ahead = seq_distance(seq, state->newest, bits);
+	int window = seq_window(bits);
+
+	// senders never retry a message this far back, so this one is new and
+	// the sender restarted its numbering.
+	bool restarted = ahead <= -window;
+
+	if (!state->valid || expired || restarted)
+	{
+		// nothing to compare against. start again from this message.
+		if (mark)
+		{
+			state->valid = true;
+			state->newest = seq;
+			state->window = 1;
+			state->last_tick = now;
+		}
+		return false;
+	}
+
+	if (ahead <= 0)
+	{
+		uint64_t bit = 1ull << -ahead;
+		if (state->window & bit)
+			return true;
+
+		// an older message that arrived late.
+		if (mark)
+			state->window |= bit;
+		return false;
+	}
+
+	if (mark)
+	{
+		state->window = ahead < window ? state->window << ahead | 1 : 1;
+		state->newest = seq;
+		state->last_tick = now;
+	}
+	return false;
+}
+
+static void handle_expiry(CANWrapper_Handle *hcw, int index, TxCacheItem *item)
+{
+	const CmdConfig *config = &cmd_configs[item->msg.msg.cmd];
+	uint64_t now = get_tick(hcw);
+
+	// the recipient only recognises retransmits of our last few messages to
+	// it (see CAN_WRAPPER_DUPLICATE_WINDOW). it would take an older one for
+	// a new message, so give up on it instead.
+	bool out_of_window = false;
+	if (item->numbered)
+	{
+		uint32_t newer = hcw->next_seq[item->msg.recipient] - 1 - item->seq;
+		out_of_window = newer >= (uint32_t)seq_window(seq_bits(hcw->init_struct.extended_ids));
+	}
+
+	if (item->awaiting_retry && !out_of_window)
+	{
+		// backoff over. send again and wait for the ACK.
+		// if the TX queue is full, this attempt times out like a lost frame.
+		item->awaiting_retry = false;
+		item->attempts++;
+		item->timestamp = now;
+
+		hcw->stats.nodes[item->msg.recipient].tx_retries++;
+		hcw->stats.cmd_tx[item->msg.msg.cmd]++;
+
+		queue_frame(hcw, item->id, &item->msg.msg, item->msg.dlc, false);
+
+		TimingWheel_Schedule(&hcw->timeouts, index, now + timeout_ticks(config));
+		return;
+	}
+
+	if (!item->awaiting_retry)
+		hcw->stats.nodes[item->msg.recipient].tx_timeouts++;
+
+	if (!item->awaiting_retry && !out_of_window && item->attempts <= config->max_retries)
+	{
+		// timed out. an ACK for an earlier attempt may still arrive while
+		// we wait, which ends the retries.
+		item->awaiting_retry = true;
+		TimingWheel_Schedule(&hcw->timeouts, index, now + backoff_ticks(hcw, config, item->attempts));
+		return;
+	}
+
+	// out of retries.
+	CANWrapper_ErrorInfo error_info;
+	error_info.error = CAN_WRAPPER_ERROR_TIMEOUT;
+	error_info.msg = item->msg.msg;
+	error_info.recipient = item->msg.recipient;
+
+	TxCache_Erase(&hcw->tx_cache, index);
+
+	hcw->stats.nodes[item->msg.recipient].tx_failures++;
+	push_error(hcw, &error_info);
+}
+
+static void push_error(CANWrapper_Handle *hcw, const CANWrapper_ErrorInfo *error_info)
+{
+	// the CAN error interrupt also pushes.
+	uint32_t primask = enter_critical();
+
+	if (hcw->error_count == CAN_WRAPPER_ERROR_QUEUE_SIZE)
+		hcw->stats.lost_errors++;
+	else
+		hcw->errors[hcw->error_count++] = *error_info;
+
+	exit_critical(primask);
+}
+
+static void report_errors(CANWrapper_Handle *hcw)
+{
+	CANWrapper_ErrorInfo errors[CAN_WRAPPER_ERROR_QUEUE_SIZE];
+
+	// take a copy, so errors raised by the callbacks wait for the next poll.
+	uint32_t primask = enter_critical();
+	uint8_t count = hcw->error_count;
+	memcpy(errors, hcw->errors, count * sizeof(errors[0]));
+	hcw->error_count = 0;
+	exit_critical(primask);
+
+	for (uint8_t i = 0; i < count; i++)
+	{
+		if (hcw->init_struct.error_callback != NULL)
+			hcw->init_struct.error_callback(errors[i]);
+	}
+}
+
+static void push_bus_error(CANWrapper_Handle *hcw, int error)
+{
+	uint32_t esr = hcw->init_struct.hcan->Instance->ESR;
+
+	CANWrapper_ErrorInfo error_info;
+	memset(&error_info, 0, sizeof(error_info));
+	error_info.error = error;
+	error_info.tec = (esr & CAN_ESR_TEC_Msk) >> CAN_ESR_TEC_Pos;
+	error_info.rec = (esr & CAN_ESR_REC_Msk) >> CAN_ESR_REC_Pos;
+
+	push_error(hcw, &error_info);
+}
+
+static void handle_bus_errors(CANWrapper_Handle *hcw, uint32_t errors)
+{
+	// HAL reports the warning, passive and bus-off flags for as long as they
+	// are set, so only act on the way in.
+	if ((errors & HAL_CAN_ERROR_BOF) && hcw->bus_state < CAN_WRAPPER_BUS_OFF)
 	{
-		return CAN_WRAPPER_INVALID_ARGS;
+		// the controller stays off the bus until it is restarted.
+		hcw->bus_state = CAN_WRAPPER_BUS_OFF;
+		if (hcw->bus_offs < UINT8_MAX)
+			hcw->bus_offs++;
+		hcw->rejoin_tick = get_tick(hcw) + rejoin_delay_ticks(hcw);
+		hcw->stats.bus_offs++;
+
+		push_bus_error(hcw, CAN_WRAPPER_ERROR_BUS_OFF);
+	}
+	else if ((errors & HAL_CAN_ERROR_EPV) && hcw->bus_state < CAN_WRAPPER_BUS_PASSIVE)
+	{
+		hcw->bus_state = CAN_WRAPPER_BUS_PASSIVE;
+		push_bus_error(hcw, CAN_WRAPPER_ERROR_BUS_PASSIVE);
+	}
+	else if ((errors & HAL_CAN_ERROR_EWG) && hcw->bus_state < CAN_WRAPPER_BUS_WARNING)
+	{
+		hcw->bus_state = CAN_WRAPPER_BUS_WARNING;
+		push_bus_error(hcw, CAN_WRAPPER_ERROR_BUS_WARNING);
 	}
 
-	const CAN_FilterTypeDef filter_config = {
-			.FilterIdHigh         = 0x0000,
-			.FilterIdLow          = 0x0000,
-			.FilterMaskIdHigh     = 0x0000,
-			.FilterMaskIdLow      = 0x0000,
-			.FilterFIFOAssignment = CAN_FILTER_FIFO0,
-			.FilterBank           = 0,
-			.FilterMode           = CAN_FILTERMODE_IDMASK,
-			.FilterScale          = CAN_FILTERSCALE_32BIT,
-			.FilterActivation     = ENABLE,
-			.SlaveStartFilterBank = 14,
+	// the controller retries a frame nobody acknowledges until it is sent,
+	// so raise this once until a frame gets through.
+	if ((errors & HAL_CAN_ERROR_ACK) && !hcw->ack_error_raised)
+	{
+		hcw->ack_error_raised = true;
+		push_bus_error(hcw, CAN_WRAPPER_ERROR_CAN_TIMEOUT);
+	}
+}
+
+static void update_bus_state(CANWrapper_Handle *hcw)
+{
+	if (hcw->bus_state == CAN_WRAPPER_BUS_ACTIVE)
+		return;
+
+	if (hcw->bus_state == CAN_WRAPPER_BUS_OFF)
+	{
+		if (get_tick(hcw) < hcw->rejoin_tick)
+			return;
+
+		// restarting makes the controller rejoin once it has seen the bus
+		// idle for 128 x 11 bits. it keeps its filters and interrupts.
+		if (HAL_CAN_Stop(hcw->init_struct.hcan) != HAL_OK
+				|| HAL_CAN_Start(hcw->init_struct.hcan) != HAL_OK)
+		{
+			hcw->rejoin_tick = get_tick(hcw) + rejoin_delay_ticks(hcw);
+			return;
+		}
+
+		hcw->bus_state = CAN_WRAPPER_BUS_REJOINING;
+	}
+
+	// the error counters fall without raising an interrupt, so follow them here.
+	uint32_t esr = hcw->init_struct.hcan->Instance->ESR;
+
+	if (esr & CAN_ESR_BOFF)
+		return; // still rejoining.
+
+	CANWrapper_BusState state = (esr & CAN_ESR_EPVF) ? CAN_WRAPPER_BUS_PASSIVE
+			: (esr & CAN_ESR_EWGF) ? CAN_WRAPPER_BUS_WARNING
+			: CAN_WRAPPER_BUS_ACTIVE;
+
+	uint32_t primask = enter_critical();
+
+	// the error interrupt may have raised the state since we read the flags.
+	if (state < hcw->bus_state && !(hcw->init_struct.hcan->Instance->ESR & CAN_ESR_BOFF))
+	{
+		bool rejoined = hcw->bus_state == CAN_WRAPPER_BUS_REJOINING;
+		hcw->bus_state = state;
+
+		// send what was queued while we were away.
+		if (rejoined)
+			submit_queued_frames(hcw);
+
+		if (state == CAN_WRAPPER_BUS_ACTIVE)
+			push_bus_error(hcw, CAN_WRAPPER_ERROR_BUS_RECOVERED);
+	}
+
+	exit_critical(primask);
+}
+
+static uint64_t rejoin_delay_ticks(const CANWrapper_Handle *hcw)
+{
+	uint32_t delay_ms = hcw->init_struct.rejoin_delay_ms != 0
+			? hcw->init_struct.rejoin_delay_ms : CAN_WRAPPER_DEFAULT_REJOIN_DELAY_MS;
+	uint32_t max_delay_ms = hcw->init_struct.max_rejoin_delay_ms != 0
+			? hcw->init_struct.max_rejoin_delay_ms : CAN_WRAPPER_DEFAULT_MAX_REJOIN_DELAY_MS;
+
+	// back off further each time we are knocked off the bus without
+	// getting a frame through in between.
+	for (uint8_t i = 1; i < hcw->bus_offs && delay_ms < max_delay_ms; i++)
+		delay_ms *= 2;
+
+	if (delay_ms > max_delay_ms)
+		delay_ms = max_delay_ms;
+
+	return (uint64_t)delay_ms*CAN_WRAPPER_TICKS_PER_MS;
+}
+
+static void mask_lec_interrupt(CANWrapper_Handle *hcw)
+{
+	// the controller raises the interrupt for every error frame it sees.
+	// the first one is enough to report the error.
+	HAL_CAN_DeactivateNotification(hcw->init_struct.hcan, CAN_IT_LAST_ERROR_CODE);
+
+	hcw->lec_rearm_tick = get_tick(hcw) + (uint64_t)CAN_WRAPPER_LEC_REARM_MS*CAN_WRAPPER_TICKS_PER_MS;
+	hcw->lec_masked = true;
+	hcw->stats.lec_masks++;
+}
+
+static void rearm_lec_interrupt(CANWrapper_Handle *hcw)
+{
+	// the interrupt can't mask it again while it is off.
+	if (!hcw->lec_masked || get_tick(hcw) < hcw->lec_rearm_tick)
+		return;
+
+	uint32_t primask = enter_critical();
+	hcw->lec_masked = false;
+	HAL_CAN_ActivateNotification(hcw->init_struct.hcan, CAN_IT_LAST_ERROR_CODE);
+	exit_critical(primask);
+}
+
+static void tx_complete(CANWrapper_Handle *hcw)
+{
+	hcw->bus_offs = 0;
+	hcw->ack_error_raised = false;
+
+	submit_queued_frames(hcw);
+
+	// the transport waits for room in the TX queue to send more segments.
+	if (hcw->transport != NULL)
+		wake_waiter(hcw);
+}
+
+static uint64_t backoff_ticks(CANWrapper_Handle *hcw, const CmdConfig *config, uint8_t attempts)
+{
+	// xorshift32.
+	uint32_t x = hcw->rng_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	hcw->rng_state = x;
+
+	uint8_t doublings = attempts - 1 < 8 ? attempts - 1 : 8;
+	uint64_t backoff_ms = (uint64_t)config->backoff << doublings;
+	uint64_t jitter_us = config->jitter != 0 ? x % ((uint32_t)config->jitter*CAN_WRAPPER_TICKS_PER_MS + 1) : 0;
+
+	return backoff_ms*CAN_WRAPPER_TICKS_PER_MS + jitter_us;
+}
+
+static uint64_t timeout_ticks(const CmdConfig *config)
+{
+	uint32_t timeout_ms = config->timeout != 0 ? config->timeout : DEFAULT_TIMEOUT_MS;
+	return (uint64_t)timeout_ms*CAN_WRAPPER_TICKS_PER_MS;
+}
+
+static void process_message(CANWrapper_Handle *hcw, const CANQueueItem *queue_item)
+{
+	if (!queue_item->msg.is_ack && hcw->transport != NULL
+			&& CANTransport_Is_Transport_Cmd(queue_item->msg.msg.cmd))
+	{
+		CANTransport_Process_Message(hcw->transport, &queue_item->msg.msg, queue_item->msg.sender, queue_item->msg.recipient);
+		return;
+	}
+
+	CANMessageInfo info = {
+			.sender = queue_item->msg.sender,
+			.priority = queue_item->msg.priority,
+			.is_ack = false,
 	};
 
-	if (HAL_CAN_ConfigFilter(init_struct.hcan, &filter_config) != HAL_OK)
+	if (!queue_item->msg.is_ack)
 	{
-		return CAN_WRAPPER_FAILED_TO_CONFIG_FILTER;
+		// a reply to us. broadcasts, and messages an application filter
+		// passes between other nodes, don't answer our requests.
+		bool to_us = queue_item->msg.recipient == hcw->init_struct.node_id;
+		if (!to_us || !complete_request(hcw, &queue_item->msg.msg, info.sender))
+			dispatch(hcw, &queue_item->msg.msg, &info);
+		return;
 	}
 
-	if (HAL_CAN_Start(init_struct.hcan) != HAL_OK)
+	// an application filter may pass ACK's between other nodes. their
+	// entries could match our own messages to the same node.
+	if (queue_item->msg.recipient != hcw->init_struct.node_id)
+		return;
+
+	info.is_ack = true;
+
+	const uint8_t seq_mask = (1U << seq_bits(hcw->init_struct.extended_ids)) - 1;
+
+	// an ACK frame holds (cmd, key) pairs for several of our messages.
+	for (uint8_t i = 0; i + 1 < queue_item->msg.dlc; i += 2)
 	{
-		return CAN_WRAPPER_FAILED_TO_START_CAN;
+		uint8_t cmd = queue_item->msg.msg.data[i] & ~ACK_ENTRY_NUMBERED;
+		uint8_t key = queue_item->msg.msg.data[i + 1];
+
+		// delete the cache entry for this message. other tasks may be
+		// transmitting, which adds to the cache.
+		uint32_t primask = enter_critical();
+
+		int index = (queue_item->msg.msg.data[i] & ACK_ENTRY_NUMBERED)
+				? TxCache_Find_Seq(&hcw->tx_cache, queue_item->msg.sender, cmd, key, seq_mask)
+				: TxCache_Find(&hcw->tx_cache, queue_item->msg.sender, cmd, key);
+		const TxCacheItem *item = TxCache_At(&hcw->tx_cache, index);
+		if (item == NULL)
+		{
+			exit_critical(primask);
+			continue;
+		}
+
+		CANMessage acked_msg = item->msg.msg;
+
+		// timed from the attempt that was ACK'd, or at least the latest one.
+		hcw->stats.nodes[queue_item->msg.sender].acks_received++;
+		hcw->stats.ack_rtt[CANStats_RTT_Bucket(get_tick(hcw) - item->timestamp)]++;
+
+		TimingWheel_Cancel(&hcw->timeouts, index);
+		TxCache_Erase(&hcw->tx_cache, index);
+
+		exit_critical(primask);
+
+		if (hcw->init_struct.notify_of_acks)
+		{
+			dispatch(hcw, &acked_msg, &info);
+		}
 	}
+}
 
-	// enable CAN interrupt.
-	if (HAL_CAN_ActivateNotification(init_struct.hcan, CAN_IT_RX_FIFO0_MSG_PENDING) != HAL_OK)
+static void dispatch(CANWrapper_Handle *hcw, const CANMessage *msg, const CANMessageInfo *info)
+{
+	if (msg->cmd < CMD_ID_COUNT && hcw->handlers[msg->cmd].handler != NULL)
 	{
-		return CAN_WRAPPER_FAILED_TO_ENABLE_INTERRUPT;
+		hcw->handlers[msg->cmd].handler(msg, info, hcw->handlers[msg->cmd].ctx);
+		return;
 	}
 
-	if (HAL_TIM_Base_Start(init_struct.htim) != HAL_OK)
+	// ACK notifications aren't commands we were asked to handle.
+	if (!info->is_ack)
+		hcw->stats.unhandled++;
+
+	if (hcw->init_struct.message_callback != NULL)
 	{
-		return CAN_WRAPPER_FAILED_TO_START_TIMER;
+		hcw->init_struct.message_callback(*msg, info->sender, info->is_ack);
 	}
+}
+
+static bool complete_request(CANWrapper_Handle *hcw, const CANMessage *reply, NodeID sender)
+{
+	if (reply->cmd >= CMD_ID_COUNT || sender >= CAN_WRAPPER_MAX_NODES)
+		return false;
 
-	s_msg_queue = CANQueue_Create();
-	s_tx_cache = TxCache_Create();
+	uint32_t bucket = request_bucket(sender, reply->cmd);
 
-	s_init_struct = init_struct;
+	// most messages aren't replies. skip the critical section for them.
+	if (hcw->request_buckets[bucket] == REQUEST_NONE)
+		return false;
 
-	s_init = true;
-	return CAN_WRAPPER_HAL_OK;
+	uint32_t primask = enter_critical();
+
+	// the bucket rarely holds more than the requests for this reply.
+	int8_t *link = &hcw->request_buckets[bucket];
+	while (*link != REQUEST_NONE
+			&& !(hcw->requests[*link].recipient == sender && hcw->requests[*link].reply_cmd == reply->cmd))
+	{
+		link = &hcw->requests[*link].next;
+	}
+
+	int index = *link;
+	if (index == REQUEST_NONE)
+	{
+		exit_critical(primask);
+		return false;
+	}
+
+	*link = hcw->requests[index].next;
+	TimingWheel_Cancel(&hcw->request_timeouts, index);
+
+	CANReplyCallback on_reply = hcw->requests[index].on_reply;
+	void *ctx = hcw->requests[index].ctx;
+	free_request(hcw, index);
+
+	exit_critical(primask);
+
+	// the slot is already free, so on_reply may make another request.
+	on_reply(reply, sender, ctx);
+
+	return true;
 }
 
-CANWrapper_StatusTypeDef CANWrapper_Poll_Messages()
+static void expire_requests(CANWrapper_Handle *hcw)
+{
+	uint32_t primask = enter_critical();
+	TimingWheel_Advance(&hcw->request_timeouts, get_tick(hcw));
+	exit_critical(primask);
+
+	while (true)
+	{
+		primask = enter_critical();
+
+		int index = TimingWheel_Pop_Expired(&hcw->request_timeouts);
+		if (index == TIMING_WHEEL_NONE)
+		{
+			exit_critical(primask);
+			break;
+		}
+
+		unlink_request(hcw, index);
+
+		CANReplyCallback on_reply = hcw->requests[index].on_reply;
+		void *ctx = hcw->requests[index].ctx;
+		NodeID recipient = hcw->requests[index].recipient;
+		free_request(hcw, index);
+
+		exit_critical(primask);
+
+		on_reply(NULL, recipient, ctx);
+	}
+}
+
+static void unlink_request(CANWrapper_Handle *hcw, int index)
+{
+	int8_t *link = &hcw->request_buckets[request_bucket(hcw->requests[index].recipient, hcw->requests[index].reply_cmd)];
+
+	while (*link != REQUEST_NONE && *link != index)
+		link = &hcw->requests[*link].next;
+
+	if (*link == index)
+		*link = hcw->requests[index].next;
+}
+
+static void free_request(CANWrapper_Handle *hcw, int index)
+{
+	hcw->requests[index].on_reply = NULL;
+	hcw->requests[index].next = hcw->free_request;
+	hcw->free_request = index;
+}
+
+static inline uint32_t request_bucket(NodeID recipient, uint8_t reply_cmd)
 {
-	if (!s_init) return CAN_WRAPPER_NOT_INITIALISED;
+	return (reply_cmd ^ recipient*13u) & (CAN_WRAPPER_REQUEST_BUCKETS - 1);
+}
+
+static HAL_StatusTypeDef config_filter_pair(CAN_HandleTypeDef *hcan, uint32_t bank, uint32_t fifo,
+		uint16_t id1, uint16_t mask1, uint16_t id2, uint16_t mask2)
+{
+	const CAN_FilterTypeDef filter_config = {
+			.FilterIdHigh         = id2,
+			.FilterIdLow          = id1,
+			.FilterMaskIdHigh     = mask2,
+			.FilterMaskIdLow      = mask1,
+			.FilterFIFOAssignment = fifo,
+			.FilterBank           = bank,
+			.FilterMode           = CAN_FILTERMODE_IDMASK,
+			.FilterScale          = CAN_FILTERSCALE_16BIT,
+			.FilterActivation     = ENABLE,
+			.SlaveStartFilterBank = SLAVE_START_FILTER_BANK,
+	};
+
+	return HAL_CAN_ConfigFilter(hcan, &filter_config);
+}
+
+static HAL_StatusTypeDef config_filter32(CAN_HandleTypeDef *hcan, uint32_t bank, uint32_t fifo,
+		uint32_t id, uint32_t mask)
+{
+	const CAN_FilterTypeDef filter_config = {
+			.FilterIdHigh         = id >> 16,
+			.FilterIdLow          = id & 0xFFFF,
+			.FilterMaskIdHigh     = mask >> 16,
+			.FilterMaskIdLow      = mask & 0xFFFF,
+			.FilterFIFOAssignment = fifo,
+			.FilterBank           = bank,
+			.FilterMode           = CAN_FILTERMODE_IDMASK,
+			.FilterScale          = CAN_FILTERSCALE_32BIT,
+			.FilterActivation     = ENABLE,
+			.SlaveStartFilterBank = SLAVE_START_FILTER_BANK,
+	};
 
-	CANQueueItem queue_item;
+	return HAL_CAN_ConfigFilter(hcan, &filter_config);
+}
+
+static HAL_StatusTypeDef config_std_filters(CAN_HandleTypeDef *hcan, uint32_t bank, const NodeID recipients[2])
+{
+	// ACKs and urgent messages go to FIFO1 so that a burst of bulk messages
+	// can't overflow the FIFO they arrive in. the filters don't overlap.
+	const uint16_t ack_mask    = (CAN_ID_RECIPIENT_MASK | CAN_ID_ACK_MASK) << FILTER16_STD_ID_SHIFT | FILTER16_RTR | FILTER16_IDE;
+	const uint16_t urgent_mask = (CAN_ID_RECIPIENT_MASK | CAN_ID_ACK_MASK | CAN_ID_URGENT_MASK) << FILTER16_STD_ID_SHIFT | FILTER16_RTR | FILTER16_IDE;
+	const uint16_t ack_bits    = CAN_ID_ACK_MASK << FILTER16_STD_ID_SHIFT;
+	const uint16_t bulk_bits   = CAN_ID_URGENT_MASK << FILTER16_STD_ID_SHIFT;
 
-	while (CANQueue_Dequeue(&s_msg_queue, &queue_item))
+	for (uint32_t i = 0; i < 2; i++)
 	{
-		if (queue_item.msg.is_ack)
+		const uint16_t recipient_bits = (recipients[i] << CAN_ID_RECIPIENT_SHIFT & CAN_ID_RECIPIENT_MASK) << FILTER16_STD_ID_SHIFT;
+
+		if (config_filter_pair(hcan, bank + 2*i, CAN_FILTER_FIFO1,
+				recipient_bits | ack_bits, ack_mask,
+				recipient_bits, urgent_mask) != HAL_OK
+			|| config_filter_pair(hcan, bank + 2*i + 1, CAN_FILTER_FIFO0,
+				recipient_bits | bulk_bits, urgent_mask,
+				recipient_bits | bulk_bits, urgent_mask) != HAL_OK)
 		{
-			// delete the cache entry for this message
-			int index = TxCache_Find(&s_tx_cache, &queue_item.msg);
-			TxCache_Erase(&s_tx_cache, index);
+			return HAL_ERROR;
 		}
+	}
+
+	return HAL_OK;
+}
+
+static HAL_StatusTypeDef config_ext_filters(CAN_HandleTypeDef *hcan, uint32_t bank, const NodeID recipients[2])
+{
+	// same split as config_std_filters, but only one extended identifier
+	// filter fits in a bank.
+	const uint32_t ack_mask    = (CAN_ID_EXT_RECIPIENT_MASK | CAN_ID_EXT_ACK_MASK) << FILTER32_EXT_ID_SHIFT | FILTER32_RTR | FILTER32_IDE;
+	const uint32_t urgent_mask = (CAN_ID_EXT_RECIPIENT_MASK | CAN_ID_EXT_ACK_MASK | CAN_ID_EXT_URGENT_MASK) << FILTER32_EXT_ID_SHIFT | FILTER32_RTR | FILTER32_IDE;
+	const uint32_t ack_bits    = CAN_ID_EXT_ACK_MASK << FILTER32_EXT_ID_SHIFT | FILTER32_IDE;
+	const uint32_t urgent_bits = FILTER32_IDE;
+	const uint32_t bulk_bits   = CAN_ID_EXT_URGENT_MASK << FILTER32_EXT_ID_SHIFT | FILTER32_IDE;
+
+	for (uint32_t i = 0; i < 2; i++)
+	{
+		const uint32_t recipient_bits = ((uint32_t)recipients[i] << CAN_ID_EXT_RECIPIENT_SHIFT & CAN_ID_EXT_RECIPIENT_MASK) << FILTER32_EXT_ID_SHIFT;
 
-		if (!queue_item.msg.is_ack || s_init_struct.notify_of_acks)
+		if (config_filter32(hcan, bank + 3*i, CAN_FILTER_FIFO1, recipient_bits | ack_bits, ack_mask) != HAL_OK
+			|| config_filter32(hcan, bank + 3*i + 1, CAN_FILTER_FIFO1, recipient_bits | urgent_bits, urgent_mask) != HAL_OK
+			|| config_filter32(hcan, bank + 3*i + 2, CAN_FILTER_FIFO0, recipient_bits | bulk_bits, urgent_mask) != HAL_OK)
 		{
-			s_init_struct.message_callback(queue_item.msg.msg, queue_item.msg.sender, queue_item.msg.is_ack);
+			return HAL_ERROR;
 		}
 	}
 
-	// TODO: Needs serious cleaning up.
-	uint32_t counter_value = __HAL_TIM_GET_COUNTER(s_init_struct.htim);
-	uint32_t rcr_value = s_init_struct.htim->Instance->RCR;
-	uint64_t current_tick = counter_value + rcr_value*PERIOD_TICKS;
+	return HAL_OK;
+}
+
+static uint64_t get_tick(CANWrapper_Handle *hcw)
+{
+	TIM_HandleTypeDef *htim = hcw->init_struct.htim;
+
+	uint32_t primask = enter_critical();
+
+	uint32_t overflows = hcw->tick_overflows;
+	uint32_t counter_value = __HAL_TIM_GET_COUNTER(htim);
 
-	while (s_tx_cache.size > 0)
+	// the counter may have wrapped without the update interrupt having run
+	// yet (we are in a critical section or a higher priority interrupt).
+	if (__HAL_TIM_GET_FLAG(htim, TIM_FLAG_UPDATE))
 	{
-		const TxCacheItem *front_item = &s_tx_cache.items[0];
+		overflows++;
+		counter_value = __HAL_TIM_GET_COUNTER(htim);
+	}
 
-		uint64_t tx_tick = front_item->timestamp.counter_value + front_item->timestamp.rcr_value*PERIOD_TICKS;
-		uint64_t timeout_tick = (tx_tick + TIMEOUT) % PERIOD_TICKS;
+	exit_critical(primask);
 
-		if (tx_tick < timeout_tick ? (current_tick >= timeout_tick || current_tick < tx_tick)
-				: (current_tick >= timeout_tick && current_tick < tx_tick)) // don't even try to decipher this :)
-		{
-			// timed out.
-			CANWrapper_ErrorInfo error_info;
-			error_info.error = CAN_WRAPPER_ERROR_TIMEOUT;
-			error_info.msg = front_item->msg.msg;
-			error_info.recipient = front_item->msg.recipient;
-			s_init_struct.error_callback(error_info); // TODO: this is dangerous. could easily lead to bugs. FIX!
+	uint64_t period = (uint64_t)__HAL_TIM_GET_AUTORELOAD(htim) + 1;
+	return overflows*period + counter_value;
+}
+
+static bool register_instance(CANWrapper_Handle *hcw)
+{
+	uint32_t primask = enter_critical();
+
+	CANWrapper_Handle **slot = NULL;
+	bool success = true;
 
-			TxCache_Erase(&s_tx_cache, 0);
+	for (size_t i = 0; i < CAN_WRAPPER_MAX_INSTANCES; i++)
+	{
+		if (s_instances[i] == hcw)
+		{
+			slot = &s_instances[i]; // re-initialising.
 		}
-		else
+		else if (s_instances[i] == NULL)
 		{
-			break;
+			if (slot == NULL)
+				slot = &s_instances[i];
+		}
+		else if (s_instances[i]->init_struct.hcan == hcw->init_struct.hcan)
+		{
+			success = false;
 		}
 	}
 
-	return CAN_WRAPPER_HAL_OK;
+	success = success && slot != NULL;
+	if (success)
+		*slot = hcw;
+
+	exit_critical(primask);
+
+	return success;
 }
 
-CANWrapper_StatusTypeDef CANWrapper_Transmit(NodeID recipient, CANMessage *msg)
+static void unregister_instance(CANWrapper_Handle *hcw)
 {
-	return transmit_internal(recipient, msg, false);
+	uint32_t primask = enter_critical();
+
+	for (size_t i = 0; i < CAN_WRAPPER_MAX_INSTANCES; i++)
+	{
+		if (s_instances[i] == hcw)
+			s_instances[i] = NULL;
+	}
+
+	exit_critical(primask);
 }
 
-static CANWrapper_StatusTypeDef transmit_internal(NodeID recipient, CANMessage *msg, bool is_ack)
+static CANWrapper_Handle *find_instance(const CAN_HandleTypeDef *hcan)
 {
-	if (!s_init) return CAN_WRAPPER_NOT_INITIALISED;
+	for (size_t i = 0; i < CAN_WRAPPER_MAX_INSTANCES; i++)
+	{
+		if (s_instances[i] != NULL && s_instances[i]->init_struct.hcan == hcan)
+			return s_instances[i];
+	}
 
-	CmdConfig config = cmd_configs[msg->cmd];
+	return NULL;
+}
 
-	// TX message parameters.
-	uint16_t id = (config.priority       << 5 & PRIORITY_MASK)
-	            | (s_init_struct.node_id << 3 & SENDER_MASK)
-	            | (recipient             << 1 & RECIPIENT_MASK)
-				| (is_ack ? ACK_MASK : 0);
+static uint32_t first_filter_bank(const CAN_HandleTypeDef *hcan)
+{
+#ifdef CAN2
+	if (hcan->Instance == CAN2)
+		return SLAVE_START_FILTER_BANK;
+#else
+	(void)hcan;
+#endif
+	return 0;
+}
 
-	// wait to send CAN message.
-	while (HAL_CAN_GetTxMailboxesFreeLevel(s_init_struct.hcan) == 0){}
+#ifdef CAN_WRAPPER_OS
+static uint64_t next_deadline(CANWrapper_Handle *hcw)
+{
+	uint64_t deadline = TimingWheel_Next_Expiry(&hcw->timeouts);
 
-	CAN_TxHeaderTypeDef tx_header;
-	tx_header.IDE = CAN_ID_STD;   // use standard identifier.
-	tx_header.StdId = id;         // define standard identifier.
-	tx_header.RTR = CAN_RTR_DATA; // specify as data frame.
-	tx_header.DLC = 1 + config.body_size; // cmd ID + message body.
+	uint64_t request_deadline = TimingWheel_Next_Expiry(&hcw->request_timeouts);
+	if (request_deadline < deadline)
+		deadline = request_deadline;
 
-	if (!is_ack)
+	if (hcw->bus_state == CAN_WRAPPER_BUS_OFF && hcw->rejoin_tick < deadline)
 	{
-		uint32_t counter_value = __HAL_TIM_GET_COUNTER(s_init_struct.htim);
-		TxCacheItem cached_msg = {
-				.timestamp = {
-						.counter_value = counter_value,
-						.rcr_value = s_init_struct.htim->Instance->RCR
-				},
-				.msg = {
-						.msg = *msg,
-						.priority = config.priority,
-						.sender = s_init_struct.node_id,
-						.recipient = recipient,
-						.is_ack = is_ack,
-				}
-		};
+		deadline = hcw->rejoin_tick;
+	}
+	else if (hcw->bus_state != CAN_WRAPPER_BUS_ACTIVE)
+	{
+		// the error counters fall without an interrupt, so check back on them.
+		uint64_t check = get_tick(hcw) + CAN_WRAPPER_DEFAULT_REJOIN_DELAY_MS*CAN_WRAPPER_TICKS_PER_MS;
+		if (check < deadline)
+			deadline = check;
+	}
+
+	if (hcw->lec_masked && hcw->lec_rearm_tick < deadline)
+		deadline = hcw->lec_rearm_tick;
+
+	if (hcw->transport != NULL)
+	{
+		uint64_t transport_deadline = CANTransport_Next_Deadline(hcw->transport);
+		if (transport_deadline < deadline)
+			deadline = transport_deadline;
+	}
 
-		TxCache_Push_Back(&s_tx_cache, &cached_msg);
+	if (hcw->telemetry != NULL)
+	{
+		uint64_t telemetry_deadline = CANTelemetry_Next_Deadline(hcw->telemetry);
+		if (telemetry_deadline < deadline)
+			deadline = telemetry_deadline;
+	}
+
+	if (hcw->capture != NULL)
+	{
+		uint64_t capture_deadline = CANCapture_Next_Deadline(hcw->capture);
+		if (capture_deadline < deadline)
+			deadline = capture_deadline;
 	}
 
-	uint32_t tx_mailbox; // transmit mailbox.
-	return HAL_CAN_AddTxMessage(s_init_struct.hcan, &tx_header, (uint8_t*)&msg, &tx_mailbox);
+	return deadline;
+}
+#endif
+
+static inline void wake_waiter(CANWrapper_Handle *hcw)
+{
+#ifdef CAN_WRAPPER_OS
+	CANOS_Event_Signal(&hcw->work_event);
+#else
+	(void)hcw;
+#endif
+}
+
+static inline uint32_t enter_critical()
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	return primask;
+}
+
+static inline void exit_critical(uint32_t primask)
+{
+	__set_PRIMASK(primask);
 }
 
 // called by HAL when a new CAN message is received and pending.
 void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef *hcan)
 {
-	if (hcan == s_init_struct.hcan)
+	CAN_PROBE_BEGIN();
+
+	CANWrapper_Handle *hcw = find_instance(hcan);
+	if (hcw != NULL)
+	{
+		receive_frame(hcw, hcan, CAN_RX_FIFO0, &hcw->msg_queue);
+	}
+
+	CAN_PROBE_END(CAN_PROBE_RX_FIFO0_ISR);
+}
+
+void HAL_CAN_RxFifo1MsgPendingCallback(CAN_HandleTypeDef *hcan)
+{
+	CAN_PROBE_BEGIN();
+
+	CANWrapper_Handle *hcw = find_instance(hcan);
+	if (hcw != NULL)
 	{
-		HAL_StatusTypeDef status;
+		receive_frame(hcw, hcan, CAN_RX_FIFO1, &hcw->urgent_queue);
+	}
 
-		CANQueueItem queue_item = {0};
+	CAN_PROBE_END(CAN_PROBE_RX_FIFO1_ISR);
+}
 
-		// get CAN message.
-		CAN_RxHeaderTypeDef rx_header; // message header.
-		status = HAL_CAN_GetRxMessage(hcan, CAN_RX_FIFO0, &rx_header, (uint8_t*)&queue_item.msg);
+void HAL_CAN_ErrorCallback(CAN_HandleTypeDef *hcan)
+{
+	CAN_PROBE_BEGIN();
 
-		if (status != HAL_OK)
-			return; // in theory this should never happen. :p
+	uint32_t errors = HAL_CAN_GetError(hcan);
 
-		bool is_ack      = ACK_MASK & rx_header.StdId;
-		NodeID recipient = (RECIPIENT_MASK & rx_header.StdId) >> 1;
-		NodeID sender    = (SENDER_MASK & rx_header.StdId) >> 3;
+	CANWrapper_Handle *hcw = find_instance(hcan);
+	if (hcw != NULL)
+	{
+		// ACK, warning (96 errors), passive (128 errors) and bus-off (256
+		// transmit errors).
+		handle_bus_errors(hcw, errors);
 
-		if (recipient == s_init_struct.node_id && sender != s_init_struct.node_id) // TODO: use CAN filtering instead.
+		if (errors & (HAL_CAN_ERROR_STF | HAL_CAN_ERROR_FOR | HAL_CAN_ERROR_ACK
+				| HAL_CAN_ERROR_BR | HAL_CAN_ERROR_BD | HAL_CAN_ERROR_CRC))
 		{
-			queue_item.msg.sender = sender;
-			queue_item.msg.is_ack = is_ack;
+			mask_lec_interrupt(hcw);
+		}
 
-			if (!is_ack)
-			{
-				// respond with ACK.
-				transmit_internal(sender, &queue_item.msg.msg, true);
-			}
+		// a failed transmission (lost arbitration, TX error) frees its
+		// mailbox without a TX complete callback.
+		submit_queued_frames(hcw);
+
+		if (errors & HAL_CAN_ERROR_RX_FOV0)
+		{
+			hcw->stats.fifo_overruns[CAN_RX_FIFO0]++;
+		}
 
-			CANQueue_Enqueue(&s_msg_queue, queue_item);
+		if (errors & HAL_CAN_ERROR_RX_FOV1)
+		{
+			hcw->stats.fifo_overruns[CAN_RX_FIFO1]++;
 		}
+
+		// errors are reported, and the bus state followed, by the poll.
+		wake_waiter(hcw);
 	}
+
+	// HAL accumulates error flags until they are reset.
+	HAL_CAN_ResetError(hcan);
+
+	CAN_PROBE_END(CAN_PROBE_ERROR_ISR);
 }
 
-void HAL_CAN_ErrorCallback(CAN_HandleTypeDef *hcan)
+void CANWrapper_TIM_IRQHandler(TIM_HandleTypeDef *htim)
 {
-	// TODO
-	if (HAL_CAN_GetError(hcan) & HAL_CAN_ERROR_ACK)
+	// count the wrap and clear the flag together. HAL_TIM_IRQHandler clears
+	// it before calling back, so an interrupt preempting it there would see
+	// neither the flag nor the new count, and get_tick would go back a period.
+	uint32_t primask = enter_critical();
+
+	if (__HAL_TIM_GET_FLAG(htim, TIM_FLAG_UPDATE))
 	{
-		// timed out.
+		__HAL_TIM_CLEAR_IT(htim, TIM_IT_UPDATE);
+
+		for (size_t i = 0; i < CAN_WRAPPER_MAX_INSTANCES; i++)
+		{
+			CANWrapper_Handle *hcw = s_instances[i];
+			if (hcw != NULL && hcw->init && htim == hcw->init_struct.htim)
+			{
+				hcw->tick_overflows++;
+			}
+		}
 	}
 
-	if (HAL_CAN_GetError(hcan) & HAL_CAN_ERROR_EWG)
+	exit_critical(primask);
+}
+
+// called by HAL when a TX mailbox finishes transmitting.
+void HAL_CAN_TxMailbox0CompleteCallback(CAN_HandleTypeDef *hcan)
+{
+	CAN_PROBE_BEGIN();
+
+	CANWrapper_Handle *hcw = find_instance(hcan);
+	if (hcw != NULL)
 	{
-		// error warning. (96 errors recorded from transmission or receipt)
+		tx_complete(hcw);
 	}
 
-	if (HAL_CAN_GetError(hcan) & HAL_CAN_ERROR_EPV)
+	CAN_PROBE_END(CAN_PROBE_TX_COMPLETE_ISR);
+}
+
+void HAL_CAN_TxMailbox1CompleteCallback(CAN_HandleTypeDef *hcan)
+{
+	CAN_PROBE_BEGIN();
+
+	CANWrapper_Handle *hcw = find_instance(hcan);
+	if (hcw != NULL)
 	{
-		// entered error passive state. (more than 16 failed transmission attempts and/or 128 failed receipts)
+		tx_complete(hcw);
 	}
 
-	if (HAL_CAN_GetError(hcan) & HAL_CAN_ERROR_BOF)
+	CAN_PROBE_END(CAN_PROBE_TX_COMPLETE_ISR);
+}
+
+void HAL_CAN_TxMailbox2CompleteCallback(CAN_HandleTypeDef *hcan)
+{
+	CAN_PROBE_BEGIN();
+
+	CANWrapper_Handle *hcw = find_instance(hcan);
+	if (hcw != NULL)
 	{
-		// entered bus-off state. (more than 32 failed transmission attempts)
+		tx_complete(hcw);
 	}
+
+	CAN_PROBE_END(CAN_PROBE_TX_COMPLETE_ISR);
 }
@@ -0,0 +1,227 @@
+/**
+ * @file timing_wheel.c
+ * Hierarchical timing wheel for scheduling timeouts.
+ *
+ * Level n holds entries due within 64^(n+1) granules of the current one.
+ * Whenever the current granule crosses a level boundary, the entries in the
+ * matching slot of the level above are re-inserted ("cascaded") closer to
+ * the bottom of the wheel.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date March 24, 2024
+ */
+
+#include "timing_wheel.h"
+
+#define SLOT_COUNT (1 << TIMING_WHEEL_SLOT_BITS)
+#define SLOT_MASK  (SLOT_COUNT - 1)
+
+#define EXPIRED_LEVEL (-1)
+
+static void link(TimingWheel *tw, int16_t *list, int index);
+static void unlink(TimingWheel *tw, int index);
+static void place(TimingWheel *tw, int index);
+static void cascade(TimingWheel *tw, int level);
+
+TimingWheel TimingWheel_Create(TimingWheelNode *nodes, size_t capacity, uint64_t now)
+{
+	TimingWheel tw;
+
+	tw.nodes = nodes;
+	tw.capacity = capacity;
+	tw.current = now >> TIMING_WHEEL_RESOLUTION_BITS;
+	tw.count = 0;
+	tw.expired = TIMING_WHEEL_NONE;
+
+	for (int level = 0; level < TIMING_WHEEL_LEVELS; level++)
+	{
+		for (int slot = 0; slot < SLOT_COUNT; slot++)
+		{
+			tw.slots[level][slot] = TIMING_WHEEL_NONE;
+		}
+	}
+
+	for (size_t i = 0; i < capacity; i++)
+	{
+		nodes[i].scheduled = false;
+	}
+
+	return tw;
+}
+
+bool TimingWheel_Schedule(TimingWheel *tw, int index, uint64_t expiry)
+{
+	if (index < 0 || (size_t)index >= tw->capacity)
+		return false;
+
+	TimingWheel_Cancel(tw, index);
+
+	tw->nodes[index].expiry = expiry;
+	tw->nodes[index].scheduled = true;
+	tw->count++;
+
+	place(tw, index);
+
+	return true;
+}
+
+void TimingWheel_Cancel(TimingWheel *tw, int index)
+{
+	if (index < 0 || (size_t)index >= tw->capacity || !tw->nodes[index].scheduled)
+		return;
+
+	unlink(tw, index);
+	tw->nodes[index].scheduled = false;
+	tw->count--;
+}
+
+void TimingWheel_Advance(TimingWheel *tw, uint64_t now)
+{
+	uint64_t target = now >> TIMING_WHEEL_RESOLUTION_BITS;
+
+	while (tw->current < target)
+	{
+		if (tw->count == 0)
+		{
+			// nothing to expire. skip ahead.
+			tw->current = target;
+			break;
+		}
+
+		tw->current++;
+
+		// cascade from the top so entries can fall through several levels.
+		for (int level = TIMING_WHEEL_LEVELS - 1; level > 0; level--)
+		{
+			if ((tw->current & ((1ULL << (TIMING_WHEEL_SLOT_BITS * level)) - 1)) == 0)
+			{
+				cascade(tw, level);
+			}
+		}
+
+		int16_t *slot = &tw->slots[0][tw->current & SLOT_MASK];
+		while (*slot != TIMING_WHEEL_NONE)
+		{
+			int index = *slot;
+			unlink(tw, index);
+			tw->nodes[index].level = EXPIRED_LEVEL;
+			link(tw, &tw->expired, index);
+		}
+	}
+}
+
+int TimingWheel_Pop_Expired(TimingWheel *tw)
+{
+	int index = tw->expired;
+	if (index == TIMING_WHEEL_NONE)
+		return TIMING_WHEEL_NONE;
+
+	unlink(tw, index);
+	tw->nodes[index].scheduled = false;
+	tw->count--;
+
+	return index;
+}
+
+uint64_t TimingWheel_Next_Expiry(const TimingWheel *tw)
+{
+	if (tw->expired != TIMING_WHEEL_NONE)
+		return 0;
+
+	// a scan is cheaper than walking the slots for the small caches this
+	// wheel serves.
+	uint64_t next = UINT64_MAX;
+	for (size_t i = 0; i < tw->capacity; i++)
+	{
+		const TimingWheelNode *node = &tw->nodes[i];
+		if (node->scheduled && node->expiry < next)
+			next = node->expiry;
+	}
+
+	if (next == UINT64_MAX)
+		return next;
+
+	// entries fire at the start of the granule after their expiry tick.
+	uint64_t granule = (next + (1 << TIMING_WHEEL_RESOLUTION_BITS) - 1) >> TIMING_WHEEL_RESOLUTION_BITS;
+	return granule << TIMING_WHEEL_RESOLUTION_BITS;
+}
+
+static void link(TimingWheel *tw, int16_t *list, int index)
+{
+	TimingWheelNode *node = &tw->nodes[index];
+
+	node->prev = TIMING_WHEEL_NONE;
+	node->next = *list;
+	if (*list != TIMING_WHEEL_NONE)
+		tw->nodes[*list].prev = index;
+	*list = index;
+}
+
+static void unlink(TimingWheel *tw, int index)
+{
+	TimingWheelNode *node = &tw->nodes[index];
+
+	if (node->prev != TIMING_WHEEL_NONE)
+		tw->nodes[node->prev].next = node->next;
+	else if (node->level == EXPIRED_LEVEL)
+		tw->expired = node->next;
+	else
+		tw->slots[node->level][node->slot] = node->next;
+
+	if (node->next != TIMING_WHEEL_NONE)
+		tw->nodes[node->next].prev = node->prev;
+}
+
+static void place(TimingWheel *tw, int index)
+{
+	TimingWheelNode *node = &tw->nodes[index];
+
+	// round up so an entry never fires before its expiry tick.
+	uint64_t granule = (node->expiry + (1 << TIMING_WHEEL_RESOLUTION_BITS) - 1) >> TIMING_WHEEL_RESOLUTION_BITS;
+
+	if (granule <= tw->current)
+	{
+		node->level = EXPIRED_LEVEL;
+		link(tw, &tw->expired, index);
+		return;
+	}
+
+	uint64_t delta = granule - tw->current;
+
+	for (int level = 0; level < TIMING_WHEEL_LEVELS; level++)
+	{
+		int shift = TIMING_WHEEL_SLOT_BITS * level;
+
+		if (delta < (1ULL << (shift + TIMING_WHEEL_SLOT_BITS)) || level == TIMING_WHEEL_LEVELS - 1)
+		{
+			if (level == TIMING_WHEEL_LEVELS - 1 && delta >= (1ULL << (shift + TIMING_WHEEL_SLOT_BITS)))
+			{
+				// beyond the wheel's range. park in the furthest slot
+				// and re-place when it is cascaded.
+				granule = tw->current + (1ULL << (shift + TIMING_WHEEL_SLOT_BITS)) - 1;
+			}
+
+			node->level = level;
+			node->slot = (granule >> shift) & SLOT_MASK;
+			link(tw, &tw->slots[level][node->slot], index);
+			return;
+		}
+	}
+}
+
+static void cascade(TimingWheel *tw, int level)
+{
+	int shift = TIMING_WHEEL_SLOT_BITS * level;
+	int16_t *slot = &tw->slots[level][(tw->current >> shift) & SLOT_MASK];
+
+	int16_t index = *slot;
+	*slot = TIMING_WHEEL_NONE;
+
+	while (index != TIMING_WHEEL_NONE)
+	{
+		int16_t next = tw->nodes[index].next;
+		place(tw, index);
+		index = next;
+	}
+}
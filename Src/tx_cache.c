@@ -1,7 +1,7 @@
 /**
- * @file tx_cache.h
- * List ADT that caches transmitted CAN messages.
- * Implemented using circular buffer.
+ * @file tx_cache.c
+ * Table ADT that caches transmitted CAN messages until they are ACK'd.
+ * Implemented using a fixed slot pool indexed by a chained hash table.
  *
  * @author Logan Furedi <logan.furedi@umsats.ca>
  *
@@ -11,98 +11,174 @@
 #include "tx_cache.h"
 #include <stdbool.h>
 
-// TODO: Refactor
 /**
- * @brief Returns true if the ACK message corresponds to msg.
+ * @brief Returns the bucket for a message to the given recipient.
  *
- * A match signifies:
- * 1. the message data and priority fields are identical,
- * 2. the sender of msg is the recipient of ack, and
- * 3. the recipient of ack is the sender of msg.
- *
- * @param msg  the message.
- * @param ack  the acknowledging message.
- * @return     true if the messages match. False otherwise.
+ * key is the low byte of the body hash, or the low bits of the sequence
+ * number, so that what an ACK entry carries is enough to locate an entry.
  */
-static bool is_matching_ack(const CachedCANMessage *msg, const CachedCANMessage *ack);
+static uint32_t bucket_of(uint8_t recipient, uint8_t cmd, uint8_t key);
 
 TxCache TxCache_Create()
 {
 	TxCache tx_cache;
 
 	tx_cache.size = 0;
-	tx_cache.head = 0;
-	tx_cache.tail = 0;
+	tx_cache.oldest = TX_CACHE_NONE;
+	tx_cache.newest = TX_CACHE_NONE;
+
+	for (size_t i = 0; i < (1 << TX_CACHE_BUCKET_BITS); i++)
+	{
+		tx_cache.buckets[i] = TX_CACHE_NONE;
+	}
+
+	// chain every slot into the free list.
+	for (int i = 0; i < TX_CACHE_SIZE; i++)
+	{
+		tx_cache.slots[i].in_use = false;
+		tx_cache.slots[i].next = (i + 1 < TX_CACHE_SIZE) ? i + 1 : TX_CACHE_NONE;
+	}
+	tx_cache.free_head = 0;
 
 	return tx_cache;
 }
 
 bool TxCache_IsFull(const TxCache* txc)
 {
-    return (txc->tail + 1) % TX_CACHE_SIZE == txc->head;
+	return txc->free_head == TX_CACHE_NONE;
 }
 
-bool TxCache_Push_Back(TxCache *txc, TxCacheItem *item)
+int TxCache_Push_Back(TxCache *txc, const TxCacheItem *item)
 {
 	if (TxCache_IsFull(txc))
-		return false;
+		return TX_CACHE_NONE;
+
+	int16_t index = txc->free_head;
+	TxCacheSlot *slot = &txc->slots[index];
+	txc->free_head = slot->next;
+
+	slot->item = *item;
+	slot->hash = CANMessage_Hash(&item->msg.msg);
+	slot->key = item->numbered ? (item->seq & TX_CACHE_SEQ_KEY_MASK) : (slot->hash & 0xFF);
+	slot->in_use = true;
+
+	// link at the front of the bucket chain.
+	int16_t *bucket = &txc->buckets[bucket_of(item->msg.recipient, item->msg.msg.cmd, slot->key)];
+	slot->prev = TX_CACHE_NONE;
+	slot->next = *bucket;
+	if (*bucket != TX_CACHE_NONE)
+		txc->slots[*bucket].prev = index;
+	*bucket = index;
+
+	// link as the newest entry.
+	slot->newer = TX_CACHE_NONE;
+	slot->older = txc->newest;
+	if (txc->newest != TX_CACHE_NONE)
+		txc->slots[txc->newest].newer = index;
+	else
+		txc->oldest = index;
+	txc->newest = index;
 
-	txc->items[txc->tail] = *item;
-	txc->tail = (txc->tail + 1) % TX_CACHE_SIZE;
 	txc->size++;
 
-	return true;
+	return index;
 }
 
-int TxCache_Find(const TxCache *txc, const CachedCANMessage *ack)
+int TxCache_Find(const TxCache *txc, uint8_t recipient, uint8_t cmd, uint8_t hash)
 {
-	int index = 0;
-	int i = txc->head;
-	while (i != txc->tail && !is_matching_ack(&txc->items[i].msg, ack))
+	int match = TX_CACHE_NONE;
+
+	// entries are linked newest first. keep going to find the oldest match.
+	int16_t i = txc->buckets[bucket_of(recipient, cmd, hash)];
+	while (i != TX_CACHE_NONE)
 	{
-		index++;
-		i = (i + 1) % TX_CACHE_SIZE;
+		const TxCacheSlot *slot = &txc->slots[i];
+		if (!slot->item.numbered
+				&& (slot->hash & 0xFF) == hash
+				&& slot->item.msg.msg.cmd == cmd
+				&& slot->item.msg.recipient == recipient)
+		{
+			match = i;
+		}
+
+		i = slot->next;
 	}
 
-	if (i == txc->tail)
-		return -1;
-
-	return index;
+	return match;
 }
 
-bool TxCache_Erase(TxCache *txc, int index)
+int TxCache_Find_Seq(const TxCache *txc, uint8_t recipient, uint8_t cmd, uint8_t seq, uint8_t seq_mask)
 {
-	if (index < 0 || index >= txc->size) return false;
+	int match = TX_CACHE_NONE;
 
-	int cur_pos = txc->head;
-	int next_pos = (cur_pos + 1) % TX_CACHE_SIZE;
-	while (cur_pos != index && next_pos != txc->tail)
+	int16_t i = txc->buckets[bucket_of(recipient, cmd, seq & TX_CACHE_SEQ_KEY_MASK)];
+	while (i != TX_CACHE_NONE)
 	{
-		txc->items[next_pos] = txc->items[cur_pos];
-		cur_pos = next_pos;
-		next_pos = (next_pos + 1) % TX_CACHE_SIZE;
+		const TxCacheSlot *slot = &txc->slots[i];
+		if (slot->item.numbered
+				&& (slot->item.seq & seq_mask) == seq
+				&& slot->item.msg.msg.cmd == cmd
+				&& slot->item.msg.recipient == recipient)
+		{
+			match = i;
+		}
+
+		i = slot->next;
 	}
 
-	txc->head = (txc->head + 1) % TX_CACHE_SIZE;
+	return match;
+}
+
+bool TxCache_Erase(TxCache *txc, int index)
+{
+	if (index < 0 || index >= TX_CACHE_SIZE || !txc->slots[index].in_use)
+		return false;
+
+	TxCacheSlot *slot = &txc->slots[index];
+
+	// unlink from the bucket chain.
+	if (slot->prev != TX_CACHE_NONE)
+		txc->slots[slot->prev].next = slot->next;
+	else
+		txc->buckets[bucket_of(slot->item.msg.recipient, slot->item.msg.msg.cmd, slot->key)] = slot->next;
+	if (slot->next != TX_CACHE_NONE)
+		txc->slots[slot->next].prev = slot->prev;
+
+	// unlink from the insertion order.
+	if (slot->older != TX_CACHE_NONE)
+		txc->slots[slot->older].newer = slot->newer;
+	else
+		txc->oldest = slot->newer;
+	if (slot->newer != TX_CACHE_NONE)
+		txc->slots[slot->newer].older = slot->older;
+	else
+		txc->newest = slot->older;
+
+	// return to the free list.
+	slot->in_use = false;
+	slot->next = txc->free_head;
+	txc->free_head = index;
+
 	txc->size--;
 
 	return true;
 }
 
-const TxCacheItem *TxCache_At(const TxCache *txc, int index)
+TxCacheItem *TxCache_At(TxCache *txc, int index)
 {
-	if (index < 0 || index >= txc->size) return NULL;
+	if (index < 0 || index >= TX_CACHE_SIZE || !txc->slots[index].in_use)
+		return NULL;
 
-	int pos = index % TX_CACHE_SIZE;
-	return &txc->items[pos];
+	return &txc->slots[index].item;
+}
+
+int TxCache_Front(const TxCache *txc)
+{
+	return txc->oldest;
 }
 
-static bool is_matching_ack(const CachedCANMessage *msg, const CachedCANMessage *ack)
+static uint32_t bucket_of(uint8_t recipient, uint8_t cmd, uint8_t key)
 {
-	return !msg->is_ack
-		&& ack->is_ack
-		&& CANMessage_Equals(&msg->msg, &ack->msg)
-		&& msg->priority == ack->priority
-		&& msg->sender == ack->recipient
-		&& msg->recipient == ack->sender;
+	uint32_t bits = (uint32_t)recipient << 16 | (uint32_t)cmd << 8 | key;
+	return (bits * 2654435761u) >> (32 - TX_CACHE_BUCKET_BITS);
 }
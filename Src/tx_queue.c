@@ -0,0 +1,131 @@
+/**
+ * @file tx_queue.c
+ * Priority queue ADT for CAN frames waiting on a free TX mailbox.
+ * Implemented using binary heap.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date March 22, 2024
+ */
+
+#include "tx_queue.h"
+
+/**
+ * @brief Returns true if the item at index a should leave before the item at b.
+ */
+static bool is_before(const TxQueue *txq, size_t a, size_t b);
+
+static void swap(TxQueue *txq, size_t a, size_t b);
+
+TxQueue TxQueue_Create()
+{
+	TxQueue txq;
+
+	txq.size = 0;
+	txq.next_order = 0;
+
+	return txq;
+}
+
+bool TxQueue_IsEmpty(const TxQueue *txq)
+{
+	return txq->size == 0;
+}
+
+bool TxQueue_IsFull(const TxQueue *txq)
+{
+	return txq->size == TX_QUEUE_SIZE;
+}
+
+bool TxQueue_Push(TxQueue *txq, const TxQueueItem *frame)
+{
+	if (TxQueue_IsFull(txq))
+		return false;
+
+	size_t i = txq->size++;
+	txq->items[i].order = txq->next_order++;
+	txq->items[i].frame = *frame;
+
+	// sift up.
+	while (i > 0 && is_before(txq, i, (i - 1) / 2))
+	{
+		swap(txq, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+
+	return true;
+}
+
+bool TxQueue_Replace(TxQueue *txq, const TxQueueItem *frame)
+{
+	for (size_t i = 0; i < txq->size; i++)
+	{
+		TxQueueItem *queued = &txq->items[i].frame;
+		if (queued->id == frame->id && queued->msg.cmd == frame->msg.cmd)
+		{
+			// same ID, so the heap order is unaffected.
+			*queued = *frame;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+const TxQueueItem *TxQueue_Peek(const TxQueue *txq)
+{
+	if (TxQueue_IsEmpty(txq))
+		return NULL;
+
+	return &txq->items[0].frame;
+}
+
+bool TxQueue_Pop(TxQueue *txq, TxQueueItem *out_frame)
+{
+	if (TxQueue_IsEmpty(txq))
+		return false;
+
+	if (out_frame != NULL)
+		*out_frame = txq->items[0].frame;
+
+	txq->size--;
+	txq->items[0] = txq->items[txq->size];
+
+	// sift down.
+	size_t i = 0;
+	while (true)
+	{
+		size_t first = i;
+		size_t left = 2*i + 1;
+		size_t right = 2*i + 2;
+
+		if (left < txq->size && is_before(txq, left, first))
+			first = left;
+		if (right < txq->size && is_before(txq, right, first))
+			first = right;
+
+		if (first == i)
+			break;
+
+		swap(txq, i, first);
+		i = first;
+	}
+
+	return true;
+}
+
+static bool is_before(const TxQueue *txq, size_t a, size_t b)
+{
+	if (txq->items[a].frame.id != txq->items[b].frame.id)
+		return txq->items[a].frame.id < txq->items[b].frame.id;
+
+	// signed difference keeps the ordering valid across counter wraparound.
+	return (int32_t)(txq->items[a].order - txq->items[b].order) < 0;
+}
+
+static void swap(TxQueue *txq, size_t a, size_t b)
+{
+	typeof(txq->items[0]) temp = txq->items[a];
+	txq->items[a] = txq->items[b];
+	txq->items[b] = temp;
+}
@@ -0,0 +1,190 @@
+/**
+ * @file test_acks.c
+ * Matching ACK's to cached messages: numbered messages by their sequence
+ * number, others by the low byte of their hash, and only from ACK frames
+ * addressed to us.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "can_id.h"
+#include "host_test.h"
+
+static VirtualBus s_bus;
+
+static uint32_t s_ack_frames;
+static uint32_t s_numbered_entries;
+
+static void on_message(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	(void)msg;
+	(void)info;
+	(void)ctx;
+}
+
+static void on_frame(const VirtualBusFrameInfo *info, void *ctx)
+{
+	(void)ctx;
+
+	CANIdFields fields;
+	CANId_Unpack(info->frame.id, info->frame.extended, &fields);
+
+	if (!info->ok || !fields.is_ack)
+		return;
+
+	s_ack_frames++;
+	for (uint8_t i = 0; i + 1 < info->frame.dlc; i += 2)
+	{
+		if (info->frame.data[i] & ACK_ENTRY_NUMBERED)
+			s_numbered_entries++;
+	}
+}
+
+static VirtualNode *add_node(NodeID id, bool sequence_numbers, bool extended_ids)
+{
+	VirtualNode *node = VirtualBus_Add_Node(&s_bus);
+
+	CANWrapper_InitTypeDef init = {
+		.node_id = id,
+		.sequence_numbers = sequence_numbers,
+		.extended_ids = extended_ids,
+	};
+	CHECK_EQ(VirtualBus_Init_Node(&s_bus, node, init), CAN_WRAPPER_HAL_OK);
+	CHECK_EQ(CANWrapperEx_Register_Handler_Range(&node->hcw, 0, CMD_ID_COUNT - 1, &on_message, NULL), CAN_WRAPPER_HAL_OK);
+
+	return node;
+}
+
+static CANMessage line_power(uint8_t state)
+{
+	CANMessage msg = {0};
+	Encode_PWR_SET_LINE_POWER(&msg, &(CmdArgs_PWR_SET_LINE_POWER){ .line = POWER_LINE_PAYLOAD, .state = state });
+
+	return msg;
+}
+
+static void test_cache_keys(void)
+{
+	static TxCache txc;
+	txc = TxCache_Create();
+
+	// the same message twice, numbered 37 and 38, and once unnumbered.
+	TxCacheItem item = {
+		.msg = { .msg = line_power(1), .recipient = NODE_POWER },
+		.numbered = true,
+		.seq = 37,
+	};
+	int first = TxCache_Push_Back(&txc, &item);
+	item.seq = 38;
+	int second = TxCache_Push_Back(&txc, &item);
+	item.numbered = false;
+	item.seq = 0;
+	int unnumbered = TxCache_Push_Back(&txc, &item);
+
+	uint8_t hash = CANMessage_Hash(&item.msg.msg) & 0xFF;
+	uint8_t cmd = item.msg.msg.cmd;
+
+	// the hash can't tell the copies apart. the sequence number can, by
+	// as many bits as are sent: 8 after the body, 5 in an extended identifier.
+	CHECK_EQ(TxCache_Find(&txc, NODE_POWER, cmd, hash), unnumbered);
+	CHECK_EQ(TxCache_Find_Seq(&txc, NODE_POWER, cmd, 38, 0xFF), second);
+	CHECK_EQ(TxCache_Find_Seq(&txc, NODE_POWER, cmd, 37, 0xFF), first);
+	CHECK_EQ(TxCache_Find_Seq(&txc, NODE_POWER, cmd, 37 & 0x1F, 0x1F), first);
+	CHECK_EQ(TxCache_Find_Seq(&txc, NODE_POWER, cmd, 39, 0xFF), TX_CACHE_NONE);
+	CHECK_EQ(TxCache_Find_Seq(&txc, NODE_ADCS, cmd, 37, 0xFF), TX_CACHE_NONE);
+
+	CHECK(TxCache_Erase(&txc, first));
+	CHECK_EQ(TxCache_Find_Seq(&txc, NODE_POWER, cmd, 37, 0xFF), TX_CACHE_NONE);
+	CHECK_EQ(TxCache_Find_Seq(&txc, NODE_POWER, cmd, 38, 0xFF), second);
+
+	CHECK(TxCache_Erase(&txc, unnumbered));
+	CHECK_EQ(TxCache_Find(&txc, NODE_POWER, cmd, hash), TX_CACHE_NONE);
+}
+
+static void check_numbered_acks(bool extended_ids)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){0}, false);
+	s_bus.on_frame = &on_frame;
+	s_ack_frames = 0;
+	s_numbered_entries = 0;
+
+	VirtualNode *cdh = add_node(NODE_CDH, true, extended_ids);
+	add_node(NODE_POWER, false, extended_ids);
+
+	// the same message 40 times, more than an extended sequence number counts.
+	for (int i = 0; i < 40; i++)
+	{
+		CANMessage msg = line_power(1);
+		CHECK_EQ(CANWrapperEx_Transmit(&cdh->hcw, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+		VirtualBus_Run(&s_bus, 1000);
+	}
+
+	VirtualBus_Run(&s_bus, 5000);
+
+	CANWrapper_Stats stats;
+	CANWrapperEx_Get_Stats(&cdh->hcw, &stats);
+
+	CHECK_EQ(stats.nodes[NODE_POWER].acks_received, 40);
+	CHECK_EQ(stats.nodes[NODE_POWER].tx_retries, 0);
+	CHECK_EQ(TxCache_Front(&cdh->hcw.tx_cache), TX_CACHE_NONE);
+	CHECK_EQ(s_numbered_entries, 40);
+	CHECK(s_ack_frames >= 10);
+}
+
+static void test_numbered_acks(void)
+{
+	check_numbered_acks(false);
+	check_numbered_acks(true);
+}
+
+static void test_other_recipients(void)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){0}, false);
+	s_bus.on_frame = NULL;
+
+	VirtualNode *cdh = add_node(NODE_CDH, false, false);
+	VirtualNode *power = add_node(NODE_POWER, false, false);
+	VirtualNode *logger = add_node(NODE_ADCS, false, false);
+
+	// ADCS also logs the whole bus.
+	CHECK_EQ(CANWrapperEx_Add_Filter(&logger->hcw, 0, 0), CAN_WRAPPER_HAL_OK);
+
+	// ADCS sends POWER a message that POWER misses, so it waits on an ACK...
+	CANMessage msg = line_power(1);
+	power->drop_permille = 1000;
+	CHECK_EQ(CANWrapperEx_Transmit(&logger->hcw, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+	VirtualBus_Run(&s_bus, 1000);
+	power->drop_permille = 0;
+
+	CHECK(TxCache_Front(&logger->hcw.tx_cache) != TX_CACHE_NONE);
+
+	// ...and sees POWER ACK the same message from CDH.
+	CHECK_EQ(CANWrapperEx_Transmit(&cdh->hcw, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+	VirtualBus_Run(&s_bus, 2000);
+
+	CHECK_EQ(TxCache_Front(&cdh->hcw.tx_cache), TX_CACHE_NONE);
+	CHECK(TxCache_Front(&logger->hcw.tx_cache) != TX_CACHE_NONE);
+
+	CANWrapper_Stats stats;
+	CANWrapperEx_Get_Stats(&logger->hcw, &stats);
+	CHECK_EQ(stats.nodes[NODE_POWER].acks_received, 0);
+
+	// its own ACK comes with the retry.
+	VirtualBus_Run(&s_bus, 100000);
+
+	CANWrapperEx_Get_Stats(&logger->hcw, &stats);
+	CHECK_EQ(stats.nodes[NODE_POWER].acks_received, 1);
+	CHECK_EQ(TxCache_Front(&logger->hcw.tx_cache), TX_CACHE_NONE);
+}
+
+int main(void)
+{
+	test_cache_keys();
+	test_numbered_acks();
+	test_other_recipients();
+
+	return HOST_TEST_RESULT();
+}
@@ -0,0 +1,206 @@
+/**
+ * @file test_bus_errors.c
+ * Faults injected on the virtual bus: a burst of error frames raises one
+ * error interrupt per node until the last error code interrupt is re-armed,
+ * and a node knocked off the bus rejoins after its rejoin delay, which
+ * doubles with each bus-off in a row.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "host_test.h"
+
+#define MAX_EVENTS 16
+
+// 128 x 11 recessive bits at 500 kbit/s.
+#define BUS_IDLE_US (128 * 11 * 1000000ULL / VIRTUAL_BUS_DEFAULT_BITRATE)
+
+static VirtualBus s_bus;
+
+static struct
+{
+	int error;
+	uint64_t time; // us.
+} s_events[MAX_EVENTS];
+static uint32_t s_event_count;
+
+static uint64_t s_last_error_frame_end; // us. of CDH's frames.
+static uint64_t s_first_ok_frame_start; // us. of CDH's frames, after an error frame.
+
+static uint32_t s_deliveries;
+
+static void on_cdh_error(CANWrapper_ErrorInfo error_info)
+{
+	if (s_event_count < MAX_EVENTS)
+	{
+		s_events[s_event_count].error = error_info.error;
+		s_events[s_event_count].time = VirtualBus_Now(&s_bus);
+		s_event_count++;
+	}
+}
+
+static void on_frame(const VirtualBusFrameInfo *info, void *ctx)
+{
+	(void)ctx;
+
+	if (info->node != 0)
+		return;
+
+	if (!info->ok)
+	{
+		s_last_error_frame_end = info->end / 1000;
+		s_first_ok_frame_start = 0;
+	}
+	else if (s_first_ok_frame_start == 0)
+	{
+		s_first_ok_frame_start = info->start / 1000;
+	}
+}
+
+static void on_message(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	(void)msg;
+	(void)info;
+	(void)ctx;
+
+	s_deliveries++;
+}
+
+static void setup(void)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){0}, false);
+	s_bus.on_frame = &on_frame;
+
+	s_event_count = 0;
+	s_last_error_frame_end = 0;
+	s_first_ok_frame_start = 0;
+	s_deliveries = 0;
+
+	VirtualNode *cdh = VirtualBus_Add_Node(&s_bus);
+	CHECK_EQ(VirtualBus_Init_Node(&s_bus, cdh, (CANWrapper_InitTypeDef){ .node_id = NODE_CDH, .error_callback = &on_cdh_error }), CAN_WRAPPER_HAL_OK);
+
+	const NodeID others[] = { NODE_POWER, NODE_ADCS };
+	for (size_t i = 0; i < sizeof(others)/sizeof(others[0]); i++)
+	{
+		VirtualNode *node = VirtualBus_Add_Node(&s_bus);
+		CHECK_EQ(VirtualBus_Init_Node(&s_bus, node, (CANWrapper_InitTypeDef){ .node_id = others[i] }), CAN_WRAPPER_HAL_OK);
+		CHECK_EQ(CANWrapperEx_Register_Handler_Range(&node->hcw, 0, CMD_ID_COUNT - 1, &on_message, NULL), CAN_WRAPPER_HAL_OK);
+	}
+}
+
+static bool has_event(int error)
+{
+	for (uint32_t i = 0; i < s_event_count && i < MAX_EVENTS; i++)
+	{
+		if (s_events[i].error == error)
+			return true;
+	}
+
+	return false;
+}
+
+static void test_error_storm(void)
+{
+	setup();
+
+	VirtualNode *cdh = &s_bus.nodes[0];
+	VirtualNode *power = &s_bus.nodes[1];
+
+	// 30 error frames in a row, short of a bus-off (8 transmit errors each).
+	VirtualBus_Inject_Errors(cdh, 30);
+
+	CANMessage msg = { .cmd = CMD_COMMON_RESET };
+	CHECK_EQ(CANWrapperEx_Transmit(&cdh->hcw, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+	VirtualBus_Run(&s_bus, 5000);
+
+	CHECK_EQ(s_bus.stats.error_frames, 30);
+	CHECK_EQ(s_deliveries, 1);
+
+	// the first error frame is reported, and the rest are masked. CDH
+	// also passes the warning and passive levels.
+	CHECK_EQ(power->can.counters.error_interrupts, 1);
+	CHECK(cdh->can.counters.error_interrupts <= 3);
+	CHECK(!(power->can.ier & CAN_IT_LAST_ERROR_CODE));
+	CHECK(has_event(CAN_WRAPPER_ERROR_BUS_PASSIVE));
+
+	CANWrapper_Stats stats;
+	CANWrapperEx_Get_Stats(&power->hcw, &stats);
+	CHECK_EQ(stats.lec_masks, 1);
+
+	// re-armed by the first poll after CAN_WRAPPER_LEC_REARM_MS.
+	VirtualBus_Run(&s_bus, CAN_WRAPPER_LEC_REARM_MS*1000);
+	CHECK(power->can.ier & CAN_IT_LAST_ERROR_CODE);
+	CHECK(cdh->can.ier & CAN_IT_LAST_ERROR_CODE);
+
+	// so the next error is reported again.
+	VirtualBus_Inject_Errors(cdh, 1);
+	CHECK_EQ(CANWrapperEx_Transmit(&cdh->hcw, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+	VirtualBus_Run(&s_bus, 5000);
+
+	CHECK_EQ(power->can.counters.error_interrupts, 2);
+	CHECK_EQ(s_deliveries, 2);
+}
+
+/**
+ * @brief Returns the us from the last error frame that CDH sent to the first
+ *        frame it sent after it.
+ */
+static uint64_t recovery_time(void)
+{
+	CHECK(s_first_ok_frame_start > s_last_error_frame_end);
+	return s_first_ok_frame_start - s_last_error_frame_end;
+}
+
+static void test_bus_off_recovery(void)
+{
+	setup();
+
+	VirtualNode *cdh = &s_bus.nodes[0];
+	const uint64_t delay_us = CAN_WRAPPER_DEFAULT_REJOIN_DELAY_MS*1000ULL;
+	const uint64_t slack_us = 2*VIRTUAL_BUS_DEFAULT_POLL_INTERVAL;
+
+	// 32 error frames put CDH's transmit error count past 255.
+	VirtualBus_Inject_Errors(cdh, 32);
+
+	CANMessage msg = { .cmd = CMD_COMMON_RESET };
+	CHECK_EQ(CANWrapperEx_Transmit(&cdh->hcw, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+	VirtualBus_Run(&s_bus, 50000);
+
+	// back after the rejoin delay and 128 idle periods, with the frame it
+	// was sending.
+	uint64_t first = recovery_time();
+	CHECK(first >= delay_us + BUS_IDLE_US);
+	CHECK(first <= delay_us + BUS_IDLE_US + slack_us);
+	CHECK_EQ(s_deliveries, 1);
+	CHECK(has_event(CAN_WRAPPER_ERROR_BUS_OFF));
+	CHECK(has_event(CAN_WRAPPER_ERROR_BUS_RECOVERED));
+	CHECK_EQ(CANWrapperEx_Get_Bus_State(&cdh->hcw), CAN_WRAPPER_BUS_ACTIVE);
+	CHECK_EQ(cdh->can.counters.bus_offs, 1);
+
+	// knocked off again as soon as it is back: 32 more errors fail the
+	// first frame after the rejoin, and the delay doubles.
+	setup();
+	cdh = &s_bus.nodes[0];
+	VirtualBus_Inject_Errors(cdh, 64);
+
+	CHECK_EQ(CANWrapperEx_Transmit(&cdh->hcw, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+	VirtualBus_Run(&s_bus, 100000);
+
+	uint64_t second = recovery_time();
+	CHECK(second >= 2*delay_us + BUS_IDLE_US);
+	CHECK(second <= 2*delay_us + BUS_IDLE_US + slack_us);
+	CHECK_EQ(s_deliveries, 1);
+	CHECK_EQ(cdh->can.counters.bus_offs, 2);
+	CHECK_EQ(CANWrapperEx_Get_Bus_State(&cdh->hcw), CAN_WRAPPER_BUS_ACTIVE);
+}
+
+int main(void)
+{
+	test_error_storm();
+	test_bus_off_recovery();
+
+	return HOST_TEST_RESULT();
+}
@@ -0,0 +1,190 @@
+/**
+ * @file test_can_queue.c
+ * The RX queue as a single-producer/single-consumer ring: a producer thread
+ * standing in for the RX interrupt and a consumer thread standing in for
+ * CANWrapper_Poll_Messages pass a million items through it, and every
+ * item comes out once, whole and in order.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "can_queue.h"
+#include "host_test.h"
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+#define STRESS_ITEMS 1000000U
+
+static CANQueue s_queue;
+
+static uint32_t s_out_of_order;
+static uint32_t s_torn;
+static uint32_t s_received;
+
+// every byte of the item depends on its sequence number, so a slot read
+// before the producer finished writing it shows up as torn.
+static void fill_item(CANQueueItem *item, uint32_t seq)
+{
+	memset(item, (uint8_t)(seq * 7), sizeof(*item));
+	memcpy(item->msg.msg.body, &seq, sizeof(seq));
+}
+
+static bool item_ok(const CANQueueItem *item, uint32_t seq)
+{
+	CANQueueItem expected;
+	fill_item(&expected, seq);
+
+	return memcmp(item, &expected, sizeof(expected)) == 0;
+}
+
+static uint32_t item_seq(const CANQueueItem *item)
+{
+	uint32_t seq;
+	memcpy(&seq, item->msg.msg.body, sizeof(seq));
+
+	return seq;
+}
+
+static void *producer(void *arg)
+{
+	(void)arg;
+
+	for (uint32_t seq = 0; seq < STRESS_ITEMS; )
+	{
+		// both ways the RX interrupt can fill the queue.
+		if (seq & 1)
+		{
+			CANQueueItem item;
+			fill_item(&item, seq);
+
+			if (CANQueue_Enqueue(&s_queue, &item))
+				seq++;
+			else
+				sched_yield();
+		}
+		else
+		{
+			CANQueueItem *slot = CANQueue_Reserve(&s_queue);
+			if (slot != NULL)
+			{
+				fill_item(slot, seq);
+				CANQueue_Commit(&s_queue);
+				seq++;
+			}
+			else
+			{
+				sched_yield();
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static void *consumer(void *arg)
+{
+	(void)arg;
+
+	CANQueueItem batch[CAN_QUEUE_SIZE];
+	uint32_t expected = 0;
+	size_t batch_size = 1;
+
+	while (expected < STRESS_ITEMS)
+	{
+		size_t count = CANQueue_DequeueBatch(&s_queue, batch, batch_size);
+
+		// on one core, spinning would only wait out the producer's time slice.
+		if (count == 0)
+			sched_yield();
+
+		for (size_t i = 0; i < count; i++)
+		{
+			if (item_seq(&batch[i]) != expected)
+				s_out_of_order++;
+			else if (!item_ok(&batch[i], expected))
+				s_torn++;
+
+			expected = item_seq(&batch[i]) + 1;
+			s_received++;
+		}
+
+		// 1 to CAN_QUEUE_SIZE, so batches cross the end of the ring at every offset.
+		batch_size = batch_size % CAN_QUEUE_SIZE + 1;
+	}
+
+	return NULL;
+}
+
+static void test_capacity(void)
+{
+	CANQueue queue = CANQueue_Create();
+	CANQueueItem item;
+
+	CHECK(CANQueue_IsEmpty(&queue));
+
+	// all CAN_QUEUE_SIZE slots are usable.
+	for (uint32_t i = 0; i < CAN_QUEUE_SIZE; i++)
+	{
+		fill_item(&item, i);
+		CHECK(CANQueue_Enqueue(&queue, &item));
+	}
+
+	CHECK(CANQueue_IsFull(&queue));
+	CHECK_EQ(CANQueue_Size(&queue), CAN_QUEUE_SIZE);
+	CHECK(CANQueue_Reserve(&queue) == NULL);
+	CHECK(!CANQueue_Enqueue(&queue, &item));
+
+	// one index update frees all of a batch.
+	CANQueueItem batch[5];
+	CHECK_EQ(CANQueue_DequeueBatch(&queue, batch, 5), 5);
+	CHECK_EQ(CANQueue_Size(&queue), CAN_QUEUE_SIZE - 5);
+
+	for (uint32_t i = 0; i < 5; i++)
+	{
+		CHECK(item_ok(&batch[i], i));
+	}
+
+	// reserving twice without a commit gives the same slot, and adds nothing.
+	CANQueueItem *slot = CANQueue_Reserve(&queue);
+	CHECK(slot != NULL);
+	CHECK(CANQueue_Reserve(&queue) == slot);
+	CHECK_EQ(CANQueue_Size(&queue), CAN_QUEUE_SIZE - 5);
+
+	// draining more than there is returns what there is.
+	static CANQueueItem all[CAN_QUEUE_SIZE];
+	CHECK_EQ(CANQueue_DequeueBatch(&queue, all, CAN_QUEUE_SIZE), CAN_QUEUE_SIZE - 5);
+	CHECK(item_ok(&all[0], 5));
+	CHECK(item_ok(&all[CAN_QUEUE_SIZE - 6], CAN_QUEUE_SIZE - 1));
+
+	CHECK(CANQueue_IsEmpty(&queue));
+	CHECK(!CANQueue_Dequeue(&queue, &item));
+	CHECK_EQ(CANQueue_DequeueBatch(&queue, all, CAN_QUEUE_SIZE), 0);
+}
+
+static void test_threads(void)
+{
+	s_queue = CANQueue_Create();
+
+	pthread_t producer_thread, consumer_thread;
+	pthread_create(&consumer_thread, NULL, consumer, NULL);
+	pthread_create(&producer_thread, NULL, producer, NULL);
+
+	pthread_join(producer_thread, NULL);
+	pthread_join(consumer_thread, NULL);
+
+	CHECK_EQ(s_received, STRESS_ITEMS);
+	CHECK_EQ(s_out_of_order, 0);
+	CHECK_EQ(s_torn, 0);
+	CHECK(CANQueue_IsEmpty(&s_queue));
+}
+
+int main(void)
+{
+	test_capacity();
+	test_threads();
+
+	return HOST_TEST_RESULT();
+}
@@ -0,0 +1,149 @@
+/**
+ * @file test_capture.c
+ * Capture of a node's frames on the virtual bus: every frame it sends and
+ * every frame its filters let through is recorded once, in order.
+ *
+ * With a path as its argument, it also writes the dump there, for the
+ * can_replay test.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "can_capture.h"
+#include "can_id.h"
+#include "host_test.h"
+#include <stdio.h>
+
+#define MAX_RECORDS 8192
+#define ROUNDS 200
+
+static VirtualBus s_bus;
+static CANCapture s_capture;
+
+static CANCaptureRecord s_records[MAX_RECORDS];
+static size_t s_record_count;
+
+static bool sink(const CANCaptureRecord *records, size_t count, void *ctx)
+{
+	(void)ctx;
+
+	if (s_record_count + count > MAX_RECORDS)
+		return false;
+
+	memcpy(&s_records[s_record_count], records, count * sizeof(records[0]));
+	s_record_count += count;
+
+	return true;
+}
+
+static void on_message(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	(void)msg;
+	(void)info;
+	(void)ctx;
+}
+
+static VirtualNode *add_node(NodeID id)
+{
+	VirtualNode *node = VirtualBus_Add_Node(&s_bus);
+	CANWrapper_InitTypeDef init = {
+		.node_id = id,
+		.sequence_numbers = true,
+		.accept_broadcast = true,
+		.broadcast_id = NODE_ADCS,
+	};
+	CHECK_EQ(VirtualBus_Init_Node(&s_bus, node, init), CAN_WRAPPER_HAL_OK);
+	CHECK_EQ(CANWrapperEx_Register_Handler_Range(&node->hcw, 0, CMD_ID_COUNT - 1, &on_message, NULL), CAN_WRAPPER_HAL_OK);
+
+	return node;
+}
+
+static void test_capture(void)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){ .seed = 9 }, false);
+
+	VirtualNode *cdh = add_node(NODE_CDH);
+	VirtualNode *power = add_node(NODE_POWER);
+	VirtualNode *payload = add_node(NODE_PAYLOAD);
+
+	CHECK_EQ(CANCapture_Init(&s_capture, &power->hcw, (CANCapture_InitTypeDef){ .sink = &sink, .flush_interval_ms = 10 }), CAN_WRAPPER_HAL_OK);
+
+	// POWER misses a few frames, so some of its ACK's come with retries.
+	power->drop_permille = 20;
+
+	for (int round = 0; round < ROUNDS; round++)
+	{
+		CANMessage msg = {0};
+
+		// ACK'd both ways, and a heartbeat for POWER.
+		Encode_PWR_SET_LINE_POWER(&msg, &(CmdArgs_PWR_SET_LINE_POWER){ .line = POWER_LINE_PAYLOAD, .state = round & 1 });
+		CHECK_EQ(CANWrapperEx_Transmit(&cdh->hcw, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+
+		msg = (CANMessage){ .cmd = CMD_CDH_PROCESS_HEARTBEAT };
+		CHECK_EQ(CANWrapperEx_Transmit(&cdh->hcw, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+
+		Encode_CDH_SET_RTC(&msg, &(CmdArgs_CDH_SET_RTC){ .timestamp = (uint32_t)round });
+		CHECK_EQ(CANWrapperEx_Transmit(&power->hcw, NODE_CDH, &msg), CAN_WRAPPER_HAL_OK);
+
+		// PAYLOAD to CDH only, which POWER's filters keep out.
+		msg = (CANMessage){ .cmd = CMD_CDH_PROCESS_HEARTBEAT };
+		CHECK_EQ(CANWrapperEx_Transmit(&payload->hcw, NODE_CDH, &msg), CAN_WRAPPER_HAL_OK);
+
+		VirtualBus_Run(&s_bus, 5000);
+	}
+
+	VirtualBus_Run(&s_bus, 500000);
+	CHECK(CANCapture_Flush(&s_capture));
+
+	uint32_t sent = 0, received = 0, dropped = 0;
+	for (size_t i = 0; i < s_record_count; i++)
+	{
+		const CANCaptureRecord *r = &s_records[i];
+
+		CANIdFields fields;
+		CANId_Unpack(r->id, false, &fields);
+
+		dropped += r->dropped;
+		if (r->flags & CAN_CAPTURE_FLAG_TX)
+		{
+			sent++;
+			CHECK_EQ(fields.sender, NODE_POWER);
+		}
+		else
+		{
+			received++;
+			CHECK_EQ(fields.recipient, NODE_POWER);
+		}
+
+		// ISR's and the poll record out of order by a little at most.
+		if (i > 0)
+			CHECK(r->tick + 1000 >= s_records[i - 1].tick);
+	}
+
+	CHECK_EQ(dropped, 0);
+	CHECK_EQ(sent, power->can.counters.frames_sent);
+	CHECK_EQ(received, power->can.counters.frames_received);
+	CHECK(received >= 2*ROUNDS);
+	CHECK(power->frames_dropped > 0);
+}
+
+int main(int argc, char **argv)
+{
+	test_capture();
+
+	if (argc > 1)
+	{
+		FILE *f = fopen(argv[1], "wb");
+		CHECK(f != NULL);
+		if (f != NULL)
+		{
+			CHECK_EQ(fwrite(s_records, sizeof(s_records[0]), s_record_count, f), s_record_count);
+			fclose(f);
+		}
+	}
+
+	return HOST_TEST_RESULT();
+}
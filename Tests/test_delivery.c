@@ -0,0 +1,179 @@
+/**
+ * @file test_delivery.c
+ * Delivery policies on the virtual bus: fire-and-forget commands are never
+ * cached or ACK'd, latest-value commands queued while the mailboxes are busy
+ * go out once with the last value, and ACK'd commands are cached until
+ * their ACK arrives.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "can_id.h"
+#include "host_test.h"
+
+#define SAMPLES 5
+
+static VirtualBus s_bus;
+
+static uint32_t s_ack_frames;
+static uint32_t s_heartbeats;
+static uint32_t s_temps;
+static uint16_t s_last_temp;
+static uint32_t s_rtcs;
+
+static void on_frame(const VirtualBusFrameInfo *info, void *ctx)
+{
+	(void)ctx;
+
+	CANIdFields fields;
+	CANId_Unpack(info->frame.id, info->frame.extended, &fields);
+
+	if (info->ok && fields.is_ack)
+		s_ack_frames++;
+}
+
+static void on_heartbeat(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	(void)msg;
+	(void)info;
+	(void)ctx;
+
+	s_heartbeats++;
+}
+
+static void on_pcb_temp(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	(void)info;
+	(void)ctx;
+
+	CmdArgs_CDH_PROCESS_PCB_TEMP args;
+	Decode_CDH_PROCESS_PCB_TEMP(msg, &args);
+
+	s_temps++;
+	s_last_temp = args.temp;
+}
+
+static void on_set_rtc(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	(void)msg;
+	(void)info;
+	(void)ctx;
+
+	s_rtcs++;
+}
+
+static void setup(void)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){0}, false);
+	s_bus.on_frame = &on_frame;
+
+	s_ack_frames = 0;
+	s_heartbeats = 0;
+	s_temps = 0;
+	s_last_temp = 0;
+	s_rtcs = 0;
+
+	const NodeID ids[] = { NODE_CDH, NODE_POWER };
+	for (int i = 0; i < 2; i++)
+	{
+		VirtualNode *node = VirtualBus_Add_Node(&s_bus);
+		CHECK_EQ(VirtualBus_Init_Node(&s_bus, node, (CANWrapper_InitTypeDef){ .node_id = ids[i] }), CAN_WRAPPER_HAL_OK);
+	}
+
+	CANWrapper_Handle *power = &s_bus.nodes[1].hcw;
+	CHECK_EQ(CANWrapperEx_Register_Handler(power, CMD_CDH_PROCESS_HEARTBEAT, &on_heartbeat, NULL), CAN_WRAPPER_HAL_OK);
+	CHECK_EQ(CANWrapperEx_Register_Handler(power, CMD_CDH_PROCESS_PCB_TEMP, &on_pcb_temp, NULL), CAN_WRAPPER_HAL_OK);
+	CHECK_EQ(CANWrapperEx_Register_Handler(power, CMD_CDH_SET_RTC, &on_set_rtc, NULL), CAN_WRAPPER_HAL_OK);
+}
+
+static void test_fire_and_forget(void)
+{
+	setup();
+
+	CANWrapper_Handle *cdh = &s_bus.nodes[0].hcw;
+
+	CANMessage msg = { .cmd = CMD_CDH_PROCESS_HEARTBEAT };
+	CHECK_EQ(CANWrapperEx_Transmit(cdh, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+	CHECK_EQ(cdh->tx_cache.size, 0);
+	CHECK_EQ(TxCache_Front(&cdh->tx_cache), TX_CACHE_NONE);
+
+	VirtualBus_Run(&s_bus, 20000);
+
+	CHECK_EQ(s_heartbeats, 1);
+	CHECK_EQ(s_ack_frames, 0);
+
+	CANWrapper_Stats stats;
+	CANWrapperEx_Get_Stats(cdh, &stats);
+	CHECK_EQ(stats.nodes[NODE_POWER].tx_msgs, 1);
+	CHECK_EQ(stats.nodes[NODE_POWER].acks_received, 0);
+	CHECK_EQ(stats.tx_cache_hwm, 0);
+}
+
+static void test_latest_value(void)
+{
+	setup();
+
+	CANWrapper_Handle *cdh = &s_bus.nodes[0].hcw;
+
+	// heartbeats fill every mailbox, and the bus isn't run until the
+	// samples are queued behind them.
+	CANMessage msg = { .cmd = CMD_CDH_PROCESS_HEARTBEAT };
+	for (int i = 0; i < CAN_TX_MAILBOX_COUNT; i++)
+		CHECK_EQ(CANWrapperEx_Transmit(cdh, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+
+	CHECK_EQ(HAL_CAN_GetTxMailboxesFreeLevel(&s_bus.nodes[0].hcan), 0);
+
+	for (uint16_t temp = 1; temp <= SAMPLES; temp++)
+	{
+		Encode_CDH_PROCESS_PCB_TEMP(&msg, &(CmdArgs_CDH_PROCESS_PCB_TEMP){ .temp = temp });
+		CHECK_EQ(CANWrapperEx_Transmit(cdh, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+	}
+
+	CHECK_EQ(cdh->tx_queue.size, 1);
+	CHECK_EQ(cdh->tx_cache.size, 0);
+
+	VirtualBus_Run(&s_bus, 20000);
+
+	CHECK_EQ(s_heartbeats, CAN_TX_MAILBOX_COUNT);
+	CHECK_EQ(s_temps, 1);
+	CHECK_EQ(s_last_temp, SAMPLES);
+	CHECK_EQ(s_ack_frames, 0);
+	CHECK_EQ(s_bus.nodes[0].can.counters.frames_sent, CAN_TX_MAILBOX_COUNT + 1);
+}
+
+static void test_acked(void)
+{
+	setup();
+
+	CANWrapper_Handle *cdh = &s_bus.nodes[0].hcw;
+
+	CANMessage msg;
+	Encode_CDH_SET_RTC(&msg, &(CmdArgs_CDH_SET_RTC){ .timestamp = 1234 });
+	CHECK_EQ(CANWrapperEx_Transmit(cdh, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+	CHECK_EQ(cdh->tx_cache.size, 1);
+	CHECK(TxCache_Front(&cdh->tx_cache) != TX_CACHE_NONE);
+
+	VirtualBus_Run(&s_bus, 20000);
+
+	CHECK_EQ(s_rtcs, 1);
+	CHECK_EQ(s_ack_frames, 1);
+	CHECK_EQ(cdh->tx_cache.size, 0);
+	CHECK_EQ(TxCache_Front(&cdh->tx_cache), TX_CACHE_NONE);
+
+	CANWrapper_Stats stats;
+	CANWrapperEx_Get_Stats(cdh, &stats);
+	CHECK_EQ(stats.nodes[NODE_POWER].acks_received, 1);
+	CHECK_EQ(stats.nodes[NODE_POWER].tx_retries, 0);
+}
+
+int main(void)
+{
+	test_fire_and_forget();
+	test_latest_value();
+	test_acked();
+
+	return HOST_TEST_RESULT();
+}
@@ -0,0 +1,143 @@
+/**
+ * @file test_fifos.c
+ * The two RX FIFOs on the virtual bus: a flood of bulk messages overruns
+ * FIFO0 and is counted against it alone, and urgent messages are handled
+ * before bulk ones that arrived earlier.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "can_id.h"
+#include "host_test.h"
+
+#define MESSAGES 4
+
+static VirtualBus s_bus;
+
+static CmdID s_handled[2*MESSAGES];
+static uint32_t s_handled_count;
+
+static void on_message(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	(void)info;
+	(void)ctx;
+
+	if (s_handled_count < sizeof(s_handled)/sizeof(s_handled[0]))
+		s_handled[s_handled_count] = msg->cmd;
+
+	s_handled_count++;
+}
+
+static void setup(void)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){0}, false);
+	s_handled_count = 0;
+
+	const NodeID ids[] = { NODE_CDH, NODE_POWER };
+	for (int i = 0; i < 2; i++)
+	{
+		VirtualNode *node = VirtualBus_Add_Node(&s_bus);
+		CHECK_EQ(VirtualBus_Init_Node(&s_bus, node, (CANWrapper_InitTypeDef){ .node_id = ids[i] }), CAN_WRAPPER_HAL_OK);
+		CHECK_EQ(CANWrapperEx_Register_Handler_Range(&node->hcw, 0, CMD_ID_COUNT - 1, &on_message, NULL), CAN_WRAPPER_HAL_OK);
+	}
+}
+
+static FakeCANFrame frame_to_power(CmdID cmd, uint8_t priority, uint8_t body_size)
+{
+	CANIdFields fields = {
+		.priority = priority,
+		.sender = NODE_CDH,
+		.recipient = NODE_POWER,
+	};
+
+	FakeCANFrame frame = {
+		.id = CANId_Pack(&fields, false),
+		.dlc = 1 + body_size,
+		.data = { cmd },
+	};
+
+	return frame;
+}
+
+static void test_bulk_overrun(void)
+{
+	setup();
+
+	VirtualNode *power = &s_bus.nodes[1];
+
+	// frames land in POWER's FIFO's without its interrupts running, as
+	// when they are held off for too long. FIFO1 fills, FIFO0 overflows.
+	FakeCANFrame bulk = frame_to_power(CMD_CDH_SET_RTC, 32, 4);
+	FakeCANFrame urgent = frame_to_power(CMD_PWR_SET_LINE_POWER, 6, 2);
+
+	for (int i = 0; i < CAN_RX_FIFO_DEPTH + 2; i++)
+		CHECK(FakeCAN_Receive(&power->can, &bulk));
+
+	for (int i = 0; i < CAN_RX_FIFO_DEPTH; i++)
+		CHECK(FakeCAN_Receive(&power->can, &urgent));
+
+	CHECK_EQ(power->can.counters.overruns, 2);
+
+	FakeCAN_Service(&power->hcan);
+
+	CANWrapper_Stats stats;
+	CANWrapperEx_Get_Stats(&power->hcw, &stats);
+	CHECK(stats.fifo_overruns[CAN_RX_FIFO0] > 0);
+	CHECK_EQ(stats.fifo_overruns[CAN_RX_FIFO1], 0);
+	CHECK_EQ(CANWrapperEx_Get_FIFO_Overruns(&power->hcw, CAN_RX_FIFO0), stats.fifo_overruns[CAN_RX_FIFO0]);
+
+	// what the FIFO's kept is still handled.
+	VirtualBus_Run(&s_bus, 5000);
+	CHECK_EQ(s_handled_count, 2*CAN_RX_FIFO_DEPTH);
+}
+
+static void test_urgent_first(void)
+{
+	setup();
+
+	VirtualNode *cdh = &s_bus.nodes[0];
+	VirtualNode *power = &s_bus.nodes[1];
+
+	// the bulk messages reach POWER first, and nothing polls it until the
+	// urgent ones have arrived too.
+	CANMessage msg;
+	for (uint32_t i = 0; i < MESSAGES; i++)
+	{
+		Encode_CDH_SET_RTC(&msg, &(CmdArgs_CDH_SET_RTC){ .timestamp = i });
+		CHECK_EQ(CANWrapperEx_Transmit(&cdh->hcw, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+	}
+
+	VirtualBus_Advance(&s_bus, 5000);
+
+	for (uint32_t i = 0; i < MESSAGES; i++)
+	{
+		Encode_PWR_SET_LINE_POWER(&msg, &(CmdArgs_PWR_SET_LINE_POWER){ .line = POWER_LINE_PAYLOAD, .state = i & 1 });
+		CHECK_EQ(CANWrapperEx_Transmit(&cdh->hcw, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+	}
+
+	VirtualBus_Advance(&s_bus, 5000);
+
+	CHECK_EQ(s_handled_count, 0);
+	CHECK_EQ(CANQueue_Size(&power->hcw.msg_queue), MESSAGES);
+	CHECK_EQ(CANQueue_Size(&power->hcw.urgent_queue), MESSAGES);
+
+	CHECK_EQ(CANWrapperEx_Poll_Messages(&power->hcw), CAN_WRAPPER_HAL_OK);
+
+	CHECK_EQ(s_handled_count, 2*MESSAGES);
+	for (uint32_t i = 0; i < MESSAGES; i++)
+	{
+		CHECK_EQ(s_handled[i], CMD_PWR_SET_LINE_POWER);
+		CHECK_EQ(s_handled[MESSAGES + i], CMD_CDH_SET_RTC);
+	}
+}
+
+int main(void)
+{
+	test_bulk_overrun();
+	test_urgent_first();
+
+	return HOST_TEST_RESULT();
+}
@@ -0,0 +1,256 @@
+/**
+ * @file test_filters.c
+ * The hardware acceptance filters, on the fake bxCAN filter banks.
+ *
+ * Every standard identifier, and a sample of extended ones, is offered to
+ * each node's filters: only data frames addressed to the node (or to the
+ * broadcast ID) pass, ACK's and urgent messages into FIFO1 and the rest into
+ * FIFO0. Then 4 nodes message each other evenly, with the default filters
+ * and with an accept-all filter added as the old configuration had, and
+ * each node only receives what is addressed to it.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "can_id.h"
+#include "host_test.h"
+
+#define NODE_COUNT 4
+#define ROUNDS 40
+
+static VirtualBus s_bus;
+
+static uint32_t s_addressed[NODE_COUNT]; // frames on the bus addressed to each node.
+
+static void on_message(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	(void)msg;
+	(void)info;
+	(void)ctx;
+}
+
+static void on_frame(const VirtualBusFrameInfo *info, void *ctx)
+{
+	(void)ctx;
+
+	if (!info->ok)
+		return;
+
+	CANIdFields fields;
+	CANId_Unpack(info->frame.id, info->frame.extended, &fields);
+	s_addressed[fields.recipient]++;
+}
+
+static void add_nodes(bool extended_ids)
+{
+	for (int i = 0; i < NODE_COUNT; i++)
+	{
+		VirtualNode *node = VirtualBus_Add_Node(&s_bus);
+
+		CANWrapper_InitTypeDef init = {
+			.node_id = (NodeID)i,
+			.extended_ids = extended_ids,
+			.accept_broadcast = extended_ids,
+			.broadcast_id = CAN_WRAPPER_EXT_BROADCAST_ID,
+		};
+		CHECK_EQ(VirtualBus_Init_Node(&s_bus, node, init), CAN_WRAPPER_HAL_OK);
+		CHECK_EQ(CANWrapperEx_Register_Handler_Range(&node->hcw, 0, CMD_ID_COUNT - 1, &on_message, NULL), CAN_WRAPPER_HAL_OK);
+	}
+}
+
+/**
+ * @brief Offers the frame to a copy of the controller.
+ *
+ * @retval The FIFO it would land in, or -1 if the filters reject it.
+ */
+static int accepted_fifo(const CAN_TypeDef *can, const FakeCANFrame *frame)
+{
+	static CAN_TypeDef scratch;
+	scratch = *can;
+	scratch.ier = 0;
+	scratch.fifo_count[0] = 0;
+	scratch.fifo_count[1] = 0;
+
+	if (!FakeCAN_Receive(&scratch, frame))
+		return -1;
+
+	return scratch.fifo_count[1] > 0 ? 1 : 0;
+}
+
+static void test_std_banks(void)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){0}, false);
+	add_nodes(false);
+
+	uint32_t wrong = 0;
+
+	for (int n = 0; n < NODE_COUNT; n++)
+	{
+		const CAN_TypeDef *can = &s_bus.nodes[n].can;
+
+		for (uint32_t id = 0; id <= 0x7FF; id++)
+		{
+			for (int remote = 0; remote < 2; remote++)
+			{
+				FakeCANFrame frame = { .id = id, .remote = remote, .dlc = 8 };
+
+				CANIdFields fields;
+				CANId_Unpack(id, false, &fields);
+
+				// urgent messages are the ones without the top priority bit.
+				int expected = -1;
+				if (!remote && fields.recipient == (NodeID)n)
+					expected = (fields.is_ack || !(id & CAN_ID_URGENT_MASK)) ? 1 : 0;
+
+				if (accepted_fifo(can, &frame) != expected)
+					wrong++;
+			}
+
+			// the same bits in an extended identifier don't match.
+			FakeCANFrame extended = { .id = id << 18, .extended = true, .dlc = 8 };
+			if (accepted_fifo(can, &extended) != -1)
+				wrong++;
+		}
+	}
+
+	CHECK_EQ(wrong, 0);
+}
+
+static void test_ext_banks(void)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){0}, false);
+	add_nodes(true);
+
+	uint32_t rng = 12345;
+	uint32_t wrong = 0;
+
+	for (int n = 0; n < NODE_COUNT; n++)
+	{
+		const CAN_TypeDef *can = &s_bus.nodes[n].can;
+
+		for (uint32_t i = 0; i < 200000; i++)
+		{
+			rng ^= rng << 13;
+			rng ^= rng >> 17;
+			rng ^= rng << 5;
+
+			// a third to the node, a third to the broadcast ID, a third to anyone.
+			uint32_t id = rng & 0x1FFFFFFF & ~CAN_ID_EXT_RECIPIENT_MASK;
+			uint32_t recipient = (i % 3 == 0) ? (uint32_t)n : (i % 3 == 1) ? CAN_WRAPPER_EXT_BROADCAST_ID : (rng >> 29) * 5;
+			id |= recipient << CAN_ID_EXT_RECIPIENT_SHIFT & CAN_ID_EXT_RECIPIENT_MASK;
+
+			bool remote = (i & 0xF) == 0;
+			FakeCANFrame frame = { .id = id, .extended = true, .remote = remote, .dlc = 8 };
+
+			CANIdFields fields;
+			CANId_Unpack(id, true, &fields);
+
+			int expected = -1;
+			if (!remote && (fields.recipient == (NodeID)n || fields.recipient == CAN_WRAPPER_EXT_BROADCAST_ID))
+				expected = (fields.is_ack || !(id & CAN_ID_EXT_URGENT_MASK)) ? 1 : 0;
+
+			if (accepted_fifo(can, &frame) != expected)
+				wrong++;
+		}
+
+		// standard identifiers don't match.
+		for (uint32_t id = 0; id <= 0x7FF; id++)
+		{
+			FakeCANFrame standard = { .id = id, .dlc = 8 };
+			if (accepted_fifo(can, &standard) != -1)
+				wrong++;
+		}
+	}
+
+	CHECK_EQ(wrong, 0);
+}
+
+/**
+ * @brief Has every node message every other node ROUNDS times.
+ *
+ * @param accept_all: add a filter that passes everything, as before the
+ *                    filters were programmed from the node ID.
+ * @param received:   frames each node's filters passed.
+ * @param rx_interrupts: the RX interrupts each node took.
+ */
+static void run_traffic(bool accept_all, uint32_t received[NODE_COUNT], uint32_t rx_interrupts[NODE_COUNT])
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){0}, false);
+	s_bus.on_frame = &on_frame;
+	memset(s_addressed, 0, sizeof(s_addressed));
+
+	add_nodes(false);
+
+	if (accept_all)
+	{
+		for (int n = 0; n < NODE_COUNT; n++)
+		{
+			CHECK_EQ(CANWrapperEx_Add_Filter(&s_bus.nodes[n].hcw, 0, 0), CAN_WRAPPER_HAL_OK);
+		}
+	}
+
+	for (int round = 0; round < ROUNDS; round++)
+	{
+		for (int n = 0; n < NODE_COUNT; n++)
+		{
+			for (int to = 0; to < NODE_COUNT; to++)
+			{
+				if (to == n)
+					continue;
+
+				CANMessage msg = {0};
+				Encode_PWR_SET_LINE_POWER(&msg, &(CmdArgs_PWR_SET_LINE_POWER){ .line = POWER_LINE_PAYLOAD, .state = (uint8_t)(round & 1) });
+				CHECK_EQ(CANWrapperEx_Transmit(&s_bus.nodes[n].hcw, (NodeID)to, &msg), CAN_WRAPPER_HAL_OK);
+			}
+		}
+
+		VirtualBus_Run(&s_bus, 10000);
+	}
+
+	for (int n = 0; n < NODE_COUNT; n++)
+	{
+		received[n] = s_bus.nodes[n].can.counters.frames_received;
+		rx_interrupts[n] = s_bus.nodes[n].can.counters.rx_interrupts;
+	}
+}
+
+static void test_rx_load(void)
+{
+	uint32_t all_received[NODE_COUNT], all_interrupts[NODE_COUNT];
+	run_traffic(true, all_received, all_interrupts);
+	const uint32_t all_frames = s_bus.stats.frames;
+
+	uint32_t received[NODE_COUNT], interrupts[NODE_COUNT];
+	run_traffic(false, received, interrupts);
+	const uint32_t frames = s_bus.stats.frames;
+
+	// each message and its ACK, in both runs.
+	CHECK_EQ(all_frames, ROUNDS*NODE_COUNT*(NODE_COUNT - 1)*2);
+	CHECK_EQ(frames, all_frames);
+
+	for (int n = 0; n < NODE_COUNT; n++)
+	{
+		// accepting everything, a node receives all but its own frames.
+		// filtered, only the quarter of the bus addressed to it.
+		CHECK_EQ(all_received[n], all_frames*(NODE_COUNT - 1)/NODE_COUNT);
+		CHECK_EQ(received[n], s_addressed[n]);
+		CHECK_EQ(received[n], frames/NODE_COUNT);
+		CHECK(interrupts[n]*2 < all_interrupts[n]);
+
+		printf("node %d: %u of %u frames received (%u accepting all), %u RX interrupts (%u accepting all)\n",
+				n, (unsigned)received[n], (unsigned)frames, (unsigned)all_received[n],
+				(unsigned)interrupts[n], (unsigned)all_interrupts[n]);
+	}
+}
+
+int main(void)
+{
+	test_std_banks();
+	test_ext_banks();
+	test_rx_load();
+
+	return HOST_TEST_RESULT();
+}
@@ -0,0 +1,138 @@
+/**
+ * @file test_probes.c
+ * Timing probes on the virtual bus: traffic through each probed site leaves
+ * a record with a count and min <= mean <= max, and CANProbe_Reset clears
+ * them all.
+ *
+ * Also built without CAN_WRAPPER_PROBES, where it checks that the probes
+ * compile to nothing. Its linking against a wrapper built that way checks
+ * that the wrapper doesn't call into can_probe.c either.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "can_probe.h"
+#include "host_test.h"
+
+#ifdef CAN_WRAPPER_PROBES
+
+static VirtualBus s_bus;
+
+static void on_message(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	(void)msg;
+	(void)info;
+	(void)ctx;
+}
+
+static void run_traffic(void)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){0}, false);
+
+	const NodeID ids[] = { NODE_CDH, NODE_POWER };
+	for (int i = 0; i < 2; i++)
+	{
+		VirtualNode *node = VirtualBus_Add_Node(&s_bus);
+		CHECK_EQ(VirtualBus_Init_Node(&s_bus, node, (CANWrapper_InitTypeDef){ .node_id = ids[i] }), CAN_WRAPPER_HAL_OK);
+		CHECK_EQ(CANWrapperEx_Register_Handler_Range(&node->hcw, 0, CMD_ID_COUNT - 1, &on_message, NULL), CAN_WRAPPER_HAL_OK);
+	}
+
+	VirtualNode *cdh = &s_bus.nodes[0];
+
+	// a few corrupted frames for the error interrupt.
+	VirtualBus_Inject_Errors(cdh, 3);
+
+	for (int i = 0; i < 20; i++)
+	{
+		CANMessage msg;
+
+		// bulk, to FIFO0, and urgent, to FIFO1. their ACK's come back on FIFO1.
+		Encode_CDH_SET_RTC(&msg, &(CmdArgs_CDH_SET_RTC){ .timestamp = (uint32_t)i });
+		CHECK_EQ(CANWrapperEx_Transmit(&cdh->hcw, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+
+		Encode_PWR_SET_LINE_POWER(&msg, &(CmdArgs_PWR_SET_LINE_POWER){ .line = POWER_LINE_PAYLOAD, .state = i & 1 });
+		CHECK_EQ(CANWrapperEx_Transmit(&cdh->hcw, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+
+		VirtualBus_Run(&s_bus, 5000);
+	}
+
+	VirtualBus_Run(&s_bus, 100000);
+}
+
+static void test_records(void)
+{
+	CANProbe_Reset();
+	run_traffic();
+
+	for (CANProbeID probe = 0; probe < CAN_PROBE_COUNT; probe++)
+	{
+		CANProbeRecord rec;
+		CANProbe_Get(probe, &rec);
+
+		const char *name = CANProbe_Name(probe);
+		CHECK(name != NULL && name[0] != '\0');
+
+		CHECK(rec.count > 0);
+		if (rec.count == 0)
+		{
+			fprintf(stderr, "no calls recorded for %s\n", name);
+			continue;
+		}
+
+		uint64_t mean = rec.total / rec.count;
+		CHECK(rec.min <= mean);
+		CHECK(mean <= rec.max);
+	}
+}
+
+static void test_reset(void)
+{
+	CANProbe_Reset();
+
+	for (CANProbeID probe = 0; probe < CAN_PROBE_COUNT; probe++)
+	{
+		CANProbeRecord rec;
+		CANProbe_Get(probe, &rec);
+
+		CHECK_EQ(rec.count, 0);
+		CHECK_EQ(rec.max, 0);
+		CHECK_EQ(rec.total, 0);
+	}
+
+	// and they start again from there.
+	CANMessage msg = { .cmd = CMD_CDH_PROCESS_HEARTBEAT };
+	CHECK_EQ(CANWrapperEx_Transmit(&s_bus.nodes[0].hcw, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+
+	CANProbeRecord rec;
+	CANProbe_Get(CAN_PROBE_TRANSMIT, &rec);
+	CHECK_EQ(rec.count, 1);
+	CHECK(rec.min == rec.max && rec.total == rec.max);
+}
+
+#else
+
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+
+static void test_compiled_out(void)
+{
+	CHECK_EQ(strcmp(STRINGIFY(CAN_PROBE_BEGIN()), "do {} while (0)"), 0);
+	CHECK_EQ(strcmp(STRINGIFY(CAN_PROBE_END(CAN_PROBE_POLL)), "do {} while (0)"), 0);
+}
+
+#endif /* CAN_WRAPPER_PROBES */
+
+int main(void)
+{
+#ifdef CAN_WRAPPER_PROBES
+	test_records();
+	test_reset();
+#else
+	test_compiled_out();
+#endif
+
+	return HOST_TEST_RESULT();
+}
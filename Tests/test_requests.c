@@ -0,0 +1,212 @@
+/**
+ * @file test_requests.c
+ * Requests on the virtual bus: 50 queries pipelined across 3 nodes each get
+ * their own reply, in order, including those retried after the TX queue was
+ * full. A reply addressed to another node doesn't complete a request, and a
+ * request without a reply times out.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "host_test.h"
+
+#define QUERIES 50
+#define RESPONDERS 3
+#define TIMEOUT_MS 100
+
+static VirtualBus s_bus;
+
+static const NodeID s_responders[RESPONDERS] = { NODE_POWER, NODE_ADCS, NODE_PAYLOAD };
+
+static bool s_auto_reply;
+static uint16_t s_next_reply[CAN_WRAPPER_MAX_NODES]; // by responder.
+
+static struct
+{
+	uint32_t calls;
+	bool timed_out;
+	NodeID sender;
+	uint16_t result;
+} s_replies[QUERIES];
+
+static uint32_t s_handled_replies; // that went to the handler instead.
+
+// responders answer each query with the number of queries they answered before.
+static void on_query(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	(void)msg;
+	VirtualNode *node = ctx;
+
+	if (!s_auto_reply)
+		return;
+
+	CANMessage reply;
+	Encode_CDH_PROCESS_LED_TEST(&reply, &(CmdArgs_CDH_PROCESS_LED_TEST){ .result = s_next_reply[node->hcw.init_struct.node_id]++ });
+	CHECK_EQ(CANWrapperEx_Transmit(&node->hcw, info->sender, &reply), CAN_WRAPPER_HAL_OK);
+}
+
+static void on_reply_handler(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	(void)msg;
+	(void)info;
+	(void)ctx;
+
+	s_handled_replies++;
+}
+
+static void on_reply(const CANMessage *reply, NodeID sender, void *ctx)
+{
+	uintptr_t query = (uintptr_t)ctx;
+	if (query >= QUERIES)
+		return;
+
+	s_replies[query].calls++;
+	s_replies[query].sender = sender;
+	s_replies[query].timed_out = reply == NULL;
+
+	if (reply != NULL)
+	{
+		CmdArgs_CDH_PROCESS_LED_TEST args;
+		Decode_CDH_PROCESS_LED_TEST(reply, &args);
+		s_replies[query].result = args.result;
+	}
+}
+
+static void setup(void)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){0}, false);
+
+	memset(s_replies, 0, sizeof(s_replies));
+	memset(s_next_reply, 0, sizeof(s_next_reply));
+	s_handled_replies = 0;
+	s_auto_reply = true;
+
+	VirtualNode *cdh = VirtualBus_Add_Node(&s_bus);
+	CHECK_EQ(VirtualBus_Init_Node(&s_bus, cdh, (CANWrapper_InitTypeDef){ .node_id = NODE_CDH }), CAN_WRAPPER_HAL_OK);
+	CHECK_EQ(CANWrapperEx_Register_Handler(&cdh->hcw, CMD_CDH_PROCESS_LED_TEST, &on_reply_handler, NULL), CAN_WRAPPER_HAL_OK);
+
+	for (int i = 0; i < RESPONDERS; i++)
+	{
+		VirtualNode *node = VirtualBus_Add_Node(&s_bus);
+		CHECK_EQ(VirtualBus_Init_Node(&s_bus, node, (CANWrapper_InitTypeDef){ .node_id = s_responders[i] }), CAN_WRAPPER_HAL_OK);
+		CHECK_EQ(CANWrapperEx_Register_Handler(&node->hcw, CMD_COMMON_GET_PCB_TEMP, &on_query, node), CAN_WRAPPER_HAL_OK);
+	}
+}
+
+static CANWrapper_StatusTypeDef request(NodeID recipient, uintptr_t query, uint32_t timeout_ms)
+{
+	CANMessage msg = { .cmd = CMD_COMMON_GET_PCB_TEMP };
+	return CANWrapperEx_Request(&s_bus.nodes[0].hcw, recipient, &msg, CMD_CDH_PROCESS_LED_TEST,
+			&on_reply, (void *)query, timeout_ms);
+}
+
+static int free_requests(const CANWrapper_Handle *hcw)
+{
+	int count = 0;
+	for (int i = hcw->free_request; i >= 0; i = hcw->requests[i].next)
+		count++;
+
+	return count;
+}
+
+static void test_pipelined_queries(void)
+{
+	setup();
+
+	// sent back to back without waiting for replies. whatever doesn't fit
+	// in the TX queue fails, frees its slot, and is made again once the
+	// queue has drained a little.
+	uint32_t tx_queue_full = 0;
+	for (uintptr_t query = 0; query < QUERIES; )
+	{
+		CANWrapper_StatusTypeDef status = request(s_responders[query % RESPONDERS], query, TIMEOUT_MS);
+		if (status == CAN_WRAPPER_TX_QUEUE_FULL)
+		{
+			tx_queue_full++;
+			VirtualBus_Run(&s_bus, 1000);
+			continue;
+		}
+
+		CHECK_EQ(status, CAN_WRAPPER_HAL_OK);
+		query++;
+	}
+
+	CHECK(tx_queue_full > 0);
+
+	VirtualBus_Run(&s_bus, 50000);
+
+	// each responder's replies complete its queries in the order they were made.
+	for (int query = 0; query < QUERIES; query++)
+	{
+		CHECK_EQ(s_replies[query].calls, 1);
+		CHECK(!s_replies[query].timed_out);
+		CHECK_EQ(s_replies[query].sender, s_responders[query % RESPONDERS]);
+		CHECK_EQ(s_replies[query].result, query / RESPONDERS);
+	}
+
+	CHECK_EQ(s_handled_replies, 0);
+	CHECK_EQ(free_requests(&s_bus.nodes[0].hcw), CAN_WRAPPER_MAX_REQUESTS);
+}
+
+static void test_reply_to_another_node(void)
+{
+	setup();
+	s_auto_reply = false;
+
+	VirtualNode *cdh = &s_bus.nodes[0];
+	VirtualNode *power = &s_bus.nodes[1];
+
+	// CDH also receives the traffic between other nodes.
+	CHECK_EQ(CANWrapperEx_Add_Filter(&cdh->hcw, 0, 0), CAN_WRAPPER_HAL_OK);
+
+	CHECK_EQ(request(NODE_POWER, 0, TIMEOUT_MS), CAN_WRAPPER_HAL_OK);
+	VirtualBus_Run(&s_bus, 5000);
+
+	// the same command from the same node, but for ADCS, goes to the handler.
+	CANMessage reply;
+	Encode_CDH_PROCESS_LED_TEST(&reply, &(CmdArgs_CDH_PROCESS_LED_TEST){ .result = 7 });
+	CHECK_EQ(CANWrapperEx_Transmit(&power->hcw, NODE_ADCS, &reply), CAN_WRAPPER_HAL_OK);
+	VirtualBus_Run(&s_bus, 5000);
+
+	CHECK_EQ(s_replies[0].calls, 0);
+	CHECK_EQ(s_handled_replies, 1);
+
+	// the reply to CDH completes it.
+	Encode_CDH_PROCESS_LED_TEST(&reply, &(CmdArgs_CDH_PROCESS_LED_TEST){ .result = 9 });
+	CHECK_EQ(CANWrapperEx_Transmit(&power->hcw, NODE_CDH, &reply), CAN_WRAPPER_HAL_OK);
+	VirtualBus_Run(&s_bus, 5000);
+
+	CHECK_EQ(s_replies[0].calls, 1);
+	CHECK(!s_replies[0].timed_out);
+	CHECK_EQ(s_replies[0].result, 9);
+	CHECK_EQ(s_handled_replies, 1);
+}
+
+static void test_timeout(void)
+{
+	setup();
+	s_auto_reply = false;
+
+	CHECK_EQ(request(NODE_ADCS, 0, 20), CAN_WRAPPER_HAL_OK);
+
+	VirtualBus_Run(&s_bus, 15000);
+	CHECK_EQ(s_replies[0].calls, 0);
+
+	VirtualBus_Run(&s_bus, 10000);
+	CHECK_EQ(s_replies[0].calls, 1);
+	CHECK(s_replies[0].timed_out);
+	CHECK_EQ(s_replies[0].sender, NODE_ADCS);
+	CHECK_EQ(free_requests(&s_bus.nodes[0].hcw), CAN_WRAPPER_MAX_REQUESTS);
+}
+
+int main(void)
+{
+	test_pipelined_queries();
+	test_reply_to_another_node();
+	test_timeout();
+
+	return HOST_TEST_RESULT();
+}
@@ -0,0 +1,170 @@
+/**
+ * @file test_retries.c
+ * The retry policy on a lossy virtual bus: resends are spaced by the
+ * command's doubling backoff, a message is given up on once, after its
+ * retry budget, and with frames lost every message still arrives once.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "can_id.h"
+#include "host_test.h"
+
+#define MAX_ATTEMPTS 16
+#define LOSSY_MESSAGES 200
+
+static VirtualBus s_bus;
+
+static uint64_t s_attempt_starts[MAX_ATTEMPTS];
+static uint32_t s_attempts;
+
+static CANWrapper_ErrorInfo s_error;
+static uint32_t s_errors;
+
+static uint32_t s_deliveries[LOSSY_MESSAGES];
+
+static void on_frame(const VirtualBusFrameInfo *info, void *ctx)
+{
+	(void)ctx;
+
+	CANIdFields fields;
+	CANId_Unpack(info->frame.id, info->frame.extended, &fields);
+
+	if (!info->ok || info->node != 0 || fields.is_ack)
+		return;
+
+	if (s_attempts < MAX_ATTEMPTS)
+		s_attempt_starts[s_attempts] = info->start;
+	s_attempts++;
+}
+
+static void on_error(CANWrapper_ErrorInfo error_info)
+{
+	if (error_info.error != CAN_WRAPPER_ERROR_TIMEOUT)
+		return;
+
+	s_error = error_info;
+	s_errors++;
+}
+
+static void on_message(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	(void)info;
+	(void)ctx;
+
+	uint16_t index = msg->body[0] | (uint16_t)msg->body[1] << 8;
+	if (index < LOSSY_MESSAGES)
+		s_deliveries[index]++;
+}
+
+static void setup(bool sequence_numbers)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){ .seed = 11 }, false);
+	s_bus.on_frame = &on_frame;
+
+	s_attempts = 0;
+	s_errors = 0;
+	memset(s_deliveries, 0, sizeof(s_deliveries));
+
+	VirtualNode *cdh = VirtualBus_Add_Node(&s_bus);
+	VirtualNode *power = VirtualBus_Add_Node(&s_bus);
+
+	CANWrapper_InitTypeDef init = {
+		.node_id = NODE_CDH,
+		.error_callback = &on_error,
+		.sequence_numbers = sequence_numbers,
+	};
+	CHECK_EQ(VirtualBus_Init_Node(&s_bus, cdh, init), CAN_WRAPPER_HAL_OK);
+
+	init.node_id = NODE_POWER;
+	CHECK_EQ(VirtualBus_Init_Node(&s_bus, power, init), CAN_WRAPPER_HAL_OK);
+	CHECK_EQ(CANWrapperEx_Register_Handler_Range(&power->hcw, 0, CMD_ID_COUNT - 1, &on_message, NULL), CAN_WRAPPER_HAL_OK);
+}
+
+static void test_give_up(void)
+{
+	setup(false);
+
+	// POWER loses everything, so no attempt is ACK'd.
+	s_bus.nodes[1].drop_permille = 1000;
+
+	CANMessage msg = { .cmd = CMD_CDH_PROCESS_ERROR };
+	CHECK_EQ(CANWrapperEx_Transmit(&s_bus.nodes[0].hcw, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+
+	VirtualBus_Run(&s_bus, 2000000);
+
+	const CmdConfig *config = &cmd_configs[CMD_CDH_PROCESS_ERROR];
+	const uint64_t timeout_us = (config->timeout != 0 ? config->timeout : 50) * 1000ULL; // 50ms by default.
+
+	CHECK_EQ(s_attempts, config->max_retries + 1U);
+
+	// each resend waits out the ACK timeout, then a backoff that doubles,
+	// plus jitter, a timing wheel granule and a poll or two.
+	for (uint32_t i = 1; i < s_attempts && i < MAX_ATTEMPTS; i++)
+	{
+		uint64_t waited_us = (s_attempt_starts[i] - s_attempt_starts[i - 1]) / 1000;
+		uint64_t backoff_us = ((uint64_t)config->backoff << (i - 1)) * 1000;
+
+		CHECK(waited_us >= timeout_us + backoff_us);
+		CHECK(waited_us <= timeout_us + backoff_us + (uint64_t)config->jitter*1000
+				+ 2*(1U << TIMING_WHEEL_RESOLUTION_BITS) + 2*VIRTUAL_BUS_DEFAULT_POLL_INTERVAL);
+	}
+
+	// reported once, after the last attempt timed out.
+	CHECK_EQ(s_errors, 1);
+	CHECK_EQ(s_error.recipient, NODE_POWER);
+	CHECK_EQ(s_error.msg.cmd, CMD_CDH_PROCESS_ERROR);
+	CHECK_EQ(TxCache_Front(&s_bus.nodes[0].hcw.tx_cache), TX_CACHE_NONE);
+
+	CANWrapper_Stats stats;
+	CANWrapperEx_Get_Stats(&s_bus.nodes[0].hcw, &stats);
+	CHECK_EQ(stats.nodes[NODE_POWER].tx_retries, config->max_retries);
+	CHECK_EQ(stats.nodes[NODE_POWER].tx_timeouts, config->max_retries + 1U);
+	CHECK_EQ(stats.nodes[NODE_POWER].tx_failures, 1);
+}
+
+static void test_lossy_delivery(void)
+{
+	setup(true);
+
+	// messages and ACK's alike are lost.
+	s_bus.nodes[0].drop_permille = 20;
+	s_bus.nodes[1].drop_permille = 20;
+
+	for (uint16_t i = 0; i < LOSSY_MESSAGES; i++)
+	{
+		// short enough to be numbered.
+		CANMessage msg = { .cmd = CMD_CDH_SET_RTC };
+		msg.body[0] = (uint8_t)i;
+		msg.body[1] = (uint8_t)(i >> 8);
+
+		CHECK_EQ(CANWrapperEx_Transmit(&s_bus.nodes[0].hcw, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+		VirtualBus_Run(&s_bus, 5000);
+	}
+
+	VirtualBus_Run(&s_bus, 2000000);
+
+	// resent when the ACK was lost, but handled once.
+	for (uint16_t i = 0; i < LOSSY_MESSAGES; i++)
+	{
+		CHECK_EQ(s_deliveries[i], 1);
+	}
+
+	CANWrapper_Stats stats;
+	CANWrapperEx_Get_Stats(&s_bus.nodes[0].hcw, &stats);
+	CHECK(stats.nodes[NODE_POWER].tx_retries > 0);
+	CHECK_EQ(stats.nodes[NODE_POWER].tx_failures, 0);
+	CHECK_EQ(s_errors, 0);
+	CHECK_EQ(TxCache_Front(&s_bus.nodes[0].hcw.tx_cache), TX_CACHE_NONE);
+}
+
+int main(void)
+{
+	test_give_up();
+	test_lossy_delivery();
+
+	return HOST_TEST_RESULT();
+}
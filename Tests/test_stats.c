@@ -0,0 +1,165 @@
+/**
+ * @file test_stats.c
+ * Statistics: the high-water marks and ACK round trip histogram kept on the
+ * virtual bus, the histogram's bucket boundaries, and packing a snapshot
+ * into CMD_COMMON_STATS frames that reassemble to the same bytes.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "can_stats.h"
+#include "host_test.h"
+
+#define MESSAGES 10
+
+static VirtualBus s_bus;
+
+static void on_message(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	(void)msg;
+	(void)info;
+	(void)ctx;
+}
+
+static void test_rtt_buckets(void)
+{
+	CHECK_EQ(CANStats_RTT_Bucket(0), 0);
+	CHECK_EQ(CANStats_RTT_Bucket(1), 0);
+
+	for (int k = 1; k < CAN_STATS_RTT_BUCKETS; k++)
+	{
+		CHECK_EQ(CANStats_RTT_Bucket(1ULL << k), k);
+		CHECK_EQ(CANStats_RTT_Bucket((1ULL << k) - 1), k - 1);
+	}
+
+	// the last bucket takes everything longer.
+	CHECK_EQ(CANStats_RTT_Bucket(1ULL << CAN_STATS_RTT_BUCKETS), CAN_STATS_RTT_BUCKETS - 1);
+	CHECK_EQ(CANStats_RTT_Bucket(0xFFFFFFFFULL), CAN_STATS_RTT_BUCKETS - 1);
+	CHECK_EQ(CANStats_RTT_Bucket(1ULL << 32), CAN_STATS_RTT_BUCKETS - 1);
+	CHECK_EQ(CANStats_RTT_Bucket(UINT64_MAX), CAN_STATS_RTT_BUCKETS - 1);
+}
+
+static void test_traffic(void)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){0}, false);
+
+	const NodeID ids[] = { NODE_CDH, NODE_POWER };
+	for (int i = 0; i < 2; i++)
+	{
+		VirtualNode *node = VirtualBus_Add_Node(&s_bus);
+		CHECK_EQ(VirtualBus_Init_Node(&s_bus, node, (CANWrapper_InitTypeDef){ .node_id = ids[i] }), CAN_WRAPPER_HAL_OK);
+		CHECK_EQ(CANWrapperEx_Register_Handler_Range(&node->hcw, 0, CMD_ID_COUNT - 1, &on_message, NULL), CAN_WRAPPER_HAL_OK);
+	}
+
+	CANWrapper_Handle *cdh = &s_bus.nodes[0].hcw;
+	CANWrapper_Handle *power = &s_bus.nodes[1].hcw;
+
+	// queued all at once, so the mailboxes take the first few and the rest
+	// wait in the TX queue. every one waits in the TX cache.
+	for (uint32_t i = 0; i < MESSAGES; i++)
+	{
+		CANMessage msg;
+		Encode_CDH_SET_RTC(&msg, &(CmdArgs_CDH_SET_RTC){ .timestamp = i });
+		CHECK_EQ(CANWrapperEx_Transmit(cdh, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+	}
+
+	// and an urgent one for POWER's other queue.
+	CANMessage msg;
+	Encode_CDH_PROCESS_ERROR(&msg, &(CmdArgs_CDH_PROCESS_ERROR){ .error = { 1 } });
+	CHECK_EQ(CANWrapperEx_Transmit(power, NODE_CDH, &msg), CAN_WRAPPER_HAL_OK);
+
+	VirtualBus_Run(&s_bus, 50000);
+
+	CANWrapper_Stats stats;
+	CANWrapperEx_Get_Stats(cdh, &stats);
+
+	// the marks stay where they were after the queues drain.
+	CHECK_EQ(cdh->tx_cache.size, 0);
+	CHECK_EQ(stats.tx_cache_hwm, MESSAGES);
+	// the TX queue's mark counts a frame before it moves to a mailbox.
+	CHECK_EQ(stats.tx_queue_hwm, MESSAGES - CAN_TX_MAILBOX_COUNT + 1);
+	CHECK(stats.urgent_queue_hwm >= 1);
+	CHECK(stats.pending_acks_hwm >= 1);
+
+	CANWrapper_Stats power_stats;
+	CANWrapperEx_Get_Stats(power, &power_stats);
+	CHECK(power_stats.msg_queue_hwm >= 1);
+	CHECK(power_stats.pending_acks_hwm >= 1);
+
+	// one round trip per ACK, none of them instant or anywhere near a second.
+	uint32_t rtts = 0;
+	for (int i = 0; i < CAN_STATS_RTT_BUCKETS; i++)
+		rtts += stats.ack_rtt[i];
+
+	CHECK_EQ(stats.nodes[NODE_POWER].acks_received, MESSAGES);
+	CHECK_EQ(rtts, MESSAGES);
+	CHECK_EQ(stats.ack_rtt[0], 0);
+	CHECK_EQ(stats.ack_rtt[CAN_STATS_RTT_BUCKETS - 1], 0);
+}
+
+static void unpack(const CANMessage *msg, CmdArgs_COMMON_STATS *out_args)
+{
+	CHECK_EQ(msg->cmd, CMD_COMMON_STATS);
+	Decode_COMMON_STATS(msg, out_args);
+}
+
+static void test_pack(void)
+{
+	static CANWrapper_Stats snapshot, reassembled;
+	static uint8_t received[sizeof(CANWrapper_Stats) + CAN_STATS_BYTES_PER_FRAME];
+
+	// no zero bytes, so padding can be told from the snapshot.
+	uint8_t *bytes = (uint8_t *)&snapshot;
+	for (size_t i = 0; i < sizeof(snapshot); i++)
+		bytes[i] = (uint8_t)(i % 251 + 1);
+
+	const uint16_t frames = (sizeof(snapshot) + CAN_STATS_BYTES_PER_FRAME - 1) / CAN_STATS_BYTES_PER_FRAME;
+	memset(received, 0xEE, sizeof(received));
+
+	CANMessage msg;
+	CmdArgs_COMMON_STATS args;
+
+	// delivered out of order, as they might be.
+	for (uint16_t n = 0; n < frames; n++)
+	{
+		uint16_t index = frames - 1 - n;
+		CHECK_EQ(CANStats_Pack(&snapshot, index, &msg), frames);
+
+		unpack(&msg, &args);
+		CHECK_EQ(args.index, index);
+		memcpy(&received[(size_t)index * CAN_STATS_BYTES_PER_FRAME], args.data, CAN_STATS_BYTES_PER_FRAME);
+	}
+
+	memcpy(&reassembled, received, sizeof(reassembled));
+	CHECK_EQ(memcmp(&reassembled, &snapshot, sizeof(snapshot)), 0);
+
+	// the last frame is padded with zeros.
+	size_t padding = (size_t)frames * CAN_STATS_BYTES_PER_FRAME - sizeof(snapshot);
+	CHECK(padding < CAN_STATS_BYTES_PER_FRAME);
+	for (size_t i = sizeof(snapshot); i < sizeof(snapshot) + padding; i++)
+		CHECK_EQ(received[i], 0);
+
+	// beyond the snapshot, frames carry the index and nothing else.
+	const uint16_t beyond[] = { frames, frames + 1, UINT16_MAX };
+	for (size_t i = 0; i < sizeof(beyond)/sizeof(beyond[0]); i++)
+	{
+		CHECK_EQ(CANStats_Pack(&snapshot, beyond[i], &msg), frames);
+
+		unpack(&msg, &args);
+		CHECK_EQ(args.index, beyond[i]);
+		for (int b = 0; b < CAN_STATS_BYTES_PER_FRAME; b++)
+			CHECK_EQ(args.data[b], 0);
+	}
+}
+
+int main(void)
+{
+	test_rtt_buckets();
+	test_traffic();
+	test_pack();
+
+	return HOST_TEST_RESULT();
+}
@@ -0,0 +1,172 @@
+/**
+ * @file test_tick.c
+ * The 64-bit tick over many timer wraps, with the update interrupt late or
+ * preempted, and an ACK timeout longer than a timer period.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "host_test.h"
+
+static VirtualBus s_bus;
+static VirtualNode *s_node;
+
+static uint32_t s_samples;
+static uint32_t s_wrong_samples;
+
+static uint64_t s_first_start;
+static uint64_t s_second_start;
+static uint32_t s_attempts;
+
+/**
+ * @brief Returns the tick the wrapper should read now: 1 per us since the timer started.
+ */
+static uint64_t expected_tick(void)
+{
+	return (FakeHAL_Get_Time() - s_node->tim.start_time) / 1000;
+}
+
+static void sample(TIM_HandleTypeDef *htim)
+{
+	(void)htim;
+
+	s_samples++;
+	if (CANWrapperEx_Get_Tick(&s_node->hcw) != expected_tick())
+		s_wrong_samples++;
+}
+
+// the vector, reading the time wherever a higher priority interrupt could.
+static void tim_irq_handler(TIM_HandleTypeDef *htim)
+{
+	sample(htim);
+	CANWrapper_TIM_IRQHandler(htim);
+	sample(htim);
+	HAL_TIM_IRQHandler(htim);
+	sample(htim);
+}
+
+static void on_frame(const VirtualBusFrameInfo *info, void *ctx)
+{
+	(void)ctx;
+
+	if (info->node != 0)
+		return;
+
+	if (s_attempts == 0)
+		s_first_start = info->start;
+	else if (s_attempts == 1)
+		s_second_start = info->start;
+
+	s_attempts++;
+}
+
+static void setup(void)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){0}, false);
+
+	// start a little after 0, so the timer isn't in phase with the clock.
+	FakeHAL_Set_Time(1234567);
+
+	s_node = VirtualBus_Add_Node(&s_bus);
+	CHECK_EQ(VirtualBus_Init_Node(&s_bus, s_node, (CANWrapper_InitTypeDef){ .node_id = NODE_CDH }), CAN_WRAPPER_HAL_OK);
+
+	s_node->tim.irq_handler = &tim_irq_handler;
+	s_node->tim.preempt = &sample;
+}
+
+static void test_wraparound(void)
+{
+	setup();
+
+	uint64_t last = 0;
+	bool monotonic = true;
+	uint32_t reads = 0;
+	uint32_t wrong = 0;
+
+	// 200 periods, read at steps that don't divide the period.
+	while (s_node->tim.updates < 200)
+	{
+		VirtualBus_Advance(&s_bus, 37);
+
+		uint64_t tick = CANWrapperEx_Get_Tick(&s_node->hcw);
+		if (tick < last)
+			monotonic = false;
+		if (tick != expected_tick())
+			wrong++;
+
+		last = tick;
+		reads++;
+	}
+
+	CHECK(monotonic);
+	CHECK_EQ(wrong, 0);
+	CHECK_EQ(s_node->hcw.tick_overflows, 200);
+	CHECK(s_samples >= 3*200);
+	CHECK_EQ(s_wrong_samples, 0);
+	CHECK(reads > 200*VIRTUAL_BUS_TIMER_PERIOD/37 - 1);
+}
+
+static void test_late_interrupt(void)
+{
+	setup();
+
+	// as if the interrupt were masked over the wrap, e.g. by a long critical section.
+	VirtualBus_Advance(&s_bus, VIRTUAL_BUS_TIMER_PERIOD - 10);
+	FakeTIM_Hold_IRQ(&s_node->htim, true);
+	VirtualBus_Advance(&s_bus, 20);
+
+	CHECK_EQ(s_node->hcw.tick_overflows, 0);
+	CHECK(__HAL_TIM_GET_FLAG(&s_node->htim, TIM_FLAG_UPDATE));
+	CHECK_EQ(CANWrapperEx_Get_Tick(&s_node->hcw), expected_tick());
+
+	// once it runs, the wrap is counted once.
+	FakeTIM_Hold_IRQ(&s_node->htim, false);
+	VirtualBus_Advance(&s_bus, 1);
+
+	CHECK_EQ(s_node->hcw.tick_overflows, 1);
+	CHECK_EQ(CANWrapperEx_Get_Tick(&s_node->hcw), expected_tick());
+	CHECK_EQ(s_wrong_samples, 0);
+}
+
+static void test_long_timeout(void)
+{
+	setup();
+
+	// POWER is on the bus but never polled, so it never ACK's.
+	VirtualNode *power = VirtualBus_Add_Node(&s_bus);
+	CHECK_EQ(VirtualBus_Init_Node(&s_bus, power, (CANWrapper_InitTypeDef){ .node_id = NODE_POWER }), CAN_WRAPPER_HAL_OK);
+	power->polled = false;
+
+	s_bus.on_frame = &on_frame;
+	s_attempts = 0;
+
+	CANMessage msg = { .cmd = CMD_COMMON_RESET };
+	CHECK_EQ(CANWrapperEx_Transmit(&s_node->hcw, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+
+	VirtualBus_Run(&s_bus, 100000);
+
+	// resent after the default 50ms timeout (10 timer periods), then its
+	// 5ms backoff and up to 2ms of jitter, rounded up to a timing wheel
+	// granule and checked at each 100us poll. the jitter depends on the
+	// handle's address, so any value in the range may come up.
+	const CmdConfig *config = &cmd_configs[CMD_COMMON_RESET];
+	uint64_t waited_us = (s_second_start - s_first_start) / 1000;
+
+	CHECK(s_attempts >= 2);
+	CHECK(waited_us >= 50000 + (uint64_t)config->backoff*1000);
+	CHECK(waited_us <= 50000 + (uint64_t)(config->backoff + config->jitter)*1000
+			+ (1U << TIMING_WHEEL_RESOLUTION_BITS) + 2*VIRTUAL_BUS_DEFAULT_POLL_INTERVAL);
+	CHECK_EQ(s_wrong_samples, 0);
+}
+
+int main(void)
+{
+	test_wraparound();
+	test_late_interrupt();
+	test_long_timeout();
+
+	return HOST_TEST_RESULT();
+}
@@ -0,0 +1,174 @@
+/**
+ * @file test_transport.c
+ * Segmented transfers over the virtual bus: a payload arrives whole, also
+ * when segments are lost, and a node that logs the bus stays out of other
+ * nodes' transfers. Nothing is sent while the wrapper isn't initialised.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "can_transport.h"
+#include "host_test.h"
+
+#define PAYLOAD_SIZE 2000
+#define TAG 0x42
+
+static VirtualBus s_bus;
+
+typedef struct
+{
+	CANTransport tp;
+	uint8_t buffer[PAYLOAD_SIZE];
+	uint32_t buffers_given;
+	uint32_t received;
+	bool receive_success;
+	uint32_t sent;
+	bool send_success;
+} Endpoint;
+
+static Endpoint s_endpoints[3];
+
+static uint8_t *on_buffer(NodeID sender, uint8_t tag, uint16_t length, void *ctx)
+{
+	(void)sender;
+	(void)tag;
+
+	Endpoint *ep = ctx;
+	ep->buffers_given++;
+
+	return length <= PAYLOAD_SIZE ? ep->buffer : NULL;
+}
+
+static void on_receive(NodeID sender, uint8_t tag, uint8_t *buffer, uint16_t length, bool success, void *ctx)
+{
+	(void)sender;
+	(void)tag;
+	(void)buffer;
+	(void)length;
+
+	Endpoint *ep = ctx;
+	ep->received++;
+	ep->receive_success = success;
+}
+
+static void on_send(NodeID recipient, uint8_t tag, bool success, void *ctx)
+{
+	(void)recipient;
+	(void)tag;
+
+	Endpoint *ep = ctx;
+	ep->sent++;
+	ep->send_success = success;
+}
+
+static bool sent(void *ctx)
+{
+	return ((Endpoint *)ctx)->sent > 0;
+}
+
+static VirtualNode *add_node(NodeID id, Endpoint *ep)
+{
+	VirtualNode *node = VirtualBus_Add_Node(&s_bus);
+	CHECK_EQ(VirtualBus_Init_Node(&s_bus, node, (CANWrapper_InitTypeDef){ .node_id = id }), CAN_WRAPPER_HAL_OK);
+
+	memset(ep, 0, sizeof(*ep));
+	CANTransport_InitTypeDef init = {
+		.buffer_callback = &on_buffer,
+		.receive_callback = &on_receive,
+		.send_callback = &on_send,
+		.ctx = ep,
+	};
+	CHECK_EQ(CANTransport_Init(&ep->tp, &node->hcw, init), CAN_WRAPPER_HAL_OK);
+
+	return node;
+}
+
+static void fill_payload(uint8_t *payload)
+{
+	for (uint32_t i = 0; i < PAYLOAD_SIZE; i++)
+	{
+		payload[i] = (uint8_t)(i * 31 + (i >> 8));
+	}
+}
+
+static void check_transfer(uint16_t drop_permille)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){ .seed = 7 }, false);
+
+	Endpoint *cdh = &s_endpoints[0];
+	Endpoint *power = &s_endpoints[1];
+	Endpoint *logger = &s_endpoints[2];
+
+	add_node(NODE_CDH, cdh);
+	VirtualNode *power_node = add_node(NODE_POWER, power);
+	VirtualNode *logger_node = add_node(NODE_ADCS, logger);
+
+	// ADCS also logs the whole bus.
+	CHECK_EQ(CANWrapperEx_Add_Filter(&logger_node->hcw, 0, 0), CAN_WRAPPER_HAL_OK);
+
+	power_node->drop_permille = drop_permille;
+
+	static uint8_t payload[PAYLOAD_SIZE];
+	fill_payload(payload);
+
+	CHECK_EQ(CANTransport_Send(&cdh->tp, NODE_POWER, TAG, payload, PAYLOAD_SIZE), CAN_WRAPPER_HAL_OK);
+	CHECK(VirtualBus_Run_Until(&s_bus, &sent, cdh, 10000000));
+
+	// let POWER's last ACK arrive, and any timers run out.
+	VirtualBus_Run(&s_bus, 200000);
+
+	CHECK(cdh->send_success);
+	CHECK_EQ(power->buffers_given, 1);
+	CHECK_EQ(power->received, 1);
+	CHECK(power->receive_success);
+	CHECK(memcmp(power->buffer, payload, PAYLOAD_SIZE) == 0);
+
+	// ADCS saw every segment, but none was for it.
+	CHECK_EQ(logger->buffers_given, 0);
+	CHECK_EQ(logger->received, 0);
+	CHECK_EQ(logger_node->can.counters.frames_sent, 0);
+
+	CANWrapper_Stats stats;
+	CANWrapperEx_Get_Stats(&logger_node->hcw, &stats);
+	CHECK(stats.cmd_rx[CMD_COMMON_SEGMENT_DATA] >= PAYLOAD_SIZE / CAN_TRANSPORT_SEGMENT_SIZE);
+}
+
+static void test_transfer(void)
+{
+	check_transfer(0);
+}
+
+static void test_lossy_transfer(void)
+{
+	check_transfer(50);
+	CHECK(s_bus.nodes[1].frames_dropped > 0);
+}
+
+static void test_not_initialised(void)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){0}, false);
+
+	Endpoint *cdh = &s_endpoints[0];
+	VirtualNode *cdh_node = add_node(NODE_CDH, cdh);
+
+	// initialising again fails, as the CAN is already running, and leaves
+	// the wrapper uninitialised under the transport.
+	CHECK_EQ(VirtualBus_Init_Node(&s_bus, cdh_node, (CANWrapper_InitTypeDef){ .node_id = NODE_CDH }), CAN_WRAPPER_FAILED_TO_START_CAN);
+
+	static uint8_t payload[PAYLOAD_SIZE];
+	CHECK_EQ(CANTransport_Send(&cdh->tp, NODE_POWER, TAG, payload, PAYLOAD_SIZE), CAN_WRAPPER_NOT_INITIALISED);
+	CHECK_EQ(cdh_node->can.counters.frames_sent, 0);
+	CHECK_EQ(cdh_node->hcw.tx_queue.size, 0);
+}
+
+int main(void)
+{
+	test_transfer();
+	test_lossy_transfer();
+	test_not_initialised();
+
+	return HOST_TEST_RESULT();
+}
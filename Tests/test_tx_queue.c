@@ -0,0 +1,139 @@
+/**
+ * @file test_tx_queue.c
+ * The software TX queue: it orders frames by identifier, and transmitting
+ * returns at once, whether or not a mailbox is free.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "can_id.h"
+#include "host_test.h"
+#include <signal.h>
+#include <unistd.h>
+
+#define MAX_FRAMES 64
+
+static VirtualBus s_bus;
+
+static uint32_t s_sent_ids[MAX_FRAMES];
+static uint32_t s_sent_count;
+static uint32_t s_received;
+
+static void on_frame(const VirtualBusFrameInfo *info, void *ctx)
+{
+	(void)ctx;
+
+	CANIdFields fields;
+	CANId_Unpack(info->frame.id, info->frame.extended, &fields);
+
+	// CDH's messages. not POWER's ACK's.
+	if (info->ok && info->node == 0 && !fields.is_ack && s_sent_count < MAX_FRAMES)
+		s_sent_ids[s_sent_count++] = info->frame.id;
+}
+
+static void on_message(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	(void)msg;
+	(void)ctx;
+
+	if (!info->is_ack)
+		s_received++;
+}
+
+static void on_hang(int signal)
+{
+	(void)signal;
+
+	static const char text[] = "a transmit call blocked\n";
+	write(STDERR_FILENO, text, sizeof(text) - 1);
+	_exit(1);
+}
+
+static void test_heap_order(void)
+{
+	TxQueue txq = TxQueue_Create();
+
+	const uint32_t ids[] = { 0x500, 0x020, 0x7E0, 0x020, 0x100, 0x000, 0x500 };
+	for (uint8_t i = 0; i < sizeof(ids)/sizeof(ids[0]); i++)
+	{
+		TxQueueItem frame = { .id = ids[i], .dlc = 1, .msg = { .cmd = i } };
+		CHECK(TxQueue_Push(&txq, &frame));
+	}
+
+	// lowest ID first, and equal ID's in the order they were pushed.
+	const uint32_t expected_ids[]  = { 0x000, 0x020, 0x020, 0x100, 0x500, 0x500, 0x7E0 };
+	const uint8_t expected_order[] = { 5,     1,     3,     4,     0,     6,     2 };
+
+	for (uint8_t i = 0; i < sizeof(expected_ids)/sizeof(expected_ids[0]); i++)
+	{
+		TxQueueItem frame;
+		CHECK(TxQueue_Pop(&txq, &frame));
+		CHECK_EQ(frame.id, expected_ids[i]);
+		CHECK_EQ(frame.msg.cmd, expected_order[i]);
+	}
+
+	CHECK(TxQueue_IsEmpty(&txq));
+}
+
+static void test_transmit_never_blocks(void)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){0}, false);
+	s_bus.on_frame = &on_frame;
+
+	VirtualNode *cdh = VirtualBus_Add_Node(&s_bus);
+	VirtualNode *power = VirtualBus_Add_Node(&s_bus);
+
+	CHECK_EQ(VirtualBus_Init_Node(&s_bus, cdh, (CANWrapper_InitTypeDef){ .node_id = NODE_CDH }), CAN_WRAPPER_HAL_OK);
+	CHECK_EQ(VirtualBus_Init_Node(&s_bus, power, (CANWrapper_InitTypeDef){ .node_id = NODE_POWER }), CAN_WRAPPER_HAL_OK);
+	CANWrapperEx_Register_Handler_Range(&power->hcw, 0, CMD_ID_COUNT - 1, &on_message, NULL);
+
+	// low priority first, so the mailboxes fill with the least urgent frames.
+	const CmdID cmds[] = { CMD_COMMON_STATS, CMD_COMMON_GET_PCB_TEMP, CMD_CDH_PROCESS_ERROR, CMD_PWR_SET_LINE_POWER, CMD_COMMON_RESET };
+
+	// the bus isn't running, so nothing leaves the mailboxes. a transmit
+	// that waited for one would never return.
+	signal(SIGALRM, &on_hang);
+	alarm(5);
+
+	uint32_t accepted = 0;
+	CANWrapper_StatusTypeDef status = CAN_WRAPPER_HAL_OK;
+	for (uint32_t i = 0; status == CAN_WRAPPER_HAL_OK; i++)
+	{
+		CANMessage msg = { .cmd = cmds[i % 5] };
+		msg.body[0] = (uint8_t)i;
+
+		status = CANWrapperEx_Transmit(&cdh->hcw, NODE_POWER, &msg);
+		if (status == CAN_WRAPPER_HAL_OK)
+			accepted++;
+	}
+
+	alarm(0);
+
+	CHECK_EQ(status, CAN_WRAPPER_TX_QUEUE_FULL);
+	CHECK_EQ(accepted, CAN_TX_MAILBOX_COUNT + TX_QUEUE_SIZE);
+
+	VirtualBus_Run(&s_bus, 50000);
+
+	CHECK_EQ(s_sent_count, accepted);
+	CHECK_EQ(s_received, accepted);
+
+	// the first out is the best of the first 3. after that, each mailbox that
+	// frees up takes the best queued frame, so the rest leave in order.
+	for (uint32_t i = 2; i < s_sent_count; i++)
+	{
+		CHECK(s_sent_ids[i] >= s_sent_ids[i - 1]);
+	}
+
+	CHECK_EQ(s_sent_ids[0], (uint32_t)cmd_configs[CMD_CDH_PROCESS_ERROR].priority << CAN_ID_PRIORITY_SHIFT | NODE_POWER << CAN_ID_RECIPIENT_SHIFT);
+}
+
+int main(void)
+{
+	test_heap_order();
+	test_transmit_never_blocks();
+
+	return HOST_TEST_RESULT();
+}
@@ -0,0 +1,197 @@
+/**
+ * @file test_virtual_bus.c
+ * Two wrapper instances talking over the virtual bus, and an Init that
+ * fails part way leaving nothing behind.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "host_test.h"
+
+static VirtualBus s_bus;
+
+static struct
+{
+	uint32_t count;
+	CANMessage msg;
+	CANMessageInfo info;
+} s_received[VIRTUAL_BUS_MAX_NODES];
+
+static uint32_t s_can_timeouts;
+static uint64_t s_frame_time;
+static uint64_t s_frame_bits;
+
+static void on_message(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	int node = (int)(intptr_t)ctx;
+
+	if (info->is_ack) return;
+
+	s_received[node].count++;
+	s_received[node].msg = *msg;
+	s_received[node].info = *info;
+}
+
+static void on_error(CANWrapper_ErrorInfo error_info)
+{
+	if (error_info.error == CAN_WRAPPER_ERROR_CAN_TIMEOUT)
+		s_can_timeouts++;
+}
+
+static void on_frame(const VirtualBusFrameInfo *info, void *ctx)
+{
+	(void)ctx;
+
+	s_frame_time += info->end - info->start;
+	s_frame_bits += info->bits;
+}
+
+static VirtualNode *add_node(NodeID id)
+{
+	VirtualNode *node = VirtualBus_Add_Node(&s_bus);
+
+	CANWrapper_InitTypeDef init = {
+		.node_id = id,
+		.error_callback = &on_error,
+	};
+	CHECK_EQ(VirtualBus_Init_Node(&s_bus, node, init), CAN_WRAPPER_HAL_OK);
+
+	int index = (int)(node - s_bus.nodes);
+	CHECK_EQ(CANWrapperEx_Register_Handler_Range(&node->hcw, 0, CMD_ID_COUNT - 1, &on_message, (void *)(intptr_t)index), CAN_WRAPPER_HAL_OK);
+
+	return node;
+}
+
+static void test_frame_bits(void)
+{
+	// 0x555 and 0x55 bytes never have 5 equal bits in a row, up to the CRC.
+	FakeCANFrame frame = { .id = 0x555, .dlc = 8, .data = {0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55} };
+	uint32_t bits = VirtualBus_Frame_Bits(&frame);
+
+	// 1 + 11 + 3 + 4 + 64 + 15 unstuffed, plus the tail. at most one stuff bit per 4 after the first.
+	CHECK(bits >= 111 && bits <= 111 + 97/4);
+
+	// a run of zeros is stuffed every 4 bits after the first 5.
+	FakeCANFrame zeros = { .id = 0, .dlc = 8 };
+	CHECK(VirtualBus_Frame_Bits(&zeros) > bits);
+
+	FakeCANFrame extended = { .id = 0x1ABCDEF, .extended = true, .dlc = 8 };
+	CHECK(VirtualBus_Frame_Bits(&extended) >= 131);
+}
+
+static void test_exchange(void)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){ .bitrate = 500000 }, false);
+	s_bus.on_frame = &on_frame;
+	s_frame_time = 0;
+	s_frame_bits = 0;
+	memset(s_received, 0, sizeof(s_received));
+
+	VirtualNode *cdh = add_node(NODE_CDH);
+	VirtualNode *power = add_node(NODE_POWER);
+
+	// CDH -> POWER, ACK'd.
+	CANMessage msg = {0};
+	Encode_PWR_SET_LINE_POWER(&msg, &(CmdArgs_PWR_SET_LINE_POWER){ .line = POWER_LINE_PAYLOAD, .state = 1 });
+	CHECK_EQ(CANWrapperEx_Transmit(&cdh->hcw, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+
+	VirtualBus_Run(&s_bus, 2000);
+
+	CHECK_EQ(s_received[1].count, 1);
+	CHECK_EQ(s_received[1].info.sender, NODE_CDH);
+	CHECK(CANMessage_Equals(&s_received[1].msg, &msg));
+
+	CANWrapper_Stats stats;
+	CANWrapperEx_Get_Stats(&cdh->hcw, &stats);
+	CHECK_EQ(stats.nodes[NODE_POWER].acks_received, 1);
+	CHECK_EQ(TxCache_Front(&cdh->hcw.tx_cache), -1);
+
+	// POWER -> CDH, fire and forget.
+	CANMessage reply = {0};
+	Encode_CDH_PROCESS_PCB_TEMP(&reply, &(CmdArgs_CDH_PROCESS_PCB_TEMP){ .temp = 2931 });
+	CHECK_EQ(CANWrapperEx_Transmit(&power->hcw, NODE_CDH, &reply), CAN_WRAPPER_HAL_OK);
+
+	VirtualBus_Run(&s_bus, 2000);
+
+	CHECK_EQ(s_received[0].count, 1);
+	CHECK_EQ(s_received[0].info.sender, NODE_POWER);
+
+	CmdArgs_CDH_PROCESS_PCB_TEMP args;
+	Decode_CDH_PROCESS_PCB_TEMP(&s_received[0].msg, &args);
+	CHECK_EQ(args.temp, 2931);
+
+	// the message, its ACK and the reply, at 2us a bit.
+	CHECK_EQ(s_bus.stats.frames, 3);
+	CHECK_EQ(s_bus.stats.error_frames, 0);
+	CHECK_EQ(s_frame_time, s_frame_bits*2000);
+	CHECK_EQ(s_bus.stats.busy_time, s_frame_time);
+
+	CHECK_EQ(cdh->can.counters.frames_sent, 1);
+	CHECK_EQ(power->can.counters.frames_sent, 2);
+}
+
+static void test_alone(void)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){0}, false);
+	s_bus.on_frame = NULL;
+	s_can_timeouts = 0;
+
+	VirtualNode *cdh = add_node(NODE_CDH);
+
+	CANMessage msg = { .cmd = CMD_CDH_PROCESS_HEARTBEAT };
+	CHECK_EQ(CANWrapperEx_Transmit(&cdh->hcw, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+
+	VirtualBus_Run(&s_bus, 20000);
+
+	// nobody ACK's, so it is resent until the TEC leaves it error passive, not bus-off.
+	CHECK_EQ(s_bus.stats.frames, 0);
+	CHECK(s_bus.stats.error_frames > 16);
+	CHECK_EQ(cdh->can.tec, 128);
+	CHECK(cdh->can.ESR & CAN_ESR_EPVF);
+	CHECK(FakeCAN_Is_On_Bus(&cdh->can));
+	CHECK_EQ(s_can_timeouts, 1);
+}
+
+static void test_failed_init(void)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){0}, false);
+
+	VirtualNode *cdh = VirtualBus_Add_Node(&s_bus);
+	VirtualNode *power = VirtualBus_Add_Node(&s_bus);
+
+	// CDH's CAN is already running, so its Init fails part way.
+	CHECK_EQ(HAL_CAN_Start(&cdh->hcan), HAL_OK);
+	CHECK_EQ(VirtualBus_Init_Node(&s_bus, cdh, (CANWrapper_InitTypeDef){ .node_id = NODE_CDH }), CAN_WRAPPER_FAILED_TO_START_CAN);
+	CHECK(!cdh->hcw.init);
+
+	// another instance can then take the peripheral.
+	static CANWrapper_Handle other;
+	CHECK_EQ(HAL_CAN_Stop(&cdh->hcan), HAL_OK);
+	CHECK_EQ(CANWrapperEx_Init(&other, (CANWrapper_InitTypeDef){ .node_id = NODE_CDH, .hcan = &cdh->hcan, .htim = &cdh->htim }), CAN_WRAPPER_HAL_OK);
+
+	// POWER's timer is already running, so its Init fails after starting
+	// the CAN, which it stops again.
+	CHECK_EQ(HAL_TIM_Base_Start_IT(&power->htim), HAL_OK);
+	CHECK_EQ(VirtualBus_Init_Node(&s_bus, power, (CANWrapper_InitTypeDef){ .node_id = NODE_POWER }), CAN_WRAPPER_FAILED_TO_START_TIMER);
+	CHECK(!power->hcw.init);
+	CHECK_EQ(power->can.state, FAKE_CAN_RESET);
+	CHECK_EQ(power->can.ier, 0);
+
+	// retried on the timer the other instance started.
+	CANWrapper_InitTypeDef init = { .node_id = NODE_POWER, .hcan = &power->hcan, .htim = &cdh->htim };
+	CHECK_EQ(CANWrapperEx_Init(&power->hcw, init), CAN_WRAPPER_HAL_OK);
+	CHECK(power->hcw.init);
+}
+
+int main(void)
+{
+	test_frame_bits();
+	test_exchange();
+	test_alone();
+	test_failed_init();
+
+	return HOST_TEST_RESULT();
+}
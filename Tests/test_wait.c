@@ -0,0 +1,150 @@
+/**
+ * @file test_wait.c
+ * Tasks sleeping in CANWrapperEx_Wait_And_Process on the POSIX port, with
+ * the bus in real time: ACK'd messages sent from another thread while the
+ * sender's task handles their ACK's are each delivered once and ACK'd, and
+ * a waiting task wakes for a retry's timeout without any frame arriving.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "host_test.h"
+#include <stdatomic.h>
+#include <time.h>
+
+#define MESSAGES 200
+#define SEND_INTERVAL_US 1000 // about a third of the bus, with the ACK's.
+
+static VirtualBus s_bus;
+
+static pthread_t s_tasks[2];
+static atomic_bool s_stop;
+
+static atomic_uint s_deliveries[MESSAGES];
+
+static void on_set_rtc(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	(void)info;
+	(void)ctx;
+
+	CmdArgs_CDH_SET_RTC args;
+	Decode_CDH_SET_RTC(msg, &args);
+
+	if (args.timestamp < MESSAGES)
+		atomic_fetch_add(&s_deliveries[args.timestamp], 1);
+}
+
+static void *task_main(void *arg)
+{
+	VirtualNode *node = arg;
+
+	while (!atomic_load(&s_stop))
+		CANWrapperEx_Wait_And_Process(&node->hcw, CAN_OS_WAIT_FOREVER);
+
+	return NULL;
+}
+
+static void sleep_us(uint64_t us)
+{
+	struct timespec delay = { .tv_sec = us / 1000000, .tv_nsec = (long)(us % 1000000) * 1000 };
+	nanosleep(&delay, NULL);
+}
+
+static void start(void)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){0}, true);
+
+	const NodeID ids[] = { NODE_CDH, NODE_POWER };
+	for (int i = 0; i < 2; i++)
+	{
+		VirtualNode *node = VirtualBus_Add_Node(&s_bus);
+		CHECK_EQ(VirtualBus_Init_Node(&s_bus, node, (CANWrapper_InitTypeDef){ .node_id = ids[i], .sequence_numbers = true }), CAN_WRAPPER_HAL_OK);
+		CHECK_EQ(CANWrapperEx_Register_Handler(&node->hcw, CMD_CDH_SET_RTC, &on_set_rtc, NULL), CAN_WRAPPER_HAL_OK);
+	}
+
+	for (int i = 0; i < MESSAGES; i++)
+		atomic_store(&s_deliveries[i], 0);
+
+	atomic_store(&s_stop, false);
+
+	VirtualBus_Start_Thread(&s_bus);
+	for (int i = 0; i < 2; i++)
+		pthread_create(&s_tasks[i], NULL, &task_main, &s_bus.nodes[i]);
+}
+
+static void stop(void)
+{
+	atomic_store(&s_stop, true);
+
+	for (int i = 0; i < 2; i++)
+	{
+		CANOS_Event_Signal(&s_bus.nodes[i].hcw.work_event);
+		pthread_join(s_tasks[i], NULL);
+	}
+
+	VirtualBus_Stop_Thread(&s_bus);
+}
+
+static void test_transmit_from_another_thread(void)
+{
+	start();
+
+	VirtualNode *cdh = &s_bus.nodes[0];
+
+	for (uint32_t i = 0; i < MESSAGES; i++)
+	{
+		CANMessage msg;
+		Encode_CDH_SET_RTC(&msg, &(CmdArgs_CDH_SET_RTC){ .timestamp = i });
+		CHECK_EQ(CANWrapperEx_Transmit(&cdh->hcw, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+
+		sleep_us(SEND_INTERVAL_US);
+	}
+
+	// the ACK timeout, with room for a retry on a loaded host.
+	sleep_us(200000);
+	stop();
+
+	for (int i = 0; i < MESSAGES; i++)
+		CHECK_EQ(atomic_load(&s_deliveries[i]), 1);
+
+	CANWrapper_Stats stats;
+	CANWrapperEx_Get_Stats(&cdh->hcw, &stats);
+	CHECK_EQ(stats.nodes[NODE_POWER].acks_received, MESSAGES);
+	CHECK_EQ(stats.nodes[NODE_POWER].tx_failures, 0);
+	CHECK_EQ(TxCache_Front(&cdh->hcw.tx_cache), TX_CACHE_NONE);
+}
+
+static void test_wake_for_timeout(void)
+{
+	start();
+
+	VirtualNode *cdh = &s_bus.nodes[0];
+	VirtualNode *power = &s_bus.nodes[1];
+
+	// POWER misses everything, so only the ACK timeouts wake CDH's task.
+	power->drop_permille = 1000;
+
+	CANMessage msg;
+	Encode_CDH_SET_RTC(&msg, &(CmdArgs_CDH_SET_RTC){ .timestamp = 0 });
+	CHECK_EQ(CANWrapperEx_Transmit(&cdh->hcw, NODE_POWER, &msg), CAN_WRAPPER_HAL_OK);
+
+	// the first timeout, its backoff and a margin for the host.
+	sleep_us(150000);
+	stop();
+
+	CANWrapper_Stats stats;
+	CANWrapperEx_Get_Stats(&cdh->hcw, &stats);
+	CHECK(stats.nodes[NODE_POWER].tx_retries >= 1);
+	CHECK_EQ(atomic_load(&s_deliveries[0]), 0);
+}
+
+int main(void)
+{
+	test_transmit_from_another_thread();
+	test_wake_for_timeout();
+
+	return HOST_TEST_RESULT();
+}
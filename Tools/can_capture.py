@@ -0,0 +1,287 @@
+#!/usr/bin/env python3
+"""
+Decodes a frame capture written by can_capture.h and reports on it.
+
+Commands are named from Inc/can_command_schema.h, so run this from a copy of
+the module that matches the firmware the dump came from.
+
+    python3 Tools/can_capture.py dump.bin
+    python3 Tools/can_capture.py dump.bin --frames --bitrate 250000
+
+The report covers what the capturing node saw: the frames it sent and the
+frames its filters let through.
+
+@author Logan Furedi <logan.furedi@umsats.ca>
+
+@date April 12, 2024
+"""
+
+import argparse
+import os
+import re
+import struct
+import sys
+from collections import Counter, defaultdict
+
+RECORD = struct.Struct('<IIBBH8s')  # CANCaptureRecord.
+
+FLAG_TX = 0x01
+FLAG_EXTENDED = 0x02
+
+ACK_ENTRY_NUMBERED = 0x80  # in an ACK entry's command byte: the key is a sequence number.
+
+TYPE_SIZES = {
+    'bool': 1, 'uint8_t': 1, 'int8_t': 1, 'char': 1,
+    'uint16_t': 2, 'int16_t': 2,
+    'uint32_t': 4, 'int32_t': 4, 'float': 4,
+    'uint64_t': 8, 'int64_t': 8, 'double': 8,
+}
+
+DEFAULT_SCHEMA = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'Inc', 'can_command_schema.h')
+
+
+class Command:
+    def __init__(self, name, cmd_id, priority, timeout, policy, body_size):
+        self.name = name
+        self.id = cmd_id
+        self.priority = priority
+        self.timeout = timeout
+        self.policy = policy
+        self.body_size = body_size
+
+
+def load_schema(path):
+    """Returns {cmd ID: Command} from the CMD(...) lines of the schema."""
+    commands = {}
+    cmd_re = re.compile(r'^CMD\((\w+),\s*(\w+),\s*(\w+),\s*(\w+),\s*(\w+),\s*\w+,\s*\w+,\s*\w+,\s*(.*)\)\s*$')
+
+    with open(path) as f:
+        for line in f:
+            match = cmd_re.match(line.strip())
+            if match is None:
+                continue
+
+            name, cmd_id, priority, timeout, policy, args = match.groups()
+
+            body_size = 0
+            for arg_type, _ in re.findall(r'\bARG\((\w+),\s*(\w+)\)', args):
+                body_size += TYPE_SIZES[arg_type]
+            for arg_type, _, count in re.findall(r'\bARRAY\((\w+),\s*(\w+),\s*(\w+)\)', args):
+                body_size += TYPE_SIZES[arg_type] * int(count, 0)
+
+            commands[int(cmd_id, 0)] = Command(name, int(cmd_id, 0), int(priority, 0), int(timeout, 0), policy, body_size)
+
+    return commands
+
+
+def decode_id(can_id, extended):
+    """Splits an identifier into its fields. See can_id.h."""
+    if extended:
+        return {
+            'priority':  (can_id >> 23) & 0x3F,
+            'cmd':       (can_id >> 16) & 0x7F,
+            'sender':    (can_id >> 11) & 0x1F,
+            'recipient': (can_id >> 6) & 0x1F,
+            'seq':       (can_id >> 1) & 0x1F,
+            'ack':       bool(can_id & 1),
+        }
+
+    return {
+        'priority':  (can_id >> 5) & 0x3F,
+        'cmd':       None,
+        'sender':    (can_id >> 3) & 0x03,
+        'recipient': (can_id >> 1) & 0x03,
+        'seq':       None,
+        'ack':       bool(can_id & 1),
+    }
+
+
+def message_hash(data, body_size):
+    """The low byte of CANMessage_Hash, as carried in ACK frames for unnumbered messages."""
+    h = 2166136261
+    for byte in data[:body_size + 1]:
+        h = ((h ^ byte) * 16777619) & 0xFFFFFFFF
+    return h & 0xFF
+
+
+def frame_bits(dlc, extended):
+    """Bits a frame occupies on the bus, including the interframe space
+    but not stuff bits."""
+    return (67 if extended else 47) + 8 * dlc
+
+
+def read_frames(path):
+    """Yields decoded records with the tick unwrapped to 64 bits."""
+    with open(path, 'rb') as f:
+        dump = f.read()
+
+    if len(dump) % RECORD.size != 0:
+        print(f'warning: {len(dump) % RECORD.size} trailing bytes ignored', file=sys.stderr)
+
+    base = 0
+    last = None
+    for offset in range(0, len(dump) - RECORD.size + 1, RECORD.size):
+        tick, can_id, dlc, flags, dropped, data = RECORD.unpack_from(dump, offset)
+
+        # records are written from several contexts, so ticks can go back a
+        # little. a big step back is the 32-bit counter wrapping.
+        if last is not None and tick < last and last - tick > 1 << 31:
+            base += 1 << 32
+        last = tick
+
+        extended = bool(flags & FLAG_EXTENDED)
+        frame = decode_id(can_id, extended)
+        frame.update({
+            'tick': base + tick,
+            'id': can_id,
+            'dlc': min(dlc, 8),
+            'data': data[:min(dlc, 8)],
+            'tx': bool(flags & FLAG_TX),
+            'extended': extended,
+            'dropped': dropped,
+        })
+        yield frame
+
+
+def describe(frame, commands):
+    direction = 'TX' if frame['tx'] else 'RX'
+    data = frame['data'].hex(' ')
+
+    if frame['ack']:
+        pairs = [f'{commands[c].name if c in commands else hex(c)}#{h:02x}'
+                 for c, h in zip(frame['data'][0::2], frame['data'][1::2])]
+        what = 'ACK ' + ' '.join(pairs)
+    elif frame['dlc'] > 0:
+        cmd = frame['data'][0]
+        what = commands[cmd].name if cmd in commands else f'unknown 0x{cmd:02x}'
+    else:
+        what = 'empty'
+
+    return (f'{frame["tick"] / 1e6:12.6f} {direction} {frame["sender"]:2}->{frame["recipient"]:<2} '
+            f'p{frame["priority"]:<2} {what:<36} [{data}]')
+
+
+def percentile(values, fraction):
+    index = min(len(values) - 1, int(fraction * len(values)))
+    return sorted(values)[index]
+
+
+def report(frames, commands, bitrate):
+    if not frames:
+        print('no frames')
+        return
+
+    start = frames[0]['tick']
+    end = frames[-1]['tick']
+    duration = max(end - start, 1) / 1e6
+
+    tx = sum(f['tx'] for f in frames)
+    bits = sum(frame_bits(f['dlc'], f['extended']) for f in frames)
+    dropped = sum(f['dropped'] for f in frames)
+
+    print(f'frames:    {len(frames)} ({tx} sent, {len(frames) - tx} received) over {duration:.3f} s')
+    print(f'bus load:  {100 * bits / (bitrate * duration):.1f}% of {bitrate} bit/s (without stuff bits)')
+    if dropped:
+        print(f'dropped:   {dropped} records lost to a full capture ring')
+
+    # busiest 100 ms, since average load hides bursts.
+    window = 100000
+    peak = 0
+    first = 0
+    window_bits = 0
+    for f in frames:
+        window_bits += frame_bits(f['dlc'], f['extended'])
+        while f['tick'] - frames[first]['tick'] >= window:
+            window_bits -= frame_bits(frames[first]['dlc'], frames[first]['extended'])
+            first += 1
+        peak = max(peak, window_bits)
+    print(f'peak load: {100 * peak / (bitrate * window / 1e6):.1f}% in 100 ms')
+
+    # per command.
+    counts = Counter()
+    for f in frames:
+        if not f['ack'] and f['dlc'] > 0:
+            counts[(f['data'][0], f['tx'])] += 1
+
+    print('\ncommand                              sent  received')
+    for cmd in sorted({c for c, _ in counts}):
+        name = commands[cmd].name if cmd in commands else f'0x{cmd:02x}'
+        print(f'{name:<36} {counts[(cmd, True)]:5} {counts[(cmd, False)]:9}')
+
+    # ACK round trips. a data frame is matched to the first ACK from its
+    # recipient that carries its command and its sequence number, or its hash
+    # if it isn't numbered. resends restart the clock, like the wrapper's own
+    # ack_rtt histogram.
+    pending = {}
+    resends = Counter()
+    round_trips = defaultdict(list)
+    unacked = Counter()
+
+    for f in frames:
+        if f['ack']:
+            for cmd, k in zip(f['data'][0::2], f['data'][1::2]):
+                numbered = bool(cmd & ACK_ENTRY_NUMBERED)
+                key = (f['recipient'], f['sender'], cmd & ~ACK_ENTRY_NUMBERED, numbered, k)
+                if key in pending:
+                    round_trips[f['tx']].append(f['tick'] - pending.pop(key))
+            continue
+
+        if f['dlc'] == 0:
+            continue
+
+        command = commands.get(f['data'][0])
+        if command is None or command.policy != 'DELIVERY_ACKED':
+            continue
+
+        # extended identifiers carry a sequence number. standard frames carry
+        # one after the body if the sender numbers its messages.
+        if f['seq'] is not None:
+            key = (f['sender'], f['recipient'], command.id, True, f['seq'])
+        elif f['dlc'] == command.body_size + 2:
+            key = (f['sender'], f['recipient'], command.id, True, f['data'][command.body_size + 1])
+        else:
+            key = (f['sender'], f['recipient'], command.id, False, message_hash(f['data'], command.body_size))
+        if key in pending:
+            resends[f['tx']] += 1
+        pending[key] = f['tick']
+
+    for key in pending:
+        unacked[key[0]] += 1
+
+    print()
+    for acked_by_us, label in ((False, 'ACKs received'), (True, 'ACKs sent')):
+        rtts = round_trips[acked_by_us]
+        if rtts:
+            print(f'{label}: {len(rtts)}, round trip min {min(rtts)} us, '
+                  f'median {percentile(rtts, 0.5)} us, 99% {percentile(rtts, 0.99)} us, max {max(rtts)} us')
+        else:
+            print(f'{label}: 0')
+
+    print(f'resends:   {resends[True]} sent, {resends[False]} received')
+    if unacked:
+        print('never ACKd (by sender): ' + ', '.join(f'node {n}: {c}' for n, c in sorted(unacked.items())))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode a CAN Wrapper frame capture.')
+    parser.add_argument('dump', help='file of CANCaptureRecords, as written by the capture sink')
+    parser.add_argument('--schema', default=DEFAULT_SCHEMA, help='path to can_command_schema.h')
+    parser.add_argument('--bitrate', type=int, default=500000, help='bus bit rate, for the load figures')
+    parser.add_argument('--frames', action='store_true', help='list every frame before the report')
+    args = parser.parse_args()
+
+    commands = load_schema(args.schema)
+    frames = list(read_frames(args.dump))
+
+    if args.frames:
+        for frame in frames:
+            if frame['dropped']:
+                print(f'--- {frame["dropped"]} records dropped ---')
+            print(describe(frame, commands))
+        print()
+
+    report(frames, commands, args.bitrate)
+
+
+if __name__ == '__main__':
+    main()
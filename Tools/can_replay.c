@@ -0,0 +1,614 @@
+/**
+ * @file can_replay.c
+ * Replays a frame capture (see can_capture.h) into the host build of the
+ * wrapper, and reports bus load, latency and ACK statistics.
+ *
+ *     can_replay dump.bin [--speed 10] [--node 1] [--broadcast 3] [--extended]
+ *                         [--accept-all] [--bitrate 500000] [--poll-us 100]
+ *
+ * The captured node is rebuilt as a wrapper instance on a virtual bus. A
+ * second controller plays back the frames the node received, and the data
+ * frames it sent, at their recorded times divided by --speed. The frames
+ * arrive through the filters and the RX interrupt, and are handled by the
+ * polls, as on the MCU. The recorded ACK's aren't played back: the replayed
+ * node sends its own.
+ *
+ * The node ID defaults to the sender of the recorded TX frames, and
+ * --extended to what the dump's identifiers use. Commands and delivery
+ * policies come from the cmd_configs this tool is built with, so build it
+ * from a copy of the module that matches the firmware the dump came from.
+ *
+ * Latencies are in bus time:
+ *  - delivery, from the end of a frame on the bus to its handler.
+ *  - ACK, from the end of a frame to the end of the ACK frame that answers it.
+ *
+ * @author Logan Furedi <logan.furedi@umsats.ca>
+ *
+ * @date April 16, 2024
+ */
+
+#include "virtual_bus.h"
+#include "can_capture.h"
+#include "can_id.h"
+#include "ack_list.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ARRIVAL_SLOTS 4096 // must be a power of two.
+#define PEAK_WINDOW_US 100000
+
+typedef struct
+{
+	uint64_t time;  // us since the start of the replay.
+	FakeCANFrame frame;
+	bool tx;        // sent by the captured node.
+	uint16_t dropped;
+} ReplayFrame;
+
+typedef struct
+{
+	uint64_t *values;
+	size_t count;
+	size_t capacity;
+} Samples;
+
+typedef struct
+{
+	uint32_t key;
+	uint64_t time; // ns. 0 if the slot is free.
+} Arrival;
+
+static struct
+{
+	double speed;
+	int node;       // -1 to infer.
+	int broadcast;  // -1 for none.
+	int extended;   // -1 to infer.
+	bool accept_all;
+	uint32_t bitrate;
+	uint32_t poll_us;
+	const char *path;
+} s_args = { .speed = 1.0, .node = -1, .broadcast = -1, .extended = -1, .bitrate = 500000, .poll_us = 100 };
+
+static VirtualBus s_bus;
+static VirtualNode *s_replayed;
+static VirtualNode *s_player;
+static bool s_extended;
+
+static ReplayFrame *s_frames;
+static size_t s_frame_count;
+
+// keyed by sender and message hash, for the delivery latency.
+static Arrival s_deliveries[ARRIVAL_SLOTS];
+// keyed by sender, command and ACK key, for the ACK latency.
+static Arrival s_acks[ARRIVAL_SLOTS];
+
+static Samples s_delivery_latency;
+static Samples s_ack_latency;
+
+static struct
+{
+	uint32_t played;
+	uint32_t played_rx;
+	uint32_t recorded_acks;   // ACK frames the captured node sent.
+	uint32_t recorded_dropped;
+	uint32_t ack_frames;      // sent by the replayed node.
+	uint32_t ack_entries;
+	uint32_t awaiting_ack;    // played frames the replayed node should ACK.
+	uint64_t window_bits;     // since window_start.
+	uint64_t window_start;    // us. steps by PEAK_WINDOW_US.
+	uint64_t peak_bits;
+} s_counts;
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: can_replay dump.bin [--speed X] [--node N] [--broadcast N] [--extended]\n"
+		"                  [--accept-all] [--bitrate B] [--poll-us U]\n");
+	exit(2);
+}
+
+static void parse_args(int argc, char **argv)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		const char *arg = argv[i];
+		const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+		if (strcmp(arg, "--extended") == 0)
+			s_args.extended = 1;
+		else if (strcmp(arg, "--accept-all") == 0)
+			s_args.accept_all = true;
+		else if (arg[0] == '-' && value == NULL)
+			usage();
+		else if (strcmp(arg, "--speed") == 0)
+			s_args.speed = atof(argv[++i]);
+		else if (strcmp(arg, "--node") == 0)
+			s_args.node = atoi(argv[++i]);
+		else if (strcmp(arg, "--broadcast") == 0)
+			s_args.broadcast = atoi(argv[++i]);
+		else if (strcmp(arg, "--bitrate") == 0)
+			s_args.bitrate = (uint32_t)atol(argv[++i]);
+		else if (strcmp(arg, "--poll-us") == 0)
+			s_args.poll_us = (uint32_t)atol(argv[++i]);
+		else if (arg[0] == '-' || s_args.path != NULL)
+			usage();
+		else
+			s_args.path = arg;
+	}
+
+	if (s_args.path == NULL || !(s_args.speed > 0) || s_args.bitrate == 0 || s_args.poll_us == 0)
+		usage();
+}
+
+static void add_sample(Samples *samples, uint64_t value)
+{
+	if (samples->count == samples->capacity)
+	{
+		samples->capacity = samples->capacity != 0 ? samples->capacity * 2 : 1024;
+		samples->values = realloc(samples->values, samples->capacity * sizeof(samples->values[0]));
+		if (samples->values == NULL)
+		{
+			perror("can_replay");
+			exit(1);
+		}
+	}
+
+	samples->values[samples->count++] = value;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void print_samples(const char *label, Samples *samples)
+{
+	if (samples->count == 0)
+	{
+		printf("%-10s none\n", label);
+		return;
+	}
+
+	qsort(samples->values, samples->count, sizeof(samples->values[0]), &compare_u64);
+
+	const uint64_t *v = samples->values;
+	const size_t n = samples->count;
+	printf("%-10s %zu, min %llu us, median %llu us, 99%% %llu us, max %llu us\n", label, n,
+			(unsigned long long)v[0], (unsigned long long)v[n / 2],
+			(unsigned long long)v[(n * 99) / 100], (unsigned long long)v[n - 1]);
+}
+
+// --- arrival tables ---
+
+static uint32_t mix(uint32_t key)
+{
+	key ^= key >> 16;
+	key *= 0x45D9F3Bu;
+	key ^= key >> 16;
+	return key;
+}
+
+static void arrival_put(Arrival *table, uint32_t key, uint64_t time)
+{
+	// a newer arrival of the same key replaces the older one. when the table
+	// is full, the slot it hashes to is reused.
+	uint32_t start = mix(key) & (ARRIVAL_SLOTS - 1);
+	for (uint32_t i = 0; i < ARRIVAL_SLOTS; i++)
+	{
+		Arrival *slot = &table[(start + i) & (ARRIVAL_SLOTS - 1)];
+		if (slot->time == 0 || slot->key == key)
+		{
+			slot->key = key;
+			slot->time = time;
+			return;
+		}
+	}
+
+	table[start] = (Arrival){ .key = key, .time = time };
+}
+
+/**
+ * @retval The arrival time, which is forgotten, or 0 if there is none.
+ */
+static uint64_t arrival_take(Arrival *table, uint32_t key)
+{
+	uint32_t start = mix(key) & (ARRIVAL_SLOTS - 1);
+	for (uint32_t i = 0; i < ARRIVAL_SLOTS; i++)
+	{
+		Arrival *slot = &table[(start + i) & (ARRIVAL_SLOTS - 1)];
+		if (slot->time == 0)
+			return 0;
+
+		if (slot->key == key)
+		{
+			uint64_t time = slot->time;
+
+			// close the gap, so later keys in the run are still found.
+			uint32_t hole = (start + i) & (ARRIVAL_SLOTS - 1);
+			slot->time = 0;
+			for (uint32_t j = 1; j < ARRIVAL_SLOTS; j++)
+			{
+				uint32_t next = (hole + j) & (ARRIVAL_SLOTS - 1);
+				if (table[next].time == 0)
+					break;
+
+				Arrival moved = table[next];
+				table[next].time = 0;
+				arrival_put(table, moved.key, moved.time);
+			}
+
+			return time;
+		}
+	}
+
+	return 0;
+}
+
+static uint32_t delivery_key(NodeID sender, const CANMessage *msg)
+{
+	return (uint32_t)sender << 24 ^ CANMessage_Hash(msg);
+}
+
+static uint32_t ack_key(NodeID sender, uint8_t cmd, bool numbered, uint8_t key)
+{
+	return (uint32_t)sender << 16 | (uint32_t)cmd << 8 | (numbered ? 1U << 15 : 0) | key;
+}
+
+// --- the replay ---
+
+static void on_message(const CANMessage *msg, const CANMessageInfo *info, void *ctx)
+{
+	(void)ctx;
+
+	uint64_t arrival = arrival_take(s_deliveries, delivery_key(info->sender, msg));
+	if (arrival != 0)
+		add_sample(&s_delivery_latency, (FakeHAL_Get_Time() - arrival) / 1000);
+}
+
+static void on_unhandled(CANMessage msg, NodeID sender, bool is_ack)
+{
+	if (is_ack)
+		return;
+
+	CANMessageInfo info = { .sender = sender };
+	on_message(&msg, &info, NULL);
+}
+
+/**
+ * @brief Notes when a frame played to the replayed node ended, to time its
+ *        handling and its ACK.
+ */
+static void note_arrival(const VirtualBusFrameInfo *info, const CANIdFields *fields)
+{
+	const FakeCANFrame *frame = &info->frame;
+	const NodeID node = s_replayed->hcw.init_struct.node_id;
+
+	if (fields->is_ack || frame->dlc == 0)
+		return;
+
+	bool to_us = fields->recipient == node;
+	bool broadcast = s_args.broadcast >= 0 && (int)fields->recipient == s_args.broadcast;
+	if (!to_us && !broadcast && !s_args.accept_all)
+		return;
+
+	CANMessage msg = {0};
+	memcpy(msg.data, frame->data, frame->dlc < sizeof(msg.data) ? frame->dlc : sizeof(msg.data));
+
+	uint8_t cmd = msg.cmd;
+	if (cmd >= CMD_ID_COUNT)
+		return;
+
+	arrival_put(s_deliveries, delivery_key(fields->sender, &msg), info->end);
+
+	// as the RX interrupt works out what to ACK.
+	if (!to_us || cmd_configs[cmd].policy != DELIVERY_ACKED)
+		return;
+
+	uint8_t body_size = cmd_configs[cmd].body_size;
+	bool numbered = frame->extended || frame->dlc == body_size + 2u;
+	uint8_t key = frame->extended ? fields->seq
+			: numbered ? frame->data[frame->dlc - 1]
+			: (uint8_t)CANMessage_Hash(&msg);
+
+	arrival_put(s_acks, ack_key(fields->sender, cmd, numbered, key), info->end);
+	s_counts.awaiting_ack++;
+}
+
+static void note_ack(const VirtualBusFrameInfo *info, const CANIdFields *fields)
+{
+	s_counts.ack_frames++;
+
+	for (uint8_t i = 0; i + 1 < info->frame.dlc; i += 2)
+	{
+		uint8_t entry = info->frame.data[i];
+		bool numbered = entry & ACK_ENTRY_NUMBERED;
+		uint8_t cmd = entry & (uint8_t)~ACK_ENTRY_NUMBERED;
+
+		s_counts.ack_entries++;
+
+		uint64_t arrival = arrival_take(s_acks, ack_key(fields->recipient, cmd, numbered, info->frame.data[i + 1]));
+		if (arrival != 0)
+			add_sample(&s_ack_latency, (info->end - arrival) / 1000);
+	}
+}
+
+static void count_bits(const VirtualBusFrameInfo *info)
+{
+	uint64_t now = info->end / 1000;
+
+	while (now >= s_counts.window_start + PEAK_WINDOW_US)
+	{
+		if (s_counts.window_bits > s_counts.peak_bits)
+			s_counts.peak_bits = s_counts.window_bits;
+
+		s_counts.window_bits = 0;
+		s_counts.window_start += PEAK_WINDOW_US;
+	}
+
+	s_counts.window_bits += info->bits;
+}
+
+static void on_frame(const VirtualBusFrameInfo *info, void *ctx)
+{
+	(void)ctx;
+
+	count_bits(info);
+
+	if (!info->ok)
+		return;
+
+	CANIdFields fields;
+	CANId_Unpack(info->frame.id, info->frame.extended, &fields);
+
+	if (&s_bus.nodes[info->node] == s_player)
+		note_arrival(info, &fields);
+	else if (fields.is_ack)
+		note_ack(info, &fields);
+}
+
+// --- loading the dump ---
+
+static void load_dump(void)
+{
+	FILE *f = fopen(s_args.path, "rb");
+	if (f == NULL)
+	{
+		perror(s_args.path);
+		exit(1);
+	}
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	size_t record_count = size > 0 ? (size_t)size / sizeof(CANCaptureRecord) : 0;
+	if (size > 0 && (size_t)size % sizeof(CANCaptureRecord) != 0)
+		fprintf(stderr, "warning: %zu trailing bytes ignored\n", (size_t)size % sizeof(CANCaptureRecord));
+
+	CANCaptureRecord *records = malloc(record_count * sizeof(records[0]) + 1);
+	s_frames = malloc(record_count * sizeof(s_frames[0]) + 1);
+	if (records == NULL || s_frames == NULL || fread(records, sizeof(records[0]), record_count, f) != record_count)
+	{
+		fprintf(stderr, "%s: couldn't read the dump\n", s_args.path);
+		exit(1);
+	}
+	fclose(f);
+
+	// infer the node from what it sent, else from what it received.
+	uint32_t senders[32] = {0};
+	uint32_t recipients[32] = {0};
+	uint32_t extended = 0;
+
+	uint64_t base = 0;
+	uint64_t first = 0;
+	uint64_t last_time = 0;
+	uint32_t last_tick = 0;
+
+	for (size_t i = 0; i < record_count; i++)
+	{
+		const CANCaptureRecord *r = &records[i];
+		bool is_extended = r->flags & CAN_CAPTURE_FLAG_EXTENDED;
+		bool tx = r->flags & CAN_CAPTURE_FLAG_TX;
+
+		// records are written from several contexts, so ticks can go back a
+		// little. a big step back is the 32-bit tick wrapping.
+		if (i > 0 && r->tick < last_tick && last_tick - r->tick > 1U << 31)
+			base += 1ULL << 32;
+		last_tick = r->tick;
+
+		uint64_t tick = base + r->tick;
+		if (i == 0)
+			first = tick;
+
+		uint64_t time = tick > first ? (uint64_t)((tick - first) / s_args.speed) : 0;
+		if (time < last_time)
+			time = last_time;
+		last_time = time;
+
+		CANIdFields fields;
+		CANId_Unpack(r->id, is_extended, &fields);
+
+		extended += is_extended;
+		if (tx)
+			senders[fields.sender & 31]++;
+		else
+			recipients[fields.recipient & 31]++;
+
+		s_counts.recorded_dropped += r->dropped;
+
+		if (tx && fields.is_ack)
+		{
+			s_counts.recorded_acks++;
+			continue;
+		}
+
+		ReplayFrame *frame = &s_frames[s_frame_count++];
+		frame->time = time;
+		frame->tx = tx;
+		frame->dropped = r->dropped;
+		frame->frame = (FakeCANFrame){
+			.id = r->id,
+			.extended = is_extended,
+			.dlc = r->dlc > 8 ? 8 : r->dlc,
+		};
+		memcpy(frame->frame.data, r->data, frame->frame.dlc);
+	}
+
+	free(records);
+
+	if (s_args.extended < 0)
+		s_args.extended = extended * 2 > record_count;
+
+	if (s_args.node < 0)
+	{
+		const uint32_t *counts = senders;
+		uint32_t total = 0;
+		for (int i = 0; i < 32; i++)
+			total += senders[i];
+		if (total == 0)
+			counts = recipients;
+
+		s_args.node = 0;
+		for (int i = 1; i < 32; i++)
+		{
+			if (counts[i] > counts[s_args.node] && i != s_args.broadcast)
+				s_args.node = i;
+		}
+	}
+
+	s_extended = s_args.extended;
+}
+
+// --- main ---
+
+static void setup(void)
+{
+	VirtualBus_Init(&s_bus, (VirtualBus_InitTypeDef){ .bitrate = s_args.bitrate, .poll_interval_us = s_args.poll_us }, false);
+	s_bus.on_frame = &on_frame;
+	s_counts.window_start = 0;
+
+	s_replayed = VirtualBus_Add_Node(&s_bus);
+	CANWrapper_InitTypeDef init = {
+		.node_id = (NodeID)s_args.node,
+		.accept_broadcast = s_args.broadcast >= 0,
+		.broadcast_id = s_args.broadcast >= 0 ? (NodeID)s_args.broadcast : 0,
+		.extended_ids = s_extended,
+		.message_callback = &on_unhandled,
+	};
+
+	CANWrapper_StatusTypeDef status = VirtualBus_Init_Node(&s_bus, s_replayed, init);
+	if (status != CAN_WRAPPER_HAL_OK)
+	{
+		fprintf(stderr, "couldn't start node %d (status %d)\n", s_args.node, (int)status);
+		exit(1);
+	}
+
+	if (s_args.accept_all)
+		CANWrapperEx_Add_Filter(&s_replayed->hcw, 0, 0);
+
+	for (uint8_t cmd = 0; cmd < CMD_ID_COUNT; cmd++)
+	{
+		CANWrapperEx_Register_Handler(&s_replayed->hcw, cmd, &on_message, NULL);
+	}
+
+	// the rest of the bus: a bare controller that only sends.
+	s_player = VirtualBus_Add_Node(&s_bus);
+	HAL_CAN_Start(&s_player->hcan);
+}
+
+static void play(void)
+{
+	size_t next = 0;   // next frame to become due.
+	size_t queued = 0; // next due frame to put in a mailbox.
+
+	while (queued < s_frame_count || HAL_CAN_GetTxMailboxesFreeLevel(&s_player->hcan) < CAN_TX_MAILBOX_COUNT)
+	{
+		uint64_t now = VirtualBus_Now(&s_bus);
+
+		while (next < s_frame_count && s_frames[next].time <= now)
+			next++;
+
+		while (queued < next && HAL_CAN_GetTxMailboxesFreeLevel(&s_player->hcan) > 0)
+		{
+			const FakeCANFrame *frame = &s_frames[queued].frame;
+			CAN_TxHeaderTypeDef header = {
+				.StdId = frame->extended ? 0 : frame->id,
+				.ExtId = frame->extended ? frame->id : 0,
+				.IDE = frame->extended ? CAN_ID_EXT : CAN_ID_STD,
+				.RTR = CAN_RTR_DATA,
+				.DLC = frame->dlc,
+			};
+			uint32_t mailbox;
+			HAL_CAN_AddTxMessage(&s_player->hcan, &header, frame->data, &mailbox);
+
+			s_counts.played++;
+			s_counts.played_rx += !s_frames[queued].tx;
+			queued++;
+		}
+
+		// frames are waiting: come back soon to refill the mailboxes.
+		// otherwise skip to the next one.
+		uint64_t step = s_args.poll_us < 50 ? s_args.poll_us : 50;
+		if (queued == next && next < s_frame_count && s_frames[next].time > now + step)
+			step = s_frames[next].time - now;
+
+		VirtualBus_Run(&s_bus, step);
+	}
+
+	// the last ACK's, and anything left to handle.
+	VirtualBus_Run(&s_bus, 100000);
+}
+
+static void report(void)
+{
+	const uint64_t elapsed_us = VirtualBus_Now(&s_bus);
+	const double elapsed_s = elapsed_us / 1e6;
+
+	CANWrapper_Stats stats;
+	CANWrapperEx_Get_Stats(&s_replayed->hcw, &stats);
+
+	uint32_t rx_dropped = 0;
+	for (int i = 0; i < CAN_WRAPPER_MAX_NODES; i++)
+	{
+		rx_dropped += stats.nodes[i].rx_dropped;
+	}
+
+	// close the last window.
+	count_bits(&(VirtualBusFrameInfo){ .end = (elapsed_us + PEAK_WINDOW_US) * 1000 });
+
+	printf("node:      %d (%s identifiers)\n", s_args.node, s_extended ? "extended" : "standard");
+	printf("replayed:  %u frames (%u received, %u sent) in %.3f s of bus time, at %gx\n",
+			s_counts.played, s_counts.played_rx, s_counts.played - s_counts.played_rx, elapsed_s, s_args.speed);
+	if (s_counts.recorded_dropped)
+		printf("dropped:   %u records lost to a full capture ring\n", s_counts.recorded_dropped);
+
+	printf("bus load:  %.1f%% of %u bit/s, peak %.1f%% in 100 ms\n",
+			100.0 * s_bus.stats.busy_time / (elapsed_us * 1000.0), s_args.bitrate,
+			100.0 * s_counts.peak_bits / (s_args.bitrate * (PEAK_WINDOW_US / 1e6)));
+
+	printf("\n");
+	print_samples("delivered:", &s_delivery_latency);
+	print_samples("ACK'd:", &s_ack_latency);
+
+	printf("\nACK frames: %u sent for %u messages (%.2f entries each), %u in the recording\n",
+			s_counts.ack_frames, s_counts.awaiting_ack,
+			s_counts.ack_frames ? (double)s_counts.ack_entries / s_counts.ack_frames : 0.0, s_counts.recorded_acks);
+	printf("dropped:   %u duplicates, %u for lack of queue or ACK space, FIFO overruns %u/%u\n",
+			stats.duplicates, rx_dropped, stats.fifo_overruns[0], stats.fifo_overruns[1]);
+	printf("queues:    receive %u, urgent %u, pending ACK's %u at most\n",
+			stats.msg_queue_hwm, stats.urgent_queue_hwm, stats.pending_acks_hwm);
+}
+
+int main(int argc, char **argv)
+{
+	parse_args(argc, argv);
+	load_dump();
+	setup();
+	play();
+	report();
+
+	return 0;
+}
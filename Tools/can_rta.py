@@ -0,0 +1,377 @@
+#!/usr/bin/env python3
+"""
+Worst-case response time analysis of the bus, for the priorities in
+Inc/can_command_schema.h.
+
+Reads the command schema and a rate specification listing which node sends
+which command to which node, how often, and by when it must arrive. Runs
+classic CAN response time analysis (Tindell et al., as corrected by Davis et
+al. in 2007) over every stream, and suggests a deadline-monotonic priority
+assignment.
+
+    python3 Tools/can_rta.py Tools/can_rates.txt
+    python3 Tools/can_rta.py Tools/can_rates.txt --bitrate 250000 --write-schema new_schema.h
+
+Each line of the specification is a stream:
+
+    # sender  recipient  command               period_ms  [deadline_ms]  [jitter_ms]
+    POWER     CDH        CDH_PROCESS_PCB_TEMP  1000       100
+
+Nodes are NODE_* names from can_message.h (without the prefix) or numbers.
+The period of a sporadic command is the shortest time between two of them.
+The deadline defaults to the period. The jitter is how late after its period
+the sender may queue the message.
+
+The model:
+ - A stream's identifier is packed as in can_id.h, so equal priorities are
+   broken by the sender and recipient (and, with --extended, the command).
+   Streams that share an identifier are assumed to delay each other.
+ - Frames are timed with worst-case bit stuffing.
+ - Every ACK'd message is answered by an ACK frame at the same priority. Its
+   jitter is the message's worst-case response time plus --poll-ms, since
+   ACK's are sent from CANWrapper_Poll_Messages. Its response time is then
+   the round trip, from queueing the message until the ACK has arrived.
+   This over-approximates the ACK's: the wrapper puts the entries for several
+   messages in one ACK frame, and an ACK released with the whole jitter in
+   one period and none in the next is counted as if both could delay the
+   same frame. Response times that include ACK's are upper bounds, and may be
+   well above what the bus shows.
+ - A node always offers its most urgent queued frame. The wrapper's TX queue
+   does that, but it doesn't abort the TX mailboxes, so a burst of less urgent
+   frames already in them can still delay a more urgent one.
+ - Error frames and retries aren't modelled.
+
+Suggested priorities keep each command on its side of 32, since that picks
+the RX FIFO and the urgent queue. Within each band, commands are ordered by
+their shortest deadline. Commands with no streams keep their priority.
+
+@author Logan Furedi <logan.furedi@umsats.ca>
+
+@date April 15, 2024
+"""
+
+import argparse
+import math
+import os
+import re
+import sys
+
+from can_capture import load_schema
+
+TOOLS_DIR = os.path.dirname(os.path.abspath(__file__))
+DEFAULT_SCHEMA = os.path.join(TOOLS_DIR, '..', 'Inc', 'can_command_schema.h')
+DEFAULT_MESSAGE_HEADER = os.path.join(TOOLS_DIR, '..', 'Inc', 'can_message.h')
+
+URGENT_PRIORITIES = 32  # priorities below this are urgent. see can_id.h.
+DEFAULT_TIMEOUT_MS = 50  # as in can_wrapper.c.
+ACK_DLC = 2              # one (cmd, key) pair.
+MAX_BODY_SIZE = 7
+
+
+class Stream:
+    def __init__(self, sender, recipient, command, period, deadline, jitter, is_ack=False):
+        self.sender = sender
+        self.recipient = recipient
+        self.command = command
+        self.period = period      # us.
+        self.deadline = deadline  # us.
+        self.jitter = jitter      # us.
+        self.is_ack = is_ack
+        self.acked = None         # the stream an ACK stream answers.
+        self.dlc = 0
+        self.response = 0.0       # us. math.inf if unbounded.
+
+
+def load_nodes(path):
+    """Returns {name: ID} from the NodeID enum of can_message.h."""
+    nodes = {}
+    with open(path) as f:
+        for name, value in re.findall(r'\bNODE_(\w+)\s*=\s*(\w+)', f.read()):
+            nodes[name] = int(value, 0)
+    return nodes
+
+
+def parse_node(text, nodes):
+    if text.upper() in nodes:
+        return nodes[text.upper()]
+    return int(text, 0)
+
+
+def load_rates(path, commands, nodes):
+    """Returns the streams listed in a rate specification."""
+    by_name = {c.name: c for c in commands.values()}
+    streams = []
+
+    with open(path) as f:
+        for number, line in enumerate(f, 1):
+            fields = line.split('#', 1)[0].split()
+            if not fields:
+                continue
+
+            where = f'{path}:{number}'
+            if len(fields) < 4 or len(fields) > 6:
+                sys.exit(f'{where}: expected sender, recipient, command, period_ms, [deadline_ms], [jitter_ms]')
+
+            name = fields[2].upper()
+            if name.startswith('CMD_'):
+                name = name[4:]
+            if name not in by_name:
+                sys.exit(f'{where}: no command {fields[2]} in the schema')
+
+            period = float(fields[3]) * 1000
+            deadline = float(fields[4]) * 1000 if len(fields) > 4 and fields[4] != '-' else period
+            jitter = float(fields[5]) * 1000 if len(fields) > 5 else 0.0
+            if period <= 0 or deadline <= 0 or jitter < 0:
+                sys.exit(f'{where}: period and deadline must be positive')
+
+            streams.append(Stream(parse_node(fields[0], nodes), parse_node(fields[1], nodes),
+                                  by_name[name], period, deadline, jitter))
+
+    return streams
+
+
+def frame_time(dlc, extended, bitrate):
+    """Worst-case time on the bus in us, with stuff bits and the interframe space."""
+    g = 54 if extended else 34
+    bits = g + 8 * dlc + 13 + (g + 8 * dlc - 1) // 4
+    return bits * 1e6 / bitrate
+
+
+def pack_id(priority, cmd, sender, recipient, is_ack, extended):
+    """The identifier of a frame. See can_id.h. The sequence number is left at 0."""
+    if extended:
+        return ((priority & 0x3F) << 23 | (cmd & 0x7F) << 16 | (sender & 0x1F) << 11
+                | (recipient & 0x1F) << 6 | int(is_ack))
+    return (priority & 0x3F) << 5 | (sender & 0x03) << 3 | (recipient & 0x03) << 1 | int(is_ack)
+
+
+def add_ack_streams(streams, extended, sequence_numbers):
+    """Sets each stream's DLC, and adds the ACK streams of ACK'd messages."""
+    acks = []
+    for s in streams:
+        s.dlc = 1 + s.command.body_size
+        if s.command.policy != 'DELIVERY_ACKED':
+            continue
+
+        # the sequence number goes in the byte after the body if it fits.
+        if not extended and sequence_numbers and s.command.body_size < MAX_BODY_SIZE:
+            s.dlc += 1
+
+        ack = Stream(s.recipient, s.sender, s.command, s.period, s.deadline, 0.0, is_ack=True)
+        ack.acked = s
+        ack.dlc = ACK_DLC
+        acks.append(ack)
+
+    return streams + acks
+
+
+def response_time(m, streams, ids, times, tau):
+    """Worst-case response time of stream m in us, or math.inf."""
+    hp = [k for k in streams if k is not m and ids[k] <= ids[m]]
+    lp = [k for k in streams if ids[k] > ids[m]]
+
+    blocking = max((times[k] for k in lp), default=0.0)
+    c = times[m]
+
+    utilisation = sum(times[k] / k.period for k in hp) + c / m.period
+    if utilisation >= 1:
+        return math.inf
+
+    # length of the longest busy period that m can be part of.
+    busy = c
+    while True:
+        following = blocking + sum(math.ceil((busy + k.jitter) / k.period) * times[k] for k in hp + [m])
+        if following <= busy:
+            break
+        busy = following
+
+    worst = 0.0
+    for q in range(math.ceil((busy + m.jitter) / m.period)):
+        # time until instance q starts to be sent.
+        w = blocking + q * c
+        while True:
+            following = blocking + q * c + sum(math.ceil((w + k.jitter + tau) / k.period) * times[k] for k in hp)
+            if following <= w:
+                break
+            w = following
+            if w - q * m.period + c > 100 * m.deadline:
+                return math.inf
+
+        worst = max(worst, m.jitter + w - q * m.period + c)
+
+    return worst
+
+
+def analyse(streams, priorities, extended, bitrate, poll):
+    """Sets every stream's response time for the given {cmd ID: priority}."""
+    tau = 1e6 / bitrate
+    ids = {s: pack_id(priorities[s.command.id], s.command.id, s.sender, s.recipient, s.is_ack, extended)
+           for s in streams}
+    times = {s: frame_time(s.dlc, extended, bitrate) for s in streams}
+
+    for s in streams:
+        if s.is_ack:
+            s.jitter = 0.0
+
+    # an ACK's jitter depends on its message's response time, which depends
+    # on the ACK's jitter. both only grow, so iterate until they settle.
+    for _ in range(100):
+        for s in streams:
+            s.response = response_time(s, streams, ids, times, tau)
+
+        changed = False
+        for s in streams:
+            if not s.is_ack:
+                continue
+
+            # released when the recipient next polls after the message has
+            # arrived. counted from the message's release, so the ACK's
+            # response time is the round trip.
+            jitter = s.acked.response + poll
+            if jitter != s.jitter:
+                s.jitter = jitter
+                changed = True
+                if math.isinf(jitter):
+                    s.response = math.inf
+
+        if not changed:
+            break
+
+    return sum(times[s] / s.period for s in streams)
+
+
+def deadline_monotonic(commands, streams):
+    """Returns {cmd ID: priority} ordered by each command's shortest deadline."""
+    priorities = {c.id: c.priority for c in commands.values()}
+
+    deadlines = {}
+    for s in streams:
+        if not s.is_ack:
+            deadlines[s.command.id] = min(deadlines.get(s.command.id, math.inf), s.deadline)
+
+    for urgent in (True, False):
+        base = 0 if urgent else URGENT_PRIORITIES
+        band = [c for c in commands.values()
+                if c.id in deadlines and (c.priority < URGENT_PRIORITIES) == urgent]
+        band.sort(key=lambda c: (deadlines[c.id], c.priority, c.id))
+
+        # more commands than levels share them, in order.
+        for rank, c in enumerate(band):
+            priorities[c.id] = base + rank * URGENT_PRIORITIES // max(len(band), URGENT_PRIORITIES)
+
+    return priorities
+
+
+def worst_by_command(streams):
+    """Returns {cmd ID: (worst response of its messages, worst ACK round trip)} in us."""
+    worst = {}
+    for s in streams:
+        response, round_trip = worst.get(s.command.id, (0.0, 0.0))
+        if s.is_ack:
+            round_trip = max(round_trip, s.response)
+        else:
+            response = max(response, s.response)
+        worst[s.command.id] = (response, round_trip)
+    return worst
+
+
+def fmt_ms(us):
+    return '     never' if math.isinf(us) else f'{us / 1000:10.3f}'
+
+
+def report(commands, streams, current, suggested, args):
+    utilisation = analyse(streams, current, args.extended, args.bitrate, args.poll_ms * 1000)
+    before = worst_by_command(streams)
+    analyse(streams, suggested, args.extended, args.bitrate, args.poll_ms * 1000)
+    after = worst_by_command(streams)
+
+    layout = 'extended' if args.extended else 'standard'
+    print(f'{len(streams)} streams ({sum(s.is_ack for s in streams)} of them ACKs), '
+          f'{layout} identifiers, {args.bitrate} bit/s')
+    print(f'worst-case bus utilisation: {100 * utilisation:.1f}%')
+    if utilisation >= 1:
+        print('the bus is overloaded. no priority assignment can meet every deadline.')
+
+    deadlines = {}
+    for s in streams:
+        if not s.is_ack:
+            deadlines[s.command.id] = min(deadlines.get(s.command.id, math.inf), s.deadline)
+
+    print('\nworst-case response times in ms. * marks a missed deadline, ! an ACK round trip')
+    print('longer than the command\'s timeout (which causes needless resends).\n')
+    print(f'{"command":<34} {"deadline":>9} | {"prio":>4} {"response":>10} {"ack rtt":>10} | '
+          f'{"prio":>4} {"response":>10} {"ack rtt":>10}')
+
+    misses = [0, 0]
+    for cmd_id in sorted(deadlines):
+        command = commands[cmd_id]
+        timeout = (command.timeout or DEFAULT_TIMEOUT_MS) * 1000
+        row = f'{command.name:<34} {fmt_ms(deadlines[cmd_id])[1:]} |'
+
+        for i, (priorities, worst) in enumerate(((current, before), (suggested, after))):
+            response, round_trip = worst[cmd_id]
+            missed = response > deadlines[cmd_id]
+            misses[i] += missed
+            acked = command.policy == 'DELIVERY_ACKED'
+            row += (f' {priorities[cmd_id]:4} {fmt_ms(response)}{"*" if missed else " "}'
+                    f'{fmt_ms(round_trip) if acked else "         -"}{"!" if acked and round_trip > timeout else " "}')
+            if i == 0:
+                row += '|'
+        print(row)
+
+    print(f'\nmissed deadlines: {misses[0]} with the current priorities, {misses[1]} with the suggested ones.')
+
+
+def write_schema(path, source, priorities, commands):
+    """Writes a copy of the schema with the PRIORITY column replaced."""
+    cmd_re = re.compile(r'^(CMD\(\w+,\s*(\w+),\s*)(\w+,\s*)')
+
+    def replace(match):
+        cmd_id = int(match.group(2), 0)
+        priority = str(priorities.get(cmd_id, commands[cmd_id].priority))
+        # keep the columns lined up.
+        return match.group(1) + (priority + ', ').ljust(len(match.group(3)))
+
+    with open(source) as f:
+        lines = [cmd_re.sub(replace, line) for line in f]
+
+    with open(path, 'w') as f:
+        f.writelines(lines)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Worst-case CAN response time analysis of the command schema.')
+    parser.add_argument('rates', help='rate specification. see Tools/can_rates.txt')
+    parser.add_argument('--schema', default=DEFAULT_SCHEMA, help='path to can_command_schema.h')
+    parser.add_argument('--bitrate', type=int, default=500000, help='bus bit rate')
+    parser.add_argument('--extended', action='store_true', help='nodes use extended_ids')
+    parser.add_argument('--sequence-numbers', action='store_true', help='nodes use sequence_numbers')
+    parser.add_argument('--poll-ms', type=float, default=1.0,
+                        help='longest time between calls to CANWrapper_Poll_Messages')
+    parser.add_argument('--write-schema', metavar='PATH',
+                        help='write a copy of the schema with the suggested priorities')
+    args = parser.parse_args()
+
+    commands = load_schema(args.schema)
+    nodes = load_nodes(DEFAULT_MESSAGE_HEADER)
+
+    streams = load_rates(args.rates, commands, nodes)
+    max_node = 31 if args.extended else 3
+    for s in streams:
+        if s.sender > max_node or s.recipient > max_node:
+            sys.exit(f'{s.command.name}: node IDs above {max_node} don\'t fit in the identifier')
+
+    streams = add_ack_streams(streams, args.extended, args.sequence_numbers)
+
+    current = {c.id: c.priority for c in commands.values()}
+    suggested = deadline_monotonic(commands, streams)
+
+    report(commands, streams, current, suggested, args)
+
+    if args.write_schema:
+        write_schema(args.write_schema, args.schema, suggested, commands)
+        print(f'suggested priorities written to {args.write_schema}')
+
+
+if __name__ == '__main__':
+    main()